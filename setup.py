@@ -1,6 +1,128 @@
 #!/usr/bin/env python
 #coding:utf-8
+import glob
+import os
+import shutil
+import subprocess
+import sys
+from distutils.cmd import Command
+from distutils.command.build_ext import build_ext
 from distutils.core import setup, Extension
+from distutils.spawn import find_executable
+
+libraries = []
+if sys.platform.startswith("linux"):
+    # clock_gettime lives in librt on glibc before 2.17.
+    libraries.append("rt")
+elif sys.platform == "win32":
+    # timeBeginPeriod and timeEndPeriod.
+    libraries.append("winmm")
+
+
+def optimize_flags(compiler):
+    """Compile and link arguments of a release build: full optimisation
+    and link-time optimisation. On Linux, -fno-semantic-interposition lets
+    calls between the module's own functions be inlined, since nothing can
+    replace them in a Python extension."""
+    if compiler.compiler_type == "msvc":
+        return ["/O2", "/GL"], ["/LTCG"]
+    compile_args = ["-O3", "-flto"]
+    if sys.platform.startswith("linux"):
+        compile_args.append("-fno-semantic-interposition")
+    return compile_args, compile_args[:]
+
+
+def is_clang(compiler):
+    return "clang" in os.path.basename(compiler.compiler_so[0])
+
+
+class timer_build_ext(build_ext):
+    """build_ext with the release flags when TIMER_OPTIMIZE is set, and the
+    profile of build_pgo when it drives the build."""
+
+    profile = None # "generate" or "use"
+    profile_dir = None
+
+    def build_extensions(self):
+        compile_args, link_args = [], []
+        if self.profile or os.environ.get("TIMER_OPTIMIZE"):
+            compile_args, link_args = optimize_flags(self.compiler)
+        if self.profile and self.compiler.compiler_type == "msvc":
+            pgd = os.path.join(self.profile_dir, "_timer.pgd")
+            stage = "GENPROFILE" if self.profile == "generate" else "USEPROFILE"
+            link_args.append("/%s:PGD=%s" % (stage, pgd))
+        elif self.profile == "generate":
+            flags = ["-fprofile-generate=" + self.profile_dir]
+            if not is_clang(self.compiler):
+                # Callbacks run on several threads at once.
+                flags.append("-fprofile-update=atomic")
+            compile_args += flags
+            link_args += flags
+        elif self.profile == "use":
+            flags = ["-fprofile-use=" + self.profile_dir]
+            if not is_clang(self.compiler):
+                flags.append("-fprofile-correction")
+            compile_args += flags
+            link_args += flags
+        for ext in self.extensions:
+            ext.extra_compile_args = compile_args
+            ext.extra_link_args = link_args
+        build_ext.build_extensions(self)
+
+
+class build_pgo(Command):
+    """Build the extension optimised with a profile of timer.bench: build
+    it instrumented, run the benchmarks on it, then build it again with the
+    profile they recorded."""
+
+    description = "build the extension with profile-guided optimisation"
+    user_options = [("bench-args=", None,
+                     "arguments to timer.bench [default: none, all of it]")]
+
+    def initialize_options(self):
+        self.bench_args = None
+
+    def finalize_options(self):
+        # --quick trains too little of the hot paths to beat plain LTO.
+        if self.bench_args is None:
+            self.bench_args = ""
+
+    def run(self):
+        self.run_command("build_py")
+        ext = self.get_finalized_command("build_ext")
+        ext.profile_dir = os.path.abspath(os.path.join(ext.build_temp, "pgo"))
+        if os.path.isdir(ext.profile_dir):
+            shutil.rmtree(ext.profile_dir)
+        os.makedirs(ext.profile_dir)
+        ext.force = True
+        # run() replaces the compiler option with the compiler it made.
+        compiler = ext.compiler
+
+        ext.profile = "generate"
+        ext.run()
+        self.train(os.path.abspath(ext.build_lib))
+        if ext.compiler.compiler_type != "msvc" and is_clang(ext.compiler):
+            self.merge(ext.profile_dir)
+        ext.compiler = compiler
+        ext.profile = "use"
+        ext.run()
+
+    def train(self, build_lib):
+        # From build_lib, so the instrumented module is the one imported.
+        command = [sys.executable, "-m", "timer.bench", "--output", os.devnull]
+        command += self.bench_args.split()
+        self.announce("training: " + " ".join(command), 2)
+        subprocess.check_call(command, cwd=build_lib)
+
+    def merge(self, profile_dir):
+        # Clang leaves raw profiles, -fprofile-use wants them merged.
+        profdata = find_executable("llvm-profdata")
+        command = [profdata] if profdata else ["xcrun", "llvm-profdata"]
+        command += ["merge", "-output=" +
+                    os.path.join(profile_dir, "default.profdata")]
+        command += glob.glob(os.path.join(profile_dir, "*.profraw"))
+        subprocess.check_call(command)
+
 
 setup(name             = "timer",
       version          = "0.1",
@@ -9,8 +131,12 @@ setup(name             = "timer",
       maintainer       = "Brian Curtin",
       license          = "PSF",
       maintainer_email = "brian@python.org",
-      packages         = ["timer", "timer.tests"],
-      ext_modules      = [Extension("timer._timer", ["src/_timer.c"])],
+      packages         = ["timer", "timer.tests", "timer.bench"],
+      ext_modules      = [Extension("timer._timer", ["src/_timer.c"],
+                                   depends=["src/timer_api.h"],
+                                   libraries=libraries)],
+      headers          = ["src/timer_api.h"],
+      cmdclass         = {"build_ext": timer_build_ext, "build_pgo": build_pgo},
       classifiers      = [
         "Development Status :: 3 - Alpha",
         "Intended Audience :: Developers",
@@ -20,12 +20,27 @@
 
    Mac/Linux:
    I added support for Mac/Linux by using pthreads and a similar loop idea
-   that uses gettimeofday. If there's a better and/or more accurate way 
-   of doing this on these platforms, I'd love to know about it.
+   that originally used gettimeofday. It now reads CLOCK_MONOTONIC through
+   clock_gettime, which is immune to wall clock changes and served from
+   the vDSO on Linux.
+
+   Scheduler:
+   Timers used to get one OS thread each, spinning until their deadline.
+   They now share a process-wide scheduler, a thread per shard, which keeps
+   every pending timer in a deadline-ordered queue and sleeps until the
+   earliest one is due. Starting a timer is an enqueue, stopping one is a
+   dequeue.
 */
 
 #include "include/Python.h"
 #include "include/structmember.h"
+#include "include/pythread.h"
+#if PY_VERSION_HEX < 0x03090000
+#include "include/frameobject.h"
+#endif
+
+#define TIMER_MODULE
+#include "timer_api.h"
 
 //#pragma comment(lib, "python27.lib")
 
@@ -39,6 +54,8 @@
 /* Py_XDECREF causes "conditional expression is constant" warnings */
 #pragma warning(disable: 4127)
 #include <windows.h>
+#include <mmsystem.h>
+#include <intrin.h>
 #endif /* MS_WINDOWS */
 
 #ifndef MS_WINDOWS
@@ -46,10 +63,72 @@
 #endif
 
 #ifdef UNIX
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#define HAVE_TIMERFD
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#endif
+
+/* timer_create timers that signal a given thread. */
+#if defined(__linux__) && defined(SIGEV_THREAD_ID)
+#define HAVE_POSIX_TIMER
+#endif
+
+/* io_uring through its system calls, where the headers know it. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+/* NUMA placement of the node arenas, see configure(numa=). On Linux
+   through the system calls, libnuma having no headers here to rely on. */
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+#define HAVE_NUMA
+#define TIMER_MPOL_PREFERRED 1 /* From linux/mempolicy.h */
+#elif defined(MS_WINDOWS)
+#define HAVE_NUMA
+#endif
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+#define HAVE_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#endif
+
+/* A clock read straight off the CPU's counter, see tsc_clock_ns. */
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_TSC
+#include <cpuid.h>
+#include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#define HAVE_TSC
+#include <intrin.h>
+#elif defined(__aarch64__)
+#define HAVE_TSC
 #endif
 
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
 #ifndef BOOL
 typedef int BOOL;
 #define FALSE 0
@@ -57,16 +136,199 @@ typedef int BOOL;
 #endif
 
 #ifdef PYTHON3
-#define GET_DURATION(args) (PyLong_AsSsize_t(PyTuple_GET_ITEM(args, 0)))
+#define GET_DURATION(obj) (PyLong_AsSsize_t(obj))
+#else
+#define GET_DURATION(obj) (PyInt_AsSsize_t(obj))
+#endif
+
+/* Where the interpreter has vectorcall, a Timer lays its callback's
+   arguments out in that form once, so firing builds no tuple or dict. */
+#if PY_VERSION_HEX >= 0x03090000
+#define HAVE_VECTORCALL
+#elif PY_VERSION_HEX >= 0x03080000
+#define HAVE_VECTORCALL
+#define PyObject_Vectorcall _PyObject_Vectorcall
+#endif
+
+/* Calling a type only goes through its tp_vectorcall from 3.9, Timer()
+   then takes its arguments as a vector too. */
+#if PY_VERSION_HEX >= 0x03090000
+#define HAVE_TYPE_VECTORCALL
+#endif
+
+/* The inherited deadline of within() lives in a context variable where
+   there are any, otherwise in the thread's state dict. */
+#if PY_VERSION_HEX >= 0x03070000
+#define HAVE_CONTEXTVARS
+#endif
+
+/* Buffer exports, of int64 arrays. Python 2's PyBufferProcs starts with
+   the old protocol's slots, and a type has to say it has the new one. */
+#ifdef PYTHON3
+#define BUFFER_PROCS(get, release) \
+    {(getbufferproc)(get), (releasebufferproc)(release)}
+#define BUFFER_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE)
+#else
+#define BUFFER_PROCS(get, release) \
+    {0, 0, 0, 0, (getbufferproc)(get), (releasebufferproc)(release)}
+#define BUFFER_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | \
+                      Py_TPFLAGS_HAVE_NEWBUFFER)
+#endif
+
+/* Free-threaded builds (PEP 703) run callbacks on the scheduler threads in
+   parallel with each other and with Python threads, so what the GIL used
+   to serialize needs locks of its own:
+   - an object's state, critical sections on the object, see CRITICAL_*;
+   - engine counters, atomic adds;
+   - the rest of the engine's Python side, such as starting the scheduler
+     and configure(), PyMutexes.
+   With a GIL all of it compiles to what it was. */
+#ifdef Py_GIL_DISABLED
+#define FREE_THREADED
+#define MUTEX_DECLARE(name) static PyMutex name
+#define MUTEX_LOCK(mutex) PyMutex_Lock(mutex)
+#define MUTEX_UNLOCK(mutex) PyMutex_Unlock(mutex)
+#ifdef _MSC_VER
+#define COUNTER_ADD(counter, n) \
+    _InterlockedExchangeAdd64((volatile __int64*)&(counter), (n))
+#define COUNTER_NEXT(counter) \
+    (_InterlockedIncrement64((volatile __int64*)&(counter)))
+#else
+#define COUNTER_ADD(counter, n) \
+    ((void)__atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED))
+#define COUNTER_NEXT(counter) __atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+#endif
+#else
+#define MUTEX_DECLARE(name) typedef int name##_unused
+#define MUTEX_LOCK(mutex)
+#define MUTEX_UNLOCK(mutex)
+#define COUNTER_ADD(counter, n) ((void)((counter) += (n)))
+#define COUNTER_NEXT(counter) (++(counter))
+#endif
+
+/* Empty before 3.13, like they are with a GIL. */
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+/* Subinterpreters share the engine, the types and the GIL with the main
+   interpreter, but a Timer's callback has to run in the one it was made
+   in, see interpreter_enter. PyGILState only knows the main one. */
+#define CURRENT_INTERPRETER() (PyThreadState_GET()->interp)
+#if PY_VERSION_HEX >= 0x03080000
+#define MAIN_INTERPRETER() PyInterpreterState_Main()
+#else
+/* The first one made, so the last of the list. */
+static PyInterpreterState *
+MAIN_INTERPRETER(void)
+{
+    PyInterpreterState *interp = PyInterpreterState_Head();
+
+    while (PyInterpreterState_Next(interp) != NULL)
+        interp = PyInterpreterState_Next(interp);
+    return interp;
+}
+#endif
+
+/* Whether the collector tracks an object, and whether it could ever be
+   part of a cycle, by the rule tuples untrack themselves with: untracked
+   tuples can't, other containers may start to. */
+#if PY_VERSION_HEX >= 0x03090000
+#define GC_IS_TRACKED(op) PyObject_GC_IsTracked((PyObject*)(op))
+#else
+#define GC_IS_TRACKED(op) _PyObject_GC_IS_TRACKED(op)
+#endif
+#define GC_MAY_BE_TRACKED(op) \
+    ((op) != NULL && PyObject_IS_GC(op) && \
+     (!PyTuple_CheckExact(op) || GC_IS_TRACKED(op)))
+
+/* fn_locked, a method calling fn in a critical section on self. */
+#define CRITICAL_NOARGS(fn, type) \
+    static PyObject * \
+    fn##_locked(type *self, PyObject *unused) \
+    { \
+        PyObject *result; \
+        (void)unused; \
+        Py_BEGIN_CRITICAL_SECTION(self); \
+        result = fn(self); \
+        Py_END_CRITICAL_SECTION(); \
+        return result; \
+    }
+
+#define CRITICAL_ARGS(fn, type) \
+    static PyObject * \
+    fn##_locked(type *self, PyObject *args) \
+    { \
+        PyObject *result; \
+        Py_BEGIN_CRITICAL_SECTION(self); \
+        result = fn(self, args); \
+        Py_END_CRITICAL_SECTION(); \
+        return result; \
+    }
+
+/* For a method of one optional argument, which fn gets as Py_None when
+   it is left out. With vectorcall it takes the argument vector, so a call
+   builds no tuple. */
+#ifdef HAVE_VECTORCALL
+#define OPTIONAL_ARG_FLAGS METH_FASTCALL
+#define CRITICAL_OPTIONAL(fn, type, name) \
+    static PyObject * \
+    fn##_locked(type *self, PyObject *const *args, Py_ssize_t nargs) \
+    { \
+        PyObject *result; \
+        if (nargs > 1) { \
+            PyErr_Format(PyExc_TypeError, name "() takes at most 1 " \
+                         "argument (%zd given)", nargs); \
+            return NULL; \
+        } \
+        Py_BEGIN_CRITICAL_SECTION(self); \
+        result = fn(self, nargs == 1 ? args[0] : Py_None); \
+        Py_END_CRITICAL_SECTION(); \
+        return result; \
+    }
 #else
-#define GET_DURATION(args) (PyInt_AsSsize_t(PyTuple_GET_ITEM(args, 0)))
+#define OPTIONAL_ARG_FLAGS METH_VARARGS
+#define CRITICAL_OPTIONAL(fn, type, name) \
+    static PyObject * \
+    fn##_locked(type *self, PyObject *args) \
+    { \
+        PyObject *result, *arg = Py_None; \
+        if (!PyArg_ParseTuple(args, "|O:" name, &arg)) \
+            return NULL; \
+        Py_BEGIN_CRITICAL_SECTION(self); \
+        result = fn(self, arg); \
+        Py_END_CRITICAL_SECTION(); \
+        return result; \
+    }
 #endif
 
+#define CRITICAL_KEYWORDS(fn, type) \
+    static PyObject * \
+    fn##_locked(type *self, PyObject *args, PyObject *kwargs) \
+    { \
+        PyObject *result; \
+        Py_BEGIN_CRITICAL_SECTION(self); \
+        result = fn(self, args, kwargs); \
+        Py_END_CRITICAL_SECTION(); \
+        return result; \
+    }
+
 
 #define TIMER_VERSION "0.1"
 #define AUTHOR "Brian Curtin"
 
 
+/* Convert ticks at frequency per second, such as performance counter
+   ticks, to units per second (1000000000 for nanoseconds), with 64-bit
+   integers only. Splitting off whole seconds keeps the multiplication
+   from overflowing for any realistic frequency. */
+static int64_t
+ticks_to_units(int64_t ticks, int64_t frequency, int64_t units)
+{
+    return (ticks / frequency) * units + (ticks % frequency) * units / frequency;
+}
+
 #ifdef MS_WINDOWS
 typedef struct {
     FILETIME time;
@@ -100,418 +362,822 @@ synchronize(reference_point *ref)
     ref->perf_counter = counter;
 }
 
-void
-timestamp(LARGE_INTEGER frequency, const reference_point *reference,
-          FILETIME *current_time)
-{
-    LARGE_INTEGER current_counter, ticks_elapsed;
-    ULARGE_INTEGER now, now_ticks;
-
-    /* Snapshot of the current counter value to get the duration since
-       we synchronized. */
-    QueryPerformanceCounter(&current_counter);
-    ticks_elapsed.QuadPart =
-        current_counter.QuadPart - reference->perf_counter.QuadPart;
+#endif /* MS_WINDOWS */
 
-    /* Divide by the current frequency and convert to microseconds */
-    now_ticks.QuadPart = 
-        (ULONGLONG)((((double)ticks_elapsed.QuadPart/
-                      (double)frequency.QuadPart)*1000000.0));
 
-    now.HighPart = reference->time.dwHighDateTime;
-    now.LowPart = reference->time.dwLowDateTime;
-    /* Add the elapsed microseconds to the reference time to get the
-       current time */
-    now.QuadPart += now_ticks.QuadPart;
+/* Portable locking and thread primitives used by the scheduler. Windows
+   gets slim reader/writer locks and condition variables, which need no
+   explicit destruction and can be zero-initialized. */
+#ifdef MS_WINDOWS
+typedef SRWLOCK timer_lock;
+typedef CONDITION_VARIABLE timer_cond;
+typedef HANDLE timer_thread;
+#elif defined(UNIX)
+typedef pthread_mutex_t timer_lock;
+typedef pthread_cond_t timer_cond;
+typedef pthread_t timer_thread;
+#endif
 
-    /* The final result - elapsed microseconds */
-    current_time->dwHighDateTime = now.HighPart;
-    current_time->dwLowDateTime = now.LowPart;
+static void
+lock_init(timer_lock *lock)
+{
+#ifdef MS_WINDOWS
+    InitializeSRWLock(lock);
+#elif defined(UNIX)
+    pthread_mutex_init(lock, NULL);
+#endif
 }
-#endif /* MS_WINDOWS */
 
+static void
+lock_acquire(timer_lock *lock)
+{
+#ifdef MS_WINDOWS
+    AcquireSRWLockExclusive(lock);
+#elif defined(UNIX)
+    pthread_mutex_lock(lock);
+#endif
+}
 
-typedef struct {
-	PyObject_HEAD
-    PyObject *callback;
-    PyObject *args; /* Sent to the callback */
-    PyObject *kwargs;
-    BOOL expired;
-    BOOL started;
-    time_t duration; /* Microseconds */
-    time_t elapsed; /* Microseconds */
- 
+static void
+lock_release(timer_lock *lock)
+{
 #ifdef MS_WINDOWS
-    HANDLE thread;
-    DWORD thread_id;
+    ReleaseSRWLockExclusive(lock);
 #elif defined(UNIX)
-    pthread_t thread;
-    int thread_rv;
+    pthread_mutex_unlock(lock);
 #endif
-} Timer;
+}
 
-static volatile BOOL die = FALSE;
+/* Bytes of stack the engine's threads are started with, or 0 for the
+   platform's default, 8 MB on Linux and 1 MB on Windows. See
+   configure(stack_size=). */
+#define MIN_STACK_SIZE 32768 /* What threading.stack_size() allows */
+static size_t thread_stack_size = 0;
 
-static PyObject *
-Timer_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+#ifdef MS_WINDOWS
+typedef LPTHREAD_START_ROUTINE timer_thread_fn;
+#elif defined(UNIX)
+typedef void *(*timer_thread_fn)(void *);
+#endif
+
+/* Start fn(data) on a new thread with thread_stack_size. Returns FALSE if
+   the OS wouldn't. */
+static BOOL
+thread_start(timer_thread *thread, timer_thread_fn fn, void *data)
 {
-    Timer *self;
-    PyObject *callback = NULL;
-    Py_ssize_t num_args, duration;
+#ifdef MS_WINDOWS
+    /* What each thread takes of the address space is the reservation;
+       the commit stays the executable's. */
+    *thread = CreateThread(NULL, thread_stack_size, fn, data,
+                           thread_stack_size > 0 ?
+                           STACK_SIZE_PARAM_IS_A_RESERVATION : 0, NULL);
+    return *thread != NULL;
+#elif defined(UNIX)
+    pthread_attr_t attr;
+    int err;
 
-    /* Don't use PyArg_Parse* functions here.
-       We want to take kwargs without specifying named arguments. We'll
-       manually pick items out of the args tuple, then take a slice of the
-       remaining ones as our callback's args, then take all kwargs. */
-    num_args = PyTuple_GET_SIZE(args);
+    if (thread_stack_size == 0)
+        return pthread_create(thread, NULL, fn, data) == 0;
+    if (pthread_attr_init(&attr) != 0)
+        return FALSE;
+    err = pthread_attr_setstacksize(&attr, thread_stack_size);
+    if (err == 0)
+        err = pthread_create(thread, &attr, fn, data);
+    pthread_attr_destroy(&attr);
+    return err == 0;
+#endif
+}
 
-    if (num_args < 2) {
-        PyErr_SetString(PyExc_TypeError, "Timer takes at least 2 arguments");
-        return NULL;
-    }
+/* Wait for a thread thread_start() started to end, and let go of it. */
+static void
+thread_join(timer_thread thread)
+{
+#ifdef MS_WINDOWS
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#elif defined(UNIX)
+    pthread_join(thread, NULL);
+#endif
+}
 
-    duration = GET_DURATION(args);
-    if (duration == -1) {
-        /* OverflowError gets set in this case. */
-        return NULL;
-    }
+/* Have threads started from now on get size bytes of stack, 0 for the
+   default. On POSIX it is rounded up to whole pages. */
+static BOOL
+set_stack_size(Py_ssize_t size)
+{
+#ifdef UNIX
+    pthread_attr_t attr;
+    long page = sysconf(_SC_PAGESIZE);
+    int err;
+#endif
 
-    callback = PyTuple_GET_ITEM(args, 1);
-    if (!PyCallable_Check(callback)) {
-        PyErr_Format(PyExc_TypeError, "callback parameter must be callable");
-        return NULL;
+    if (size != 0 && size < MIN_STACK_SIZE) {
+        PyErr_Format(PyExc_ValueError,
+                     "stack_size must be 0 or at least %d", MIN_STACK_SIZE);
+        return FALSE;
     }
-    
-    self = (Timer*)type->tp_alloc(type, 0);
-    if (self == NULL)
-        return NULL;
-
-    Py_INCREF(callback);
-    self->callback = callback;
-
-    /* Optional attributes from here on. */
-    if (num_args > 2)
-        self->args = PyTuple_GetSlice(args, 2, num_args);
-    else
-        self->args = PyTuple_New(0);
+#ifdef UNIX
+    if (size != 0 && page > 0)
+        size = (size + page - 1) / page * page;
+    /* Find out now whether the system takes it, not at the next start. */
+    if (size != 0) {
+        if (pthread_attr_init(&attr) != 0) {
+            PyErr_NoMemory();
+            return FALSE;
+        }
+        err = pthread_attr_setstacksize(&attr, (size_t)size);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            PyErr_SetString(PyExc_ValueError, "stack_size not supported");
+            return FALSE;
+        }
+    }
+#endif
+    thread_stack_size = (size_t)size;
+    return TRUE;
+}
 
-    /* kwargs might be NULL, which is fine for PyObject_Call.
-       If we get kwargs, use them, nothing special to do here. */
-    self->kwargs = kwargs;
-    Py_XINCREF(kwargs);
+/* The engine clock. Nanoseconds, only meaningful relative to other values
+   returned by it. On POSIX it's clock_gettime on a monotonic clock, so NTP
+   slews and wall clock changes don't move deadlines. TIMER_CLOCK_ID is the
+   clock kernel timers and condition variables wait on; the engine clock
+   may be a different one (CLOCK_MONOTONIC_RAW can't be waited on), see
+   kernel_deadline. */
+#ifdef UNIX
+#define TIMER_CLOCK_ID CLOCK_MONOTONIC
+static clockid_t clock_id = CLOCK_MONOTONIC;
+static const char *clock_name = "CLOCK_MONOTONIC";
+#endif
+#ifdef MS_WINDOWS
+/* Both are set once per process at import. The engine clock counts from
+   the reference point's counter. Only wall_sample() needs its wall time,
+   and synchronize() can take up to a system tick to find it, so import
+   only reads the counter. */
+static LARGE_INTEGER clock_frequency;
+static reference_point clock_reference;
+static const char *clock_name = "QueryPerformanceCounter";
+#endif
+static BOOL tsc_clock = FALSE; /* Read the CPU's counter, see tsc_clock_ns */
 
-    self->duration = duration;
-    self->elapsed = 0;
-    self->expired = FALSE;
+/* use_virtual_clock() swaps the engine clock for virtual_now, which only
+   advance() moves. The scheduler thread then stays asleep and advance()
+   runs the callbacks that come due itself. Both are only written with the
+   GIL held. */
+static volatile BOOL virtual_clock = FALSE;
+static int64_t virtual_now;
 
-    return (PyObject*)self;
+#ifdef UNIX
+static int64_t
+timespec_to_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
 }
 
 static void
-Timer_dealloc(Timer *self)
+ns_to_timespec(int64_t ns, struct timespec *ts)
 {
-    Py_XDECREF(self->callback);
-    Py_XDECREF(self->args);
-    Py_XDECREF(self->kwargs);
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    ts->tv_sec = (time_t)(ns / 1000000000);
+    ts->tv_nsec = (long)(ns % 1000000000);
 }
+#endif /* UNIX */
 
-static PyObject *
-Timer_str(Timer* self)
+/* The engine clock as the OS keeps it. */
+static int64_t
+os_clock_ns(void)
 {
-    return PyUnicode_FromFormat(
-        "<%s at %p duration=%d, expired=%d, started=%d>",
-        Py_TYPE(self)->tp_name, self,
-        self->duration, self->expired, self->started);
+#ifdef MS_WINDOWS
+    LARGE_INTEGER counter;
+
+    QueryPerformanceCounter(&counter);
+    return ticks_to_units(counter.QuadPart -
+                          clock_reference.perf_counter.QuadPart,
+                          clock_frequency.QuadPart, 1000000000);
+#elif defined(UNIX)
+    struct timespec now;
+
+    clock_gettime(clock_id, &now);
+    return timespec_to_ns(&now);
+#endif
 }
 
-/*static PyObject *
-Timer_repr(Timer* self)
-{
-    return PyUnicode_FromFormat("%s(%d, %s)",
-            Py_TYPE(self)->tp_name, self->duration,
-            Py_TYPE(self->callback)->tp_name);
-}*/
+#ifdef HAVE_TSC
+/* TIMER_CLOCK=tsc reads the CPU's time stamp counter, or the generic
+   timer's virtual count on ARM, instead of asking the OS, a few
+   nanoseconds instead of a few tens. That only works where the counter
+   runs at a constant rate on every core, which x86 CPUs announce as an
+   invariant TSC. Engine time stays on the OS clock's timebase: the first
+   read calibrates the counter against it over TSC_CALIBRATION, which on
+   ARM isn't needed since the rate is given. Calibration is good to about
+   ten parts per million, less than a wait's worth of drift. */
+#define TSC_CALIBRATION 5000000 /* Nanoseconds */
 
+static uint64_t tsc_start; /* Counter at tsc_base */
+static int64_t tsc_base;
+static uint64_t tsc_mult; /* Nanoseconds per tick, times 2 ** 32 */
 #ifdef MS_WINDOWS
-void WINAPI
-Timer_win32_thread(Timer *self)
+static INIT_ONCE tsc_once = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_once_t tsc_once = PTHREAD_ONCE_INIT;
+#endif
+
+static uint64_t
+tsc_read(void)
 {
-    PyGILState_STATE gil_state;
-    PyObject *call_rslt;
-
-    reference_point ref_point;
-    LARGE_INTEGER frequency;
-    FILETIME start_time, current_time;
-    time_t start, cur, val;
-
-    QueryPerformanceFrequency(&frequency);
-    synchronize(&ref_point);
-
-    timestamp(frequency, &ref_point, &start_time);
-    start = ((__int64)start_time.dwHighDateTime << 32) + start_time.dwLowDateTime;
-
-    while(1) {
-        timestamp(frequency, &ref_point, &current_time);
-        cur = ((__int64)current_time.dwHighDateTime << 32) + current_time.dwLowDateTime;
-        val = cur - start;
-        if (val > self->duration) {
-            /* Grab the GIL, call out into the user callback, then give the
-               GIL back. If we're given a method as opposed to a function
-               we have to do things slightly different. */
-            gil_state = PyGILState_Ensure();
-            /* This will work for free functions and bound methods. */
-            call_rslt = PyObject_Call(self->callback,
-                                      self->args, self->kwargs);
-            Py_DECREF(self->args); /* XXX: needed? */
-            PyGILState_Release(gil_state);
-
-            /* Flag denoting timer expiration rather than being stopped */
-            self->expired = TRUE;
-            self->started = FALSE;
-            /* Don't use val here since it is likely to be larger than the
-               requested duration. Using duration is another way to signal
-               that a timeout occurred. */
-            self->elapsed = self->duration;
-            
-            if (call_rslt == NULL) {
-                /* These calls also require the GIL */
-                gil_state = PyGILState_Ensure();
-                PyErr_SetString(PyExc_RuntimeError, "Unable to call callback");
-                PyErr_Print();
-                PyGILState_Release(gil_state);
-            } else
-                Py_DECREF(call_rslt);
+#if defined(__aarch64__)
+    uint64_t count;
 
-            break;
-        } else if (die) {
-            self->elapsed = val;
-            break;
-        }
-    }
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(count) : : "memory");
+    return count;
+#else
+    return __rdtsc();
+#endif
 }
-#endif /* MS_WINDOWS */
 
-#ifdef UNIX
-void *
-Timer_posix_thread(void *data)
+/* Whether the counter can be used as a clock at all. */
+static BOOL
+tsc_usable(void)
 {
-    Timer *self = (Timer*)data;
+#if defined(__aarch64__)
+    return TRUE;
+#elif defined(_MSC_VER)
+    int regs[4];
 
-    PyGILState_STATE gil_state;
-    PyObject *call_rslt;
-    struct timeval start, cur;
-    time_t val;
-
-    gettimeofday(&start, NULL);
-
-    while(1) {
-        gettimeofday(&cur, NULL);
-        /* Seconds to microseconds */
-        val = (cur.tv_sec - start.tv_sec) * 1000000;
-        val += (cur.tv_usec - start.tv_usec);
-
-        if (val > self->duration) {
-            gil_state = PyGILState_Ensure();
-            call_rslt = PyObject_Call(self->callback,
-                                      self->args, self->kwargs);
-            Py_DECREF(self->args); /* XXX: needed? */
-            PyGILState_Release(gil_state);
-
-            self->expired = TRUE;
-            self->started = FALSE;
-            self->elapsed = self->duration;
+    __cpuid(regs, 0x80000000);
+    if ((unsigned int)regs[0] < 0x80000007)
+        return FALSE;
+    __cpuid(regs, 0x80000007);
+    return (regs[3] & (1 << 8)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
 
-            if (call_rslt == NULL) {
-                /* These calls also require the GIL */
-                gil_state = PyGILState_Ensure();
-                PyErr_SetString(PyExc_RuntimeError, "Unable to call callback");
-                PyErr_Print();
-                PyGILState_Release(gil_state);
-            } else
-                Py_DECREF(call_rslt);
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return FALSE;
+    return (edx & (1 << 8)) != 0;
+#endif
+}
 
-            break;
-        } else if(die) {
-            self->elapsed = val;
-            break;
-        }
-    }
+/* A counter reading and an OS clock reading taken together, the counter
+   halfway through the latter. */
+static void
+tsc_pair(uint64_t *tsc, int64_t *ns)
+{
+    uint64_t before = tsc_read();
 
-    /* pthread_exit(NULL); */
+    *ns = os_clock_ns();
+    *tsc = before + (tsc_read() - before) / 2;
 }
-#endif /* UNIX */
 
-/* Handle all thread cleanup here. Used by reset and stop functionality.
-   In any error cases, set an exception and return FALSE, then the caller
-   should check the return value and return NULL, thus raising the exception.*/
-BOOL
-cleanup_Timer_thread(Timer *self)
-{
 #ifdef MS_WINDOWS
-    if (self->thread != NULL) {
-        if (WaitForSingleObject(self->thread, INFINITE) != WAIT_OBJECT_0)
-            goto fail;
-        CloseHandle(self->thread);
-        self->thread = NULL;
-        self->thread_id = 0;
-    }
-#elif defined(UNIX)
-    if (self->thread_rv == 0) {
-        if (pthread_join(self->thread, NULL) != 0)
-            goto fail;
-        self->thread = 0;
-    }
+static BOOL CALLBACK
+tsc_calibrate(PINIT_ONCE once, PVOID parameter, PVOID *context)
+#else
+static void
+tsc_calibrate(void)
 #endif
-    return TRUE;
+{
+    uint64_t end;
+    int64_t ns;
+#if defined(__aarch64__)
+    uint64_t frequency;
 
-fail:
-    PyErr_SetString(PyExc_RuntimeError, "Error stopping timer thread");
-    return FALSE;
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frequency));
+    tsc_pair(&tsc_start, &tsc_base);
+    tsc_mult = ((uint64_t)1000000000 << 32) / frequency;
+    (void)end;
+    (void)ns;
+#else
+    tsc_pair(&tsc_start, &tsc_base);
+    do
+        tsc_pair(&end, &ns);
+    while (ns - tsc_base < TSC_CALIBRATION);
+    tsc_mult = ((uint64_t)(ns - tsc_base) << 32) / (end - tsc_start);
+#endif
+#ifdef MS_WINDOWS
+    return TRUE;
+#endif
 }
 
-PyDoc_STRVAR(Timer_start_doc,
-"start()\n"
-"\n"
-"Start a Timer object.");
-
-static PyObject *
-Timer_start(Timer *self)
+static int64_t
+tsc_clock_ns(void)
 {
-    if (self->started)
-        Py_RETURN_NONE;
-    die = FALSE;
-
-    self->elapsed = 0;
+    uint64_t ticks, high, low;
 
 #ifdef MS_WINDOWS
-    self->thread = CreateThread(NULL, 0,
-                                (LPTHREAD_START_ROUTINE)Timer_win32_thread,
-                                self, 0, &self->thread_id);
-    if (self->thread == NULL) {
-        PyErr_SetString(PyExc_WindowsError,
-                        "CreateThread error. Unable to start timer thread");
-        return NULL;
-    }
-#elif defined(UNIX)
-    self->thread_rv = pthread_create(&self->thread, NULL, Timer_posix_thread,
-                                     (void*)self);
-    if (self->thread_rv != 0) {
-        PyErr_SetString(PyExc_OSError,
-                        "pthread_create error. Unable to start timer thread");
-        return NULL;
-    }
+    InitOnceExecuteOnce(&tsc_once, tsc_calibrate, NULL, NULL);
+#else
+    pthread_once(&tsc_once, tsc_calibrate);
 #endif
+    ticks = tsc_read() - tsc_start;
+#if defined(_MSC_VER) && defined(_M_X64)
+    low = _umul128(ticks, tsc_mult, &high);
+    return tsc_base + (int64_t)((high << 32) | (low >> 32));
+#elif defined(__SIZEOF_INT128__)
+    (void)high;
+    (void)low;
+    return tsc_base + (int64_t)(((unsigned __int128)ticks * tsc_mult) >> 32);
+#else
+    /* No 128 bit product, so split the ticks. On 32 bit x86 tsc_mult is
+       below 2 ** 32 and neither half overflows. */
+    high = (ticks >> 32) * tsc_mult;
+    low = ((ticks & 0xffffffff) * tsc_mult) >> 32;
+    return tsc_base + (int64_t)(high + low);
+#endif
+}
+#endif /* HAVE_TSC */
 
-    self->started = TRUE;
-
-    Py_RETURN_NONE;
+/* The engine clock, leaving the virtual one aside. */
+static int64_t
+real_clock_ns(void)
+{
+#ifdef HAVE_TSC
+    if (tsc_clock)
+        return tsc_clock_ns();
+#endif
+    return os_clock_ns();
 }
 
-PyDoc_STRVAR(Timer_reset_doc,
-"reset()\n"
-"\n"
-"Reset a Timer object. Sets the expired and running members to False\n"
-"and sets the elapsed member to 0.");
+static int64_t
+timer_clock_ns(void)
+{
+    if (virtual_clock)
+        return virtual_now;
+    return real_clock_ns();
+}
 
-static PyObject *
-Timer_reset(Timer *self)
+#ifdef UNIX
+/* An engine clock deadline, or a real_clock_ns() one if real is set, as
+   an absolute time on TIMER_CLOCK_ID. */
+static int64_t
+kernel_deadline_of(int64_t deadline, BOOL real)
 {
-    self->started = FALSE;
-    self->expired = FALSE;
-    self->elapsed = 0;
+    struct timespec now;
 
-    if (!cleanup_Timer_thread(self))
-        return NULL;
-    
-    Py_RETURN_NONE;
+    if (clock_id == TIMER_CLOCK_ID && !tsc_clock)
+        return deadline;
+    clock_gettime(TIMER_CLOCK_ID, &now);
+    return timespec_to_ns(&now) +
+           (deadline - (real ? real_clock_ns() : timer_clock_ns()));
 }
 
-PyDoc_STRVAR(Timer_stop_doc,
-"stop()\n"
-"\n"
-"Stop a timer object. Returns the current elapsed time.");
+static int64_t
+kernel_deadline(int64_t deadline)
+{
+    return kernel_deadline_of(deadline, FALSE);
+}
+#endif /* UNIX */
+
+/* Pick the engine clock from a TIMER_CLOCK setting. */
+static BOOL
+set_clock(const char *name)
+{
+#ifdef CLOCK_MONOTONIC_RAW
+    struct timespec res;
+#endif
+
+#ifdef HAVE_TSC
+    if (strcmp(name, "tsc") == 0 && tsc_usable()) {
+        tsc_clock = TRUE;
+#if defined(__aarch64__)
+        clock_name = "CNTVCT_EL0";
+#else
+        clock_name = "TSC";
+#endif
+        return TRUE;
+    }
+#endif
+#ifdef MS_WINDOWS
+    if (strcmp(name, "monotonic") == 0) {
+        tsc_clock = FALSE;
+        clock_name = "QueryPerformanceCounter";
+        return TRUE;
+    }
+#elif defined(UNIX)
+    if (strcmp(name, "monotonic") == 0) {
+        tsc_clock = FALSE;
+        clock_id = CLOCK_MONOTONIC;
+        clock_name = "CLOCK_MONOTONIC";
+        return TRUE;
+    }
+#ifdef CLOCK_MONOTONIC_RAW
+    if (strcmp(name, "monotonic_raw") == 0 &&
+        clock_getres(CLOCK_MONOTONIC_RAW, &res) == 0) {
+        tsc_clock = FALSE;
+        clock_id = CLOCK_MONOTONIC_RAW;
+        clock_name = "CLOCK_MONOTONIC_RAW";
+        return TRUE;
+    }
+#endif
+#endif
+    PyErr_Format(PyExc_ValueError, "unknown or unsupported clock '%s'", name);
+    return FALSE;
+}
+
+static void
+cond_init(timer_cond *cond)
+{
+#ifdef MS_WINDOWS
+    InitializeConditionVariable(cond);
+#elif defined(__APPLE__)
+    pthread_cond_init(cond, NULL);
+#elif defined(UNIX)
+    pthread_condattr_t attr;
+
+    /* Time out against the monotonic clock rather than wall time. */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, TIMER_CLOCK_ID);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
+
+static void
+cond_signal(timer_cond *cond)
+{
+#ifdef MS_WINDOWS
+    WakeConditionVariable(cond);
+#elif defined(UNIX)
+    pthread_cond_signal(cond);
+#endif
+}
+
+static void
+cond_broadcast(timer_cond *cond)
+{
+#ifdef MS_WINDOWS
+    WakeAllConditionVariable(cond);
+#elif defined(UNIX)
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+/* Wait on cond until signalled or until the engine clock reaches deadline,
+   or real_clock_ns() does if real is set. A negative deadline waits
+   forever. The lock must be held. */
+static void
+cond_wait_on(timer_cond *cond, timer_lock *lock, int64_t deadline,
+             BOOL real)
+{
+#ifdef MS_WINDOWS
+    DWORD timeout = INFINITE;
+    int64_t remaining;
+
+    if (deadline >= 0) {
+        remaining = deadline - (real ? real_clock_ns() : timer_clock_ns());
+        timeout = remaining > 0 ? (DWORD)((remaining + 999999) / 1000000) : 0;
+    }
+    SleepConditionVariableSRW(cond, lock, timeout, 0);
+#elif defined(UNIX)
+    struct timespec ts;
+
+    if (deadline < 0) {
+        pthread_cond_wait(cond, lock);
+        return;
+    }
+#ifdef __APPLE__
+    /* There's no pthread_condattr_setclock, but a relative wait. */
+    deadline -= real ? real_clock_ns() : timer_clock_ns();
+    ns_to_timespec(deadline > 0 ? deadline : 0, &ts);
+    pthread_cond_timedwait_relative_np(cond, lock, &ts);
+#else
+    ns_to_timespec(kernel_deadline_of(deadline, real), &ts);
+    pthread_cond_timedwait(cond, lock, &ts);
+#endif
+#endif
+}
+
+static void
+cond_wait(timer_cond *cond, timer_lock *lock, int64_t deadline)
+{
+    cond_wait_on(cond, lock, deadline, FALSE);
+}
+
+/* cond_wait() on the real clock, for waits the virtual one mustn't stretch
+   or cut short. */
+static void
+cond_wait_real(timer_cond *cond, timer_lock *lock, int64_t deadline)
+{
+    cond_wait_on(cond, lock, deadline, TRUE);
+}
+
+
+/* A Timer's future, see Timer.future. Completed once with the GIL held;
+   threads waiting on it release the GIL and wait on cond, so they need
+   lock to read done. */
+typedef struct {
+    PyObject_HEAD
+    timer_lock lock;
+    timer_cond cond;
+    BOOL done;
+    PyObject *result;
+    PyObject *exc_type, *exc_value, *exc_tb; /* If the callback raised */
+    PyObject *callbacks; /* Of add_done_callback(), or NULL */
+} Future;
+
+static PyTypeObject Future_type;
+
+/* How long a waiter sleeps before checking for signals. */
+#define FUTURE_SIGNAL_CHECK 50000000
 
 static PyObject *
-Timer_stop(Timer *self)
+Future_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 {
-    if (!self->started)
-        goto done;
+    static char *kwlist[] = {NULL};
+    Future *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":Future", kwlist))
+        return NULL;
+    self = (Future*)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    lock_init(&self->lock);
+    cond_init(&self->cond);
+    return (PyObject*)self;
+}
+
+static void
+Future_dealloc(Future *self)
+{
+#ifdef UNIX
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->lock);
+#endif
+    Py_XDECREF(self->result);
+    Py_XDECREF(self->exc_type);
+    Py_XDECREF(self->exc_value);
+    Py_XDECREF(self->exc_tb);
+    Py_XDECREF(self->callbacks);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Wake the waiters and run the callbacks, once result or the exception
+   are in place. */
+static void
+future_finish(Future *self)
+{
+    PyObject *callbacks, *rslt;
+    Py_ssize_t i;
+
+    /* add_done_callback() either sees done or has its callback taken. */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    lock_acquire(&self->lock);
+    self->done = TRUE;
+    cond_broadcast(&self->cond);
+    lock_release(&self->lock);
+    callbacks = self->callbacks;
+    self->callbacks = NULL;
+    Py_END_CRITICAL_SECTION();
+
+    if (callbacks == NULL)
+        return;
+    for (i = 0; i < PyList_GET_SIZE(callbacks); i++) {
+        rslt = PyObject_CallFunctionObjArgs(PyList_GET_ITEM(callbacks, i),
+                                            self, NULL);
+        if (rslt == NULL)
+            PyErr_Print();
+        Py_XDECREF(rslt);
+    }
+    Py_DECREF(callbacks);
+}
+
+static void
+future_set_result(Future *self, PyObject *result)
+{
+    Py_INCREF(result);
+    self->result = result;
+    future_finish(self);
+}
+
+/* Takes the exception being raised. */
+static void
+future_set_exception(Future *self)
+{
+    PyErr_Fetch(&self->exc_type, &self->exc_value, &self->exc_tb);
+    PyErr_NormalizeException(&self->exc_type, &self->exc_value,
+                             &self->exc_tb);
+    future_finish(self);
+}
+
+/* Returns 0 once done, or -1 with an exception set when timeout, in
+   seconds or None, runs out first or a signal handler raises. */
+static int
+future_wait(Future *self, PyObject *timeout)
+{
+    int64_t deadline = -1, until;
+    double seconds;
+    BOOL done;
+
+    /* Under the lock, which orders it after the result without a GIL. */
+    lock_acquire(&self->lock);
+    done = self->done;
+    lock_release(&self->lock);
+    if (done)
+        return 0;
+    if (timeout != Py_None) {
+        seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1.0 && PyErr_Occurred())
+            return -1;
+        deadline = timer_clock_ns() + (int64_t)(seconds * 1e9);
+    }
+    for (;;) {
+        Py_BEGIN_ALLOW_THREADS
+        until = timer_clock_ns() + FUTURE_SIGNAL_CHECK;
+        if (deadline >= 0 && deadline < until)
+            until = deadline;
+        lock_acquire(&self->lock);
+        if (!self->done)
+            cond_wait(&self->cond, &self->lock, until);
+        done = self->done;
+        lock_release(&self->lock);
+        Py_END_ALLOW_THREADS
+        if (done)
+            return 0;
+        if (PyErr_CheckSignals() < 0)
+            return -1;
+        if (deadline >= 0 && timer_clock_ns() >= deadline) {
+#ifdef PYTHON3
+            PyErr_SetString(PyExc_TimeoutError, "future not done in time");
+#else
+            PyErr_SetString(PyExc_RuntimeError, "future not done in time");
+#endif
+            return -1;
+        }
+    }
+}
+
+static PyObject *
+Future_done(Future *self)
+{
+    return PyBool_FromLong(self->done);
+}
 
-    /* All thread stoppage and cleanup code is in cleanup_Timer_thread, so
-       set the die flag, which will interrupt the thread, then let the
-       cleanup handle the rest. */
-    die = TRUE;
+static PyObject *
+Future_result(Future *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"timeout", NULL};
+    PyObject *timeout = Py_None;
 
-    if (!cleanup_Timer_thread(self))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:result", kwlist,
+                                     &timeout))
+        return NULL;
+    if (future_wait(self, timeout) < 0)
         return NULL;
+    if (self->exc_type != NULL) {
+        Py_INCREF(self->exc_type);
+        Py_XINCREF(self->exc_value);
+        Py_XINCREF(self->exc_tb);
+        PyErr_Restore(self->exc_type, self->exc_value, self->exc_tb);
+        return NULL;
+    }
+    Py_INCREF(self->result);
+    return self->result;
+}
 
-    self->started = FALSE;
+static PyObject *
+Future_exception(Future *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"timeout", NULL};
+    PyObject *timeout = Py_None, *exc;
 
-done:
-    return PyLong_FromUnsignedLongLong(self->elapsed);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:exception", kwlist,
+                                     &timeout))
+        return NULL;
+    if (future_wait(self, timeout) < 0)
+        return NULL;
+    exc = self->exc_value != NULL ? self->exc_value : Py_None;
+    Py_INCREF(exc);
+    return exc;
 }
 
-static PyMethodDef Timer_methods[] = {
-    {"start", (PyCFunction)Timer_start, METH_NOARGS, Timer_start_doc},
-    {"stop", (PyCFunction)Timer_stop, METH_NOARGS, Timer_stop_doc},
-    {"reset", (PyCFunction)Timer_reset, METH_NOARGS, Timer_reset_doc},
-    {NULL, NULL}
+static PyObject *
+Future_add_done_callback(Future *self, PyObject *fn)
+{
+    PyObject *rslt;
+    BOOL done;
+    int err = 0;
+
+    if (!PyCallable_Check(fn)) {
+        PyErr_SetString(PyExc_TypeError, "fn must be callable");
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    done = self->done;
+    if (!done) {
+        if (self->callbacks == NULL)
+            self->callbacks = PyList_New(0);
+        err = self->callbacks == NULL ||
+              PyList_Append(self->callbacks, fn) < 0;
+    }
+    Py_END_CRITICAL_SECTION();
+    if (err)
+        return NULL;
+    if (done) {
+        rslt = PyObject_CallFunctionObjArgs(fn, self, NULL);
+        if (rslt == NULL)
+            PyErr_Print();
+        Py_XDECREF(rslt);
+    }
+    Py_RETURN_NONE;
+}
+
+#ifdef PYTHON3
+/* Awaited through an asyncio future of the running loop that
+   timer.aio.wrap_future() completes from whichever thread this one is. */
+static PyObject *
+Future_await(Future *self)
+{
+    PyObject *aio, *future, *rslt;
+
+    aio = PyImport_ImportModule("timer.aio");
+    if (aio == NULL)
+        return NULL;
+    future = PyObject_CallMethod(aio, "wrap_future", "O", self);
+    Py_DECREF(aio);
+    if (future == NULL)
+        return NULL;
+    rslt = PyObject_CallMethod(future, "__await__", NULL);
+    Py_DECREF(future);
+    return rslt;
+}
+
+static PyAsyncMethods Future_as_async = {
+    (unaryfunc)Future_await,                    /*am_await*/
 };
+#define FUTURE_AS_ASYNC &Future_as_async
+#else
+#define FUTURE_AS_ASYNC 0
+#endif
 
-PyDoc_STRVAR(Timer_elapsed_doc,
-"Integer representing the current elapsed time in microseconds");
+PyDoc_STRVAR(Future_done_doc,
+"done()\n"
+"\n"
+"Whether the timer has fired.");
 
-PyDoc_STRVAR(Timer_expired_doc,
-"Boolean representing whether or not the timer finished on it's \n"
-"own or if it reached the maximum duration.");
+PyDoc_STRVAR(Future_result_doc,
+"result(timeout=None)\n"
+"\n"
+"Wait up to timeout seconds, or for as long as it takes, for the timer\n"
+"to fire and return what its callback returned, or raise what it raised.");
 
-PyDoc_STRVAR(Timer_running_doc,
-"Boolean representing whether or not the timer is currently running.");
+PyDoc_STRVAR(Future_exception_doc,
+"exception(timeout=None)\n"
+"\n"
+"Like result(), but return what the callback raised, or None.");
 
-static PyMemberDef Timer_members[] = {
-    {"elapsed", T_INT, offsetof(Timer, elapsed), 0, Timer_elapsed_doc},
-    {"expired", T_BOOL, offsetof(Timer, expired), 0, Timer_expired_doc},
-    {"running", T_BOOL, offsetof(Timer, started), 0, Timer_running_doc},
-    {NULL}
+PyDoc_STRVAR(Future_add_done_callback_doc,
+"add_done_callback(fn)\n"
+"\n"
+"Call fn(future) once it is done, in the thread that runs the timer's\n"
+"callback, or right away if it already is.");
+
+static PyMethodDef Future_methods[] = {
+    {"done", (PyCFunction)Future_done, METH_NOARGS, Future_done_doc},
+    {"result", (PyCFunction)Future_result, METH_VARARGS | METH_KEYWORDS,
+     Future_result_doc},
+    {"exception", (PyCFunction)Future_exception,
+     METH_VARARGS | METH_KEYWORDS, Future_exception_doc},
+    {"add_done_callback", (PyCFunction)Future_add_done_callback, METH_O,
+     Future_add_done_callback_doc},
+    {NULL, NULL}
 };
 
-PyDoc_STRVAR(Timer_class_doc,
-"Timer(duration, callback, args)\n"
+PyDoc_STRVAR(Future_class_doc,
+"Future()\n"
 "\n"
-"Creates a timer object which can be started, stopped, or reset.\n"
-"This provides a microsecond resolution timer outside of the Python GIL.");
+"The outcome of a timer's callback. Assign one to Timer.future and the\n"
+"first callback after that completes it with its return value or its\n"
+"exception. Threads can wait for it with result(), and coroutines can\n"
+"await it.");
 
-static PyTypeObject Timer_type = {
+static PyTypeObject Future_type = {
 	PyVarObject_HEAD_INIT(NULL, 0)
-    "_timer.Timer",                             /*tp_name*/
-    sizeof(Timer),                              /*tp_basicsize*/
+    "_timer.Future",                            /*tp_name*/
+    sizeof(Future),                             /*tp_basicsize*/
     0,                                          /*tp_itemsize*/
-    (destructor)Timer_dealloc,                  /*tp_dealloc*/
+    (destructor)Future_dealloc,                 /*tp_dealloc*/
     0,                                          /*tp_print*/
     0,                                          /*tp_getattr*/
     0,                                          /*tp_setattr*/
-    0,                                          /*tp_compare*/
-    (reprfunc)Timer_str,                        /*tp_repr*/
+    FUTURE_AS_ASYNC,                            /*tp_as_async*/
+    0,                                          /*tp_repr*/
     0,                                          /*tp_as_number*/
     0,                                          /*tp_as_sequence*/
     0,                                          /*tp_as_mapping*/
     0,                                          /*tp_hash*/
     0,                                          /*tp_call*/
-    (reprfunc)Timer_str,                        /*tp_str*/
+    0,                                          /*tp_str*/
     0,                                          /*tp_getattro*/
     0,                                          /*tp_setattro*/
     0,                                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /*tp_flags*/
-    Timer_class_doc,                            /*tp_doc*/
+    Py_TPFLAGS_DEFAULT,                         /*tp_flags*/
+    Future_class_doc,                           /*tp_doc*/
     0,		                                    /*tp_traverse*/
     0,		                                    /*tp_clear*/
     0,		                                    /*tp_richcompare*/
     0,		                                    /*tp_weaklistoffset*/
     0,		                                    /*tp_iter*/
     0,		                                    /*tp_iternext*/
-    Timer_methods,                              /*tp_methods*/
-    Timer_members,                              /*tp_members*/
+    Future_methods,                             /*tp_methods*/
+    0,                                          /*tp_members*/
     0,                                          /*tp_getset*/
     0,                                          /*tp_base*/
     0,                                          /*tp_dict*/
@@ -520,56 +1186,14374 @@ static PyTypeObject Timer_type = {
     0,                                          /*tp_dictoffset*/
     0,                                          /*tp_init*/
     PyType_GenericAlloc,                        /*tp_alloc*/
-    Timer_new,                                  /*tp_new*/
+    Future_new,                                 /*tp_new*/
 };
 
+struct timer_node;
+struct timer_channel;
 
-PyDoc_STRVAR(module_doc, "A simple timer module implemented in C.");
+/* What only some timers use, allocated the first time it is set. */
+typedef struct {
+    int64_t *offsets; /* Of a sequence's deadlines from the first, or NULL */
+    Py_ssize_t shots; /* Deadlines in offsets */
+    PyObject *group; /* TimerGroup, or NULL */
+    unsigned long long generation; /* The group's when started */
+    PyObject *future; /* Future the next callback completes, or NULL */
+    PyObject *key; /* Bytes snapshot() saves it under, or NULL */
+} timer_extra;
 
-#ifdef PYTHON3
-static struct PyModuleDef _timer_module = {
-    PyModuleDef_HEAD_INIT,
-    "_timer",
-    module_doc,
-    -1,
-    NULL /*functions*/,
-    NULL, NULL, NULL, NULL
+/* A pending timer is this, its node and, unless it has one argument or
+   none, the args tuple, so it is kept small: flags are chars, settings
+   few timers have are in extra, and a single argument is kept without a
+   tuple. */
+typedef struct {
+	PyObject_HEAD
+    PyObject *callback;
+    PyObject *args; /* Sent to the callback, then kwargs values if vectorcall,
+                       or the only argument itself with bare_arg set */
+    PyObject *kwargs; /* Or with vectorcall the names of them, or NULL */
+    Py_ssize_t nargs; /* Positional arguments in args */
+    int64_t duration; /* Nanoseconds */
+    int64_t elapsed; /* Nanoseconds, once stopped or expired */
+    int64_t start_time; /* Engine clock, nanoseconds */
+    struct timer_node *node; /* Queue entry while started */
+    Py_ssize_t interval; /* Microseconds between repeats, 0 one-shot */
+    Py_ssize_t hz; /* Ticks per second of a Ticker, otherwise 0 */
+    Py_ssize_t slack; /* Microseconds it may expire late, see Timer_slack */
+    int64_t origin; /* First deadline of a repeating timer */
+    int64_t tick; /* Repeat number of the pending deadline */
+    Py_ssize_t missed; /* Repeats skipped or merged by the policy */
+    int64_t deadline; /* When it should fire, may be later than node's */
+    PyObject *histogram; /* Records elapsed on stop(), or NULL */
+    long long lateness; /* Of the last callback, nanoseconds */
+    long long wake_latency; /* Deadline to the scheduler noticing */
+    long long gil_wait; /* Noticing to having the GIL */
+    unsigned long long trace_id; /* Identifies it in event traces */
+    PyObject *channel; /* Channel expirations are delivered to, or NULL */
+    timer_extra *extra; /* NULL until one of its settings is made */
+    PyInterpreterState *interp; /* The one it was made in */
+    char expired;
+    char started;
+    char bare_arg; /* args is the only argument, see Timer_pack_arguments */
+    char overrun; /* OVERRUN_* policy for repeats that fell behind */
+    char main_thread; /* Run callbacks on the main thread instead */
+    char thread_affine; /* Or on the thread that started it */
+    char precision; /* PRECISION_* the scheduler keeps to its deadline */
+    char priority; /* LANE_* its callbacks wait in once due */
+    char backoff; /* A Backoff, the callback gets the attempt instead */
+    char lazy; /* Its node waits for the shard's next sweep, see LAZY_LEAD */
+} Timer;
+
+static PyTypeObject Timer_type;
+
+/* A Timer whose delay grows with each retry, see Backoff_retry. */
+typedef struct {
+    Timer timer;
+    double delay; /* Nanoseconds before jitter of the next retry */
+    double factor;
+    double max; /* Nanoseconds the delay stops growing at */
+    double jitter; /* Fraction of the delay that may be taken off */
+    int64_t base; /* Nanoseconds, the first delay */
+    uint64_t rng; /* xorshift64* state */
+    Py_ssize_t attempt; /* Retries since the last reset() */
+} Backoff;
+static PyTypeObject Ticker_type;
+
+/* Timers that are stopped together. cancel() only bumps the generation;
+   a member whose start saw an older one has lapsed, and is stopped for
+   real when it comes due or is next used. */
+typedef struct {
+    PyObject_HEAD
+    unsigned long long generation;
+    int64_t cancelled_at; /* Engine clock of the last cancel() */
+} TimerGroup;
+
+static PyTypeObject TimerGroup_type;
+
+/* An extra setting of a Timer, or none if it has no extra. */
+#define TIMER_EXTRA(self, field, none) \
+    ((self)->extra != NULL ? (self)->extra->field : (none))
+
+#define TIMER_LAPSED(self) \
+    (TIMER_EXTRA(self, group, NULL) != NULL && \
+     ((TimerGroup*)(self)->extra->group)->generation != \
+     (self)->extra->generation)
+
+/* What a repeating timer does when a callback ran so late that one or more
+   of its following deadlines have already passed. */
+enum {
+    OVERRUN_SKIP,     /* Drop them and continue with the next future one */
+    OVERRUN_CATCH_UP, /* Fire all of them, back to back */
+    OVERRUN_COALESCE  /* Fire once right away for all of them */
 };
-#endif
 
-#ifdef PYTHON3
-PyMODINIT_FUNC PyInit__timer(void)
-#else
-PyMODINIT_FUNC init_timer()
-#endif
+static const char *overrun_names[] = {"skip", "catch_up", "coalesce", NULL};
+
+/* How a shard waits for a timer's deadline, see shard_margin. */
+enum {
+    PRECISION_HYBRID, /* Sleep, then spin for the last spin_margin */
+    PRECISION_SPIN,   /* The same, spinning for at least SPIN_WINDOW */
+    PRECISION_COARSE  /* Sleep only */
+};
+
+static const char *precision_names[] = {"hybrid", "spin", "coarse", NULL};
+
+/* Timer.priority, the lane its due expirations wait in. Lanes are
+   drained in this order, see shard_claim and deliver_with_gil. */
+enum {
+    LANE_HIGH,
+    LANE_NORMAL,
+    LANE_LOW,
+    LANES
+};
+
+static const char *lane_names[] = {"high", "normal", "low", NULL};
+
+/* A pending expiration. Nodes are owned by the scheduler from the time
+   they are submitted, and own a reference to their Timer until they are
+   done with or buried, see scheduler_cancel. */
+enum {
+    NODE_SUBMITTED, /* Handed to the scheduler, not in the queue yet */
+    NODE_PENDING,   /* In the queue */
+    NODE_DUE,       /* Taken off the queue, waiting for the GIL */
+    NODE_CANCELLED, /* Was due, but stopped before the callback ran */
+    NODE_RUNNING,   /* C API callback running, see native_run */
+    NODE_TOMBSTONE, /* Stopped and left there, timer and u are stale */
+    NODE_WALL       /* In the wall queue, deadline on the wall clock */
+};
+
+typedef struct timer_node {
+    int64_t deadline; /* Engine clock, nanoseconds */
+    int64_t due_time; /* When the scheduler found it due */
+    struct timer_node *prev;
+    struct timer_node *next;
+    Timer *timer;
+    union {
+        struct timer_channel *channel; /* Timer's at start, a reference */
+        void (*fn)(void *); /* C API callback, timer is NULL then */
+    } u;
+    union {
+        void *arg; /* For fn */
+        int64_t window; /* Timer's at start, see node_window */
+    } v;
+    int slot; /* Queue specific position, see the queue implementations */
+    char state;
+    char main_thread; /* Timer's main_thread at start */
+    unsigned char shard; /* Home shard, see timer_shard */
+    unsigned char precision : 4; /* Timer's precision at start */
+    unsigned char lane : 3; /* Timer's priority at start */
+    unsigned char lazy : 1; /* Timer's lazy at start */
+} timer_node;
+
+
+/* Scheduler queues. Each keeps pending nodes and hands back the ones that
+   are due. All operations are called with the shard's lock held. */
+typedef struct timer_queue timer_queue;
+
+typedef struct {
+    const char *name;
+    int (*init)(timer_queue *queue, int64_t now);
+    void (*fini)(timer_queue *queue);
+    int (*insert)(timer_queue *queue, timer_node *node); /* -1 no memory */
+    void (*remove)(timer_queue *queue, timer_node *node);
+    /* Engine time at which the queue next needs attention, or -1 when
+       empty. May be earlier than any deadline, never later. */
+    int64_t (*next)(timer_queue *queue);
+    /* Remove every node due at now, returned as a list linked by next. */
+    timer_node *(*pop_due)(timer_queue *queue, int64_t now);
+} timer_queue_ops;
+
+struct timer_queue {
+    const timer_queue_ops *ops;
+    void *data;
+};
+
+static int
+queue_init(timer_queue *queue, const timer_queue_ops *ops, int64_t now)
 {
-    PyObject *module;
-    
-#ifdef PYTHON3
-    module = PyModule_Create(&_timer_module);
-#else
-    module = Py_InitModule3("_timer", NULL, module_doc);
-#endif
+    queue->ops = ops;
+    queue->data = NULL;
+    return ops->init(queue, now);
+}
 
-    if (module == NULL)
-        goto fail;
+/* Append node to the list given by its first and last elements. */
+static void
+node_append(timer_node **first, timer_node **last, timer_node *node)
+{
+    node->next = NULL;
+    if (*last != NULL)
+        (*last)->next = node;
+    else
+        *first = node;
+    *last = node;
+}
 
-    if (PyType_Ready(&Timer_type) < 0)
-        goto fail;
-    Py_INCREF(&Timer_type);
-    PyModule_AddObject(module, "Timer", (PyObject*)&Timer_type);
-    
-    PyModule_AddStringConstant(module, "__version__", TIMER_VERSION);
-    PyModule_AddStringConstant(module, "__author__", AUTHOR);
 
-#ifdef PYTHON3
-    return module;
-#endif
+/* List queue. Nodes are kept in a single deadline-ordered doubly-linked
+   list, data is the head. Insertion is linear, which is fine for a few
+   hundred timers. Ties keep submission order. */
+static int
+list_init(timer_queue *queue, int64_t now)
+{
+    return 0;
+}
 
-fail:
-#ifdef PYTHON3
-    return NULL;
-#else
-    return;
+static void
+list_fini(timer_queue *queue)
+{
+}
+
+static int
+list_insert(timer_queue *queue, timer_node *node)
+{
+    timer_node *cur = (timer_node*)queue->data, *prev = NULL;
+
+    while (cur != NULL && cur->deadline <= node->deadline) {
+        prev = cur;
+        cur = cur->next;
+    }
+
+    node->prev = prev;
+    node->next = cur;
+    if (cur != NULL)
+        cur->prev = node;
+    if (prev != NULL)
+        prev->next = node;
+    else
+        queue->data = node;
+    return 0;
+}
+
+static void
+list_remove(timer_queue *queue, timer_node *node)
+{
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        queue->data = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+static int64_t
+list_next(timer_queue *queue)
+{
+    timer_node *head = (timer_node*)queue->data;
+
+    return head != NULL ? head->deadline : -1;
+}
+
+static timer_node *
+list_pop_due(timer_queue *queue, int64_t now)
+{
+    timer_node *head, *first = NULL, *last = NULL;
+
+    while ((head = (timer_node*)queue->data) != NULL && head->deadline <= now) {
+        list_remove(queue, head);
+        node_append(&first, &last, head);
+    }
+    return first;
+}
+
+static const timer_queue_ops list_queue = {
+    "list", list_init, list_fini, list_insert, list_remove,
+    list_next, list_pop_due
+};
+
+
+/* Hierarchical timing wheel. Time is counted in microsecond ticks. Level 0
+   has one slot per tick, and each level above has slots 256 times as wide,
+   so four levels cover 2**32 microseconds (about 71 minutes). Anything
+   further out waits in an overflow list. Nodes live in the level whose
+   span covers their distance from the wheel's current tick and are
+   cascaded down a level each time the wheel reaches their slot, so insert
+   and remove are O(1) and a node moves at most once per level.
+
+   An occupancy bitmap per level lets the wheel jump straight to the next
+   tick where something fires or cascades instead of stepping one tick at
+   a time. A node's slot member is level * WHEEL_SLOTS + index. */
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_OVERFLOW (WHEEL_LEVELS * WHEEL_SLOTS)
+
+typedef struct {
+    int64_t now; /* Current tick. Everything before it has been handled. */
+    timer_node *slots[WHEEL_LEVELS * WHEEL_SLOTS + 1]; /* + overflow */
+    uint64_t occupied[WHEEL_LEVELS][WHEEL_SLOTS / 64];
+    /* Earliest deadline in the slot each level cascades next, so the
+       scheduler can sleep until that rather than until the cascade.
+       Index WHEEL_LEVELS is the overflow list, -1 marks no cached slot. */
+    int cached_slot[WHEEL_LEVELS + 1];
+    int64_t cached_min[WHEEL_LEVELS + 1];
+} timer_wheel;
+
+/* Microsecond tick a deadline fires on. Rounded up so nothing fires
+   early. */
+#define WHEEL_TICK(deadline) (((deadline) + 999) / 1000)
+
+static int
+bit_scan_forward(uint64_t word)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+#ifdef _WIN64
+    _BitScanForward64(&index, word);
+#else
+    if (!_BitScanForward(&index, (unsigned long)word)) {
+        _BitScanForward(&index, (unsigned long)(word >> 32));
+        index += 32;
+    }
+#endif
+    return (int)index;
+#else
+    return __builtin_ctzll(word);
+#endif
+}
+
+/* Index of the highest set bit. word must not be 0. */
+static int
+bit_scan_reverse(uint64_t word)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+#ifdef _WIN64
+    _BitScanReverse64(&index, word);
+#else
+    if (_BitScanReverse(&index, (unsigned long)(word >> 32)))
+        index += 32;
+    else
+        _BitScanReverse(&index, (unsigned long)word);
+#endif
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(word);
+#endif
+}
+
+/* Fails to compile if a level's bitmap isn't the four words wheel_scan
+   tests at once. */
+typedef char wheel_slots_check[WHEEL_SLOTS == 256 ? 1 : -1];
+
+/* Distance from start to the first occupied slot of a level, wrapping
+   around, or -1 if the level is empty. */
+static int
+wheel_scan(const uint64_t *bits, int start)
+{
+    int i, word, offset = start & 63;
+    uint64_t mask;
+
+    /* Most levels are empty most of the time. */
+    if ((bits[0] | bits[1] | bits[2] | bits[3]) == 0)
+        return -1;
+    for (i = 0; i <= WHEEL_SLOTS / 64; i++) {
+        word = ((start >> 6) + i) % (WHEEL_SLOTS / 64);
+        mask = bits[word];
+        if (i == 0)
+            mask &= ~(uint64_t)0 << offset;
+        else if (i == WHEEL_SLOTS / 64)
+            mask &= offset ? ((uint64_t)1 << offset) - 1 : 0;
+        if (mask)
+            return ((word << 6) + bit_scan_forward(mask) - start) & WHEEL_MASK;
+    }
+    return -1;
+}
+
+static void
+wheel_link(timer_wheel *wheel, timer_node *node)
+{
+    int64_t tick = WHEEL_TICK(node->deadline), delta;
+    int level, index;
+
+    if (tick < wheel->now)
+        tick = wheel->now;
+    delta = tick - wheel->now;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (delta < ((int64_t)1 << (WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    if (level == WHEEL_LEVELS)
+        node->slot = WHEEL_OVERFLOW;
+    else {
+        index = (int)(tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        node->slot = level * WHEEL_SLOTS + index;
+        wheel->occupied[level][index >> 6] |= (uint64_t)1 << (index & 63);
+    }
+    if (level > 0 && wheel->cached_slot[level] == node->slot &&
+        node->deadline < wheel->cached_min[level])
+        wheel->cached_min[level] = node->deadline;
+
+    node->prev = NULL;
+    node->next = wheel->slots[node->slot];
+    if (node->next != NULL)
+        node->next->prev = node;
+    wheel->slots[node->slot] = node;
+}
+
+static void
+wheel_unlink(timer_wheel *wheel, timer_node *node)
+{
+    int slot = node->slot, level = slot / WHEEL_SLOTS;
+
+    if (level > 0 && wheel->cached_slot[level] == slot &&
+        node->deadline <= wheel->cached_min[level])
+        wheel->cached_slot[level] = -1;
+
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        wheel->slots[slot] = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+
+    if (slot != WHEEL_OVERFLOW && wheel->slots[slot] == NULL)
+        wheel->occupied[slot / WHEEL_SLOTS][(slot & WHEEL_MASK) >> 6] &=
+            ~((uint64_t)1 << (slot & 63));
+}
+
+/* Take every node out of a slot, returned as a list linked by next. */
+static timer_node *
+wheel_take(timer_wheel *wheel, int slot)
+{
+    timer_node *first = wheel->slots[slot];
+
+    if (wheel->cached_slot[slot / WHEEL_SLOTS] == slot)
+        wheel->cached_slot[slot / WHEEL_SLOTS] = -1;
+    wheel->slots[slot] = NULL;
+    if (slot != WHEEL_OVERFLOW)
+        wheel->occupied[slot / WHEEL_SLOTS][(slot & WHEEL_MASK) >> 6] &=
+            ~((uint64_t)1 << (slot & 63));
+    return first;
+}
+
+/* Redistribute the slots whose time has come now that the wheel is at a
+   level 0 rotation boundary. */
+static void
+wheel_cascade(timer_wheel *wheel)
+{
+    timer_node *node, *next;
+    int level, index, slot;
+
+    for (level = 1; level <= WHEEL_LEVELS; level++) {
+        if (level == WHEEL_LEVELS)
+            slot = WHEEL_OVERFLOW;
+        else {
+            index = (int)(wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            slot = level * WHEEL_SLOTS + index;
+        }
+        for (node = wheel_take(wheel, slot); node != NULL; node = next) {
+            next = node->next;
+            wheel_link(wheel, node);
+        }
+        /* Higher levels only turn over when this one wraps. */
+        if (level < WHEEL_LEVELS && index != 0)
+            break;
+    }
+}
+
+/* The next tick after the current one at which a node fires or a slot has
+   to be cascaded, or -1 if the wheel is empty. */
+static int64_t
+wheel_next_tick(timer_wheel *wheel)
+{
+    int64_t best = -1, tick;
+    int level, shift, distance;
+
+    distance = wheel_scan(wheel->occupied[0], (int)(wheel->now & WHEEL_MASK));
+    if (distance >= 0)
+        best = wheel->now + distance;
+
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        shift = WHEEL_BITS * level;
+        /* The current slot of this level was cascaded when the wheel got
+           there, so anything in it belongs to the next time around. */
+        distance = wheel_scan(wheel->occupied[level],
+            (int)(((wheel->now >> shift) + 1) & WHEEL_MASK));
+        if (distance < 0)
+            continue;
+        tick = ((wheel->now >> shift) + 1 + distance) << shift;
+        if (best < 0 || tick < best)
+            best = tick;
+    }
+
+    if (wheel->slots[WHEEL_OVERFLOW] != NULL) {
+        shift = WHEEL_BITS * WHEEL_LEVELS;
+        tick = ((wheel->now >> shift) + 1) << shift;
+        if (best < 0 || tick < best)
+            best = tick;
+    }
+    return best;
+}
+
+/* Earliest deadline of the nodes in a slot. */
+static int64_t
+wheel_slot_min(timer_wheel *wheel, int slot)
+{
+    int level = slot / WHEEL_SLOTS;
+    timer_node *node;
+    int64_t best;
+
+    if (wheel->cached_slot[level] == slot)
+        return wheel->cached_min[level];
+
+    best = wheel->slots[slot]->deadline;
+    for (node = wheel->slots[slot]->next; node != NULL; node = node->next) {
+        if (node->deadline < best)
+            best = node->deadline;
+    }
+    wheel->cached_slot[level] = slot;
+    wheel->cached_min[level] = best;
+    return best;
+}
+
+static int
+wheel_init(timer_queue *queue, int64_t now)
+{
+    timer_wheel *wheel = (timer_wheel*)calloc(1, sizeof(timer_wheel));
+    int level;
+
+    if (wheel == NULL)
+        return -1;
+    wheel->now = now / 1000;
+    for (level = 0; level <= WHEEL_LEVELS; level++)
+        wheel->cached_slot[level] = -1;
+    queue->data = wheel;
+    return 0;
+}
+
+static void
+wheel_fini(timer_queue *queue)
+{
+    free(queue->data);
+    queue->data = NULL;
+}
+
+static int
+wheel_insert(timer_queue *queue, timer_node *node)
+{
+    wheel_link((timer_wheel*)queue->data, node);
+    return 0;
+}
+
+static void
+wheel_remove(timer_queue *queue, timer_node *node)
+{
+    wheel_unlink((timer_wheel*)queue->data, node);
+}
+
+/* Unlike wheel_next_tick this gives the earliest actual deadline. Slots
+   that cascade before then are handled by wheel_pop_due on the way. */
+static int64_t
+wheel_next(timer_queue *queue)
+{
+    timer_wheel *wheel = (timer_wheel*)queue->data;
+    int64_t best = -1, deadline, base;
+    int level, shift, distance, index;
+
+    distance = wheel_scan(wheel->occupied[0], (int)(wheel->now & WHEEL_MASK));
+    if (distance >= 0)
+        best = (wheel->now + distance) * 1000;
+
+    /* Within a level, slots further along the rotation hold later
+       deadlines, so only the first occupied one matters. */
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        shift = WHEEL_BITS * level;
+        base = (wheel->now >> shift) + 1;
+        distance = wheel_scan(wheel->occupied[level], (int)(base & WHEEL_MASK));
+        if (distance < 0)
+            continue;
+        index = (int)((base + distance) & WHEEL_MASK);
+        deadline = wheel_slot_min(wheel, level * WHEEL_SLOTS + index);
+        if (best < 0 || deadline < best)
+            best = deadline;
+    }
+
+    if (wheel->slots[WHEEL_OVERFLOW] != NULL) {
+        deadline = wheel_slot_min(wheel, WHEEL_OVERFLOW);
+        if (best < 0 || deadline < best)
+            best = deadline;
+    }
+    return best;
+}
+
+static timer_node *
+wheel_pop_due(timer_queue *queue, int64_t now)
+{
+    timer_wheel *wheel = (timer_wheel*)queue->data;
+    timer_node *first = NULL, *last = NULL, *node, *next;
+    int64_t target = now / 1000, tick;
+
+    while (1) {
+        node = wheel_take(wheel, (int)(wheel->now & WHEEL_MASK));
+        for (; node != NULL; node = next) {
+            next = node->next;
+            node_append(&first, &last, node);
+        }
+
+        tick = wheel_next_tick(wheel);
+        if (tick < 0 || tick > target) {
+            /* Nothing happens in between, so the wheel can skip ahead. */
+            if (target > wheel->now)
+                wheel->now = target;
+            break;
+        }
+        wheel->now = tick;
+        if ((tick & WHEEL_MASK) == 0)
+            wheel_cascade(wheel);
+    }
+    return first;
+}
+
+static const timer_queue_ops wheel_queue = {
+    "wheel", wheel_init, wheel_fini, wheel_insert, wheel_remove,
+    wheel_next, wheel_pop_due
+};
+
+/* Indexed 4-ary min-heap on deadline, data is a timer_heap. Four children
+   per node keep the tree shallow. The deadlines are kept in an array of
+   their own beside the nodes, so siblings' deadlines share a cache line
+   and sifting compares them without touching the nodes, each in a line of
+   its own. A node's slot member is its index in the arrays, so removing
+   an arbitrary node is O(log n) instead of a search. */
+#define HEAP_ARITY 4
+
+typedef struct {
+    timer_node **items;
+    int64_t *deadlines; /* deadlines[i] is items[i]->deadline */
+    Py_ssize_t size;
+    Py_ssize_t capacity;
+} timer_heap;
+
+static void
+heap_place(timer_heap *heap, Py_ssize_t index, timer_node *node,
+           int64_t deadline)
+{
+    heap->items[index] = node;
+    heap->deadlines[index] = deadline;
+    node->slot = (int)index;
+}
+
+static void
+heap_move(timer_heap *heap, Py_ssize_t to, Py_ssize_t from)
+{
+    heap_place(heap, to, heap->items[from], heap->deadlines[from]);
+}
+
+/* Index of the earliest of the children from child up to last. A full
+   set of siblings is compared pairwise, which compiles to conditional
+   moves rather than a branch per child. */
+static Py_ssize_t
+heap_min_child(const int64_t *deadlines, Py_ssize_t child, Py_ssize_t last)
+{
+    Py_ssize_t best, a, b;
+
+    if (last - child == HEAP_ARITY) {
+        a = deadlines[child + 1] < deadlines[child] ? child + 1 : child;
+        b = deadlines[child + 3] < deadlines[child + 2] ? child + 3 : child + 2;
+        return deadlines[b] < deadlines[a] ? b : a;
+    }
+    for (best = child++; child < last; child++) {
+        if (deadlines[child] < deadlines[best])
+            best = child;
+    }
+    return best;
+}
+
+static void
+heap_sift_up(timer_heap *heap, Py_ssize_t index)
+{
+    timer_node *node = heap->items[index];
+    int64_t deadline = heap->deadlines[index];
+    Py_ssize_t parent;
+
+    while (index > 0) {
+        parent = (index - 1) / HEAP_ARITY;
+        if (heap->deadlines[parent] <= deadline)
+            break;
+        heap_move(heap, index, parent);
+        index = parent;
+    }
+    heap_place(heap, index, node, deadline);
+}
+
+static void
+heap_sift_down(timer_heap *heap, Py_ssize_t index)
+{
+    timer_node *node = heap->items[index];
+    int64_t deadline = heap->deadlines[index];
+    Py_ssize_t child, best, last;
+
+    while (1) {
+        child = index * HEAP_ARITY + 1;
+        if (child >= heap->size)
+            break;
+        last = child + HEAP_ARITY;
+        if (last > heap->size)
+            last = heap->size;
+        best = heap_min_child(heap->deadlines, child, last);
+        if (deadline <= heap->deadlines[best])
+            break;
+        heap_move(heap, index, best);
+        index = best;
+    }
+    heap_place(heap, index, node, deadline);
+}
+
+static int
+heap_init(timer_queue *queue, int64_t now)
+{
+    timer_heap *heap = (timer_heap*)calloc(1, sizeof(timer_heap));
+
+    if (heap == NULL)
+        return -1;
+    queue->data = heap;
+    return 0;
+}
+
+static void
+heap_fini(timer_queue *queue)
+{
+    timer_heap *heap = (timer_heap*)queue->data;
+
+    free(heap->items);
+    free(heap->deadlines);
+    free(heap);
+    queue->data = NULL;
+}
+
+static int
+heap_insert(timer_queue *queue, timer_node *node)
+{
+    timer_heap *heap = (timer_heap*)queue->data;
+    timer_node **items;
+    int64_t *deadlines;
+    Py_ssize_t capacity;
+
+    if (heap->size == heap->capacity) {
+        capacity = heap->capacity ? heap->capacity * 2 : 64;
+        items = (timer_node**)realloc(heap->items,
+                                      capacity * sizeof(timer_node*));
+        if (items == NULL)
+            return -1;
+        heap->items = items;
+        deadlines = (int64_t*)realloc(heap->deadlines,
+                                      capacity * sizeof(int64_t));
+        if (deadlines == NULL)
+            return -1; /* items is merely larger than it needs to be */
+        heap->deadlines = deadlines;
+        heap->capacity = capacity;
+    }
+    heap_place(heap, heap->size++, node, node->deadline);
+    heap_sift_up(heap, heap->size - 1);
+    return 0;
+}
+
+static void
+heap_remove(timer_queue *queue, timer_node *node)
+{
+    timer_heap *heap = (timer_heap*)queue->data;
+    Py_ssize_t index = node->slot;
+
+    if (index == --heap->size)
+        return;
+    /* The last node takes the hole and moves whichever way it has to. */
+    heap_move(heap, index, heap->size);
+    if (index > 0 &&
+        heap->deadlines[(index - 1) / HEAP_ARITY] > heap->deadlines[index])
+        heap_sift_up(heap, index);
+    else
+        heap_sift_down(heap, index);
+}
+
+static int64_t
+heap_next(timer_queue *queue)
+{
+    timer_heap *heap = (timer_heap*)queue->data;
+
+    return heap->size > 0 ? heap->deadlines[0] : -1;
+}
+
+static timer_node *
+heap_pop_due(timer_queue *queue, int64_t now)
+{
+    timer_heap *heap = (timer_heap*)queue->data;
+    timer_node *first = NULL, *last = NULL, *node;
+
+    while (heap->size > 0 && heap->deadlines[0] <= now) {
+        node = heap->items[0];
+        heap_remove(queue, node);
+        node_append(&first, &last, node);
+    }
+    return first;
+}
+
+static const timer_queue_ops heap_queue = {
+    "heap", heap_init, heap_fini, heap_insert, heap_remove,
+    heap_next, heap_pop_due
+};
+
+static const timer_queue_ops *queue_types[] = {
+    &wheel_queue,
+    &heap_queue,
+    &list_queue,
+    NULL
+};
+
+static const timer_queue_ops *
+find_queue_type(const char *name)
+{
+    int i;
+
+    for (i = 0; queue_types[i] != NULL; i++) {
+        if (strcmp(queue_types[i]->name, name) == 0)
+            return queue_types[i];
+    }
+    PyErr_Format(PyExc_ValueError, "unknown timer queue '%s'", name);
+    return NULL;
+}
+
+/* Wait backends. A shard's thread blocks in a backend until the next
+   deadline or until another thread wakes it. wait is called with the
+   shard's lock held and returns with it held; wake is called with the
+   lock held. */
+typedef struct timer_waiter timer_waiter;
+
+typedef struct {
+    const char *name;
+    /* -1 on failure, with errno set, or GetLastError() on Windows. */
+    int (*init)(timer_waiter *waiter);
+    void (*fini)(timer_waiter *waiter);
+    /* Wait until woken or until the engine clock reaches deadline, which
+       may be -1 to wait for a wake-up only. May return early, and up to
+       the waiter's window late. */
+    void (*wait)(timer_waiter *waiter, timer_lock *lock, int64_t deadline);
+    void (*wake)(timer_waiter *waiter);
+} timer_backend;
+
+struct timer_waiter {
+    const timer_backend *ops;
+    void *data;
+    int64_t window; /* Nanoseconds, set by the shard before each wait */
+};
+
+
+/* Condition variable backend, data is a timer_cond. Portable, but the
+   wake-up is only as accurate as the condition variable's timeout. */
+static int
+condvar_init(timer_waiter *waiter)
+{
+    timer_cond *cond = (timer_cond*)malloc(sizeof(timer_cond));
+
+    if (cond == NULL) {
+#ifdef MS_WINDOWS
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+#endif
+        errno = ENOMEM;
+        return -1;
+    }
+    cond_init(cond);
+    waiter->data = cond;
+    return 0;
+}
+
+static void
+condvar_fini(timer_waiter *waiter)
+{
+#ifdef UNIX
+    pthread_cond_destroy((timer_cond*)waiter->data);
+#endif
+    free(waiter->data);
+}
+
+static void
+condvar_wait(timer_waiter *waiter, timer_lock *lock, int64_t deadline)
+{
+    cond_wait((timer_cond*)waiter->data, lock, deadline);
+}
+
+static void
+condvar_wake(timer_waiter *waiter)
+{
+    cond_signal((timer_cond*)waiter->data);
+}
+
+static const timer_backend condvar_backend = {
+    "condvar", condvar_init, condvar_fini, condvar_wait, condvar_wake
+};
+
+
+#ifdef HAVE_TIMERFD
+/* Linux timerfd backend. One timerfd armed with the absolute deadline and
+   an eventfd for wake-ups, both watched by epoll, so the scheduler thread
+   sleeps in the kernel until the hrtimer fires. */
+typedef struct {
+    int epoll;
+    int timer;
+    int event;
+    int64_t armed; /* Deadline the timerfd is set to, -1 disarmed */
+} timerfd_state;
+
+static void
+timerfd_close(timerfd_state *state)
+{
+    if (state->epoll >= 0)
+        close(state->epoll);
+    if (state->timer >= 0)
+        close(state->timer);
+    if (state->event >= 0)
+        close(state->event);
+    free(state);
+}
+
+static int
+timerfd_init(timer_waiter *waiter)
+{
+    timerfd_state *state = (timerfd_state*)malloc(sizeof(timerfd_state));
+    struct epoll_event event;
+    int err;
+
+    if (state == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    state->armed = -1;
+    state->timer = state->event = -1;
+    state->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (state->epoll < 0)
+        goto fail;
+    state->timer = timerfd_create(TIMER_CLOCK_ID, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (state->timer < 0)
+        goto fail;
+    state->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (state->event < 0)
+        goto fail;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = state->timer;
+    if (epoll_ctl(state->epoll, EPOLL_CTL_ADD, state->timer, &event) < 0)
+        goto fail;
+    event.data.fd = state->event;
+    if (epoll_ctl(state->epoll, EPOLL_CTL_ADD, state->event, &event) < 0)
+        goto fail;
+
+    waiter->data = state;
+    return 0;
+
+fail:
+    err = errno;
+    timerfd_close(state);
+    errno = err;
+    return -1;
+}
+
+static void
+timerfd_fini(timer_waiter *waiter)
+{
+    timerfd_close((timerfd_state*)waiter->data);
+}
+
+static void
+timerfd_wait(timer_waiter *waiter, timer_lock *lock, int64_t deadline)
+{
+    timerfd_state *state = (timerfd_state*)waiter->data;
+    struct epoll_event events[2];
+    struct itimerspec spec;
+    uint64_t count;
+    int i, n;
+
+    /* Only touch the timer when the queue head has moved. */
+    if (deadline != state->armed) {
+        memset(&spec, 0, sizeof(spec));
+        if (deadline >= 0) {
+            ns_to_timespec(kernel_deadline(deadline), &spec.it_value);
+            /* An all zero value would disarm the timer. */
+            if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+                spec.it_value.tv_nsec = 1;
+        }
+        timerfd_settime(state->timer, TFD_TIMER_ABSTIME, &spec, NULL);
+        state->armed = deadline;
+    }
+
+    lock_release(lock);
+    n = epoll_wait(state->epoll, events, 2, -1);
+    for (i = 0; i < n; i++) {
+        /* Both are non-blocking, reading just clears them. */
+        if (read(events[i].data.fd, &count, sizeof(count)) < 0)
+            continue;
+        if (events[i].data.fd == state->timer)
+            state->armed = -1;
+    }
+    lock_acquire(lock);
+}
+
+static void
+timerfd_wake(timer_waiter *waiter)
+{
+    uint64_t one = 1;
+
+    if (write(((timerfd_state*)waiter->data)->event, &one, sizeof(one)) < 0) {
+        /* The counter is already non-zero, so a wake-up is pending. */
+    }
+}
+
+static const timer_backend timerfd_backend = {
+    "timerfd", timerfd_init, timerfd_fini, timerfd_wait, timerfd_wake
+};
+#endif /* HAVE_TIMERFD */
+
+#ifdef HAVE_IO_URING
+/* Linux io_uring backend, without liburing. The queue head's deadline is
+   one IORING_OP_TIMEOUT, absolute on CLOCK_MONOTONIC, and wake-ups an
+   IORING_OP_READ of an eventfd. Moving the deadline queues an
+   IORING_OP_TIMEOUT_REMOVE of the old one and the new one, and a single
+   io_uring_enter submits whatever is queued and sleeps until something
+   completes, where timerfd takes a settime, an epoll_wait and a read. */
+#define URING_ENTRIES 8
+#define URING_WAKE ((uint64_t)1 << 63) /* user_data of the eventfd read */
+#define URING_REMOVE ((uint64_t)1 << 62) /* Of a TIMEOUT_REMOVE */
+
+typedef struct {
+    int ring;
+    int event;
+    void *sq_map, *cq_map;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued; /* SQEs filled in since the last enter */
+    uint64_t timeout; /* user_data of the armed timeout, from 1 */
+    int64_t armed; /* Its deadline, -1 none */
+    BOOL reading; /* The eventfd read is in flight */
+    uint64_t count; /* What it reads */
+    struct __kernel_timespec spec;
+} uring_state;
+
+static void
+uring_close(uring_state *state)
+{
+    if (state->sqes != NULL)
+        munmap(state->sqes, state->sqes_size);
+    if (state->cq_map != NULL && state->cq_map != state->sq_map)
+        munmap(state->cq_map, state->cq_size);
+    if (state->sq_map != NULL)
+        munmap(state->sq_map, state->sq_size);
+    if (state->ring >= 0)
+        close(state->ring);
+    if (state->event >= 0)
+        close(state->event);
+    free(state);
+}
+
+static int
+uring_init(timer_waiter *waiter)
+{
+    uring_state *state = (uring_state*)calloc(1, sizeof(uring_state));
+    struct io_uring_params params;
+    void *map;
+    int err;
+
+    if (state == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    state->armed = -1;
+    state->event = -1;
+    memset(&params, 0, sizeof(params));
+    state->ring = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (state->ring < 0)
+        goto fail;
+    state->event = eventfd(0, EFD_CLOEXEC);
+    if (state->event < 0)
+        goto fail;
+
+    state->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    state->cq_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    /* Since 5.4 one mapping holds both rings. */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_size > state->sq_size)
+            state->sq_size = state->cq_size;
+    }
+    map = mmap(NULL, state->sq_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, state->ring, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED)
+        goto fail;
+    state->sq_map = map;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        state->cq_map = map;
+    else {
+        map = mmap(NULL, state->cq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, state->ring, IORING_OFF_CQ_RING);
+        if (map == MAP_FAILED)
+            goto fail;
+        state->cq_map = map;
+    }
+    state->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, state->ring, IORING_OFF_SQES);
+    if (map == MAP_FAILED)
+        goto fail;
+    state->sqes = (struct io_uring_sqe*)map;
+
+    state->sq_head = (unsigned*)((char*)state->sq_map + params.sq_off.head);
+    state->sq_tail = (unsigned*)((char*)state->sq_map + params.sq_off.tail);
+    state->sq_mask = (unsigned*)((char*)state->sq_map +
+                                 params.sq_off.ring_mask);
+    state->sq_array = (unsigned*)((char*)state->sq_map + params.sq_off.array);
+    state->cq_head = (unsigned*)((char*)state->cq_map + params.cq_off.head);
+    state->cq_tail = (unsigned*)((char*)state->cq_map + params.cq_off.tail);
+    state->cq_mask = (unsigned*)((char*)state->cq_map +
+                                 params.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)((char*)state->cq_map +
+                                         params.cq_off.cqes);
+
+    waiter->data = state;
+    return 0;
+
+fail:
+    err = errno;
+    uring_close(state);
+    errno = err;
+    return -1;
+}
+
+static void
+uring_fini(timer_waiter *waiter)
+{
+    uring_close((uring_state*)waiter->data);
+}
+
+/* The next free SQE, cleared. Only the shard's thread submits, and at
+   most three between enters, well within the ring. */
+static struct io_uring_sqe *
+uring_sqe(uring_state *state)
+{
+    unsigned tail = *state->sq_tail + state->queued;
+    unsigned index = tail & *state->sq_mask;
+    struct io_uring_sqe *sqe = &state->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    state->sq_array[index] = index;
+    state->queued++;
+    return sqe;
+}
+
+static void
+uring_wait(timer_waiter *waiter, timer_lock *lock, int64_t deadline)
+{
+    uring_state *state = (uring_state*)waiter->data;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    int64_t ns;
+
+    /* Only touch the timeout when the queue head has moved. */
+    if (deadline != state->armed) {
+        if (state->armed >= 0) {
+            sqe = uring_sqe(state);
+            sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+            sqe->addr = state->timeout;
+            sqe->user_data = URING_REMOVE;
+        }
+        if (deadline >= 0) {
+            ns = kernel_deadline(deadline);
+            state->spec.tv_sec = ns / 1000000000;
+            state->spec.tv_nsec = ns % 1000000000;
+            sqe = uring_sqe(state);
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uint64_t)(uintptr_t)&state->spec;
+            sqe->len = 1;
+            sqe->timeout_flags = IORING_TIMEOUT_ABS;
+            sqe->user_data = ++state->timeout;
+        }
+        state->armed = deadline;
+    }
+    if (!state->reading) {
+        sqe = uring_sqe(state);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = state->event;
+        sqe->addr = (uint64_t)(uintptr_t)&state->count;
+        sqe->len = sizeof(state->count);
+        sqe->user_data = URING_WAKE;
+        state->reading = TRUE;
+    }
+    __atomic_store_n(state->sq_tail, *state->sq_tail + state->queued,
+                     __ATOMIC_RELEASE);
+
+    lock_release(lock);
+    /* The kernel consumes all of them or fails the call, EINTR included,
+       before it sleeps. Either way they are off our hands. */
+    syscall(__NR_io_uring_enter, state->ring, state->queued, 1,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+    state->queued = 0;
+
+    head = *state->cq_head;
+    tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &state->cqes[head & *state->cq_mask];
+        if (cqe->user_data == URING_WAKE)
+            state->reading = FALSE;
+        else if (cqe->user_data == state->timeout && cqe->res == -ETIME)
+            state->armed = -1;
+        /* The rest are removals and the timeouts they cancelled. */
+    }
+    __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+    lock_acquire(lock);
+}
+
+static void
+uring_wake(timer_waiter *waiter)
+{
+    uint64_t one = 1;
+
+    if (write(((uring_state*)waiter->data)->event, &one, sizeof(one)) < 0) {
+        /* The counter is already non-zero, so a wake-up is pending. */
+    }
+}
+
+static const timer_backend uring_backend = {
+    "io_uring", uring_init, uring_fini, uring_wait, uring_wake
+};
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_POSIX_TIMER
+/* POSIX timer backend, for kernels without timerfd or where it is
+   unwanted. One timer_create timer, armed with the absolute deadline,
+   signals the shard's thread itself through SIGEV_THREAD_ID, and the
+   thread takes the signal synchronously with sigwaitinfo, blocked so it
+   is never delivered to a handler. Wake-ups are the same signal through
+   tgkill. The timer can only target the thread once it runs, so it is
+   made on the first wait. */
+#define POSIX_TIMER_SIGNAL (SIGRTMAX - 3) /* Away from those libraries pick */
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+typedef struct {
+    timer_t timer;
+    BOOL created;
+    pid_t tid; /* Of the shard's thread, once created */
+    int64_t armed; /* Deadline the timer is set to, -1 disarmed */
+} posix_timer_state;
+
+static int
+posix_timer_init(timer_waiter *waiter)
+{
+    posix_timer_state *state;
+
+    state = (posix_timer_state*)calloc(1, sizeof(posix_timer_state));
+    if (state == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    state->armed = -1;
+    waiter->data = state;
+    return 0;
+}
+
+static void
+posix_timer_fini(timer_waiter *waiter)
+{
+    posix_timer_state *state = (posix_timer_state*)waiter->data;
+
+    if (state->created)
+        timer_delete(state->timer);
+    free(state);
+}
+
+/* Make the timer for the calling thread. */
+static BOOL
+posix_timer_create(posix_timer_state *state, sigset_t *set)
+{
+    struct sigevent event;
+
+    pthread_sigmask(SIG_BLOCK, set, NULL);
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = POSIX_TIMER_SIGNAL;
+    state->tid = (pid_t)syscall(SYS_gettid);
+    event.sigev_notify_thread_id = state->tid;
+    if (timer_create(TIMER_CLOCK_ID, &event, &state->timer) < 0)
+        return FALSE;
+    state->created = TRUE;
+    return TRUE;
+}
+
+static void
+posix_timer_wait(timer_waiter *waiter, timer_lock *lock, int64_t deadline)
+{
+    posix_timer_state *state = (posix_timer_state*)waiter->data;
+    struct timespec zero = {0, 0};
+    struct itimerspec spec;
+    siginfo_t info;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, POSIX_TIMER_SIGNAL);
+    if (!state->created && !posix_timer_create(state, &set)) {
+        /* Out of timers, RLIMIT_SIGPENDING, nap instead. */
+        lock_release(lock);
+        usleep(1000);
+        lock_acquire(lock);
+        return;
+    }
+
+    /* Anything queued predates the lock, so what it was for has been
+       seen. Real-time signals queue, and would each cut a sleep short. */
+    while (sigtimedwait(&set, &info, &zero) == POSIX_TIMER_SIGNAL) {
+        if (info.si_code == SI_TIMER)
+            state->armed = -1;
+    }
+
+    /* Only touch the timer when the queue head has moved. */
+    if (deadline != state->armed) {
+        memset(&spec, 0, sizeof(spec));
+        if (deadline >= 0) {
+            ns_to_timespec(kernel_deadline(deadline), &spec.it_value);
+            /* An all zero value would disarm the timer. */
+            if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+                spec.it_value.tv_nsec = 1;
+        }
+        timer_settime(state->timer, TIMER_ABSTIME, &spec, NULL);
+        state->armed = deadline;
+    }
+
+    lock_release(lock);
+    if (sigwaitinfo(&set, &info) == POSIX_TIMER_SIGNAL &&
+        info.si_code == SI_TIMER)
+        state->armed = -1;
+    lock_acquire(lock);
+}
+
+static void
+posix_timer_wake(timer_waiter *waiter)
+{
+    posix_timer_state *state = (posix_timer_state*)waiter->data;
+
+    /* Before its first wait the thread still looks at the queue. */
+    if (state->created)
+        syscall(SYS_tgkill, getpid(), state->tid, POSIX_TIMER_SIGNAL);
+}
+
+static const timer_backend posix_timer_backend = {
+    "posix_timer", posix_timer_init, posix_timer_fini, posix_timer_wait,
+    posix_timer_wake
+};
+#endif /* HAVE_POSIX_TIMER */
+
+#ifdef MS_WINDOWS
+/* Windows waitable timer backend. The scheduler thread waits on a waitable
+   timer and a wake-up event together. High resolution waitable timers
+   (Windows 10 1803 and later) aren't tied to the system tick, so they fire
+   within about half a millisecond instead of up to 15.6 ms late; older
+   systems fall back to a regular waitable timer. */
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+typedef struct {
+    HANDLE timer;
+    HANDLE event;
+    BOOL high_resolution; /* Otherwise it fires on the system tick */
+} waitable_state;
+
+static void
+waitable_close(waitable_state *state)
+{
+    if (state->timer != NULL)
+        CloseHandle(state->timer);
+    if (state->event != NULL)
+        CloseHandle(state->event);
+    free(state);
+}
+
+static int
+waitable_init(timer_waiter *waiter)
+{
+    waitable_state *state = (waitable_state*)malloc(sizeof(waitable_state));
+    DWORD err;
+
+    if (state == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return -1;
+    }
+    state->timer = CreateWaitableTimerExW(NULL, NULL,
+                                          CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                          TIMER_ALL_ACCESS);
+    state->high_resolution = state->timer != NULL;
+    if (state->timer == NULL)
+        state->timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+    state->event = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (state->timer == NULL || state->event == NULL) {
+        err = GetLastError();
+        waitable_close(state);
+        SetLastError(err);
+        return -1;
+    }
+    waiter->data = state;
+    return 0;
+}
+
+static void
+waitable_fini(timer_waiter *waiter)
+{
+    waitable_close((waitable_state*)waiter->data);
+}
+
+static void
+waitable_wait(timer_waiter *waiter, timer_lock *lock, int64_t deadline)
+{
+    waitable_state *state = (waitable_state*)waiter->data;
+    HANDLE handles[2];
+    LARGE_INTEGER due;
+    DWORD count = 1;
+    int64_t remaining;
+
+    handles[0] = state->event;
+    if (deadline >= 0) {
+        /* The engine clock isn't wall time, so set a relative due time,
+           which is negative and in 100 nanosecond units. */
+        remaining = deadline - timer_clock_ns();
+        due.QuadPart = remaining > 0 ? -(remaining / 100) : 0;
+        if (SetWaitableTimer(state->timer, &due, 0, NULL, NULL, FALSE))
+            handles[count++] = state->timer;
+    }
+
+    lock_release(lock);
+    WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+    lock_acquire(lock);
+}
+
+static void
+waitable_wake(timer_waiter *waiter)
+{
+    SetEvent(((waitable_state*)waiter->data)->event);
+}
+
+static const timer_backend waitable_backend = {
+    "waitable", waitable_init, waitable_fini, waitable_wait, waitable_wake
+};
+
+/* Thread pool timer backend. A thread pool timer sets an event the
+   scheduler thread waits on, along with wake-ups. Its window, how late
+   the system may run it to batch it with other timers, is the shard's,
+   so timers with slack let Windows coalesce wake-ups across processes.
+   It is tied to the system tick like a regular waitable timer. */
+typedef struct {
+    PTP_TIMER timer;
+    HANDLE event;
+} pool_timer_state;
+
+static VOID CALLBACK
+pool_timer_fire(PTP_CALLBACK_INSTANCE instance, PVOID event, PTP_TIMER timer)
+{
+    SetEvent((HANDLE)event);
+}
+
+static int
+pool_timer_init(timer_waiter *waiter)
+{
+    pool_timer_state *state;
+    DWORD err;
+
+    state = (pool_timer_state*)malloc(sizeof(pool_timer_state));
+    if (state == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return -1;
+    }
+    state->event = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (state->event == NULL) {
+        err = GetLastError();
+        free(state);
+        SetLastError(err);
+        return -1;
+    }
+    state->timer = CreateThreadpoolTimer(pool_timer_fire, state->event, NULL);
+    if (state->timer == NULL) {
+        err = GetLastError();
+        CloseHandle(state->event);
+        free(state);
+        SetLastError(err);
+        return -1;
+    }
+    waiter->data = state;
+    return 0;
+}
+
+static void
+pool_timer_fini(timer_waiter *waiter)
+{
+    pool_timer_state *state = (pool_timer_state*)waiter->data;
+
+    /* A callback in flight still sets the event. */
+    SetThreadpoolTimer(state->timer, NULL, 0, 0);
+    WaitForThreadpoolTimerCallbacks(state->timer, TRUE);
+    CloseThreadpoolTimer(state->timer);
+    CloseHandle(state->event);
+    free(state);
+}
+
+static void
+pool_timer_wait(timer_waiter *waiter, timer_lock *lock, int64_t deadline)
+{
+    pool_timer_state *state = (pool_timer_state*)waiter->data;
+    ULARGE_INTEGER due;
+    FILETIME when;
+    int64_t remaining, window;
+
+    if (deadline >= 0) {
+        /* Relative, so negative and in 100 nanosecond units like the
+           waitable backend's. */
+        remaining = deadline - timer_clock_ns();
+        due.QuadPart = (ULONGLONG)(remaining > 0 ? -(remaining / 100) : 0);
+        when.dwLowDateTime = due.LowPart;
+        when.dwHighDateTime = due.HighPart;
+        window = waiter->window / 1000000;
+        if (window > MAXDWORD)
+            window = MAXDWORD;
+        SetThreadpoolTimer(state->timer, &when, 0, (DWORD)window);
+    } else
+        SetThreadpoolTimer(state->timer, NULL, 0, 0);
+
+    /* One set by an earlier deadline's callback only cuts this short. */
+    lock_release(lock);
+    WaitForSingleObject(state->event, INFINITE);
+    lock_acquire(lock);
+}
+
+static void
+pool_timer_wake(timer_waiter *waiter)
+{
+    SetEvent(((pool_timer_state*)waiter->data)->event);
+}
+
+static const timer_backend pool_timer_backend = {
+    "threadpool", pool_timer_init, pool_timer_fini, pool_timer_wait,
+    pool_timer_wake
+};
+
+/* Whether a waiter can only wake up on the system tick. */
+static BOOL
+waiter_coarse(const timer_waiter *waiter)
+{
+    if (waiter->ops == &waitable_backend)
+        return !((waitable_state*)waiter->data)->high_resolution;
+    return TRUE;
+}
+#endif /* MS_WINDOWS */
+
+#ifdef HAVE_KQUEUE
+/* kqueue backend for Mac and FreeBSD. A one-shot EVFILT_TIMER for the
+   deadline and an EVFILT_USER event for wake-ups on a single kqueue. The
+   timer is set relative to the engine clock; NOTE_ABSOLUTE would tie it to
+   wall time, which the engine clock deliberately isn't. */
+#define KQUEUE_WAKE_IDENT 1
+#define KQUEUE_TIMER_IDENT 2
+
+#ifdef NOTE_USECONDS
+#define KQUEUE_TIMER_UNIT 1000 /* Nanoseconds */
+#define KQUEUE_TIMER_FLAGS NOTE_USECONDS
+#else
+#define KQUEUE_TIMER_UNIT 1000000 /* The default is milliseconds */
+#define KQUEUE_TIMER_FLAGS 0
+#endif
+
+static int
+kqueue_init(timer_waiter *waiter)
+{
+    int *kq = (int*)malloc(sizeof(int)), err;
+    struct kevent change;
+
+    if (kq == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *kq = kqueue();
+    if (*kq < 0)
+        goto fail;
+    EV_SET(&change, KQUEUE_WAKE_IDENT, EVFILT_USER, EV_ADD | EV_CLEAR,
+           0, 0, NULL);
+    if (kevent(*kq, &change, 1, NULL, 0, NULL) < 0)
+        goto fail;
+    waiter->data = kq;
+    return 0;
+
+fail:
+    err = errno;
+    if (*kq >= 0)
+        close(*kq);
+    free(kq);
+    errno = err;
+    return -1;
+}
+
+static void
+kqueue_fini(timer_waiter *waiter)
+{
+    close(*(int*)waiter->data);
+    free(waiter->data);
+}
+
+static void
+kqueue_wait(timer_waiter *waiter, timer_lock *lock, int64_t deadline)
+{
+    int kq = *(int*)waiter->data, nchanges = 0;
+    struct kevent change, events[2];
+    int64_t remaining;
+
+    if (deadline >= 0) {
+        /* Rounded up, waking early just means another wait. */
+        remaining = deadline - timer_clock_ns();
+        remaining = remaining > 0 ?
+            (remaining + KQUEUE_TIMER_UNIT - 1) / KQUEUE_TIMER_UNIT : 0;
+        EV_SET(&change, KQUEUE_TIMER_IDENT, EVFILT_TIMER, EV_ADD | EV_ONESHOT,
+               KQUEUE_TIMER_FLAGS, (intptr_t)remaining, NULL);
+        nchanges = 1;
+    }
+
+    lock_release(lock);
+    kevent(kq, &change, nchanges, events, 2, NULL);
+    lock_acquire(lock);
+}
+
+static void
+kqueue_wake(timer_waiter *waiter)
+{
+    struct kevent change;
+
+    EV_SET(&change, KQUEUE_WAKE_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    kevent(*(int*)waiter->data, &change, 1, NULL, 0, NULL);
+}
+
+static const timer_backend kqueue_backend = {
+    "kqueue", kqueue_init, kqueue_fini, kqueue_wait, kqueue_wake
+};
+#endif /* HAVE_KQUEUE */
+
+static const timer_backend *backend_types[] = {
+    &condvar_backend,
+#ifdef MS_WINDOWS
+    &waitable_backend,
+    &pool_timer_backend,
+#endif
+#ifdef HAVE_TIMERFD
+    &timerfd_backend,
+#endif
+#ifdef HAVE_IO_URING
+    &uring_backend,
+#endif
+#ifdef HAVE_POSIX_TIMER
+    &posix_timer_backend,
+#endif
+#ifdef HAVE_KQUEUE
+    &kqueue_backend,
+#endif
+    NULL
+};
+
+static void
+raise_backend_error(void)
+{
+#ifdef MS_WINDOWS
+    PyErr_SetFromWindowsErr(0);
+#else
+    PyErr_SetFromErrno(PyExc_OSError);
+#endif
+}
+
+static const timer_backend *
+find_backend_type(const char *name)
+{
+    int i;
+
+    for (i = 0; backend_types[i] != NULL; i++) {
+        if (strcmp(backend_types[i]->name, name) == 0)
+            return backend_types[i];
+    }
+    PyErr_Format(PyExc_ValueError, "unknown or unsupported timer backend '%s'",
+                 name);
+    return NULL;
+}
+
+/* The scheduler is split into shards, each a queue with its own lock,
+   wait backend and thread. A timer goes to the shard of the thread that
+   starts it, so threads starting timers don't share a lock. Due nodes
+   wait on their shard's ready list until a thread claims them, and a
+   shard with more ready than it can run at once wakes its neighbour,
+   which steals half. A node keeps its home shard for its whole life:
+   cancel() and rearming always go there, whoever ran it. */
+#define MAX_SHARDS 64
+#define STEAL_THRESHOLD 64 /* Ready nodes worth waking a neighbour for */
+
+typedef struct {
+    timer_lock lock;
+    timer_waiter waiter; /* Set up when the scheduler starts */
+    timer_waiter retired; /* Replaced waiter, until the thread leaves it */
+    timer_queue queue; /* Set up when the scheduler starts */
+    /* When the shard wakes by itself, -1 never, 0 while awake. Read
+       without the lock by scheduler_submit. */
+    int64_t sleep_until;
+    volatile BOOL woken; /* Set when sleep_until is no longer good enough */
+    Py_ssize_t pending;
+    /* Least lateness any of those takes, nanoseconds, see shard_count */
+    int64_t window;
+    /* Of those, the ones that spin by precision, see shard_count */
+    Py_ssize_t spinning[PRECISION_COARSE];
+    /* Of those, the ones stopped by precision, changed without the lock */
+    volatile int64_t tombstones[PRECISION_COARSE + 1];
+    volatile BOOL compact; /* Asked to clear them out, see shard_compact */
+    timer_node *submitted; /* Pushed without the lock, newest first */
+    timer_node *lazy; /* The same for lazy nodes, see LAZY_LEAD */
+    /* Earliest deadline pushed onto lazy since it was taken, -1 none */
+    volatile int64_t lazy_until;
+    timer_node *deferred; /* Submitted, but the queue had no memory */
+    timer_node *dead; /* Stopped before they were collected, cancelled */
+    timer_node *ready[LANES]; /* Due, not claimed by a thread yet */
+    timer_node *ready_last[LANES];
+    Py_ssize_t ready_lane[LANES];
+    volatile Py_ssize_t ready_count; /* In all lanes */
+    int64_t wakeups; /* This shard's share of the stats() counters */
+    int64_t spins;
+    int64_t oversleep; /* How late its backend wakes, -1 unknown */
+    int index;
+    int cpu; /* thread is pinned to, -1 not pinned, see shard_tune */
+    BOOL realtime; /* thread has realtime priority */
+    int numa_node; /* thread last found itself on, -1 unknown */
+    volatile BOOL numa_stale; /* It may have moved, see shard_tune */
+#ifdef MS_WINDOWS
+    BOOL fine_resolution; /* Holds a reference, see shard_resolution */
+#endif
+    BOOL running; /* thread was started */
+    timer_thread thread;
+} timer_shard;
+
+/* Tombstones. Stopping a Timer whose node is in the queue only marks the
+   node, with a compare-and-swap of its state that needs no lock, and
+   leaves it there. Whatever takes a node off the queue swaps its state
+   too, see node_unqueued, so a tombstone comes out cancelled. That
+   happens when it comes due or, once tombstones are half of a shard's
+   queue, when the shard rebuilds the queue without them, see
+   shard_compact. A lazy node stopped while still submitted is buried the
+   same way, and shard_collect drops it without ever queueing it; those
+   aren't counted as tombstones. Whoever buries a node lets go of its Timer
+   and channel right away, with the GIL, so a tombstone pins nothing but
+   itself however far off its deadline is. What comes out is bare, see
+   node_reap, and freed like a cancelled C API node. */
+#define COMPACT_MIN 64 /* Tombstones worth rebuilding a queue for */
+
+static Py_ssize_t compactions;
+
+static BOOL
+node_state_swap(timer_node *node, char expected, char desired)
+{
+#ifdef _MSC_VER
+    return _InterlockedCompareExchange8(&node->state, desired,
+                                        expected) == expected;
+#else
+    return __atomic_compare_exchange_n(&node->state, &expected, desired, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Make node, in state, a tombstone. Returns FALSE if it wasn't in that
+   state. From then on the node is the scheduler's alone, so its Timer and
+   channel have to be read before, see scheduler_cancel. */
+static BOOL
+node_bury(timer_node *node, char state)
+{
+    return node_state_swap(node, state, NODE_TOMBSTONE);
+}
+
+/* Finish a tombstone the scheduler took off its shard: cancelled, with
+   the stale Timer and channel gone. Only node_release is left to do,
+   which native_run does for a cancelled node without a Timer. */
+static void
+node_reap(timer_node *node)
+{
+    node->state = NODE_CANCELLED;
+    node->timer = NULL;
+    node->u.fn = NULL;
+}
+
+static char
+node_state_exchange(timer_node *node, char state)
+{
+#ifdef _MSC_VER
+    return _InterlockedExchange8(&node->state, state);
+#else
+    return __atomic_exchange_n(&node->state, state, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static void
+tombstones_add(timer_shard *shard, int precision, int64_t n)
+{
+#ifdef _MSC_VER
+    InterlockedExchangeAdd64(
+        (LONG64 volatile*)&shard->tombstones[precision], n);
+#else
+    __atomic_fetch_add(&shard->tombstones[precision], n, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* All of the shard's tombstones, as a hint without its lock. */
+static int64_t
+tombstones_count(timer_shard *shard)
+{
+    int64_t total = 0;
+    int i;
+
+    for (i = 0; i <= PRECISION_COARSE; i++)
+        total += shard->tombstones[i];
+    return total;
+}
+
+/* Pending nodes not counting tombstones. */
+static Py_ssize_t
+shard_live(timer_shard *shard)
+{
+    return shard->pending - (Py_ssize_t)tombstones_count(shard);
+}
+
+typedef struct {
+    const timer_backend *backend_type; /* Used when a waiter is set up */
+    const timer_queue_ops *queue_type; /* Used when a queue is set up */
+    int64_t spin_margin; /* Nanoseconds spun instead of slept, see below */
+    Py_ssize_t batch_limit; /* Callbacks per GIL acquisition, 0 no limit */
+    int shards; /* In use, fixed at import */
+    volatile int workers; /* Callback threads, 0 runs them on the shards */
+    BOOL adaptive; /* Spin for the learned oversleep, see shard_learn */
+    int fork_policy; /* What a forked child does with inherited timers */
+    BOOL forked; /* In a child that hasn't dealt with them yet */
+    BOOL started;
+    volatile BOOL shutdown;
+} timer_scheduler;
+
+/* configure(fork=) */
+enum {
+    FORK_KEEP,   /* Inherited timers go on in the child */
+    FORK_DISCARD /* The child starts without them */
+};
+
+static const char *fork_names[] = {"keep", "discard", NULL};
+
+static timer_scheduler scheduler;
+static timer_shard shards[MAX_SHARDS];
+static BOOL scheduler_initialized = FALSE;
+
+#define NODE_SHARD(node) (&shards[(node)->shard])
+
+/* Callback workers. By default a shard runs the callbacks it finds due
+   itself, so a slow one holds back every timer of the shard behind it.
+   With a pool configured, shards only find what is due and hand the
+   batches that need the GIL to the least busy worker, which takes the
+   GIL and runs them. A worker that runs out of its own takes half of the
+   longest queue, and one with more queued than the batch it is about to
+   run wakes its neighbour to do that. Each queue is bounded; if even the
+   shortest one is full the shard runs the batch itself, as without a
+   pool. */
+#define MAX_WORKERS 64
+#define WORKER_QUEUE_LIMIT 4096 /* Nodes queued per worker */
+
+typedef struct {
+    timer_lock lock;
+    timer_cond cond; /* Signalled for new nodes, a nudge or stopping */
+    timer_node *first; /* Handed over, not claimed yet */
+    timer_node *last;
+    volatile Py_ssize_t count;
+    volatile BOOL busy; /* Running callbacks, only written by the worker */
+    volatile int64_t late; /* How late the batch it runs was, when taken */
+    BOOL open; /* Takes nodes, until it is asked to stop or leaves */
+    BOOL nudged; /* Another worker is behind, see worker_run */
+    volatile BOOL exited; /* thread is past its last look at open */
+    int index;
+    BOOL running; /* thread was started, not joined, under workers_lock */
+    timer_thread thread;
+} timer_worker;
+
+static timer_worker workers[MAX_WORKERS];
+
+/* Autoscaling, configure(workers_max=). The pool hands callbacks to the
+   first scheduler.workers workers, from workers up to workers_max: one
+   more joins when even the least busy has WORKER_GROW_DEPTH queued or is
+   running a batch that was WORKER_GROW_LATE late, or when a worker is
+   that late with more queued behind it; the last one leaves once it has
+   been idle for workers_idle.
+   A worker's thread starts when it joins and ends when it leaves, so a
+   pool that shrank back runs only the threads of workers. One that left
+   is joined by a worker before it once that is idle, which the leaving
+   nudges it to be, or else by whatever starts the worker again or stops
+   the pool. workers_lock keeps them from joining a thread twice, and is
+   taken before a worker's lock. */
+static timer_lock workers_lock;
+static int workers_limit; /* Workers from it on can't start, see workers_stop */
+#define WORKER_GROW_DEPTH 64
+#define WORKER_GROW_LATE 1000000 /* Nanoseconds */
+#define WORKER_IDLE 1000000000 /* Nanoseconds, the default workers_idle */
+
+static int workers_floor; /* configure(workers=) */
+static int workers_ceiling; /* configure(workers_max=), 0 keeps it fixed */
+static int64_t workers_idle = WORKER_IDLE;
+static int64_t workers_grown;
+static int64_t workers_shrunk;
+
+/* One shard per four CPUs. Callbacks into Python all need the GIL, so
+   more threads would mostly take turns waiting for it. */
+static int
+default_shards(void)
+{
+    long cpus;
+#ifdef MS_WINDOWS
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    cpus = (long)info.dwNumberOfProcessors;
+#elif defined(UNIX)
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (cpus < 1)
+        cpus = 1;
+    cpus = (cpus + 3) / 4;
+    return cpus > MAX_SHARDS ? MAX_SHARDS : (int)cpus;
+}
+
+/* Take the shard count from the TIMER_SHARDS environment variable. Only
+   at import, before any shard has a queue. */
+static BOOL
+set_shards(const char *value)
+{
+    char *end;
+    long n = strtol(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || n < 1 || n > MAX_SHARDS) {
+        PyErr_Format(PyExc_ValueError,
+                     "TIMER_SHARDS must be from 1 to %d, not '%s'",
+                     MAX_SHARDS, value);
+        return FALSE;
+    }
+    scheduler.shards = (int)n;
+    return TRUE;
+}
+
+/* Engine counters for stats(). Each has a single writer at a time, the GIL
+   or the scheduler thread, so they are plain stores, atomic adds without a
+   GIL, see COUNTER_ADD. stats() reads them without locking; an aligned
+   64-bit load doesn't tear. wakeups and spins are counted per shard and
+   added up when read. */
+typedef struct {
+    int64_t started;
+    int64_t fired;
+    int64_t cancelled;
+    int64_t errors; /* Callbacks that raised */
+    int64_t callback_ns; /* Time spent in callbacks */
+    int64_t gil_wait_ns; /* Scheduler waiting for the GIL */
+    int64_t wakeups; /* Scheduler returning from a backend wait */
+    int64_t spins; /* Clock reads while spinning */
+} timer_stats;
+
+static timer_stats stats;
+
+/* Scheduler and worker threads created since import, with the GIL. The
+   threads live until _shutdown(), not per timer, so this only moves when
+   the engine starts or the pool grows. */
+static int64_t threads_started;
+
+/* Times the system timer resolution was raised, see shard_resolution.
+   Only Windows has one to raise. */
+static int64_t resolution_raises;
+
+/* stats with the shards' counters added in. Other threads may be adding
+   to them, so the totals can be a moment behind. */
+static void
+stats_totals(timer_stats *total)
+{
+    int i;
+
+    *total = stats;
+    for (i = 0; i < scheduler.shards; i++) {
+        total->wakeups += shards[i].wakeups;
+        total->spins += shards[i].spins;
+    }
+}
+
+/* Sleeping is cheap but the OS wakes us late; spinning is accurate but
+   burns a core. The scheduler sleeps until spin_margin before the next
+   deadline and spins for the rest. The margin covers the usual wake-up
+   latency of a condition variable: tens of microseconds on POSIX, and at
+   least a scheduler quantum on Windows. */
+#ifdef MS_WINDOWS
+#define DEFAULT_SPIN_MARGIN 2000 /* Microseconds */
+#else
+#define DEFAULT_SPIN_MARGIN 100
+#endif
+
+#define DEFAULT_BATCH_LIMIT 64
+
+/* Least a "spin" timer is spun for, whatever spin_margin is. */
+#define SPIN_WINDOW 1000000 /* Nanoseconds */
+
+/* A sleeping backend wakes up late by an amount that depends on the host
+   and its load. Every timed wait that wasn't cut short is a sample of it,
+   and the shard keeps track of an upper quantile: a later sample moves
+   the estimate up by an eighth of the difference, an earlier one down by
+   a 64th, which settles above about nine in ten samples. Samples beyond
+   MAX_OVERSLEEP, a preempted thread or a suspended machine, are left
+   out. With configure(adaptive=True) the shard sleeps that much, plus
+   SPIN_CUSHION, less than spin_margin would and spins the rest. */
+#define MAX_OVERSLEEP 10000000 /* Nanoseconds */
+#define SPIN_CUSHION 10000
+
+/* Called with the shard's lock held. */
+static void
+shard_learn(timer_shard *shard, int64_t late)
+{
+    if (late < 0 || late > MAX_OVERSLEEP)
+        return;
+    if (shard->oversleep < 0)
+        shard->oversleep = late;
+    else if (late > shard->oversleep)
+        shard->oversleep += (late - shard->oversleep) / 8;
+    else
+        shard->oversleep -= (shard->oversleep - late) / 64;
+}
+
+/* How long before its next deadline a shard stops sleeping, going by the
+   precision its pending timers asked for. The earliest deadline isn't
+   necessarily one of theirs, so a "coarse" timer due first is spun for
+   too while anything else wants it. Called with the shard's lock held. */
+static int64_t
+shard_margin(timer_shard *shard)
+{
+    int64_t margin = scheduler.spin_margin;
+
+    if (margin == 0)
+        return 0;
+    if (scheduler.adaptive && shard->oversleep >= 0)
+        margin = shard->oversleep + SPIN_CUSHION;
+    /* Not for tombstones, the shard only has to wake for those. */
+    if (shard->spinning[PRECISION_SPIN] > shard->tombstones[PRECISION_SPIN])
+        return margin > SPIN_WINDOW ? margin : SPIN_WINDOW;
+    return shard->spinning[PRECISION_HYBRID] >
+           shard->tombstones[PRECISION_HYBRID] ? margin : 0;
+}
+
+#ifdef MS_WINDOWS
+/* A condition variable or a regular waitable timer only wakes up on the
+   system tick, every 15.6 ms by default. While a shard sleeping in one
+   has a deadline within RESOLUTION_HORIZON, it holds a reference on a
+   1 ms tick. That costs power system-wide, so the last shard gives it
+   back as soon as nothing that close is pending. */
+#define RESOLUTION_HORIZON 200000000 /* Nanoseconds */
+
+static timer_lock resolution_lock; /* Taken alone or inside a shard's */
+static int resolution_users;
+
+/* Take or drop the shard's reference. Called by its thread. */
+static void
+shard_resolution(timer_shard *shard, BOOL wanted)
+{
+    if (wanted == shard->fine_resolution)
+        return;
+    shard->fine_resolution = wanted;
+    lock_acquire(&resolution_lock);
+    if (wanted && resolution_users++ == 0) {
+        timeBeginPeriod(1);
+        resolution_raises++;
+    } else if (!wanted && --resolution_users == 0)
+        timeEndPeriod(1);
+    lock_release(&resolution_lock);
+}
+#endif /* MS_WINDOWS */
+
+/* Log-linear histogram of nanosecond values, after HdrHistogram. Values
+   below 2 ** (bits + 1) get a bucket each. Above that, every power of two
+   is split into 2 ** bits buckets, so a bucket is never wider than
+   1 / 2 ** bits of the values in it.
+
+   The counts can be split into shards, one per recording thread. Each
+   shard starts on its own cache line and is only written by the threads
+   mapped to it, with plain stores. Reading adds the shards up. */
+#define HISTOGRAM_DEFAULT_BITS 7
+#define HISTOGRAM_MAX_BITS 12
+#define HISTOGRAM_MAX_SHARDS 1024
+#define CACHE_LINE 64
+
+typedef struct {
+    int64_t total;
+    int64_t min;
+    int64_t max;
+    double sum;
+    int64_t counts[1]; /* Really size of them */
+} histogram_shard;
+
+typedef struct {
+    PyObject_HEAD
+    int bits;
+    Py_ssize_t size; /* Number of buckets */
+    Py_ssize_t shards;
+    size_t stride; /* Bytes from one shard to the next */
+    char *memory; /* As allocated, the shards are aligned into it */
+    char *base;
+    Py_ssize_t shape[2]; /* Of the counts as a buffer, see Histogram_buffer */
+    Py_ssize_t strides[2];
+} Histogram;
+
+static PyTypeObject Histogram_type;
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* Small per-thread number picking the shard a thread records into, and its
+   trace ring. Handed out on first use. */
+static THREAD_LOCAL Py_ssize_t thread_slot;
+static Py_ssize_t thread_slots;
+
+#define HISTOGRAM_SHARD(self, i) \
+    ((histogram_shard*)((self)->base + (size_t)(i) * (self)->stride))
+
+static Py_ssize_t
+current_thread_slot(void)
+{
+    if (thread_slot == 0)
+        thread_slot = COUNTER_NEXT(thread_slots);
+    return thread_slot;
+}
+
+static histogram_shard *
+histogram_local_shard(Histogram *self)
+{
+    if (self->shards == 1)
+        return HISTOGRAM_SHARD(self, 0);
+    return HISTOGRAM_SHARD(self, (current_thread_slot() - 1) % self->shards);
+}
+
+static Py_ssize_t
+histogram_index(const Histogram *self, int64_t value)
+{
+    int shift;
+
+    if (value < ((int64_t)2 << self->bits))
+        return value < 0 ? 0 : (Py_ssize_t)value;
+    shift = bit_scan_reverse((uint64_t)value) - self->bits;
+    return ((Py_ssize_t)(shift + 1) << self->bits) +
+           (Py_ssize_t)((value >> shift) - ((int64_t)1 << self->bits));
+}
+
+/* The highest value that lands in a bucket. */
+static int64_t
+histogram_value(const Histogram *self, Py_ssize_t index)
+{
+    int shift = (int)(index >> self->bits) - 1;
+    int64_t top;
+
+    if (shift <= 0)
+        return index;
+    top = (index & (((Py_ssize_t)1 << self->bits) - 1)) +
+          ((int64_t)1 << self->bits);
+    return (top << shift) + (((int64_t)1 << shift) - 1);
+}
+
+static void
+shard_record(histogram_shard *shard, Py_ssize_t index, int64_t value,
+             int64_t count)
+{
+    shard->counts[index] += count;
+    if (shard->total == 0 || value < shard->min)
+        shard->min = value;
+    if (value > shard->max)
+        shard->max = value;
+    shard->total += count;
+    shard->sum += (double)value * count;
+}
+
+static void
+histogram_record(Histogram *self, int64_t value, int64_t count)
+{
+    if (value < 0)
+        value = 0;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    shard_record(histogram_local_shard(self), histogram_index(self, value),
+                 value, count);
+    Py_END_CRITICAL_SECTION();
+}
+
+/* The shards' totals added up, counts excluded. */
+static void
+histogram_summary(const Histogram *self, histogram_shard *summary)
+{
+    histogram_shard *shard;
+    Py_ssize_t i;
+
+    memset(summary, 0, sizeof(*summary));
+    for (i = 0; i < self->shards; i++) {
+        shard = HISTOGRAM_SHARD(self, i);
+        if (shard->total == 0)
+            continue;
+        if (summary->total == 0 || shard->min < summary->min)
+            summary->min = shard->min;
+        if (shard->max > summary->max)
+            summary->max = shard->max;
+        summary->total += shard->total;
+        summary->sum += shard->sum;
+    }
+}
+
+static int64_t
+histogram_count(const Histogram *self, Py_ssize_t index)
+{
+    int64_t count = 0;
+    Py_ssize_t i;
+
+    for (i = 0; i < self->shards; i++)
+        count += HISTOGRAM_SHARD(self, i)->counts[index];
+    return count;
+}
+
+/* Module-wide lateness of every callback, see Timer.lateness_ns. Created
+   at import and only recorded into with the GIL held. */
+static PyObject *lateness_histogram;
+static PyObject *wake_latency_histogram;
+static PyObject *gil_wait_histogram;
+static PyObject *lane_lateness_histograms[LANES]; /* By Timer.priority */
+
+/* Record into a Histogram bound to a Timer or Stopwatch, if any. */
+#define RECORD_BOUND(histogram, value) \
+    do { \
+        if ((histogram) != NULL) \
+            histogram_record((Histogram*)(histogram), (value), 1); \
+    } while (0)
+
+static PyObject *
+Histogram_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"bits", "shards", NULL};
+    Histogram *self;
+    int bits = HISTOGRAM_DEFAULT_BITS;
+    Py_ssize_t shards = 1, size;
+    size_t stride;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|in:Histogram", kwlist,
+                                     &bits, &shards))
+        return NULL;
+    if (bits < 1 || bits > HISTOGRAM_MAX_BITS) {
+        PyErr_Format(PyExc_ValueError, "bits must be between 1 and %d",
+                     HISTOGRAM_MAX_BITS);
+        return NULL;
+    }
+    if (shards < 1 || shards > HISTOGRAM_MAX_SHARDS) {
+        PyErr_Format(PyExc_ValueError, "shards must be between 1 and %d",
+                     HISTOGRAM_MAX_SHARDS);
+        return NULL;
+    }
+
+    /* Enough buckets for the largest int64_t. */
+    size = (Py_ssize_t)(64 - bits) << bits;
+    stride = offsetof(histogram_shard, counts) + size * sizeof(int64_t);
+    stride = (stride + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+
+    self = (Histogram*)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    self->bits = bits;
+    self->size = size;
+    self->shards = shards;
+    self->stride = stride;
+    self->memory = (char*)PyMem_Malloc(stride * shards + CACHE_LINE);
+    if (self->memory == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    self->base = (char*)(((uintptr_t)self->memory + CACHE_LINE - 1) &
+                         ~(uintptr_t)(CACHE_LINE - 1));
+    memset(self->base, 0, stride * shards);
+    self->shape[0] = shards;
+    self->shape[1] = size;
+    self->strides[0] = (Py_ssize_t)stride;
+    self->strides[1] = sizeof(int64_t);
+
+    return (PyObject*)self;
+}
+
+static void
+Histogram_dealloc(Histogram *self)
+{
+    PyMem_Free(self->memory);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+PyDoc_STRVAR(Histogram_record_doc,
+"record(value, count=1)\n"
+"\n"
+"Add count occurrences of value. Negative values are recorded as 0.");
+
+static PyObject *
+Histogram_record(Histogram *self, PyObject *args)
+{
+    long long value, count = 1;
+
+    if (!PyArg_ParseTuple(args, "L|L:record", &value, &count))
+        return NULL;
+    if (count < 0) {
+        PyErr_SetString(PyExc_ValueError, "count must not be negative");
+        return NULL;
+    }
+
+    histogram_record(self, value, count);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Histogram_percentile_doc,
+"percentile(p)\n"
+"\n"
+"Return the value p percent of the recorded values are at or below, for\n"
+"p from 0 to 100. This is the top of the bucket the value falls in, and\n"
+"0 if nothing was recorded.");
+
+static PyObject *
+Histogram_percentile(Histogram *self, PyObject *args)
+{
+    histogram_shard summary;
+    double p;
+    int64_t target, seen = 0, value;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "d:percentile", &p))
+        return NULL;
+    if (!(p >= 0.0 && p <= 100.0)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "percentile must be between 0 and 100");
+        return NULL;
+    }
+    histogram_summary(self, &summary);
+    if (summary.total == 0)
+        return PyLong_FromLong(0);
+
+    target = (int64_t)(p / 100.0 * (double)summary.total + 0.5);
+    if (target < 1)
+        target = 1;
+    for (i = 0; i < self->size; i++) {
+        seen += histogram_count(self, i);
+        if (seen >= target)
+            break;
+    }
+
+    value = histogram_value(self, i);
+    if (value > summary.max)
+        value = summary.max;
+    if (value < summary.min)
+        value = summary.min;
+    return PyLong_FromLongLong(value);
+}
+
+PyDoc_STRVAR(Histogram_merge_doc,
+"merge(other)\n"
+"\n"
+"Add everything recorded in another Histogram with the same bits.");
+
+static PyObject *
+Histogram_merge(Histogram *self, PyObject *arg)
+{
+    Histogram *other = (Histogram*)arg;
+    histogram_shard *shard, summary;
+    Py_ssize_t i;
+
+    if (!PyObject_TypeCheck(arg, &Histogram_type)) {
+        PyErr_SetString(PyExc_TypeError, "merge() takes a Histogram");
+        return NULL;
+    }
+    if (other->bits != self->bits) {
+        PyErr_SetString(PyExc_ValueError,
+                        "can only merge histograms with the same bits");
+        return NULL;
+    }
+    histogram_summary(other, &summary);
+    if (summary.total == 0)
+        Py_RETURN_NONE;
+
+    shard = histogram_local_shard(self);
+    for (i = 0; i < self->size; i++)
+        shard->counts[i] += histogram_count(other, i);
+    if (shard->total == 0 || summary.min < shard->min)
+        shard->min = summary.min;
+    if (summary.max > shard->max)
+        shard->max = summary.max;
+    shard->total += summary.total;
+    shard->sum += summary.sum;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Histogram_snapshot_doc,
+"snapshot()\n"
+"\n"
+"Return a dict with the count, min, max and mean of the recorded values,\n"
+"and under 'buckets' a list of (value, count) pairs for every non-empty\n"
+"bucket, value being the top of the bucket.");
+
+static PyObject *
+Histogram_snapshot(Histogram *self)
+{
+    histogram_shard summary;
+    PyObject *buckets, *item;
+    int64_t count;
+    Py_ssize_t i;
+
+    buckets = PyList_New(0);
+    if (buckets == NULL)
+        return NULL;
+    for (i = 0; i < self->size; i++) {
+        count = histogram_count(self, i);
+        if (count == 0)
+            continue;
+        item = Py_BuildValue("(LL)", (long long)histogram_value(self, i),
+                             (long long)count);
+        if (item == NULL || PyList_Append(buckets, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(buckets);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+
+    histogram_summary(self, &summary);
+    return Py_BuildValue("{s:L,s:L,s:L,s:d,s:N}",
+                         "count", (long long)summary.total,
+                         "min", (long long)summary.min,
+                         "max", (long long)summary.max,
+                         "mean", summary.total ?
+                                 summary.sum / summary.total : 0.0,
+                         "buckets", buckets);
+}
+
+PyDoc_STRVAR(Histogram_reset_doc,
+"reset()\n"
+"\n"
+"Forget everything recorded.");
+
+static PyObject *
+Histogram_reset(Histogram *self)
+{
+    memset(self->base, 0, self->stride * self->shards);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Histogram_bucket_values_doc,
+"bucket_values()\n"
+"\n"
+"Return the top of each bucket, in the order of the counts the Histogram\n"
+"exports as a buffer, as an array.array('q'). On Python 2 a list.");
+
+static PyObject *
+Histogram_bucket_values(Histogram *self)
+{
+    PyObject *rslt;
+    Py_ssize_t i;
+#ifdef PYTHON3
+    PyObject *array, *bytes;
+    int64_t *values;
+
+    bytes = PyBytes_FromStringAndSize(NULL, self->size * sizeof(int64_t));
+    if (bytes == NULL)
+        return NULL;
+    values = (int64_t*)PyBytes_AS_STRING(bytes);
+    for (i = 0; i < self->size; i++)
+        values[i] = histogram_value(self, i);
+    array = PyImport_ImportModule("array");
+    rslt = array != NULL ?
+           PyObject_CallMethod(array, "array", "sO", "q", bytes) : NULL;
+    Py_XDECREF(array);
+    Py_DECREF(bytes);
+    return rslt;
+#else
+    PyObject *item;
+
+    rslt = PyList_New(self->size);
+    if (rslt == NULL)
+        return NULL;
+    for (i = 0; i < self->size; i++) {
+        item = PyLong_FromLongLong(histogram_value(self, i));
+        if (item == NULL) {
+            Py_DECREF(rslt);
+            return NULL;
+        }
+        PyList_SET_ITEM(rslt, i, item);
+    }
+    return rslt;
+#endif
+}
+
+/* The counts, read-only and without copying them, as a (shards, buckets)
+   array of int64. The view is live, the counts go on changing under it.
+   The shards are a cache line apart with their totals in between, so
+   only a consumer that takes strides gets more than one. */
+static int
+Histogram_buffer(Histogram *self, Py_buffer *view, int flags)
+{
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "Histogram counts are read-only");
+        view->obj = NULL;
+        return -1;
+    }
+    if (self->shards > 1 &&
+        ((flags & PyBUF_STRIDES) != PyBUF_STRIDES ||
+         (flags & (PyBUF_C_CONTIGUOUS | PyBUF_F_CONTIGUOUS |
+                   PyBUF_ANY_CONTIGUOUS) & ~PyBUF_STRIDES) != 0)) {
+        PyErr_SetString(PyExc_BufferError,
+                        "the counts of a sharded Histogram aren't contiguous");
+        view->obj = NULL;
+        return -1;
+    }
+    view->buf = self->base + offsetof(histogram_shard, counts);
+    view->obj = (PyObject*)self;
+    Py_INCREF(self);
+    view->len = self->shards * self->size * (Py_ssize_t)sizeof(int64_t);
+    view->readonly = 1;
+    view->itemsize = sizeof(int64_t);
+    view->format = (flags & PyBUF_FORMAT) ? "q" : NULL;
+    view->ndim = 2;
+    view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ?
+                    self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PyBufferProcs Histogram_as_buffer = BUFFER_PROCS(Histogram_buffer,
+                                                        NULL);
+
+static PyMethodDef Histogram_methods[] = {
+    {"record", (PyCFunction)Histogram_record, METH_VARARGS,
+     Histogram_record_doc},
+    {"percentile", (PyCFunction)Histogram_percentile, METH_VARARGS,
+     Histogram_percentile_doc},
+    {"merge", (PyCFunction)Histogram_merge, METH_O, Histogram_merge_doc},
+    {"snapshot", (PyCFunction)Histogram_snapshot, METH_NOARGS,
+     Histogram_snapshot_doc},
+    {"reset", (PyCFunction)Histogram_reset, METH_NOARGS, Histogram_reset_doc},
+    {"bucket_values", (PyCFunction)Histogram_bucket_values, METH_NOARGS,
+     Histogram_bucket_values_doc},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(Histogram_bits_doc,
+"Sub-bucket bits, the precision is 1 / 2 ** bits.");
+
+PyDoc_STRVAR(Histogram_shards_doc,
+"Number of per-thread shards the counts are split into.");
+
+static PyMemberDef Histogram_members[] = {
+    {"bits", T_INT, offsetof(Histogram, bits), READONLY, Histogram_bits_doc},
+    {"shards", T_PYSSIZET, offsetof(Histogram, shards), READONLY,
+     Histogram_shards_doc},
+    {NULL}
+};
+
+/* count, min and max add the shards up, the closure picks the field. */
+static PyObject *
+Histogram_get_summary(Histogram *self, void *closure)
+{
+    histogram_shard summary;
+
+    histogram_summary(self, &summary);
+    return PyLong_FromLongLong(
+        *(int64_t*)((char*)&summary + (Py_ssize_t)closure));
+}
+
+PyDoc_STRVAR(Histogram_count_doc, "Number of values recorded.");
+PyDoc_STRVAR(Histogram_min_doc, "Smallest value recorded, 0 if none.");
+PyDoc_STRVAR(Histogram_max_doc, "Largest value recorded, 0 if none.");
+
+static PyGetSetDef Histogram_getset[] = {
+    {"count", (getter)Histogram_get_summary, NULL, Histogram_count_doc,
+     (void*)offsetof(histogram_shard, total)},
+    {"min", (getter)Histogram_get_summary, NULL, Histogram_min_doc,
+     (void*)offsetof(histogram_shard, min)},
+    {"max", (getter)Histogram_get_summary, NULL, Histogram_max_doc,
+     (void*)offsetof(histogram_shard, max)},
+    {NULL}
+};
+
+PyDoc_STRVAR(Histogram_class_doc,
+"Histogram(bits=7, shards=1)\n"
+"\n"
+"Log-linear histogram of nanosecond values. Values are bucketed with a\n"
+"relative precision of 1 / 2 ** bits. With several shards, each thread\n"
+"records into its own cache-aligned copy of the counts and they are only\n"
+"added up when read. Assign one to the histogram attribute of a Timer or\n"
+"Stopwatch to record its measurements in C. The counts are exported as a\n"
+"read-only (shards, buckets) buffer of int64.");
+
+static PyTypeObject Histogram_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.Histogram",                         /*tp_name*/
+    sizeof(Histogram),                          /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    (destructor)Histogram_dealloc,              /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    &Histogram_as_buffer,                       /*tp_as_buffer*/
+    BUFFER_FLAGS,                               /*tp_flags*/
+    Histogram_class_doc,                        /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    Histogram_methods,                          /*tp_methods*/
+    Histogram_members,                          /*tp_members*/
+    Histogram_getset,                           /*tp_getset*/
+    0,                                          /*tp_base*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    PyType_GenericAlloc,                        /*tp_alloc*/
+    Histogram_new,                              /*tp_new*/
+};
+
+/* Getter and setter for the histogram attribute of Timer and Stopwatch.
+   The closure is the offset of the PyObject* in the struct. */
+#define BOUND_HISTOGRAM(self, closure) \
+    (*(PyObject**)((char*)(self) + (Py_ssize_t)(closure)))
+
+/* Track owner, which its type may leave untracked while nothing it
+   refers to could be in a cycle, now that it refers to value. */
+static void
+gc_adopt(PyObject *owner, PyObject *value)
+{
+    if (!PyObject_IS_GC(owner) || !GC_MAY_BE_TRACKED(value))
+        return;
+    Py_BEGIN_CRITICAL_SECTION(owner);
+    if (!GC_IS_TRACKED(owner))
+        PyObject_GC_Track(owner);
+    Py_END_CRITICAL_SECTION();
+}
+
+static PyObject *
+get_bound_histogram(PyObject *self, void *closure)
+{
+    PyObject *histogram = BOUND_HISTOGRAM(self, closure);
+
+    if (histogram == NULL)
+        histogram = Py_None;
+    Py_INCREF(histogram);
+    return histogram;
+}
+
+static int
+set_bound_histogram(PyObject *self, PyObject *value, void *closure)
+{
+    PyObject *old = BOUND_HISTOGRAM(self, closure);
+
+    if (value == Py_None)
+        value = NULL;
+    if (value != NULL && !PyObject_TypeCheck(value, &Histogram_type)) {
+        PyErr_SetString(PyExc_TypeError, "histogram must be a Histogram");
+        return -1;
+    }
+    Py_XINCREF(value);
+    BOUND_HISTOGRAM(self, closure) = value;
+    gc_adopt(self, value);
+    Py_XDECREF(old);
+    return 0;
+}
+
+PyDoc_STRVAR(bound_histogram_doc,
+"Histogram that every measurement is recorded into, in nanoseconds, or\n"
+"None.");
+
+/* A file shared with other processes through a writable mapping. Used for
+   the stats page and the trace rings. */
+typedef struct {
+    void *memory;
+    size_t size;
+#ifdef MS_WINDOWS
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} mapped_file;
+
+/* Create path with size bytes, zeroed, and map it. Returns FALSE with an
+   exception set on failure. */
+static BOOL
+map_file(mapped_file *map, const char *path, size_t size)
+{
+#ifdef MS_WINDOWS
+    map->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE) {
+        PyErr_SetFromWindowsErr(0);
+        return FALSE;
+    }
+    map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READWRITE, 0,
+                                      (DWORD)size, NULL);
+    if (map->mapping == NULL) {
+        PyErr_SetFromWindowsErr(0);
+        CloseHandle(map->file);
+        return FALSE;
+    }
+    map->memory = MapViewOfFile(map->mapping, FILE_MAP_WRITE, 0, 0, size);
+    if (map->memory == NULL) {
+        PyErr_SetFromWindowsErr(0);
+        CloseHandle(map->mapping);
+        CloseHandle(map->file);
+        return FALSE;
+    }
+#elif defined(UNIX)
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char*)path);
+        return FALSE;
+    }
+    if (ftruncate(fd, (off_t)size) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char*)path);
+        close(fd);
+        return FALSE;
+    }
+    map->memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map->memory == MAP_FAILED) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char*)path);
+        return FALSE;
+    }
+#endif
+    map->size = size;
+    memset(map->memory, 0, size);
+    return TRUE;
+}
+
+/* Map all of the existing file at path, read-only. An empty one comes
+   back with nothing mapped and size 0. Returns FALSE with an exception
+   set on failure. */
+static BOOL
+map_existing(mapped_file *map, const char *path)
+{
+#ifdef MS_WINDOWS
+    LARGE_INTEGER size;
+
+    map->memory = NULL;
+    map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE) {
+        PyErr_SetFromWindowsErr(0);
+        return FALSE;
+    }
+    if (!GetFileSizeEx(map->file, &size)) {
+        PyErr_SetFromWindowsErr(0);
+        CloseHandle(map->file);
+        return FALSE;
+    }
+    map->size = (size_t)size.QuadPart;
+    if (map->size == 0) {
+        CloseHandle(map->file);
+        return TRUE;
+    }
+    map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0,
+                                      NULL);
+    if (map->mapping == NULL) {
+        PyErr_SetFromWindowsErr(0);
+        CloseHandle(map->file);
+        return FALSE;
+    }
+    map->memory = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (map->memory == NULL) {
+        PyErr_SetFromWindowsErr(0);
+        CloseHandle(map->mapping);
+        CloseHandle(map->file);
+        return FALSE;
+    }
+#elif defined(UNIX)
+    struct stat st;
+    int fd;
+
+    map->memory = NULL;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char*)path);
+        return FALSE;
+    }
+    if (fstat(fd, &st) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char*)path);
+        close(fd);
+        return FALSE;
+    }
+    map->size = (size_t)st.st_size;
+    if (map->size == 0) {
+        close(fd);
+        return TRUE;
+    }
+    map->memory = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map->memory == MAP_FAILED) {
+        map->memory = NULL;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char*)path);
+        return FALSE;
+    }
+#endif
+    return TRUE;
+}
+
+static void
+unmap_file(mapped_file *map)
+{
+    if (map->memory == NULL)
+        return;
+#ifdef MS_WINDOWS
+    UnmapViewOfFile(map->memory);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#elif defined(UNIX)
+    munmap(map->memory, map->size);
+#endif
+    map->memory = NULL;
+}
+
+#ifdef _MSC_VER
+#define WRITE_BARRIER() MemoryBarrier()
+#define READ_BARRIER() MemoryBarrier()
+#else
+#define WRITE_BARRIER() __sync_synchronize()
+#define READ_BARRIER() __sync_synchronize()
+#endif
+
+/* Tells the CPU it is in a spin loop, which saves power and lets a
+   hyperthread sibling run. */
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define CPU_RELAX() _mm_pause()
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() ((void)0)
+#endif
+
+#ifdef MS_WINDOWS
+#define THREAD_YIELD() SwitchToThread()
+#else
+#define THREAD_YIELD() sched_yield()
+#endif
+
+/* Spinning on the clock. A clock read costs tens of nanoseconds and a
+   pause from a few to over a hundred cycles, depending on the CPU, so
+   the pauses between reads adapt: while reads come less than an eighth
+   of the time left apart, their number doubles, up to SPIN_PAUSES; once
+   they come further apart it halves. Being late is thus bounded by the
+   gap, which shrinks towards the deadline, while most of a long spin is
+   pauses that leave the core to its hyperthread sibling. A spin that has
+   gone on for SPIN_YIELD_AFTER gives the rest of the CPU to other
+   threads, between reads, until it is SPIN_YIELD_UNTIL from the end. */
+#define SPIN_PAUSES 64
+#define SPIN_YIELD_AFTER 50000 /* Nanoseconds */
+#define SPIN_YIELD_UNTIL 20000
+
+/* Spin until the engine clock reaches deadline or *stop, if given, is
+   set. Returns the clock reads. */
+static int64_t
+spin_until(int64_t deadline, volatile BOOL *stop)
+{
+    int64_t now = timer_clock_ns(), start = now, last = now, reads = 1;
+    int pauses = 1, i;
+
+    while (now < deadline && (stop == NULL || !*stop)) {
+        if (now - start >= SPIN_YIELD_AFTER &&
+            deadline - now > SPIN_YIELD_UNTIL) {
+            THREAD_YIELD();
+        } else {
+            if ((now - last) * 8 < deadline - now) {
+                if (pauses < SPIN_PAUSES)
+                    pauses *= 2;
+            } else if (pauses > 1)
+                pauses /= 2;
+            for (i = 0; i < pauses; i++)
+                CPU_RELAX();
+        }
+        last = now;
+        now = timer_clock_ns();
+        reads++;
+    }
+    return reads;
+}
+
+/* Wall time, see wall_ns(). It extrapolates from a reference pairing an
+   engine clock reading with the system time at the same moment, so a
+   read costs no more than the engine clock. The two drift apart, NTP
+   slews the system time, so once the reference is wall_interval old it
+   is taken again: by the first shard's thread when it wakes up anyway,
+   or by the first reader to find it stale while the scheduler sleeps.
+   wall_writing elects the one that does.
+
+   The reference is double-buffered behind a seqlock, which never makes
+   readers wait: the writer makes wall_seq odd, so readers use the second
+   copy while it rewrites the first, then even again while it rewrites
+   the second. A reader only retries if wall_seq moved while it copied. */
+#define WALL_INTERVAL 1000000000 /* Nanoseconds */
+#define FILETIME_EPOCH 116444736000000000LL /* 1970 in FILETIME units */
+
+typedef struct {
+    int64_t engine; /* real_clock_ns() */
+    int64_t wall; /* Nanoseconds since the Unix epoch */
+} wall_reference;
+
+static wall_reference wall_refs[2];
+static volatile unsigned int wall_seq; /* Updates begun and finished */
+static volatile int wall_writing;
+static volatile int64_t wall_due = INT64_MAX; /* Of the next re-sync */
+static int64_t wall_interval = WALL_INTERVAL; /* 0 never re-syncs */
+static volatile Py_ssize_t wall_syncs; /* References taken */
+#ifdef MS_WINDOWS
+/* Windows 8 and later, otherwise synchronize() finds a tick edge. */
+typedef VOID (WINAPI *precise_time_fn)(LPFILETIME);
+static precise_time_fn precise_time;
+#endif
+
+static void
+wall_sample(wall_reference *ref)
+{
+    int64_t before;
+#ifdef MS_WINDOWS
+    reference_point point;
+    ULARGE_INTEGER wall;
+
+    if (precise_time != NULL) {
+        before = real_clock_ns();
+        precise_time(&point.time);
+        ref->engine = before + (real_clock_ns() - before) / 2;
+    } else {
+        synchronize(&point);
+        /* On the OS clock's timebase, which the TSC clock shares. */
+        ref->engine = ticks_to_units(point.perf_counter.QuadPart -
+                                     clock_reference.perf_counter.QuadPart,
+                                     clock_frequency.QuadPart, 1000000000);
+    }
+    wall.HighPart = point.time.dwHighDateTime;
+    wall.LowPart = point.time.dwLowDateTime;
+    ref->wall = ((int64_t)wall.QuadPart - FILETIME_EPOCH) * 100;
+#elif defined(UNIX)
+    struct timespec now;
+
+    before = real_clock_ns();
+    clock_gettime(CLOCK_REALTIME, &now);
+    ref->engine = before + (real_clock_ns() - before) / 2;
+    ref->wall = timespec_to_ns(&now);
+#endif
+}
+
+/* Take a new reference, unless another thread is already at it. */
+static void
+wall_resync(void)
+{
+    wall_reference ref;
+
+#ifdef _MSC_VER
+    if (InterlockedCompareExchange((LONG volatile*)&wall_writing, 1, 0) != 0)
+        return;
+#else
+    int idle = 0;
+
+    if (!__atomic_compare_exchange_n(&wall_writing, &idle, 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+#endif
+    wall_sample(&ref);
+    wall_seq++;
+    WRITE_BARRIER();
+    wall_refs[0] = ref;
+    WRITE_BARRIER();
+    wall_seq++;
+    WRITE_BARRIER();
+    wall_refs[1] = ref;
+    wall_due = wall_interval > 0 ? ref.engine + wall_interval : INT64_MAX;
+    wall_syncs++;
+    WRITE_BARRIER();
+    wall_writing = 0;
+}
+
+static int64_t
+wall_clock_ns(void)
+{
+    wall_reference ref;
+    unsigned int seq;
+    int64_t now = real_clock_ns();
+
+    /* The first reader has to wait for a reference to exist. */
+    if (now >= wall_due || wall_syncs == 0) {
+        wall_resync();
+        while (wall_syncs == 0)
+            ;
+    }
+    do {
+        seq = wall_seq;
+        READ_BARRIER();
+        ref = wall_refs[seq & 1];
+        READ_BARRIER();
+    } while (seq != wall_seq);
+    return ref.wall + (now - ref.engine);
+}
+
+/* Coarse clock, which start() and rearm() of "coarse" timers read instead
+   of the engine clock. Its reading is as of the last system tick, so a
+   coarse timer may fire up to a tick early as well as late.
+
+   Where the engine clock is CLOCK_MONOTONIC, CLOCK_MONOTONIC_COARSE is the
+   same clock as of the last tick and reading it is a plain load. On
+   Windows the first shard's thread leaves each engine clock reading it
+   takes in coarse_cache, next to the GetTickCount64() value it was taken
+   at. A reader that is still in that tick uses it, one that isn't reads
+   the engine clock. The pair is double-buffered behind a seqlock, like
+   wall_refs. Other engine clocks, the TSC among them, are read as they
+   are: no coarse clock is cheaper and on the same timebase. */
+#define COARSE_LIMIT 10000000 /* Nanoseconds, a coarser tick isn't used */
+
+#ifdef MS_WINDOWS
+typedef struct {
+    int64_t engine;
+    ULONGLONG tick;
+} coarse_reading;
+
+static coarse_reading coarse_cache[2];
+static volatile unsigned int coarse_seq;
+#endif
+static BOOL coarse_clock; /* Whether there is one */
+
+/* Look for one, once the engine clock is chosen. */
+static void
+coarse_setup(void)
+{
+#ifdef MS_WINDOWS
+    DWORD adjustment, increment;
+    BOOL disabled;
+
+    /* The tick GetTickCount64() moves on, in 100 ns units. */
+    coarse_clock = GetSystemTimeAdjustment(&adjustment, &increment,
+                                           &disabled) &&
+                   (int64_t)increment * 100 <= COARSE_LIMIT;
+#elif defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec res;
+
+    coarse_clock = clock_id == CLOCK_MONOTONIC && !tsc_clock &&
+                   clock_getres(CLOCK_MONOTONIC_COARSE, &res) == 0 &&
+                   timespec_to_ns(&res) <= COARSE_LIMIT;
+#endif
+}
+
+#ifdef MS_WINDOWS
+/* Called by the first shard's thread with each engine clock reading. */
+static void
+coarse_publish(int64_t now)
+{
+    coarse_reading reading;
+
+    if (!coarse_clock)
+        return;
+    reading.engine = now;
+    reading.tick = GetTickCount64();
+    coarse_seq++;
+    WRITE_BARRIER();
+    coarse_cache[0] = reading;
+    WRITE_BARRIER();
+    coarse_seq++;
+    WRITE_BARRIER();
+    coarse_cache[1] = reading;
+}
+#endif
+
+static int64_t
+coarse_clock_ns(void)
+{
+#ifdef MS_WINDOWS
+    coarse_reading reading;
+    unsigned int seq;
+    ULONGLONG tick;
+#elif defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec now;
+#endif
+
+    if (!coarse_clock || virtual_clock)
+        return timer_clock_ns();
+#ifdef MS_WINDOWS
+    tick = GetTickCount64();
+    do {
+        seq = coarse_seq;
+        READ_BARRIER();
+        reading = coarse_cache[seq & 1];
+        READ_BARRIER();
+    } while (seq != coarse_seq);
+    if (reading.tick == tick)
+        return reading.engine;
+    return timer_clock_ns();
+#elif defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return timespec_to_ns(&now);
+#else
+    return timer_clock_ns();
+#endif
+}
+
+/* Stats page: the stats() counters and the lateness histograms, published
+   in a memory-mapped file so monitoring can read them from outside the
+   process. The first shard's thread is the only writer, and a seqlock lets
+   readers detect a half-written copy: seq is odd while an update is in
+   progress, so a reader retries until it sees the same even seq before
+   and after copying. The layout is native endian and documented in
+   timer/shm.py. */
+#define STATS_PAGE_MAGIC "PYTIMER"
+#define STATS_PAGE_VERSION 1
+#define STATS_PAGE_HISTOGRAMS 3
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size; /* Offset of the first histogram */
+    volatile uint64_t seq;
+    int64_t pid;
+    int64_t updated_ns; /* Engine clock at the last update */
+    int64_t interval_ns;
+    int64_t pending;
+    timer_stats stats;
+    uint32_t histograms;
+    uint32_t buckets; /* Per histogram */
+    int32_t bits;
+    int32_t reserved;
+    /* Then per histogram: count, min, max, sum and the bucket counts, all
+       int64_t. */
+} stats_page;
+
+/* All of these are guarded by the first shard's lock. */
+static mapped_file page_file;
+static stats_page *page; /* page_file's memory while publishing */
+static int64_t page_due;
+
+/* Copy the counters into the page. Called by the first shard's thread. */
+static void
+stats_page_update(int64_t now)
+{
+    PyObject *histograms[STATS_PAGE_HISTOGRAMS];
+    histogram_shard summary;
+    Histogram *histogram;
+    int64_t *out;
+    Py_ssize_t i, pending = 0;
+    int h;
+
+    histograms[0] = lateness_histogram;
+    histograms[1] = wake_latency_histogram;
+    histograms[2] = gil_wait_histogram;
+
+    /* Other shards' counts are read without their locks, see above. */
+    for (h = 0; h < scheduler.shards; h++)
+        pending += shard_live(&shards[h]);
+
+    page->seq++;
+    WRITE_BARRIER();
+
+    page->updated_ns = now;
+    page->pending = pending;
+    stats_totals(&page->stats);
+    out = (int64_t*)((char*)page + page->header_size);
+    for (h = 0; h < STATS_PAGE_HISTOGRAMS; h++) {
+        histogram = (Histogram*)histograms[h];
+        histogram_summary(histogram, &summary);
+        *out++ = summary.total;
+        *out++ = summary.min;
+        *out++ = summary.max;
+        *out++ = (int64_t)summary.sum;
+        for (i = 0; i < histogram->size; i++)
+            *out++ = histogram_count(histogram, i);
+    }
+
+    WRITE_BARRIER();
+    page->seq++;
+}
+
+/* Event trace: fixed-size records of timer lifecycle events in mmap'd
+   rings, one per recording thread, for timer.shm.read_trace() to pick up.
+   Events come from scheduler threads and the C API without the GIL, and
+   threads past the number of rings share one, so a writer claims its
+   record by adding to the ring's head, writes it, and then stamps it with
+   its index plus one in a release store. Writers never wait for each
+   other: readers skip a record whose stamp doesn't match its index, one
+   still being written, and drop anything head says may have been lapped
+   while they were copying. trace_writers counts the writers in
+   trace_event, which trace() waits to drop to zero between taking the
+   rings away and unmapping them. */
+#define TRACE_MAGIC "PYTRACE"
+#define TRACE_VERSION 1
+#define TRACE_MAX_RINGS 256
+
+enum {
+    TRACE_START = 1,        /* arg: deadline */
+    TRACE_ARM,              /* Queued, arg: deadline */
+    TRACE_FIRE,             /* Found due by the scheduler, arg: deadline */
+    TRACE_CALLBACK_BEGIN,
+    TRACE_CALLBACK_END,     /* arg: 1 if the callback raised */
+    TRACE_CANCEL
+};
+
+typedef struct {
+    volatile uint64_t seq; /* Index in the ring + 1, once written */
+    int64_t time; /* Engine clock */
+    uint64_t timer; /* Timer.trace_id */
+    int64_t arg;
+    uint32_t event;
+    uint32_t thread;
+} trace_record;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size; /* Offset of the first ring */
+    uint32_t rings;
+    uint32_t capacity; /* Records per ring, a power of two */
+    uint32_t record_size;
+    uint32_t reserved;
+    int64_t pid;
+} trace_header;
+
+/* Each ring is its head on its own cache line, then the records. */
+typedef struct {
+    volatile uint64_t head; /* Records ever claimed */
+    char pad[CACHE_LINE - sizeof(uint64_t)];
+    trace_record records[1];
+} trace_ring;
+
+#if defined(__GNUC__)
+#define RELEASE_STORE(target, value) \
+    __atomic_store_n(&(target), (value), __ATOMIC_RELEASE)
+#else
+/* MSVC gives volatile stores release semantics. */
+#define RELEASE_STORE(target, value) ((target) = (value))
+#endif
+
+static mapped_file trace_file;
+/* trace_file's memory while tracing, set after its header. */
+static trace_header *volatile trace;
+static size_t trace_stride;
+static uint64_t next_trace_id;
+static volatile long trace_writers;
+
+/* Count the caller among the writers and return the trace, or NULL
+   without counting it when tracing stopped meanwhile. Either trace()
+   sees it counted, or it sees trace cleared. */
+static trace_header *
+trace_enter(void)
+{
+    trace_header *header;
+
+#ifdef _MSC_VER
+    /* Interlocked operations are full barriers. */
+    InterlockedIncrement(&trace_writers);
+    header = trace;
+    if (header == NULL)
+        InterlockedDecrement(&trace_writers);
+#else
+    __atomic_add_fetch(&trace_writers, 1, __ATOMIC_SEQ_CST);
+    header = __atomic_load_n(&trace, __ATOMIC_SEQ_CST);
+    if (header == NULL)
+        __atomic_sub_fetch(&trace_writers, 1, __ATOMIC_RELEASE);
+#endif
+    return header;
+}
+
+static void
+trace_leave(void)
+{
+#ifdef _MSC_VER
+    InterlockedDecrement(&trace_writers);
+#else
+    __atomic_sub_fetch(&trace_writers, 1, __ATOMIC_RELEASE);
+#endif
+}
+
+/* Take the rings away from writers and wait for those still in
+   trace_event to finish, after which they can be unmapped. */
+static void
+trace_stop(void)
+{
+#ifdef _MSC_VER
+    InterlockedExchangePointer((PVOID volatile*)&trace, NULL);
+    while (InterlockedCompareExchange(&trace_writers, 0, 0) != 0)
+        THREAD_YIELD();
+#else
+    __atomic_store_n(&trace, NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&trace_writers, __ATOMIC_ACQUIRE) != 0)
+        THREAD_YIELD();
+#endif
+}
+
+static void
+trace_event(uint32_t event, uint64_t timer, int64_t time, int64_t arg)
+{
+    Py_ssize_t slot = current_thread_slot();
+    trace_header *header = trace_enter();
+    trace_ring *ring;
+    trace_record *record;
+    uint64_t claim;
+
+    if (header == NULL)
+        return;
+    ring = (trace_ring*)((char*)header + header->header_size +
+                         (size_t)((slot - 1) % header->rings) *
+                         trace_stride);
+#ifdef _MSC_VER
+    claim = (uint64_t)InterlockedExchangeAdd64(
+        (LONG64 volatile*)&ring->head, 1);
+#else
+    claim = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+#endif
+    record = &ring->records[claim & (header->capacity - 1)];
+    record->time = time;
+    record->timer = timer;
+    record->arg = arg;
+    record->event = event;
+    record->thread = (uint32_t)slot;
+    RELEASE_STORE(record->seq, claim + 1);
+    trace_leave();
+}
+
+#define TRACE(event, timer, time, arg) \
+    do { \
+        if (trace != NULL) \
+            trace_event((event), (timer), (time), (arg)); \
+    } while (0)
+
+/* Queue nodes live in slabs of SLAB_SIZE bytes aligned to their size, so
+   a node finds its slab by masking its address. A slab is a header and
+   SLAB_NODES nodes, each in a NODE_SIZE cache line of its own, and
+   belongs to an arena picked by the allocating thread, one of the first
+   ARENA_SHARDS.
+   Nodes are allocated and freed with and without the GIL (the C API),
+   and freed on other threads than they came from, so every arena has a
+   lock; sharding keeps threads starting timers at once off each other's.
+   A slab whose nodes are all free goes back to the system unless it is
+   its arena's last.
+
+   With configure(huge_pages=) or configure(numa=), slabs are carved out
+   of CHUNK_SIZE chunks instead, each mapped on its own so that it can be
+   backed by a huge page and placed on a NUMA node: millions of pending
+   timers then take a TLB entry per 2 MiB rather than per 4 KiB when the
+   scheduler sweeps them. A free slab of a chunk is kept for the arena's
+   next. With numa every scheduler shard has an arena of its own, which
+   its nodes come from and whose chunks go to the NUMA node that shard's
+   thread runs on. */
+#define SLAB_SIZE 65536
+#define NODE_SIZE 64
+#define SLAB_NODES (SLAB_SIZE / NODE_SIZE - 1)
+#define ARENA_SHARDS 8
+#define ARENAS MAX_SHARDS /* One per shard with numa */
+#define CHUNK_SIZE (2 * 1024 * 1024) /* A huge page on x86-64 and arm64 */
+#define CHUNK_SLABS (CHUNK_SIZE / SLAB_SIZE)
+
+/* configure(huge_pages=) */
+enum {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT, /* madvise(MADV_HUGEPAGE), Linux */
+    HUGE_PAGES_EXPLICIT /* MAP_HUGETLB or MEM_LARGE_PAGES, reserved ones */
+};
+
+static const char *huge_page_names[] = {"off", "transparent", "explicit",
+                                        NULL};
+
+/* Changed with the GIL, read under an arena's lock when it needs a slab,
+   so a change applies from the next one on. */
+static int huge_pages;
+static BOOL numa_placement;
+
+/* Fails to compile if a node outgrows its cache line. */
+typedef char node_size_check[sizeof(timer_node) <= NODE_SIZE ? 1 : -1];
+
+typedef struct node_arena node_arena;
+
+typedef struct node_slab {
+    node_arena *arena;
+    struct node_slab *prev; /* In the arena's list of slabs with room */
+    struct node_slab *next;
+    void *free; /* Freed nodes, linked through their first word */
+    Py_ssize_t used;
+    Py_ssize_t carved; /* Nodes handed out at least once */
+    BOOL chunked; /* Out of a chunk, kept when free */
+} node_slab;
+
+/* Fails to compile if the header outgrows the node it takes the place
+   of. */
+typedef char slab_header_check[sizeof(node_slab) <= NODE_SIZE ? 1 : -1];
+
+struct node_arena {
+    timer_lock lock;
+    node_slab *partial; /* Slabs with room */
+    Py_ssize_t slabs;
+    Py_ssize_t used;
+    int64_t hits; /* Allocations that reused a freed node */
+    int64_t misses; /* Allocations of a node never used before */
+    char *carve; /* What the latest chunk has left */
+    int carve_left; /* In slabs */
+    node_slab *spare; /* Free slabs of chunks, linked through next */
+    Py_ssize_t chunks;
+    Py_ssize_t huge_chunks; /* Of those, backed by huge pages */
+    int numa_node; /* Its latest chunk was placed on, -1 none */
+};
+
+static node_arena arenas[ARENAS];
+
+#define NODE_SLAB(node) \
+    ((node_slab*)((uintptr_t)(node) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+static void
+slab_link(node_arena *arena, node_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = arena->partial;
+    if (arena->partial != NULL)
+        arena->partial->prev = slab;
+    arena->partial = slab;
+}
+
+static void
+slab_unlink(node_arena *arena, node_slab *slab)
+{
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        arena->partial = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+#ifdef HAVE_NUMA
+/* The NUMA node of the CPU the calling thread is on, or -1. */
+static int
+current_numa_node(void)
+{
+#ifdef MS_WINDOWS
+    PROCESSOR_NUMBER processor;
+    USHORT node;
+
+    GetCurrentProcessorNumberEx(&processor);
+    if (!GetNumaProcessorNodeEx(&processor, &node))
+        return -1;
+    return (int)node;
+#else
+    unsigned cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return -1;
+    return (int)node;
+#endif
+}
+#endif /* HAVE_NUMA */
+
+/* The NUMA node arena's chunks belong on, that of the shard it serves,
+   or -1 to leave them to the system. */
+static int
+arena_numa_node(node_arena *arena)
+{
+    int index = (int)(arena - arenas);
+
+    if (!numa_placement || index >= scheduler.shards)
+        return -1;
+    return shards[index].numa_node;
+}
+
+/* Map a chunk for arena, aligned to its size. Returns NULL when out of
+   memory. Huge pages and NUMA placement are best effort: without the
+   reserved pages or the privilege, it is mapped like any memory. */
+static char *
+chunk_map(node_arena *arena)
+{
+    int node = arena_numa_node(arena);
+    BOOL huge = FALSE;
+#ifdef MS_WINDOWS
+    SIZE_T large = GetLargePageMinimum();
+    DWORD preferred = node >= 0 ? (DWORD)node : NUMA_NO_PREFERRED_NODE;
+    char *memory = NULL;
+
+    if (huge_pages == HUGE_PAGES_EXPLICIT && large > 0 &&
+        CHUNK_SIZE % large == 0) {
+        memory = (char*)VirtualAllocExNuma(GetCurrentProcess(), NULL,
+                                           CHUNK_SIZE,
+                                           MEM_RESERVE | MEM_COMMIT |
+                                           MEM_LARGE_PAGES,
+                                           PAGE_READWRITE, preferred);
+        huge = memory != NULL;
+    }
+    /* The 64 KiB allocation granularity is all the slabs need. */
+    if (memory == NULL)
+        memory = (char*)VirtualAllocExNuma(GetCurrentProcess(), NULL,
+                                           CHUNK_SIZE,
+                                           MEM_RESERVE | MEM_COMMIT,
+                                           PAGE_READWRITE, preferred);
+    if (memory == NULL)
+        return NULL;
+#elif defined(UNIX)
+    char *memory = MAP_FAILED, *aligned;
+#ifdef HAVE_NUMA
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+#endif
+
+#ifdef MAP_HUGETLB
+    if (huge_pages == HUGE_PAGES_EXPLICIT) {
+        memory = (char*)mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                             -1, 0);
+        huge = memory != MAP_FAILED;
+    }
+#endif
+    if (memory == MAP_FAILED) {
+        /* Twice the size trimmed to an aligned chunk, which a transparent
+           huge page needs. */
+        memory = (char*)mmap(NULL, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return NULL;
+        aligned = (char*)(((uintptr_t)memory + CHUNK_SIZE - 1) &
+                          ~(uintptr_t)(CHUNK_SIZE - 1));
+        if (aligned > memory)
+            munmap(memory, aligned - memory);
+        munmap(aligned + CHUNK_SIZE, memory + CHUNK_SIZE - aligned);
+        memory = aligned;
+#ifdef MADV_HUGEPAGE
+        if (huge_pages == HUGE_PAGES_TRANSPARENT)
+            huge = madvise(memory, CHUNK_SIZE, MADV_HUGEPAGE) == 0;
+#endif
+    }
+#ifdef HAVE_NUMA
+    /* Before anything touches it, so every page is allocated there. */
+    if (node >= 0 && node < (int)(8 * sizeof(mask))) {
+        memset(mask, 0, sizeof(mask));
+        mask[node / (8 * sizeof(unsigned long))] |=
+            1UL << (node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, memory, (unsigned long)CHUNK_SIZE,
+                    TIMER_MPOL_PREFERRED, mask,
+                    (unsigned long)(8 * sizeof(mask)), 0) != 0)
+            node = -1;
+    }
+    else
+        node = -1;
+#endif
+#endif
+    arena->chunks++;
+    if (huge)
+        arena->huge_chunks++;
+    arena->numa_node = node;
+    return memory;
+}
+
+static node_slab *
+slab_new(node_arena *arena)
+{
+    node_slab *slab;
+
+    if (arena->spare != NULL) {
+        slab = arena->spare;
+        arena->spare = slab->next;
+    }
+    else if (huge_pages != HUGE_PAGES_OFF || numa_placement) {
+        if (arena->carve_left == 0) {
+            arena->carve = chunk_map(arena);
+            if (arena->carve == NULL)
+                return NULL;
+            arena->carve_left = CHUNK_SLABS;
+        }
+        slab = (node_slab*)arena->carve;
+        arena->carve += SLAB_SIZE;
+        arena->carve_left--;
+        slab->chunked = TRUE;
+    }
+    else {
+#ifdef MS_WINDOWS
+        /* Allocations are aligned to the 64 KiB allocation granularity. */
+        slab = (node_slab*)VirtualAlloc(NULL, SLAB_SIZE,
+                                        MEM_RESERVE | MEM_COMMIT,
+                                        PAGE_READWRITE);
+        if (slab == NULL)
+            return NULL;
+#elif defined(UNIX)
+        void *memory;
+
+        if (posix_memalign(&memory, SLAB_SIZE, SLAB_SIZE) != 0)
+            return NULL;
+        slab = (node_slab*)memory;
+#endif
+        slab->chunked = FALSE;
+    }
+    slab->arena = arena;
+    slab->free = NULL;
+    slab->used = 0;
+    slab->carved = 0;
+    slab_link(arena, slab);
+    arena->slabs++;
+    return slab;
+}
+
+/* Called with the arena's lock held. */
+static void
+slab_release(node_slab *slab)
+{
+    if (slab->chunked) {
+        slab->next = slab->arena->spare;
+        slab->arena->spare = slab;
+        return;
+    }
+#ifdef MS_WINDOWS
+    VirtualFree(slab, 0, MEM_RELEASE);
+#elif defined(UNIX)
+    free(slab);
+#endif
+}
+
+/* Returns NULL when out of memory. slot is the calling thread's, or 0 if
+   it has none. */
+static timer_node *
+node_alloc(Py_ssize_t slot)
+{
+    /* That of the shard the caller puts the node on. */
+    node_arena *arena = &arenas[numa_placement ? slot % scheduler.shards :
+                                slot % ARENA_SHARDS];
+    node_slab *slab;
+    timer_node *node;
+
+    lock_acquire(&arena->lock);
+    slab = arena->partial;
+    if (slab == NULL && (slab = slab_new(arena)) == NULL) {
+        lock_release(&arena->lock);
+        return NULL;
+    }
+    if (slab->free != NULL) {
+        node = (timer_node*)slab->free;
+        slab->free = *(void**)node;
+        arena->hits++;
+    } else {
+        node = (timer_node*)((char*)slab + (slab->carved + 1) * NODE_SIZE);
+        slab->carved++;
+        arena->misses++;
+    }
+    slab->used++;
+    arena->used++;
+    if (slab->free == NULL && slab->carved == SLAB_NODES)
+        slab_unlink(arena, slab);
+    lock_release(&arena->lock);
+    return node;
+}
+
+/* Return a node to its slab, from any thread. */
+static void
+node_release(timer_node *node)
+{
+    node_slab *slab = NODE_SLAB(node);
+    node_arena *arena = slab->arena;
+
+    lock_acquire(&arena->lock);
+    if (slab->used == SLAB_NODES)
+        slab_link(arena, slab); /* Was full */
+    *(void**)node = slab->free;
+    slab->free = node;
+    slab->used--;
+    arena->used--;
+    if (slab->used == 0 && arena->slabs > 1) {
+        slab_unlink(arena, slab);
+        arena->slabs--;
+        slab_release(slab);
+    }
+    lock_release(&arena->lock);
+}
+
+/* Delivery of expirations to the thread of an event loop. The scheduler
+   hands due nodes of timers with a channel to it instead of taking the
+   GIL, and makes its file descriptor readable when the channel goes from
+   empty to not. The loop watches that and calls drain(), which runs the
+   callbacks in the loop's thread with one GIL acquisition it already
+   has. */
+typedef struct timer_channel {
+    PyObject_HEAD
+    timer_lock lock;
+    timer_node *first; /* Delivered nodes waiting for drain() */
+    timer_node *last;
+    int read_fd; /* -1 once closed */
+    int write_fd; /* The same as read_fd for an eventfd */
+} Channel;
+
+static PyTypeObject Channel_type;
+
+#ifdef UNIX
+/* Called with the channel lock held. */
+static void
+channel_signal(Channel *channel)
+{
+#ifdef HAVE_TIMERFD /* Which means eventfd too */
+    uint64_t one = 1;
+
+    if (write(channel->write_fd, &one, sizeof(one)) < 0) {
+#else
+    char byte = 0;
+
+    if (write(channel->write_fd, &byte, 1) < 0) {
+#endif
+        /* Full or closed, either way drain() will look. */
+    }
+}
+#endif /* UNIX */
+
+static BOOL Timer_expire(timer_node *node, int64_t gil_time);
+
+/* Run a node scheduled through the C API, on the thread that found it
+   due and without its shard's lock. The lock is only needed to tell
+   cancel() the callback has begun. */
+static void
+native_run(timer_node *node)
+{
+    BOOL cancelled;
+
+    lock_acquire(&NODE_SHARD(node)->lock);
+    cancelled = node->state == NODE_CANCELLED;
+    node->state = NODE_RUNNING;
+    lock_release(&NODE_SHARD(node)->lock);
+
+    if (!cancelled)
+        node->u.fn(node->v.arg);
+    node_release(node);
+}
+
+/* Delivery to the main thread. Due nodes of timers with main_thread set
+   are collected here and a single pending call, which the interpreter
+   runs on the main thread at its next check, takes the whole batch. The
+   scheduler thread never takes the GIL for them. */
+static timer_lock main_lock;
+static timer_node *main_first; /* Waiting for main_drain, under main_lock */
+static timer_node *main_last;
+
+static int
+main_drain(void *arg)
+{
+    timer_node *due, *node;
+    int64_t now;
+
+    lock_acquire(&main_lock);
+    due = main_first;
+    main_first = main_last = NULL;
+    lock_release(&main_lock);
+
+    now = timer_clock_ns();
+    while (due != NULL) {
+        node = due;
+        due = node->next;
+        Timer_expire(node, now);
+    }
+    /* Callback errors are printed already, don't raise them here. */
+    return 0;
+}
+
+static void
+main_deliver(timer_node *node)
+{
+    BOOL idle;
+
+    lock_acquire(&main_lock);
+    idle = main_first == NULL;
+    node_append(&main_first, &main_last, node);
+    lock_release(&main_lock);
+
+    /* A batch that is already waiting for its pending call takes this one
+       along. The interpreter's queue of pending calls is small and shared
+       with other extensions, so wait for room if it is full. */
+    while (idle && Py_AddPendingCall(main_drain, NULL) < 0) {
+#ifdef MS_WINDOWS
+        Sleep(1);
+#elif defined(UNIX)
+        usleep(1000);
+#endif
+    }
+}
+
+/* Delivery to the thread that started a timer. Every thread that starts
+   one with thread_affine set gets an inbox, a Channel without a file
+   descriptor kept in its thread state dict, and the node is delivered to
+   it like to any other channel. run_pending() drains it. The inbox goes
+   with the thread, callbacks still in it then never run. */
+#define INBOX_KEY "_timer.inbox"
+
+/* The calling thread's inbox, a borrowed reference, created if create is
+   set, else NULL without an exception if there is none. */
+static Channel *
+thread_inbox(int create)
+{
+    PyObject *dict = PyThreadState_GetDict();
+    Channel *inbox;
+
+    if (dict == NULL) {
+        if (create)
+            PyErr_SetString(PyExc_RuntimeError, "no thread state");
+        return NULL;
+    }
+    inbox = (Channel*)PyDict_GetItemString(dict, INBOX_KEY);
+    if (inbox != NULL || !create)
+        return inbox;
+
+    inbox = (Channel*)Channel_type.tp_alloc(&Channel_type, 0);
+    if (inbox == NULL)
+        return NULL;
+    lock_init(&inbox->lock);
+    inbox->first = inbox->last = NULL;
+    inbox->read_fd = inbox->write_fd = -1;
+    if (PyDict_SetItemString(dict, INBOX_KEY, (PyObject*)inbox) < 0) {
+        Py_DECREF(inbox);
+        return NULL;
+    }
+    Py_DECREF(inbox);
+    return inbox;
+}
+
+/* Run the C API nodes of due right away and pass those that don't run on
+   the scheduler thread on to the main thread or their channel. Returns
+   the rest, which need the GIL. Called without any shard lock. */
+static timer_node *
+deliver_elsewhere(timer_node *due)
+{
+    timer_node *rest = NULL, *last = NULL, *node, *next;
+    Channel *channel;
+    BOOL idle;
+
+    for (node = due; node != NULL; node = next) {
+        next = node->next;
+        if (node->timer == NULL) {
+            native_run(node);
+            continue;
+        }
+        channel = node->u.channel;
+        if (node->main_thread) {
+            main_deliver(node);
+            continue;
+        }
+        if (channel == NULL) {
+            node_append(&rest, &last, node);
+            continue;
+        }
+        lock_acquire(&channel->lock);
+        idle = channel->first == NULL;
+        node_append(&channel->first, &channel->last, node);
+#ifdef UNIX
+        if (idle && channel->write_fd >= 0)
+            channel_signal(channel);
+#endif
+        lock_release(&channel->lock);
+    }
+    return rest;
+}
+
+/* Bounded free lists of Timer objects, so that short-lived timeouts
+   mostly reuse memory instead of going through the allocator. Entries are
+   linked through their first word. Only used with the GIL held. Without
+   one the interpreter's allocator reclaims objects' memory safely across
+   threads, which a list here would bypass, so it stays empty. */
+#ifdef FREE_THREADED
+#define TIMER_POOL_SIZE 0
+#else
+#define TIMER_POOL_SIZE 1024
+#endif
+
+typedef struct {
+    void *first;
+    Py_ssize_t count;
+    int64_t hits; /* Allocations served from the list */
+    int64_t misses; /* Allocations that found it empty */
+} free_list;
+
+static free_list timer_pool;
+
+static void *
+pool_take(free_list *pool)
+{
+    void *item = pool->first;
+
+    if (item == NULL) {
+        pool->misses++;
+        return NULL;
+    }
+    pool->first = *(void**)item;
+    pool->count--;
+    pool->hits++;
+    return item;
+}
+
+/* Returns FALSE if the list is full and item should really be freed. */
+static BOOL
+pool_give(free_list *pool, void *item, Py_ssize_t limit)
+{
+    if (pool->count >= limit)
+        return FALSE;
+    *(void**)item = pool->first;
+    pool->first = item;
+    pool->count++;
+    return TRUE;
+}
+
+/* self's extra, allocated if it has none yet. NULL with MemoryError set
+   if there is no memory for it. */
+static timer_extra *
+Timer_extra(Timer *self)
+{
+    timer_extra *extra;
+
+    if (self->extra != NULL)
+        return self->extra;
+    extra = (timer_extra*)PyMem_Malloc(sizeof(timer_extra));
+    if (extra == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    memset(extra, 0, sizeof(timer_extra));
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (self->extra == NULL) {
+        self->extra = extra;
+        extra = NULL;
+    }
+    Py_END_CRITICAL_SECTION();
+    /* Another thread got there first. */
+    PyMem_Free(extra);
+    return self->extra;
+}
+
+/* Keep what follows the duration and callback in args, and kwargs, for
+   calling the callback. With vectorcall the positional arguments and the
+   kwargs values go into one tuple, whose items are the argument vector,
+   and the kwargs names into another. A lone positional argument is kept
+   as it is, args then being a vector of one. Without arguments args is
+   the interpreter's shared empty tuple. */
+static int
+Timer_pack_arguments(Timer *self, PyObject *args, PyObject *kwargs)
+{
+    Py_ssize_t n = PyTuple_GET_SIZE(args) - 2;
+#ifdef HAVE_VECTORCALL
+    Py_ssize_t i, pos = 0, nkw = kwargs != NULL ? PyDict_Size(kwargs) : 0;
+    PyObject *key, *value;
+
+    self->nargs = n;
+    if (n == 1 && nkw == 0) {
+        self->args = PyTuple_GET_ITEM(args, 2);
+        Py_INCREF(self->args);
+        self->bare_arg = TRUE;
+        return 0;
+    }
+    self->args = PyTuple_New(n + nkw);
+    if (self->args == NULL)
+        return -1;
+    for (i = 0; i < n; i++) {
+        value = PyTuple_GET_ITEM(args, i + 2);
+        Py_INCREF(value);
+        PyTuple_SET_ITEM(self->args, i, value);
+    }
+    if (nkw == 0)
+        return 0;
+    self->kwargs = PyTuple_New(nkw);
+    if (self->kwargs == NULL)
+        return -1;
+    for (i = 0; PyDict_Next(kwargs, &pos, &key, &value); i++) {
+        Py_INCREF(key);
+        PyTuple_SET_ITEM(self->kwargs, i, key);
+        Py_INCREF(value);
+        PyTuple_SET_ITEM(self->args, n + i, value);
+    }
+    return 0;
+#else
+    self->nargs = n;
+    self->args = PyTuple_GetSlice(args, 2, n + 2);
+    if (self->args == NULL)
+        return -1;
+    /* kwargs might be NULL, which is fine for PyObject_Call. */
+    self->kwargs = kwargs;
+    Py_XINCREF(kwargs);
+    return 0;
+#endif
+}
+
+#ifdef HAVE_TYPE_VECTORCALL
+/* The same from Timer()'s own argument vector, which already has the
+   layout kept: the values of kwnames follow the n positional arguments,
+   and kwnames itself is a tuple that can be shared. */
+static int
+Timer_pack_vector(Timer *self, PyObject *const *args, Py_ssize_t n,
+                  PyObject *kwnames)
+{
+    Py_ssize_t i, nkw = kwnames != NULL ? PyTuple_GET_SIZE(kwnames) : 0;
+
+    self->nargs = n;
+    if (n == 1 && nkw == 0) {
+        self->args = args[0];
+        Py_INCREF(self->args);
+        self->bare_arg = TRUE;
+        return 0;
+    }
+    self->args = PyTuple_New(n + nkw);
+    if (self->args == NULL)
+        return -1;
+    for (i = 0; i < n + nkw; i++) {
+        Py_INCREF(args[i]);
+        PyTuple_SET_ITEM(self->args, i, args[i]);
+    }
+    if (nkw > 0) {
+        self->kwargs = kwnames;
+        Py_INCREF(kwnames);
+    }
+    return 0;
+}
+#endif
+
+/* Whether anything self refers to could lead back to it. Most callbacks
+   can, but a Timer of, say, a builtin type with atomic arguments needn't
+   cost the collector anything. */
+static BOOL
+Timer_needs_gc(Timer *self)
+{
+    Py_ssize_t i;
+
+    /* A Python subclass has its __dict__ and slots besides. */
+    if (PyType_HasFeature(Py_TYPE(self), Py_TPFLAGS_HEAPTYPE))
+        return TRUE;
+    if (GC_MAY_BE_TRACKED(self->callback) ||
+        GC_MAY_BE_TRACKED(self->histogram) ||
+        GC_MAY_BE_TRACKED(self->channel))
+        return TRUE;
+    if (self->extra != NULL &&
+        (GC_MAY_BE_TRACKED(self->extra->group) ||
+         GC_MAY_BE_TRACKED(self->extra->future)))
+        return TRUE;
+    if (self->bare_arg)
+        return GC_MAY_BE_TRACKED(self->args);
+    for (i = 0; i < PyTuple_GET_SIZE(self->args); i++) {
+        if (GC_MAY_BE_TRACKED(PyTuple_GET_ITEM(self->args, i)))
+            return TRUE;
+    }
+#ifndef HAVE_VECTORCALL
+    /* With vectorcall the values are in args and these are names. */
+    if (GC_MAY_BE_TRACKED(self->kwargs))
+        return TRUE;
+#endif
+    return FALSE;
+}
+
+/* Have the collector track self or not, as Timer_needs_gc() says. Timers
+   are left untracked while the scheduler holds them, see Timer_arm, and
+   this is called again when it lets go. */
+static void
+Timer_retrack(Timer *self)
+{
+    if (!Timer_needs_gc(self))
+        PyObject_GC_UnTrack(self);
+    else if (!GC_IS_TRACKED(self))
+        PyObject_GC_Track(self);
+}
+
+/* A new Timer of duration, in units of scale nanoseconds, and callback,
+   with its callback's arguments still to be packed. */
+static Timer *
+Timer_alloc(PyTypeObject *type, PyObject *duration_obj, PyObject *callback,
+            int64_t scale)
+{
+    Timer *self;
+    Py_ssize_t duration;
+
+    duration = GET_DURATION(duration_obj);
+    if (duration == -1) {
+        /* OverflowError gets set in this case. */
+        return NULL;
+    }
+
+    if (!PyCallable_Check(callback)) {
+        PyErr_Format(PyExc_TypeError, "callback parameter must be callable");
+        return NULL;
+    }
+
+    /* Subclasses may differ in size, only plain Timers are pooled. */
+    self = type == &Timer_type ? (Timer*)pool_take(&timer_pool) : NULL;
+    if (self != NULL) {
+        memset(self, 0, sizeof(Timer));
+        PyObject_INIT(self, type);
+    } else {
+        self = (Timer*)type->tp_alloc(type, 0);
+        if (self == NULL)
+            return NULL;
+    }
+
+    Py_INCREF(callback);
+    self->callback = callback;
+    self->duration = (int64_t)duration * scale;
+    self->priority = LANE_NORMAL;
+    self->interp = CURRENT_INTERPRETER();
+    self->trace_id = COUNTER_NEXT(next_trace_id);
+    self->elapsed = 0;
+    self->expired = FALSE;
+    self->node = NULL;
+    return self;
+}
+
+/* Timer(duration, callback, *args, **kwargs), with duration in units of
+   scale nanoseconds. */
+static PyObject *
+Timer_create(PyTypeObject *type, PyObject *args, PyObject *kwargs,
+             int64_t scale)
+{
+    Timer *self;
+
+    /* Don't use PyArg_Parse* functions here.
+       We want to take kwargs without specifying named arguments. We'll
+       manually pick items out of the args tuple, then take a slice of the
+       remaining ones as our callback's args, then take all kwargs. */
+    if (PyTuple_GET_SIZE(args) < 2) {
+        PyErr_SetString(PyExc_TypeError, "Timer takes at least 2 arguments");
+        return NULL;
+    }
+    self = Timer_alloc(type, PyTuple_GET_ITEM(args, 0),
+                       PyTuple_GET_ITEM(args, 1), scale);
+    if (self == NULL)
+        return NULL;
+
+    /* Optional attributes from here on. */
+    if (Timer_pack_arguments(self, args, kwargs) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    Timer_retrack(self);
+
+    return (PyObject*)self;
+}
+
+#ifdef HAVE_TYPE_VECTORCALL
+/* Timer() itself, without the tuple and dict of its arguments that
+   tp_new takes, let alone repacking them. Only Timer calls this, the slot
+   isn't inherited. */
+static PyObject *
+Timer_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
+                 PyObject *kwnames)
+{
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    Timer *self;
+
+    if (nargs < 2) {
+        PyErr_SetString(PyExc_TypeError, "Timer takes at least 2 arguments");
+        return NULL;
+    }
+    self = Timer_alloc((PyTypeObject*)type, args[0], args[1], 1000);
+    if (self == NULL)
+        return NULL;
+    if (Timer_pack_vector(self, args + 2, nargs - 2, kwnames) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    Timer_retrack(self);
+    return (PyObject*)self;
+}
+#endif
+
+static PyObject *
+Timer_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    return Timer_create(type, args, kwargs, 1000);
+}
+
+PyDoc_STRVAR(Timer_from_ns_doc,
+"Timer.from_ns(duration_ns, callback, *args, **kwargs)\n"
+"\n"
+"Create a Timer with its duration given in nanoseconds.");
+
+static PyObject *
+Timer_from_ns(PyObject *cls, PyObject *args, PyObject *kwargs)
+{
+    return Timer_create((PyTypeObject*)cls, args, kwargs, 1);
+}
+
+PyDoc_STRVAR(Timer_sequence_doc,
+"Timer.sequence(offsets, callback, *args, **kwargs)\n"
+"\n"
+"Create a Timer that, once started, calls callback(*args, **kwargs) at\n"
+"each of offsets, increasing microseconds from start(), then stops, such\n"
+"as retries at (10000, 50000, 250000, 1000000). stop() cancels the\n"
+"ones left, start() begins again from the first.");
+
+static PyObject *
+Timer_sequence(PyObject *cls, PyObject *args, PyObject *kwargs)
+{
+    PyObject *seq, *timer_args, *item;
+    Timer *self;
+    int64_t *offsets;
+    Py_ssize_t i, n, gap = PY_SSIZE_T_MAX;
+    long long offset, first = 0, previous = -1;
+
+    if (PyTuple_GET_SIZE(args) < 2) {
+        PyErr_SetString(PyExc_TypeError,
+                        "Timer.sequence() takes offsets and a callback");
+        return NULL;
+    }
+    seq = PySequence_Fast(PyTuple_GET_ITEM(args, 0),
+                          "offsets must be a sequence");
+    if (seq == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (n == 0) {
+        PyErr_SetString(PyExc_ValueError, "offsets must not be empty");
+        Py_DECREF(seq);
+        return NULL;
+    }
+    offsets = (int64_t*)PyMem_Malloc(n * sizeof(int64_t));
+    if (offsets == NULL) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < n; i++) {
+        offset = PyLong_AsLongLong(PySequence_Fast_GET_ITEM(seq, i));
+        if (offset == -1 && PyErr_Occurred())
+            goto fail;
+        if (offset <= previous || offset > INT64_MAX / 1000) {
+            PyErr_SetString(PyExc_ValueError, "offsets must be increasing "
+                            "microseconds from 0");
+            goto fail;
+        }
+        if (i == 0)
+            first = offset;
+        else if (offset - previous < gap)
+            gap = (Py_ssize_t)(offset - previous);
+        offsets[i] = (offset - first) * 1000;
+        previous = offset;
+    }
+    Py_DECREF(seq);
+
+    /* The same arguments Timer() takes, with the first offset as the
+       duration. */
+    timer_args = PyTuple_New(PyTuple_GET_SIZE(args));
+    if (timer_args == NULL) {
+        PyMem_Free(offsets);
+        return NULL;
+    }
+    item = PyLong_FromLongLong(first);
+    if (item == NULL) {
+        Py_DECREF(timer_args);
+        PyMem_Free(offsets);
+        return NULL;
+    }
+    PyTuple_SET_ITEM(timer_args, 0, item);
+    for (i = 1; i < PyTuple_GET_SIZE(args); i++) {
+        Py_INCREF(PyTuple_GET_ITEM(args, i));
+        PyTuple_SET_ITEM(timer_args, i, PyTuple_GET_ITEM(args, i));
+    }
+    self = (Timer*)Timer_create((PyTypeObject*)cls, timer_args, kwargs, 1000);
+    Py_DECREF(timer_args);
+    if (self == NULL) {
+        PyMem_Free(offsets);
+        return NULL;
+    }
+    if (n > 1) {
+        if (Timer_extra(self) == NULL) {
+            PyMem_Free(offsets);
+            Py_DECREF(self);
+            return NULL;
+        }
+        self->extra->offsets = offsets;
+        self->extra->shots = n;
+        /* Repeating, for slack no coarser than the shortest gap. */
+        self->interval = gap;
+    } else
+        PyMem_Free(offsets);
+    return (PyObject*)self;
+
+fail:
+    PyMem_Free(offsets);
+    Py_DECREF(seq);
+    return NULL;
+}
+
+PyDoc_STRVAR(Timer_many_doc,
+"Timer.many(specs) -> list\n"
+"\n"
+"Create a Timer for each (duration, callback, args) in specs, with\n"
+"duration in microseconds and args a sequence. Start them together with\n"
+"timer.start_many().");
+
+static PyObject *
+Timer_many(PyObject *cls, PyObject *specs)
+{
+    PyObject *seq, *result, *spec, *args, *item, *t;
+    Py_ssize_t i, j, n, nargs;
+
+    seq = PySequence_Fast(specs, "Timer.many() takes a sequence");
+    if (seq == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    result = PyList_New(n);
+    if (result == NULL)
+        goto fail;
+    for (i = 0; i < n; i++) {
+        spec = PySequence_Fast(PySequence_Fast_GET_ITEM(seq, i),
+                               "Timer.many() specs must be sequences");
+        if (spec == NULL)
+            goto fail;
+        if (PySequence_Fast_GET_SIZE(spec) != 3) {
+            PyErr_SetString(PyExc_TypeError, "Timer.many() specs must be "
+                            "(duration, callback, args)");
+            Py_DECREF(spec);
+            goto fail;
+        }
+        item = PySequence_Fast(PySequence_Fast_GET_ITEM(spec, 2),
+                               "Timer.many() args must be a sequence");
+        if (item == NULL) {
+            Py_DECREF(spec);
+            goto fail;
+        }
+        /* The same arguments Timer() takes. */
+        nargs = PySequence_Fast_GET_SIZE(item);
+        args = PyTuple_New(nargs + 2);
+        if (args == NULL) {
+            Py_DECREF(item);
+            Py_DECREF(spec);
+            goto fail;
+        }
+        for (j = 0; j < 2; j++) {
+            Py_INCREF(PySequence_Fast_GET_ITEM(spec, j));
+            PyTuple_SET_ITEM(args, j, PySequence_Fast_GET_ITEM(spec, j));
+        }
+        for (j = 0; j < nargs; j++) {
+            Py_INCREF(PySequence_Fast_GET_ITEM(item, j));
+            PyTuple_SET_ITEM(args, j + 2, PySequence_Fast_GET_ITEM(item, j));
+        }
+        Py_DECREF(item);
+        Py_DECREF(spec);
+        t = Timer_create((PyTypeObject*)cls, args, NULL, 1000);
+        Py_DECREF(args);
+        if (t == NULL)
+            goto fail;
+        PyList_SET_ITEM(result, i, t);
+    }
+    Py_DECREF(seq);
+    return result;
+
+fail:
+    Py_XDECREF(result);
+    Py_DECREF(seq);
+    return NULL;
+}
+
+static int
+Timer_traverse(Timer *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->callback);
+    Py_VISIT(self->args);
+    Py_VISIT(self->kwargs);
+    Py_VISIT(self->histogram);
+    Py_VISIT(self->channel);
+    if (self->extra != NULL) {
+        Py_VISIT(self->extra->group);
+        Py_VISIT(self->extra->future);
+        Py_VISIT(self->extra->key);
+    }
+    return 0;
+}
+
+/* Something else in the cycle may still start the Timer, so it is left
+   calling None with no arguments rather than with NULLs. Every field is
+   replaced before anything is released, as releasing can run code. */
+static int
+Timer_clear(Timer *self)
+{
+    PyObject *callback = self->callback, *args = self->args;
+    PyObject *kwargs = self->kwargs, *histogram = self->histogram;
+    PyObject *channel = self->channel, *group = NULL, *future = NULL;
+    PyObject *key = NULL, *empty = PyTuple_New(0);
+
+    /* () is a singleton, so this only fails in theory. */
+    if (empty == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+    Py_INCREF(Py_None);
+    self->callback = Py_None;
+    self->args = empty;
+    self->nargs = 0;
+    self->bare_arg = FALSE;
+    self->kwargs = NULL;
+    self->histogram = NULL;
+    self->channel = NULL;
+    if (self->extra != NULL) {
+        group = self->extra->group;
+        future = self->extra->future;
+        key = self->extra->key;
+        self->extra->group = NULL;
+        self->extra->future = NULL;
+        self->extra->key = NULL;
+    }
+    Py_XDECREF(callback);
+    Py_XDECREF(args);
+    Py_XDECREF(kwargs);
+    Py_XDECREF(histogram);
+    Py_XDECREF(channel);
+    Py_XDECREF(group);
+    Py_XDECREF(future);
+    Py_XDECREF(key);
+    return 0;
+}
+
+static void
+Timer_dealloc(Timer *self)
+{
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->callback);
+    Py_XDECREF(self->args);
+    Py_XDECREF(self->kwargs);
+    Py_XDECREF(self->histogram);
+    Py_XDECREF(self->channel);
+    if (self->extra != NULL) {
+        Py_XDECREF(self->extra->group);
+        Py_XDECREF(self->extra->future);
+        Py_XDECREF(self->extra->key);
+        PyMem_Free(self->extra->offsets);
+        PyMem_Free(self->extra);
+    }
+    if (Py_TYPE(self) == &Timer_type &&
+        pool_give(&timer_pool, self, TIMER_POOL_SIZE))
+        return;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+Timer_str(Timer* self)
+{
+    char duration[24];
+
+    /* Python 2's PyUnicode_FromFormat has no %lld. */
+    PyOS_snprintf(duration, sizeof(duration), "%lld",
+                  (long long)(self->duration / 1000));
+    return PyUnicode_FromFormat(
+        "<%s at %p duration=%s, expired=%d, started=%d>",
+        Py_TYPE(self)->tp_name, self,
+        duration, self->expired, self->started);
+}
+
+/*static PyObject *
+Timer_repr(Timer* self)
+{
+    return PyUnicode_FromFormat("%s(%d, %s)",
+            Py_TYPE(self)->tp_name, self->duration,
+            Py_TYPE(self->callback)->tp_name);
+}*/
+
+
+/* How late a node can fire past its deadline and still be within its
+   timer's slack, see Timer_window. Kept in the node, since a lazy one may
+   be buried, and its Timer let go of, while it is being queued. */
+static int64_t
+node_window(timer_node *node)
+{
+    return node->timer == NULL ? 0 : node->v.window;
+}
+
+/* Count a node into or out of its shard's pending ones. Called with the
+   lock held. The shard's window only shrinks while anything is pending,
+   so it may be less than the pending nodes need, never more. */
+static void
+shard_count(timer_shard *shard, timer_node *node, Py_ssize_t n)
+{
+    int64_t window;
+
+    if (n > 0) {
+        window = node_window(node);
+        if (shard->pending == 0 || window < shard->window)
+            shard->window = window;
+    }
+    shard->pending += n;
+    if (node->precision != PRECISION_COARSE)
+        shard->spinning[(int)node->precision] += n;
+}
+
+/* Queue bookkeeping shared by every queue type. Called with the node's
+   shard's lock held. */
+static int
+queue_insert(timer_node *node)
+{
+    timer_shard *shard = NODE_SHARD(node);
+
+    char state = node->state;
+
+    if (shard->queue.ops->insert(&shard->queue, node) < 0)
+        return -1;
+    shard_count(shard, node, 1);
+    /* Stopped since it was collected, so it is a tombstone in there. */
+    if (state == NODE_TOMBSTONE ||
+        !node_state_swap(node, state, NODE_PENDING))
+        tombstones_add(shard, node->precision, 1);
+    return 0;
+}
+
+static void
+queue_remove(timer_node *node)
+{
+    timer_shard *shard = NODE_SHARD(node);
+
+    shard->queue.ops->remove(&shard->queue, node);
+    shard_count(shard, node, -1);
+}
+
+/* Account for a node the queue handed back, which then has state, or is
+   cancelled if it was a tombstone. Called with the shard's lock held. */
+static void
+node_unqueued(timer_shard *shard, timer_node *node, char state)
+{
+    if (node_state_exchange(node, state) == NODE_TOMBSTONE) {
+        node_reap(node);
+        tombstones_add(shard, node->precision, -1);
+    }
+    shard_count(shard, node, -1);
+}
+
+/* Rebuild the shard's queue without its tombstones, which go to *dead
+   bare, see node_reap, linked by next. A queue can only be emptied by popping it
+   at the end of time, so the rest go into a fresh one, each passed to
+   visit(node, arg) first if visit isn't NULL. Returns -1 if there's no
+   memory for the fresh queue, leaving the old one alone. Called with the
+   shard's lock held. */
+static int
+shard_rebuild(timer_shard *shard, int64_t now,
+              void (*visit)(timer_node *, void *), void *arg,
+              timer_node **dead)
+{
+    timer_queue kept;
+    timer_node *node, *next, *last = NULL;
+
+    *dead = NULL;
+    if (shard->queue.ops == NULL)
+        return 0;
+    if (queue_init(&kept, shard->queue.ops, now) < 0)
+        return -1;
+
+    for (last = shard->deferred; last != NULL && last->next != NULL;)
+        last = last->next;
+    node = shard->queue.ops->pop_due(&shard->queue, INT64_MAX);
+    for (; node != NULL; node = next) {
+        next = node->next;
+        /* The tombstone may come while it moves, it stays one. */
+        if (node->state == NODE_PENDING && kept.ops->insert(&kept, node) == 0) {
+            if (visit != NULL)
+                visit(node, arg);
+            continue;
+        }
+        node_unqueued(shard, node, NODE_SUBMITTED);
+        if (node->state == NODE_CANCELLED) {
+            node->next = *dead;
+            *dead = node;
+        } else
+            node_append(&shard->deferred, &last, node);
+    }
+    shard->queue.ops->fini(&shard->queue);
+    shard->queue = kept;
+    return 0;
+}
+
+/* Rebuild the shard's queue if it has tombstones, returning them. Called
+   with the shard's lock held. */
+static timer_node *
+shard_compact(timer_shard *shard, int64_t now)
+{
+    timer_node *dead;
+
+    shard->compact = FALSE;
+    if (shard->queue.ops == NULL || tombstones_count(shard) == 0 ||
+        shard_rebuild(shard, now, NULL, NULL, &dead) < 0)
+        return NULL;
+    compactions++;
+    return dead;
+}
+
+static int scheduler_submit(timer_node *node, int64_t now);
+
+/* A repeating timer's deadline number tick, origin + tick * interval. A
+   Ticker's period needn't be a whole number of nanoseconds, so its
+   deadlines are origin + tick / hz seconds, rounded down. A sequence's
+   are its offsets from origin. */
+static int64_t
+Timer_tick_deadline(Timer *self, int64_t tick)
+{
+    if (TIMER_EXTRA(self, offsets, NULL) != NULL)
+        return self->origin + self->extra->offsets[tick];
+    if (self->hz > 0)
+        return self->origin + ticks_to_units(tick, self->hz, 1000000000);
+    return self->origin + tick * (int64_t)self->interval * 1000;
+}
+
+/* Move a repeating timer's node to its next deadline. Deadlines always
+   come from Timer_tick_deadline, so they don't drift however late
+   callbacks run. */
+static void
+Timer_next_deadline(Timer *self, timer_node *node)
+{
+    int64_t now, behind;
+
+    self->tick++;
+    node->deadline = Timer_tick_deadline(self, self->tick);
+
+    now = timer_clock_ns();
+    if (node->deadline > now || self->overrun == OVERRUN_CATCH_UP)
+        return;
+
+    /* The deadlines up to and including this one have passed. */
+    if (TIMER_EXTRA(self, offsets, NULL) != NULL) {
+        for (behind = self->tick; behind + 1 < self->extra->shots &&
+             Timer_tick_deadline(self, behind + 1) <= now;)
+            behind++;
+    } else if (self->hz > 0)
+        behind = ticks_to_units(now - self->origin, 1000000000, self->hz);
+    else
+        behind = (now - self->origin) / ((int64_t)self->interval * 1000);
+    /* A sequence whose last deadline passed too still fires that one. */
+    if (self->overrun == OVERRUN_SKIP &&
+        (TIMER_EXTRA(self, offsets, NULL) == NULL ||
+         behind + 1 < self->extra->shots)) {
+        self->missed += (Py_ssize_t)(behind - self->tick + 1);
+        self->tick = behind + 1;
+        node->deadline = Timer_tick_deadline(self, self->tick);
+    } else {
+        self->missed += (Py_ssize_t)(behind - self->tick);
+        self->tick = behind;
+        node->deadline = now;
+    }
+}
+
+/* When a timer with slack really expires: deadline rounded up to a
+   multiple of the largest power of two nanoseconds within its slack. Timers
+   due around the same time with similar slack so share a deadline, and
+   the scheduler wakes, takes the GIL and runs them once for all of them,
+   like Linux's timer_slack_ns. Never early, and less than slack late.
+   A repeating timer's slack is capped at its interval, so that rounding
+   doesn't merge repeats. */
+static int64_t
+Timer_slack(Timer *self, int64_t deadline)
+{
+    Py_ssize_t slack = self->slack;
+    int64_t bucket;
+
+    if (self->interval > 0 && slack > self->interval)
+        slack = self->interval;
+    if (slack <= 0 || deadline < 0)
+        return deadline;
+    bucket = (int64_t)1 << bit_scan_reverse((uint64_t)slack * 1000);
+    return (deadline + bucket - 1) / bucket * bucket;
+}
+
+/* What Timer_slack's rounding leaves of self's slack, how late its node
+   can fire past its deadline and still be within it. */
+static int64_t
+Timer_window(Timer *self)
+{
+    Py_ssize_t slack = self->slack;
+    int64_t ns;
+
+    if (self->interval > 0 && slack > self->interval)
+        slack = self->interval;
+    if (slack <= 0)
+        return 0;
+    ns = (int64_t)slack * 1000;
+    return ns - ((int64_t)1 << bit_scan_reverse((uint64_t)ns));
+}
+
+/* Aim self's node at deadline, with self's slack. */
+static void
+Timer_aim(Timer *self, timer_node *node, int64_t deadline)
+{
+    node->deadline = Timer_slack(self, deadline);
+    node->v.window = Timer_window(self);
+}
+
+/* rearm() only pushes Timer.deadline back. The node stays where it was, and
+   when it comes due it is requeued at the real deadline instead of firing.
+   Returns TRUE if that happened. */
+static BOOL
+Timer_postpone(Timer *self, timer_node *node)
+{
+    int64_t now;
+
+    if (self->deadline <= node->deadline)
+        return FALSE;
+    now = timer_clock_ns();
+    if (self->deadline <= now)
+        return FALSE;
+
+    Timer_aim(self, node, self->deadline);
+    if (scheduler_submit(node, now) == 0)
+        return TRUE;
+    /* Firing early beats never firing. */
+    return FALSE;
+}
+
+/* Note how late a callback is about to run. gil_time is when the
+   scheduler got the GIL for the batch the node is in. */
+static int64_t
+Timer_record_lateness(Timer *self, timer_node *node, int64_t gil_time)
+{
+    int64_t now = timer_clock_ns();
+
+    self->lateness = now - node->deadline;
+    self->wake_latency = node->due_time - node->deadline;
+    self->gil_wait = gil_time - node->due_time;
+
+    RECORD_BOUND(lateness_histogram, self->lateness);
+    RECORD_BOUND(lane_lateness_histograms[node->lane], self->lateness);
+    RECORD_BOUND(wake_latency_histogram, self->wake_latency);
+    RECORD_BOUND(gil_wait_histogram, self->gil_wait);
+    return now;
+}
+
+/* Release a node nobody else will touch. The GIL must be held. */
+static void
+node_free(timer_node *node)
+{
+    Py_XDECREF((PyObject*)node->u.channel);
+    node_release(node);
+}
+
+/* Drop the references a node of self held to it and to channel, past
+   which the collector may now have to see. */
+static void
+node_unref(Timer *self, Channel *channel)
+{
+    Py_XDECREF((PyObject*)channel);
+    Py_BEGIN_CRITICAL_SECTION(self);
+    Timer_retrack(self);
+    Py_END_CRITICAL_SECTION();
+    Py_DECREF(self);
+}
+
+/* node_free() for a Timer's node, see node_unref. */
+static void
+node_done(timer_node *node)
+{
+    Timer *self = node->timer;
+
+    node_free(node);
+    node_unref(self, NULL);
+}
+
+/* What stop() does to a started timer, for one that lapsed, dated back
+   to its group's cancel(). Its node is taken care of by the caller. */
+static void
+Timer_lapse(Timer *self)
+{
+    self->elapsed = ((TimerGroup*)self->extra->group)->cancelled_at -
+                    self->start_time;
+    RECORD_BOUND(self->histogram, self->elapsed);
+    self->started = FALSE;
+}
+
+/* Overload policy, see configure(overload=). Once callbacks run
+   overload_after or more behind their deadlines, some of them are
+   skipped, counted as missed by their timer, so that the others catch
+   up. Coalescing remembers the late calls run under the current GIL
+   acquisition, which gil_time tells apart, in a small window. */
+enum {
+    OVERLOAD_NONE,         /* Run them all, however late */
+    OVERLOAD_DROP_OLDEST,  /* Skip those that late */
+    OVERLOAD_COALESCE,     /* Skip repeats of a late call already run */
+    OVERLOAD_SHED_TOLERANT /* Skip those of timers with slack or coarse */
+};
+
+static const char *overload_names[] = {"none", "drop_oldest", "coalesce",
+                                       "shed_tolerant", NULL};
+
+#define COALESCE_WINDOW 64
+
+static int overload_policy;
+static int64_t overload_after = 10000000; /* Nanoseconds */
+static Py_ssize_t overload_shed;
+static Py_ssize_t overload_coalesced;
+static Timer *coalesce_window[COALESCE_WINDOW]; /* References */
+static int coalesce_count;
+static int64_t coalesce_batch;
+MUTEX_DECLARE(coalesce_mutex); /* For the window without a GIL */
+
+static BOOL
+tuple_same(PyObject *a, PyObject *b)
+{
+    Py_ssize_t i;
+
+    if (a == b)
+        return TRUE;
+    if (a == NULL || b == NULL || PyTuple_GET_SIZE(a) != PyTuple_GET_SIZE(b))
+        return FALSE;
+    for (i = 0; i < PyTuple_GET_SIZE(a); i++) {
+        if (PyTuple_GET_ITEM(a, i) != PyTuple_GET_ITEM(b, i))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Whether the timers make the same call: callback and arguments are the
+   same objects. Ticks of a Ticker and attempts of a Backoff never are. */
+static BOOL
+same_call(Timer *a, Timer *b)
+{
+    return a->callback == b->callback && a->hz == 0 && b->hz == 0 &&
+           !a->backoff && !b->backoff && a->bare_arg == b->bare_arg &&
+           (a->bare_arg ? a->args == b->args : tuple_same(a->args, b->args)) &&
+#ifdef HAVE_VECTORCALL
+           tuple_same(a->kwargs, b->kwargs);
+#else
+           a->kwargs == b->kwargs;
+#endif
+}
+
+static void
+coalesce_reset(int64_t batch)
+{
+    while (coalesce_count > 0) {
+        coalesce_count--;
+        Py_DECREF(coalesce_window[coalesce_count]);
+    }
+    coalesce_batch = batch;
+}
+
+/* Whether to skip the callback of a node that came due. The GIL must be
+   held. */
+static BOOL
+overload_skip(Timer *self, timer_node *node, int64_t gil_time)
+{
+    BOOL skip;
+    int i;
+
+    if (overload_policy == OVERLOAD_NONE ||
+        timer_clock_ns() - node->deadline < overload_after)
+        return FALSE;
+    switch (overload_policy) {
+    case OVERLOAD_SHED_TOLERANT:
+        if (self->slack == 0 && self->precision != PRECISION_COARSE)
+            return FALSE;
+        break;
+    case OVERLOAD_COALESCE:
+        MUTEX_LOCK(&coalesce_mutex);
+        if (gil_time != coalesce_batch)
+            coalesce_reset(gil_time);
+        for (i = 0; i < coalesce_count && !same_call(coalesce_window[i], self);
+             i++)
+            ;
+        skip = i < coalesce_count;
+        if (skip)
+            COUNTER_ADD(overload_coalesced, 1);
+        else if (coalesce_count < COALESCE_WINDOW) {
+            Py_INCREF(self);
+            coalesce_window[coalesce_count++] = self;
+        }
+        MUTEX_UNLOCK(&coalesce_mutex);
+        return skip;
+    }
+    COUNTER_ADD(overload_shed, 1);
+    return TRUE;
+}
+
+/* What Timer_expire does with a node that came due, see Timer_due. */
+enum {
+    EXPIRE_CALL,     /* Run the callback */
+    EXPIRE_SKIP,     /* Not this time, see overload_skip */
+    EXPIRE_DROP,     /* Cancelled or lapsed, the node is done with */
+    EXPIRE_REQUEUED  /* Postponed, the node is queued again */
+};
+
+/* What Timer_due hands Timer_expire for the callback, so that it runs
+   outside the critical section. */
+typedef struct {
+    PyObject *callback;
+    PyObject *args;
+    PyObject *kwargs; /* The names of them with vectorcall */
+    long long tick;
+    long long lateness;
+    Py_ssize_t attempt;
+    int64_t started;
+} expire_call;
+
+/* The part of an expiration up to the callback. Called in a critical
+   section on self, fills in call for EXPIRE_CALL. */
+static int
+Timer_due(Timer *self, timer_node *node, int64_t gil_time, BOOL *repeat,
+          expire_call *call)
+{
+    *repeat = self->interval > 0 &&
+        (TIMER_EXTRA(self, offsets, NULL) == NULL ||
+         self->tick + 1 < self->extra->shots);
+
+    if (node->state == NODE_CANCELLED)
+        return EXPIRE_DROP;
+    if (self->node == node && TIMER_LAPSED(self)) {
+        self->node = NULL;
+        COUNTER_ADD(stats.cancelled, 1);
+        TRACE(TRACE_CANCEL, self->trace_id, gil_time, 0);
+        Timer_lapse(self);
+        return EXPIRE_DROP;
+    }
+
+    if (Timer_postpone(self, node))
+        return EXPIRE_REQUEUED;
+
+    if (!*repeat) {
+        /* Flag denoting timer expiration rather than being stopped. These
+           are set before the callback runs so the callback may restart the
+           timer. */
+        self->node = NULL;
+        self->expired = TRUE;
+        self->started = FALSE;
+        /* Don't use the actual lateness here. Using duration is another
+           way to signal that a timeout occurred. */
+        self->elapsed = self->duration;
+    }
+
+    if (overload_skip(self, node, gil_time)) {
+        self->missed++;
+        return EXPIRE_SKIP;
+    }
+
+    call->started = Timer_record_lateness(self, node, gil_time);
+    TRACE(TRACE_FIRE, self->trace_id, node->due_time, node->deadline);
+    TRACE(TRACE_CALLBACK_BEGIN, self->trace_id, call->started, 0);
+    /* Held, the callback may replace them meanwhile. */
+    call->callback = self->callback;
+    Py_INCREF(call->callback);
+    call->args = self->args;
+    Py_INCREF(call->args);
+    call->kwargs = self->kwargs;
+    Py_XINCREF(call->kwargs);
+    call->tick = (long long)self->tick;
+    call->lateness = self->lateness;
+    call->attempt = self->backoff ? ((Backoff*)self)->attempt : 0;
+    return EXPIRE_CALL;
+}
+
+/* Hand a repeating timer's node back to the scheduler, unless the callback
+   stopped it or made it one-shot. Returns TRUE if it was. Called in a
+   critical section on self. */
+static BOOL
+Timer_requeue(Timer *self, timer_node *node, BOOL repeat, int64_t finished)
+{
+    if (repeat && self->node == node && self->interval > 0) {
+        Timer_next_deadline(self, node);
+        self->deadline = node->deadline;
+        Timer_aim(self, node, node->deadline);
+        if (scheduler_submit(node, finished) == 0)
+            return TRUE;
+        PyErr_NoMemory();
+        PyErr_Print();
+    }
+    if (self->node == node) {
+        self->node = NULL;
+        self->started = FALSE;
+    }
+    return FALSE;
+}
+
+/* What happens to the exception of a callback that raised and has no
+   future to take it, see errors under configure(). 'print' prints it
+   right away, 'count' drops it after stats() has counted it, 'defer'
+   queues it for a Timer to print along with the others a moment later,
+   and a callable gets it without anything being formatted. */
+enum {
+    ERRORS_PRINT,
+    ERRORS_COUNT,
+    ERRORS_DEFER,
+    ERRORS_CALL
+};
+
+static const char *error_names[] = {"print", "count", "defer", NULL};
+
+#define DEFERRED_ERRORS_MAX 100 /* Printed per batch, the rest counted */
+#define DEFERRED_ERRORS_DELAY 100000 /* Microseconds */
+
+static int error_policy;
+static PyObject *error_handler; /* Callable for ERRORS_CALL */
+static PyObject *deferred_errors; /* (callback, type, value, traceback) */
+static PyObject *deferred_timer; /* Prints them, see errors_print */
+static Py_ssize_t deferred_dropped;
+MUTEX_DECLARE(errors_mutex); /* For the last three without a GIL */
+
+/* deferred_timer's callback. */
+static PyObject *
+errors_print(PyObject *unused, PyObject *noargs)
+{
+    PyObject *queued, *item, *value, *tb;
+    Py_ssize_t i, dropped;
+
+    MUTEX_LOCK(&errors_mutex);
+    queued = deferred_errors;
+    dropped = deferred_dropped;
+    deferred_errors = NULL;
+    deferred_dropped = 0;
+    MUTEX_UNLOCK(&errors_mutex);
+
+    for (i = 0; queued != NULL && i < PyList_GET_SIZE(queued); i++) {
+        item = PyList_GET_ITEM(queued, i);
+        value = PyTuple_GET_ITEM(item, 2);
+        tb = PyTuple_GET_ITEM(item, 3) != Py_None ?
+             PyTuple_GET_ITEM(item, 3) : NULL;
+        Py_INCREF(PyTuple_GET_ITEM(item, 1));
+        Py_INCREF(value);
+        Py_XINCREF(tb);
+        PyErr_Restore(PyTuple_GET_ITEM(item, 1), value, tb);
+        PyErr_Print();
+    }
+    Py_XDECREF(queued);
+    if (dropped > 0)
+        PySys_WriteStderr("timer: %ld more callback errors not shown\n",
+                          (long)dropped);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef errors_print_def = {
+    "errors_print", (PyCFunction)errors_print, METH_NOARGS, NULL
+};
+
+/* Queue the current exception for deferred_timer. */
+static void
+errors_defer(PyObject *callback)
+{
+    PyObject *type, *value, *tb, *item, *rslt;
+    BOOL first;
+
+    /* Past the limit it is only counted, checked again under the mutex.
+       That is what keeps an error storm cheap. */
+    if (deferred_errors != NULL &&
+        PyList_GET_SIZE(deferred_errors) >= DEFERRED_ERRORS_MAX) {
+        PyErr_Clear();
+        MUTEX_LOCK(&errors_mutex);
+        deferred_dropped++;
+        MUTEX_UNLOCK(&errors_mutex);
+        return;
+    }
+    PyErr_Fetch(&type, &value, &tb);
+    PyErr_NormalizeException(&type, &value, &tb);
+    if (tb == NULL) {
+        Py_INCREF(Py_None);
+        tb = Py_None;
+    }
+    item = value != NULL ? PyTuple_Pack(4, callback, type, value, tb) : NULL;
+    Py_DECREF(type);
+    Py_XDECREF(value);
+    Py_DECREF(tb);
+    if (item == NULL) {
+        PyErr_Print();
+        return;
+    }
+
+    MUTEX_LOCK(&errors_mutex);
+    first = deferred_errors == NULL;
+    if (first)
+        deferred_errors = PyList_New(0);
+    if (deferred_errors != NULL &&
+        PyList_GET_SIZE(deferred_errors) < DEFERRED_ERRORS_MAX)
+        PyList_Append(deferred_errors, item);
+    else
+        deferred_dropped++;
+    MUTEX_UNLOCK(&errors_mutex);
+    Py_DECREF(item);
+
+    /* The first of a batch starts the Timer that prints it and the rest. */
+    if (PyErr_Occurred())
+        PyErr_Print();
+    else if (first) {
+        rslt = PyObject_CallMethod(deferred_timer, "start", NULL);
+        if (rslt == NULL)
+            PyErr_Print();
+        Py_XDECREF(rslt);
+    }
+}
+
+/* Dispose of the exception set by callback. */
+static void
+callback_error(PyObject *callback)
+{
+    PyObject *type, *value, *tb, *handler, *rslt;
+
+    switch (error_policy) {
+    case ERRORS_COUNT:
+        PyErr_Clear();
+        break;
+    case ERRORS_DEFER:
+        errors_defer(callback);
+        break;
+    case ERRORS_CALL:
+        /* Held, configure() may replace it meanwhile. */
+        MUTEX_LOCK(&errors_mutex);
+        handler = error_handler;
+        Py_XINCREF(handler);
+        MUTEX_UNLOCK(&errors_mutex);
+        if (handler == NULL) {
+            PyErr_Print();
+            break;
+        }
+        PyErr_Fetch(&type, &value, &tb);
+        PyErr_NormalizeException(&type, &value, &tb);
+        rslt = PyObject_CallFunctionObjArgs(handler, callback, type,
+                                            value != NULL ? value : Py_None,
+                                            tb != NULL ? tb : Py_None, NULL);
+        Py_DECREF(handler);
+        Py_DECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(tb);
+        if (rslt == NULL)
+            PyErr_Print();
+        Py_XDECREF(rslt);
+        break;
+    default:
+        PyErr_Print();
+    }
+}
+
+/* Callback accounting, see watch_callbacks(). The clock is read around
+   every callback anyway, so with watching on each call only costs a dict
+   lookup of the callback, under which a capsule holds its counters, and
+   one that took threshold or longer is reported. All of these are only
+   touched with the GIL held, or callbacks_mutex without one. */
+typedef struct {
+    int64_t calls;
+    int64_t total_ns;
+    int64_t max_ns;
+} callback_counters;
+
+#define CALLBACK_COUNTERS "timer.callback_counters"
+
+static PyObject *callbacks_watched; /* Callback to counters, or NULL */
+static int64_t callbacks_threshold; /* Nanoseconds, 0 to not report */
+static PyObject *callbacks_callback; /* Called with slow ones, or NULL */
+static Py_ssize_t slow_callbacks;
+MUTEX_DECLARE(callbacks_mutex);
+
+static void
+callback_counters_free(PyObject *capsule)
+{
+    free(PyCapsule_GetPointer(capsule, CALLBACK_COUNTERS));
+}
+
+/* The counters of callback, created on its first call. */
+static callback_counters *
+callbacks_lookup(PyObject *watched, PyObject *callback)
+{
+    callback_counters *counters;
+    PyObject *capsule = PyDict_GetItem(watched, callback);
+
+    if (capsule != NULL)
+        return (callback_counters*)PyCapsule_GetPointer(capsule,
+                                                        CALLBACK_COUNTERS);
+    counters = (callback_counters*)calloc(1, sizeof(callback_counters));
+    if (counters == NULL)
+        return NULL;
+    capsule = PyCapsule_New(counters, CALLBACK_COUNTERS,
+                            callback_counters_free);
+    if (capsule == NULL) {
+        free(counters);
+        return NULL;
+    }
+    if (PyDict_SetItem(watched, callback, capsule) < 0)
+        counters = NULL;
+    Py_DECREF(capsule);
+    return counters;
+}
+
+static void
+callbacks_report(PyObject *callback, int64_t ns)
+{
+    PyObject *rslt, *logger, *logging;
+
+    if (callbacks_callback != NULL)
+        rslt = PyObject_CallFunction(callbacks_callback, "OL", callback,
+                                     (long long)ns);
+    else {
+        logging = PyImport_ImportModule("logging");
+        logger = logging ?
+            PyObject_CallMethod(logging, "getLogger", "s", "timer") : NULL;
+        rslt = logger ? PyObject_CallMethod(
+            logger, "warning", "sOL", "Timer callback %r ran for %d us",
+            callback, (long long)(ns / 1000)) : NULL;
+        Py_XDECREF(logger);
+        Py_XDECREF(logging);
+    }
+    if (rslt == NULL)
+        PyErr_Print();
+    Py_XDECREF(rslt);
+}
+
+/* Count a call of callback that took ns. Called with no exception set. */
+static void
+callbacks_account(PyObject *callback, int64_t ns)
+{
+    callback_counters *counters;
+    PyObject *watched;
+    BOOL slow;
+
+    MUTEX_LOCK(&callbacks_mutex);
+    /* Held, hashing the callback may let watch_callbacks() run. */
+    watched = callbacks_watched;
+    if (watched == NULL) {
+        MUTEX_UNLOCK(&callbacks_mutex);
+        return;
+    }
+    Py_INCREF(watched);
+    counters = callbacks_lookup(watched, callback);
+    if (counters != NULL) {
+        counters->calls++;
+        counters->total_ns += ns;
+        if (ns > counters->max_ns)
+            counters->max_ns = ns;
+    }
+    else
+        PyErr_Clear(); /* Unhashable, say, it just isn't counted */
+    slow = callbacks_threshold > 0 && ns >= callbacks_threshold;
+    if (slow)
+        slow_callbacks++;
+    MUTEX_UNLOCK(&callbacks_mutex);
+    Py_DECREF(watched);
+
+    if (slow)
+        callbacks_report(callback, ns);
+}
+
+/* Runs the callback for an expired node. One-shot timers then release the
+   node, repeating ones hand it back to the scheduler. The GIL must be
+   held. Without a GIL the Timer's state is changed in critical sections
+   on it, and the callback runs outside them, so that it may use the
+   Timer and callbacks of other timers run alongside it. Returns whether
+   the callback was called. */
+static BOOL
+Timer_expire(timer_node *node, int64_t gil_time)
+{
+    Timer *self = node->timer;
+    PyObject *call_rslt, *future = NULL;
+    int64_t finished;
+    expire_call call;
+    BOOL repeat, requeued;
+    int action;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    action = Timer_due(self, node, gil_time, &repeat, &call);
+    Py_END_CRITICAL_SECTION();
+    if (action == EXPIRE_REQUEUED)
+        return FALSE;
+    if (action == EXPIRE_DROP)
+        goto done;
+    if (action == EXPIRE_SKIP) {
+        finished = timer_clock_ns();
+        goto resubmit;
+    }
+
+    /* This will work for free functions and bound methods. */
+    if (self->hz > 0)
+        call_rslt = PyObject_CallFunction(call.callback, "LL", call.tick,
+                                          call.lateness);
+    else if (self->backoff)
+        call_rslt = PyObject_CallFunction(call.callback, "n", call.attempt);
+    else
+#ifdef HAVE_VECTORCALL
+        call_rslt = PyObject_Vectorcall(call.callback, self->bare_arg ?
+                                        &call.args :
+                                        ((PyTupleObject*)call.args)->ob_item,
+                                        (size_t)self->nargs, call.kwargs);
+#else
+        call_rslt = PyObject_Call(call.callback, call.args, call.kwargs);
+#endif
+    Py_DECREF(call.args);
+    Py_XDECREF(call.kwargs);
+    finished = timer_clock_ns();
+    TRACE(TRACE_CALLBACK_END, self->trace_id, finished, call_rslt == NULL);
+    COUNTER_ADD(stats.fired, 1);
+    COUNTER_ADD(stats.callback_ns, finished - call.started);
+    /* The callback may have replaced it, that one is for the next call. */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    future = TIMER_EXTRA(self, future, NULL);
+    if (future != NULL && !((Future*)future)->done)
+        Py_INCREF(future);
+    else
+        future = NULL;
+    Py_END_CRITICAL_SECTION();
+    if (call_rslt == NULL) {
+        COUNTER_ADD(stats.errors, 1);
+        if (future != NULL)
+            future_set_exception((Future*)future);
+        else
+            callback_error(call.callback);
+    } else {
+        if (future != NULL)
+            future_set_result((Future*)future, call_rslt);
+        Py_DECREF(call_rslt);
+    }
+    Py_XDECREF(future);
+    if (callbacks_watched != NULL)
+        callbacks_account(call.callback, finished - call.started);
+    Py_DECREF(call.callback);
+
+resubmit:
+    Py_BEGIN_CRITICAL_SECTION(self);
+    requeued = Timer_requeue(self, node, repeat, finished);
+    Py_END_CRITICAL_SECTION();
+    if (requeued)
+        return action == EXPIRE_CALL;
+
+done:
+    node_done(node);
+    return action == EXPIRE_CALL;
+}
+
+/* Submission. scheduler_submit pushes nodes onto their shard's submitted
+   list with a compare-and-swap instead of taking the lock, and whoever
+   holds the lock next moves them into the queue: the shard's thread each
+   time round its loop, or a thread that needs one of them in the queue,
+   such as to stop it. The submitter only takes the lock to wake the
+   shard when its deadline is earlier than the one the shard sleeps
+   towards. Otherwise the shard finds the node when it wakes anyway.
+
+   That needs sleep_until and submitted to be ordered both ways: the
+   shard stores sleep_until before looking at submitted a last time, a
+   submitter pushes before loading sleep_until, both sequentially
+   consistent, so one of them always sees the other.
+
+   Several nodes can go in one push, linked newest first from first to
+   last. */
+static void
+submissions_push(timer_node **list, timer_node *first, timer_node *last)
+{
+    timer_node *head;
+
+#ifdef _MSC_VER
+    do {
+        head = *list;
+        last->next = head;
+    } while (InterlockedCompareExchangePointer(
+                 (PVOID volatile*)list, first, head) != head);
+#else
+    head = __atomic_load_n(list, __ATOMIC_RELAXED);
+    do {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(list, &head, first, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+#endif
+}
+
+static timer_node *
+submissions_take(timer_node **list)
+{
+#ifdef _MSC_VER
+    return (timer_node*)InterlockedExchangePointer((PVOID volatile*)list,
+                                                   NULL);
+#else
+    return __atomic_exchange_n(list, NULL, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Lazy submission, for timeouts that are nearly always stopped soon
+   after they start. A lazy node goes onto the shard's lazy list, which
+   the shard only takes the next time it sweeps: once the earliest
+   deadline on it is LAZY_LEAD away, or whenever something else needs
+   the whole queue, such as stats(). Until then a submission wakes the
+   shard only if that sweep has to come sooner than it sleeps, and a node
+   stopped before the sweep is buried where it is and dropped there,
+   never touching the queue. Nodes taken in a sweep are queued however
+   far off they are due, so the ones that survive it cost what any
+   other does.
+
+   lazy_until only ever goes down between sweeps, by compare-and-swap.
+   A sweep first sets it back to -1, then takes the list, so a push that
+   races with it leaves lazy_until early at worst, which costs one
+   needless sweep. */
+#define LAZY_LEAD 1000000 /* Nanoseconds */
+
+static int64_t
+lazy_until_load(timer_shard *shard)
+{
+#ifdef _MSC_VER
+    return InterlockedCompareExchange64(
+        (LONG64 volatile*)&shard->lazy_until, 0, 0);
+#else
+    return __atomic_load_n(&shard->lazy_until, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static BOOL
+lazy_until_swap(timer_shard *shard, int64_t expected, int64_t desired)
+{
+#ifdef _MSC_VER
+    return InterlockedCompareExchange64(
+        (LONG64 volatile*)&shard->lazy_until, desired, expected) == expected;
+#else
+    return __atomic_compare_exchange_n(&shard->lazy_until, &expected,
+                                       desired, 0, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_RELAXED);
+#endif
+}
+
+static void
+lazy_until_reset(timer_shard *shard)
+{
+#ifdef _MSC_VER
+    InterlockedExchange64((LONG64 volatile*)&shard->lazy_until, -1);
+#else
+    __atomic_store_n(&shard->lazy_until, -1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Lower lazy_until to deadline, unless it is already earlier. */
+static void
+lazy_until_lower(timer_shard *shard, int64_t deadline)
+{
+    int64_t current;
+
+    do {
+        current = lazy_until_load(shard);
+        if (current >= 0 && current <= deadline)
+            return;
+    } while (!lazy_until_swap(shard, current, deadline));
+}
+
+/* When the shard has to sweep its lazy list, -1 if it is empty. */
+static int64_t
+lazy_sweep_time(timer_shard *shard)
+{
+    int64_t until = lazy_until_load(shard);
+
+    if (until < 0)
+        return -1;
+    return until > LAZY_LEAD ? until - LAZY_LEAD : 0;
+}
+
+static BOOL
+submissions_waiting(timer_shard *shard)
+{
+#ifdef _MSC_VER
+    return *(timer_node* volatile*)&shard->submitted != NULL;
+#else
+    return __atomic_load_n(&shard->submitted, __ATOMIC_SEQ_CST) != NULL;
+#endif
+}
+
+static void
+sleep_until_publish(timer_shard *shard, int64_t value)
+{
+#ifdef _MSC_VER
+    InterlockedExchange64((LONG64 volatile*)&shard->sleep_until, value);
+#else
+    __atomic_store_n(&shard->sleep_until, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static int64_t
+sleep_until_load(timer_shard *shard)
+{
+#ifdef _MSC_VER
+    return InterlockedCompareExchange64(
+        (LONG64 volatile*)&shard->sleep_until, 0, 0);
+#else
+    return __atomic_load_n(&shard->sleep_until, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Move submitted nodes into the queue in submission order, after those
+   deferred earlier, and the lazy ones first if lazy is set. Nodes the
+   queue has no memory for stay deferred, still NODE_SUBMITTED, and those
+   stopped meanwhile go to the shard's dead list. Called with the shard's
+   lock held. */
+static void
+shard_collect_some(timer_shard *shard, BOOL lazy)
+{
+    timer_node *node, *next, *list = NULL, *last = NULL, *dead_last;
+
+    if (lazy && lazy_sweep_time(shard) >= 0) {
+        lazy_until_reset(shard);
+        for (node = submissions_take(&shard->lazy); node != NULL;
+             node = next) {
+            next = node->next;
+            node->next = list;
+            list = node;
+        }
+    }
+    for (node = submissions_take(&shard->submitted); node != NULL;
+         node = next) {
+        next = node->next;
+        node->next = list;
+        list = node;
+    }
+    if (shard->deferred != NULL) {
+        for (node = shard->deferred; node->next != NULL; node = node->next)
+            ;
+        node->next = list;
+        list = shard->deferred;
+        shard->deferred = NULL;
+    }
+    for (dead_last = shard->dead; dead_last != NULL &&
+         dead_last->next != NULL;)
+        dead_last = dead_last->next;
+    for (node = list; node != NULL; node = next) {
+        next = node->next;
+        if (node_state_swap(node, NODE_TOMBSTONE, NODE_CANCELLED)) {
+            node_reap(node);
+            node_append(&shard->dead, &dead_last, node);
+        } else if (queue_insert(node) < 0)
+            node_append(&shard->deferred, &last, node);
+    }
+}
+
+#define shard_collect(shard) shard_collect_some(shard, TRUE)
+
+/* Take a deferred node back. Called with the shard's lock held. */
+static void
+deferred_remove(timer_shard *shard, timer_node *node)
+{
+    timer_node **link = &shard->deferred;
+
+    while (*link != node)
+        link = &(*link)->next;
+    *link = node->next;
+}
+
+/* Interrupt the shard's sleep or spin so it looks at its queue again.
+   Called with the shard's lock held. */
+static void
+shard_wake(timer_shard *shard)
+{
+    shard->woken = TRUE;
+    if (shard->waiter.ops != NULL)
+        shard->waiter.ops->wake(&shard->waiter);
+}
+
+/* Wake shard, if not NULL, to steal from a shard that is behind. It only
+   needs waking if it is asleep. Called without any shard lock. */
+static void
+shard_nudge(timer_shard *shard)
+{
+    if (shard != NULL && sleep_until_load(shard) != 0) {
+        lock_acquire(&shard->lock);
+        shard_wake(shard);
+        lock_release(&shard->lock);
+    }
+}
+
+/* Configuration changes hold every shard's lock, taken in order. */
+static void
+shards_lock(void)
+{
+    int i;
+
+    for (i = 0; i < scheduler.shards; i++)
+        lock_acquire(&shards[i].lock);
+}
+
+static void
+shards_unlock(void)
+{
+    int i;
+
+    for (i = scheduler.shards - 1; i >= 0; i--)
+        lock_release(&shards[i].lock);
+}
+
+/* Move due nodes onto the shard's ready list. Called with its lock
+   held. */
+static void
+shard_ready(timer_shard *shard, timer_node *due, int64_t now)
+{
+    timer_node *node, *next;
+
+    for (node = due; node != NULL; node = next) {
+        next = node->next;
+        node_unqueued(shard, node, NODE_DUE);
+        node->due_time = now;
+        node_append(&shard->ready[node->lane], &shard->ready_last[node->lane],
+                    node);
+        shard->ready_lane[node->lane]++;
+        shard->ready_count++;
+    }
+}
+
+/* Take up to n nodes, all of them if n is 0, off the front of a list of
+   count nodes. Called with the list's lock held. */
+static timer_node *
+nodes_claim(timer_node **first, timer_node **last,
+            volatile Py_ssize_t *count, Py_ssize_t n)
+{
+    timer_node *claimed = *first, *node = claimed;
+    Py_ssize_t i;
+
+    if (n == 0 || n >= *count) {
+        *first = *last = NULL;
+        *count = 0;
+        return claimed;
+    }
+    for (i = 1; i < n; i++)
+        node = node->next;
+    *first = node->next;
+    node->next = NULL;
+    *count -= n;
+    return claimed;
+}
+
+/* Up to count nodes, all of them if count is 0, off the front of the
+   shard's ready lanes, higher ones first. Called with its lock held. */
+static timer_node *
+shard_claim(timer_shard *shard, Py_ssize_t count)
+{
+    timer_node *claimed = NULL, *last = NULL, *part;
+    Py_ssize_t before;
+    int lane;
+
+    for (lane = 0; lane < LANES; lane++) {
+        before = shard->ready_lane[lane];
+        if (before == 0)
+            continue;
+        part = nodes_claim(&shard->ready[lane], &shard->ready_last[lane],
+                           &shard->ready_lane[lane], count);
+        if (last != NULL)
+            last->next = part;
+        else
+            claimed = part;
+        for (last = part; last->next != NULL; last = last->next)
+            ;
+        shard->ready_count -= before - shard->ready_lane[lane];
+        if (count > 0 && (count -= before - shard->ready_lane[lane]) == 0)
+            break;
+    }
+    return claimed;
+}
+
+/* Order a list of due nodes by lane, keeping their order within each. */
+static timer_node *
+lanes_sort(timer_node *due)
+{
+    timer_node *first[LANES] = {NULL}, *last[LANES] = {NULL}, *node, *next;
+    int lane;
+
+    for (node = due; node != NULL; node = next) {
+        next = node->next;
+        node_append(&first[node->lane], &last[node->lane], node);
+    }
+    due = NULL;
+    for (lane = LANES - 1; lane >= 0; lane--) {
+        if (first[lane] != NULL) {
+            last[lane]->next = due;
+            due = first[lane];
+        }
+    }
+    return due;
+}
+
+/* Another shard with ready nodes for thief to take half of, preferring
+   the one with most. The counts are read without the locks, so this is
+   only a hint. */
+static timer_shard *
+shard_victim(timer_shard *thief)
+{
+    timer_shard *victim = NULL;
+    Py_ssize_t most = 1;
+    int i;
+
+    for (i = 0; i < scheduler.shards; i++) {
+        if (&shards[i] != thief && shards[i].ready_count > most) {
+            victim = &shards[i];
+            most = victim->ready_count;
+        }
+    }
+    return victim;
+}
+
+/* A scheduler thread's hold on the GIL, in a thread state of the
+   interpreter it calls into. */
+typedef struct {
+    PyThreadState *tstate; /* Made for a subinterpreter, or NULL */
+    PyGILState_STATE gil_state; /* Of the main interpreter's */
+} interpreter_entry;
+
+/* Take the GIL to call into interp from a thread the engine owns. The
+   main interpreter's thread states are PyGILState's, as they always
+   were. A subinterpreter gets one just for the call, so none is left
+   over when it ends, see interpreter_shutdown. */
+static void
+interpreter_enter(PyInterpreterState *interp, interpreter_entry *entry)
+{
+    if (interp == MAIN_INTERPRETER()) {
+        entry->tstate = NULL;
+        entry->gil_state = PyGILState_Ensure();
+        return;
+    }
+    entry->gil_state = PyGILState_UNLOCKED;
+    entry->tstate = PyThreadState_New(interp);
+    if (entry->tstate == NULL)
+        Py_FatalError("_timer: no memory for a thread state");
+    PyEval_AcquireThread(entry->tstate);
+}
+
+static void
+interpreter_leave(interpreter_entry *entry)
+{
+    if (entry->tstate == NULL) {
+        PyGILState_Release(entry->gil_state);
+        return;
+    }
+    PyThreadState_Clear(entry->tstate);
+    PyThreadState_DeleteCurrent();
+}
+
+/* Run the callbacks of due nodes that need the GIL, which became ready
+   at ready. One GIL acquisition per batch_limit callbacks, so Python
+   threads get a turn in between, and per interpreter, those of others
+   wait for the next. Called without any lock. */
+static void
+deliver_with_gil(timer_node *due, int64_t ready)
+{
+    interpreter_entry entry;
+    PyInterpreterState *interp;
+    timer_node *node, *rest, **tail;
+    int64_t gil_time;
+    Py_ssize_t count;
+
+    due = lanes_sort(due);
+    while (due != NULL) {
+        interp = due->timer->interp;
+        interpreter_enter(interp, &entry);
+        gil_time = timer_clock_ns();
+        COUNTER_ADD(stats.gil_wait_ns, gil_time - ready);
+        rest = NULL;
+        tail = &rest;
+        for (count = 0; due != NULL; ) {
+            node = due;
+            due = node->next;
+            if (scheduler.batch_limit != 0 &&
+                count >= scheduler.batch_limit) {
+                *tail = node; /* The rest as they are */
+                tail = NULL;
+                break;
+            }
+            if (node->timer->interp != interp) {
+                *tail = node;
+                tail = &node->next;
+                continue;
+            }
+            Timer_expire(node, gil_time);
+            count++;
+        }
+        if (tail != NULL)
+            *tail = NULL;
+        interpreter_leave(&entry);
+        due = rest;
+        if (due != NULL)
+            ready = timer_clock_ns();
+    }
+}
+
+/* The worker whose thread this is, if any. */
+static THREAD_LOCAL timer_worker *current_worker;
+
+/* Wake a worker to look for nodes to take. NULL is ignored. */
+static void
+worker_nudge(timer_worker *worker)
+{
+    if (worker == NULL)
+        return;
+    lock_acquire(&worker->lock);
+    worker->nudged = TRUE;
+    cond_signal(&worker->cond);
+    lock_release(&worker->lock);
+}
+
+/* Threads the pool may run, autoscaled or not. */
+static int
+workers_threads(void)
+{
+    return workers_ceiling > workers_floor ? workers_ceiling : workers_floor;
+}
+
+#ifdef MS_WINDOWS
+DWORD WINAPI worker_win32_thread(LPVOID data);
+#elif defined(UNIX)
+void *worker_posix_thread(void *data);
+#endif
+
+/* Have a thread run worker: the one it has if that hasn't left its loop
+   yet, else a new one, once the old is joined. Returns FALSE if the OS
+   wouldn't start one or workers_stop closed the worker. Called with
+   workers_lock held, without the GIL. */
+static BOOL
+worker_open(timer_worker *worker)
+{
+    BOOL alive;
+
+    if (worker->index >= workers_limit)
+        return FALSE;
+    lock_acquire(&worker->lock);
+    alive = worker->running && !worker->exited;
+    if (alive)
+        worker->open = TRUE;
+    lock_release(&worker->lock);
+    if (alive)
+        return TRUE;
+    if (worker->running) {
+        thread_join(worker->thread);
+        worker->running = FALSE;
+    }
+
+    lock_acquire(&worker->lock);
+    worker->open = TRUE;
+    worker->exited = FALSE;
+#ifdef MS_WINDOWS
+    worker->running = thread_start(&worker->thread, worker_win32_thread,
+                                   worker);
+#elif defined(UNIX)
+    worker->running = thread_start(&worker->thread, worker_posix_thread,
+                                   worker);
+#endif
+    if (!worker->running)
+        worker->open = FALSE;
+    lock_release(&worker->lock);
+    if (worker->running)
+        COUNTER_ADD(threads_started, 1);
+    return worker->running;
+}
+
+/* Join worker's thread if it left the pool. Called without any lock. */
+static void
+worker_reap(timer_worker *worker)
+{
+    timer_thread thread;
+    BOOL exited;
+
+    lock_acquire(&workers_lock);
+    lock_acquire(&worker->lock);
+    exited = worker->running && worker->exited;
+    if (exited)
+        worker->exited = FALSE;
+    lock_release(&worker->lock);
+    if (exited) {
+        thread = worker->thread;
+        worker->running = FALSE;
+    }
+    lock_release(&workers_lock);
+    /* It only has to return. */
+    if (exited)
+        thread_join(thread);
+}
+
+/* worker_reap() the workers from first on. exited is only read as a hint
+   here, most are running or never were. */
+static void
+workers_reap(int first)
+{
+    int i;
+
+    for (i = first; i < workers_limit; i++) {
+        if (workers[i].exited)
+            worker_reap(&workers[i]);
+    }
+}
+
+/* Close the workers from first up to last. Their threads end once they
+   have run what they were handed, without anyone waiting for them. */
+static void
+workers_close(int first, int last)
+{
+    timer_worker *worker;
+    int i;
+
+    for (i = first; i < last; i++) {
+        worker = &workers[i];
+        lock_acquire(&worker->lock);
+        worker->open = FALSE;
+        cond_signal(&worker->cond);
+        lock_release(&worker->lock);
+    }
+}
+
+/* Move scheduler.workers from expected to desired, unless another thread
+   got there first, and count it. Workers and shards both do, without the
+   GIL. */
+static BOOL
+workers_swap(int expected, int desired)
+{
+    int64_t *counter = desired > expected ? &workers_grown : &workers_shrunk;
+
+#ifdef _MSC_VER
+    if (InterlockedCompareExchange((LONG volatile*)&scheduler.workers,
+                                   desired, expected) != expected)
+        return FALSE;
+    InterlockedIncrement64((LONG64 volatile*)counter);
+#else
+    if (!__atomic_compare_exchange_n(&scheduler.workers, &expected, desired,
+                                     0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return FALSE;
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+#endif
+    return TRUE;
+}
+
+/* Bring the worker after the n in use into the pool, with a thread.
+   Returns it, or NULL if the pool is at workers_max, changed meanwhile or
+   has no thread for it. Called without any lock. */
+static timer_worker *
+worker_grow(int n)
+{
+    BOOL opened;
+
+    if (n >= workers_ceiling || !workers_swap(n, n + 1))
+        return NULL;
+    lock_acquire(&workers_lock);
+    opened = worker_open(&workers[n]);
+    lock_release(&workers_lock);
+    if (!opened) {
+        /* Closed, dispatch passes it by if it stays in. */
+        workers_swap(n + 1, n);
+        return NULL;
+    }
+    return &workers[n];
+}
+
+/* Whether worker is the last of the pool and autoscaling may let it go. */
+static BOOL
+worker_may_leave(timer_worker *worker)
+{
+    return workers_ceiling > workers_floor &&
+           worker->index >= workers_floor &&
+           worker->index == scheduler.workers - 1;
+}
+
+/* Hand due nodes to the least busy worker. Returns FALSE if there is no
+   pool, or no room in it, and the caller has to run them. */
+static BOOL
+worker_dispatch(timer_node *due)
+{
+    timer_worker *worker = NULL, *grown;
+    timer_node *node;
+    Py_ssize_t count = 0, shortest = 0;
+    int64_t late;
+    int i, n = scheduler.workers;
+    BOOL taken = FALSE;
+
+    /* The counts are read without the locks, only to pick one. */
+    for (i = 0; i < n; i++) {
+        if (workers[i].count == 0 && !workers[i].busy) {
+            worker = &workers[i];
+            break;
+        }
+        if (worker == NULL || workers[i].count < shortest) {
+            worker = &workers[i];
+            shortest = worker->count;
+        }
+    }
+    /* None idle, and the pool falls behind, or there is none yet and
+       this batch is late: one more worker, if there is room for it. */
+    if (n < workers_ceiling &&
+        (worker == NULL || worker->count > 0 || worker->busy)) {
+        late = worker != NULL ? worker->late :
+                                timer_clock_ns() - due->deadline;
+        if (shortest >= WORKER_GROW_DEPTH || late > WORKER_GROW_LATE) {
+            grown = worker_grow(n);
+            if (grown != NULL)
+                worker = grown;
+        }
+    }
+    if (worker == NULL)
+        return FALSE;
+
+    for (node = due; node != NULL; node = node->next)
+        count++;
+    lock_acquire(&worker->lock);
+    if (worker->open && worker->count + count <= WORKER_QUEUE_LIMIT) {
+        if (worker->first == NULL)
+            worker->first = due;
+        else
+            worker->last->next = due;
+        for (node = due; node->next != NULL; node = node->next)
+            ;
+        worker->last = node;
+        worker->count += count;
+        cond_signal(&worker->cond);
+        taken = TRUE;
+    }
+    lock_release(&worker->lock);
+    return taken;
+}
+
+/* Take half of the longest other queue for thief, at most a batch.
+   Returns NULL if there's nothing worth taking. Called without any
+   lock. */
+static timer_node *
+worker_steal(timer_worker *thief)
+{
+    timer_worker *victim = NULL;
+    timer_node *due;
+    Py_ssize_t most = 0, count;
+    int i, n = scheduler.workers;
+
+    for (i = 0; i < n; i++) {
+        if (&workers[i] != thief && workers[i].count > most) {
+            victim = &workers[i];
+            most = victim->count;
+        }
+    }
+    if (victim == NULL)
+        return NULL;
+
+    lock_acquire(&victim->lock);
+    count = (victim->count + 1) / 2;
+    if (scheduler.batch_limit > 0 && count > scheduler.batch_limit)
+        count = scheduler.batch_limit;
+    due = count > 0 ? nodes_claim(&victim->first, &victim->last,
+                                  &victim->count, count) : NULL;
+    lock_release(&victim->lock);
+    return due;
+}
+
+/* The next worker in the pool after worker, or NULL if it is alone. */
+static timer_worker *
+worker_neighbour(timer_worker *worker)
+{
+    int n = scheduler.workers;
+
+    if (n < 2 || worker->index >= n)
+        return NULL;
+    return &workers[(worker->index + 1) % n];
+}
+
+/* A worker thread. It runs its queue a batch at a time, helps the others
+   when that is empty, and once asked to stop, or out of the pool, ends
+   after running what is left in it. */
+static void
+worker_run(timer_worker *worker)
+{
+    timer_worker *neighbour, *grown;
+    timer_node *due;
+    int64_t idle;
+    BOOL grow;
+
+    current_worker = worker;
+    lock_acquire(&worker->lock);
+    while (worker->open || worker->first != NULL) {
+        if (worker->first == NULL) {
+            worker->nudged = FALSE;
+            lock_release(&worker->lock);
+            /* Those after it may have left. */
+            workers_reap(worker->index + 1);
+            due = worker_steal(worker);
+            if (due != NULL) {
+                worker->late = timer_clock_ns() - due->deadline;
+                worker->busy = TRUE;
+                deliver_with_gil(due, due->due_time);
+                worker->busy = FALSE;
+            }
+            lock_acquire(&worker->lock);
+            /* A nudge while it was looking means there may be more. */
+            if (due == NULL && worker->open && worker->first == NULL &&
+                !worker->nudged) {
+                if (!worker_may_leave(worker)) {
+                    cond_wait(&worker->cond, &worker->lock, -1);
+                    continue;
+                }
+                /* On the real clock, the virtual one may stand still. */
+                idle = real_clock_ns();
+                cond_wait_real(&worker->cond, &worker->lock,
+                               idle + workers_idle);
+                if (worker->first != NULL || worker->nudged ||
+                    real_clock_ns() - idle < workers_idle ||
+                    !worker_may_leave(worker) ||
+                    !workers_swap(worker->index + 1, worker->index))
+                    continue;
+                /* Out of the pool, so the thread ends, unless it is
+                   brought back first. The one now last may leave in
+                   turn, and joins this. */
+                worker->open = FALSE;
+                lock_release(&worker->lock);
+                if (worker->index > 0)
+                    worker_nudge(&workers[worker->index - 1]);
+                lock_acquire(&worker->lock);
+            }
+            continue;
+        }
+        due = nodes_claim(&worker->first, &worker->last, &worker->count,
+                          scheduler.batch_limit);
+        neighbour = worker->count > 0 ? worker_neighbour(worker) : NULL;
+        worker->late = timer_clock_ns() - due->deadline;
+        grow = worker->count > 0 && worker->late > WORKER_GROW_LATE;
+        worker->busy = TRUE;
+        lock_release(&worker->lock);
+        /* Behind with more queued: one more worker takes half of it. */
+        if (grow) {
+            grown = worker_grow(scheduler.workers);
+            if (grown != NULL)
+                neighbour = grown;
+        }
+        worker_nudge(neighbour);
+        deliver_with_gil(due, due->due_time);
+        worker->busy = FALSE;
+        lock_acquire(&worker->lock);
+    }
+    worker->exited = TRUE;
+    lock_release(&worker->lock);
+    current_worker = NULL;
+}
+
+#ifdef MS_WINDOWS
+DWORD WINAPI
+worker_win32_thread(LPVOID data)
+{
+    worker_run((timer_worker*)data);
+    return 0;
+}
+#endif /* MS_WINDOWS */
+
+#ifdef UNIX
+void *
+worker_posix_thread(void *data)
+{
+    worker_run((timer_worker*)data);
+    return NULL;
+}
+#endif /* UNIX */
+
+/* Start the threads of the scheduler.workers workers in use that have
+   none, the rest start as the pool grows. The GIL must be held. On
+   failure, set an exception and return FALSE; those started stay so. */
+static BOOL
+workers_start(void)
+{
+    BOOL started = TRUE;
+    int i;
+
+#if PY_VERSION_HEX < 0x03070000
+    PyEval_InitThreads();
+#endif
+
+    lock_acquire(&workers_lock);
+    workers_limit = workers_threads();
+    for (i = 0; i < scheduler.workers && started; i++)
+        started = worker_open(&workers[i]);
+    lock_release(&workers_lock);
+    if (!started) {
+#ifdef MS_WINDOWS
+        PyErr_SetString(PyExc_WindowsError,
+                        "CreateThread error. Unable to start worker thread");
+#elif defined(UNIX)
+        PyErr_SetString(PyExc_OSError,
+                        "pthread_create error. Unable to start worker thread");
+#endif
+    }
+    return started;
+}
+
+/* Stop the threads of the workers from first on, once they have run what
+   they were handed, and keep the pool from starting them again. The GIL
+   must be held; it is released while waiting, since they need it to
+   finish. */
+static void
+workers_stop(int first)
+{
+    timer_worker *worker;
+    timer_thread thread;
+    BOOL running;
+    int i;
+
+    lock_acquire(&workers_lock);
+    workers_limit = first;
+    workers_close(first, MAX_WORKERS);
+    lock_release(&workers_lock);
+
+    Py_BEGIN_ALLOW_THREADS
+    for (i = first; i < MAX_WORKERS; i++) {
+        worker = &workers[i];
+        lock_acquire(&workers_lock);
+        running = worker->running;
+        thread = worker->thread;
+        worker->running = worker->exited = FALSE;
+        lock_release(&workers_lock);
+        if (running)
+            thread_join(thread);
+    }
+    Py_END_ALLOW_THREADS
+}
+
+/* Run claimed due nodes, which became ready at ready, or hand them to the
+   worker pool. Called without any shard lock. */
+static void
+scheduler_deliver(timer_node *due, int64_t ready)
+{
+    due = deliver_elsewhere(due);
+    if (due != NULL && !worker_dispatch(due))
+        deliver_with_gil(due, ready);
+}
+
+static void
+scheduler_run(timer_shard *shard)
+{
+    timer_queue *queue = &shard->queue;
+    timer_shard *victim, *neighbour;
+    timer_waiter waiter;
+    timer_node *due;
+    int64_t now, next, wake, ready, margin, spins, sweep;
+    Py_ssize_t count;
+
+    lock_acquire(&shard->lock);
+    while (!scheduler.shutdown) {
+#ifdef HAVE_NUMA
+        if (shard->numa_stale) {
+            shard->numa_stale = FALSE;
+            shard->numa_node = current_numa_node();
+        }
+#endif
+        if (shard->retired.ops != NULL) {
+            shard->retired.ops->fini(&shard->retired);
+            shard->retired.ops = NULL;
+        }
+        sweep = lazy_sweep_time(shard);
+        shard_collect_some(shard, sweep >= 0 && sweep <= timer_clock_ns());
+
+        if (shard->dead != NULL) {
+            due = shard->dead;
+            shard->dead = NULL;
+            lock_release(&shard->lock);
+            scheduler_deliver(due, timer_clock_ns());
+            lock_acquire(&shard->lock);
+            continue;
+        }
+
+        if (shard->compact) {
+            due = shard_compact(shard, timer_clock_ns());
+            if (due != NULL) {
+                lock_release(&shard->lock);
+                scheduler_deliver(due, timer_clock_ns());
+                lock_acquire(&shard->lock);
+            }
+            continue;
+        }
+
+        if (virtual_clock) {
+            /* advance() fires the timers until the real clock is back. */
+            waiter = shard->waiter;
+#ifdef MS_WINDOWS
+            shard_resolution(shard, FALSE);
+#endif
+            waiter.ops->wait(&waiter, &shard->lock, -1);
+            continue;
+        }
+
+        next = queue->ops->next(queue);
+        /* The lazy list needs attention by its sweep, like a deadline. */
+        sweep = lazy_sweep_time(shard);
+        if (sweep >= 0 && (next < 0 || sweep < next))
+            next = sweep;
+        now = timer_clock_ns();
+        if (shard->index == 0 && page != NULL && now >= page_due) {
+            stats_page_update(now);
+            page_due = now + page->interval_ns;
+        }
+#ifdef MS_WINDOWS
+        if (shard->index == 0)
+            coarse_publish(now);
+#endif
+        if (shard->index == 0 && now >= wall_due)
+            wall_resync();
+        if (next < 0 || next > now) {
+            /* Nothing of its own to do, so help a shard that is behind. */
+            victim = scheduler.shards > 1 ? shard_victim(shard) : NULL;
+            if (victim != NULL) {
+                lock_release(&shard->lock);
+                lock_acquire(&victim->lock);
+                /* A batch at a time, its own timers may come due. */
+                count = victim->ready_count / 2;
+                if (count > STEAL_THRESHOLD)
+                    count = STEAL_THRESHOLD;
+                due = count > 0 ? shard_claim(victim, count) : NULL;
+                /* Still behind, so pass the word on. */
+                neighbour = &shards[(shard->index + 1) % scheduler.shards];
+                if (victim->ready_count <= STEAL_THRESHOLD ||
+                    neighbour == victim)
+                    neighbour = NULL;
+                lock_release(&victim->lock);
+                shard_nudge(neighbour);
+                if (due != NULL)
+                    scheduler_deliver(due, timer_clock_ns());
+                lock_acquire(&shard->lock);
+                continue;
+            }
+
+            shard->woken = FALSE;
+            sleep_until_publish(shard, next);
+            sweep = lazy_sweep_time(shard);
+            if (submissions_waiting(shard) ||
+                (sweep >= 0 && (next < 0 || sweep < next))) {
+                /* Pushed before the submitter could see sleep_until. */
+                shard->sleep_until = 0;
+                continue;
+            }
+            margin = shard_margin(shard);
+            if (next < 0 || next - now > margin) {
+                wake = next < 0 ? -1 : next - margin;
+                /* The stats page is refreshed even when nothing is due. */
+                if (shard->index == 0 && page != NULL &&
+                    (wake < 0 || page_due < wake))
+                    wake = page_due;
+                /* Deferred nodes are retried while memory may come back. */
+                if (shard->deferred != NULL &&
+                    (wake < 0 || wake > now + 1000000))
+                    wake = now + 1000000;
+                /* Wait on a copy, configure() may swap the backend. */
+                waiter = shard->waiter;
+#ifdef MS_WINDOWS
+                shard_resolution(shard, next >= 0 &&
+                                 next - now < RESOLUTION_HORIZON &&
+                                 waiter_coarse(&waiter));
+#endif
+                waiter.window = shard->window;
+                waiter.ops->wait(&waiter, &shard->lock, wake);
+                shard->wakeups++;
+                if (wake >= 0 && !shard->woken)
+                    shard_learn(shard, timer_clock_ns() - wake);
+            } else {
+                /* Spin without the lock so timers can still be submitted.
+                   One due earlier than next stops the spin. */
+                lock_release(&shard->lock);
+                spins = spin_until(next, &shard->woken);
+                lock_acquire(&shard->lock);
+                shard->spins += spins;
+            }
+            shard->sleep_until = 0;
+            continue;
+        }
+
+        /* Detach everything that is due, then run the callbacks without
+           holding the lock so other threads can keep submitting, and
+           sleeping shards can take a share. */
+        due = queue->ops->pop_due(queue, now);
+        if (due == NULL)
+            continue;
+        shard_ready(shard, due, now);
+        neighbour = NULL;
+        if (scheduler.shards > 1 && shard->ready_count > STEAL_THRESHOLD)
+            neighbour = &shards[(shard->index + 1) % scheduler.shards];
+
+        ready = now;
+        while ((due = shard_claim(shard, scheduler.batch_limit)) != NULL) {
+            lock_release(&shard->lock);
+            shard_nudge(neighbour);
+            neighbour = NULL;
+            scheduler_deliver(due, ready);
+            ready = timer_clock_ns();
+            lock_acquire(&shard->lock);
+        }
+    }
+#ifdef MS_WINDOWS
+    shard_resolution(shard, FALSE);
+#endif
+    lock_release(&shard->lock);
+}
+
+#ifdef MS_WINDOWS
+DWORD WINAPI
+scheduler_win32_thread(LPVOID data)
+{
+    scheduler_run((timer_shard*)data);
+    return 0;
+}
+#endif /* MS_WINDOWS */
+
+#ifdef UNIX
+void *
+scheduler_posix_thread(void *data)
+{
+    scheduler_run((timer_shard*)data);
+    return NULL;
+}
+#endif /* UNIX */
+
+/* Timers started with start_at_wall() wait in the wall queue, a list
+   sorted by their deadline on the system clock, instead of a shard's.
+   Its thread sleeps on that clock itself, which the kernel keeps to
+   however the clock is set: a timerfd on CLOCK_REALTIME on Linux, which
+   TFD_TIMER_CANCEL_ON_SET also wakes when the clock is set so wall_ns()
+   gets a new reference right away, an absolute waitable timer on
+   Windows. Elsewhere it checks the clock at least once a second. Once
+   due, a node is handed to its shard to expire now, so between fires
+   the jobs waiting in it cost nothing. */
+#define WALL_CHECK 1000000000 /* Nanoseconds, without a clock timer */
+
+static timer_lock wall_lock;
+static timer_node *wall_first; /* Soonest first, linked by next and prev */
+static Py_ssize_t wall_count;
+static Py_ssize_t clock_changes; /* Clock set notifications seen */
+static BOOL wall_running, wall_stopping;
+static timer_thread wall_thread;
+#ifdef MS_WINDOWS
+static HANDLE wall_timer, wall_event;
+#elif defined(HAVE_TIMERFD)
+static int wall_fd = -1;
+#else
+static timer_cond wall_cond;
+#endif
+
+/* Have the thread wake at deadline on the system clock, or only when
+   woken if it is -1. Called with wall_lock held. */
+static void
+wall_arm(int64_t deadline)
+{
+#ifdef MS_WINDOWS
+    LARGE_INTEGER due;
+
+    if (deadline < 0) {
+        CancelWaitableTimer(wall_timer);
+        return;
+    }
+    /* Positive due times are absolute, in FILETIME units. */
+    due.QuadPart = deadline / 100 + FILETIME_EPOCH;
+    SetWaitableTimer(wall_timer, &due, 0, NULL, NULL, FALSE);
+#elif defined(HAVE_TIMERFD)
+    struct itimerspec spec;
+
+    /* Armed, however far off, so that setting the clock still wakes it. */
+    memset(&spec, 0, sizeof(spec));
+    ns_to_timespec(deadline < 0 ? INT64_MAX / 2 : deadline > 0 ? deadline : 1,
+                   &spec.it_value);
+    timerfd_settime(wall_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                    &spec, NULL);
+#else
+    cond_signal(&wall_cond);
+#endif
+}
+
+/* Sleep until the first deadline or a wake-up. Called with wall_lock
+   held, which is released meanwhile. */
+static void
+wall_wait(void)
+{
+#ifdef MS_WINDOWS
+    HANDLE handles[2];
+
+    handles[0] = wall_timer;
+    handles[1] = wall_event;
+    lock_release(&wall_lock);
+    WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+    lock_acquire(&wall_lock);
+#elif defined(HAVE_TIMERFD)
+    uint64_t expirations;
+
+    lock_release(&wall_lock);
+    if (read(wall_fd, &expirations, sizeof(expirations)) < 0 &&
+        errno == ECANCELED) {
+        clock_changes++;
+        wall_resync();
+    }
+    lock_acquire(&wall_lock);
+#else
+    wall_reference ref;
+    int64_t sleep = WALL_CHECK;
+
+    if (wall_first != NULL) {
+        wall_sample(&ref);
+        if (wall_first->deadline - ref.wall < sleep)
+            sleep = wall_first->deadline - ref.wall;
+    }
+    cond_wait(&wall_cond, &wall_lock, timer_clock_ns() + sleep);
+#endif
+}
+
+static void
+wall_run(void)
+{
+    wall_reference ref;
+    timer_node *node;
+    int64_t now;
+
+    lock_acquire(&wall_lock);
+    while (!wall_stopping) {
+        wall_sample(&ref);
+        while (wall_first != NULL && wall_first->deadline <= ref.wall) {
+            node = wall_first;
+            wall_first = node->next;
+            if (wall_first != NULL)
+                wall_first->prev = NULL;
+            wall_count--;
+            /* Still under the lock, so a cancel finds it either here or
+               submitted. The Timer's deadline goes too, or it would be
+               postponed to the estimate made when it started. */
+            now = timer_clock_ns();
+            node->deadline = now;
+            node->timer->deadline = now;
+            scheduler_submit(node, now);
+        }
+        wall_arm(wall_first != NULL ? wall_first->deadline : -1);
+        wall_wait();
+    }
+    lock_release(&wall_lock);
+}
+
+#ifdef MS_WINDOWS
+DWORD WINAPI
+wall_win32_thread(LPVOID data)
+{
+    wall_run();
+    return 0;
+}
+#elif defined(UNIX)
+static void *
+wall_posix_thread(void *data)
+{
+    wall_run();
+    return NULL;
+}
+#endif
+
+/* Start the wall queue's thread if it isn't running. The GIL must be
+   held. Returns FALSE with an exception set on failure. */
+static BOOL
+wall_start(void)
+{
+    if (wall_running)
+        return TRUE;
+#ifdef MS_WINDOWS
+    if (wall_timer == NULL) {
+        wall_timer = CreateWaitableTimer(NULL, FALSE, NULL);
+        wall_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (wall_timer == NULL || wall_event == NULL) {
+            PyErr_SetFromWindowsErr(0);
+            return FALSE;
+        }
+    }
+    if (!thread_start(&wall_thread, wall_win32_thread, NULL)) {
+        PyErr_SetString(PyExc_WindowsError,
+                        "CreateThread error. Unable to start wall clock thread");
+        return FALSE;
+    }
+#elif defined(UNIX)
+#ifdef HAVE_TIMERFD
+    if (wall_fd < 0) {
+        wall_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+        if (wall_fd < 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return FALSE;
+        }
+    }
+#endif
+    if (!thread_start(&wall_thread, wall_posix_thread, NULL)) {
+        PyErr_SetString(PyExc_OSError,
+                        "pthread_create error. Unable to start wall clock thread");
+        return FALSE;
+    }
+#endif
+    wall_running = TRUE;
+    threads_started++;
+    return TRUE;
+}
+
+/* Stop the thread, leaving the queue for the next wall_start(). The GIL
+   must be held. */
+static void
+wall_stop(void)
+{
+    if (!wall_running)
+        return;
+    lock_acquire(&wall_lock);
+    wall_stopping = TRUE;
+#ifdef MS_WINDOWS
+    SetEvent(wall_event);
+#else
+    wall_arm(0);
+#endif
+    lock_release(&wall_lock);
+    Py_BEGIN_ALLOW_THREADS
+#ifdef MS_WINDOWS
+    WaitForSingleObject(wall_thread, INFINITE);
+    CloseHandle(wall_thread);
+#elif defined(UNIX)
+    pthread_join(wall_thread, NULL);
+#endif
+    Py_END_ALLOW_THREADS
+    wall_stopping = FALSE;
+    wall_running = FALSE;
+}
+
+/* Queue a node whose deadline is on the wall clock. */
+static void
+wall_insert(timer_node *node)
+{
+    timer_node *before = NULL, *after;
+
+    lock_acquire(&wall_lock);
+    node->state = NODE_WALL;
+    for (after = wall_first; after != NULL && after->deadline <= node->deadline;
+         after = after->next)
+        before = after;
+    node->prev = before;
+    node->next = after;
+    if (after != NULL)
+        after->prev = node;
+    if (before != NULL)
+        before->next = node;
+    else {
+        wall_first = node;
+        wall_arm(node->deadline);
+    }
+    wall_count++;
+    lock_release(&wall_lock);
+}
+
+/* Take a node out of the wall queue, returning it, or NULL if the thread
+   already handed it to its shard. */
+static timer_node *
+wall_cancel(timer_node *node)
+{
+    lock_acquire(&wall_lock);
+    if (node->state != NODE_WALL) {
+        lock_release(&wall_lock);
+        return NULL;
+    }
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        wall_first = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    node->state = NODE_CANCELLED;
+    wall_count--;
+    lock_release(&wall_lock);
+    return node;
+}
+
+#ifdef UNIX
+/* Fork support, for pre-fork servers. Before fork() the forking thread
+   takes every engine lock, so the child gets them in a consistent state
+   and unlocks them again. None of the engine's threads exist in the
+   child: it forgets them, and the waiters they slept in, and starts new
+   ones once it has dealt with the timers it inherited, see fork_settle.
+   Nodes a thread had claimed when the process forked are lost to the
+   child. Channel locks aren't taken, a Channel belongs to one process. */
+static void
+fork_prepare(void)
+{
+    int i;
+
+    /* First, its thread takes a shard's lock while holding it. */
+    lock_acquire(&wall_lock);
+    shards_lock();
+    for (i = 0; i < ARENAS; i++)
+        lock_acquire(&arenas[i].lock);
+    lock_acquire(&main_lock);
+    lock_acquire(&workers_lock);
+    for (i = 0; i < MAX_WORKERS; i++)
+        lock_acquire(&workers[i].lock);
+}
+
+static void
+fork_parent(void)
+{
+    int i;
+
+    for (i = MAX_WORKERS - 1; i >= 0; i--)
+        lock_release(&workers[i].lock);
+    lock_release(&workers_lock);
+    lock_release(&main_lock);
+    for (i = ARENAS - 1; i >= 0; i--)
+        lock_release(&arenas[i].lock);
+    shards_unlock();
+    lock_release(&wall_lock);
+}
+
+/* Forget a waiter whose thread didn't survive the fork. That may have
+   been blocked on the condition variable, which then can't be destroyed,
+   only abandoned. */
+static void
+fork_forget_waiter(timer_waiter *waiter)
+{
+    if (waiter->ops == NULL)
+        return;
+    if (waiter->ops == &condvar_backend)
+        free(waiter->data);
+    else
+        waiter->ops->fini(waiter);
+    waiter->ops = NULL;
+}
+
+static void
+fork_child(void)
+{
+    timer_worker *worker;
+    timer_shard *shard;
+    int i;
+
+    for (i = MAX_WORKERS - 1; i >= 0; i--) {
+        worker = &workers[i];
+        lock_release(&worker->lock);
+        cond_init(&worker->cond);
+        worker->busy = worker->nudged = FALSE;
+        worker->open = worker->running = FALSE;
+    }
+    lock_release(&workers_lock);
+    lock_release(&main_lock);
+    for (i = ARENAS - 1; i >= 0; i--)
+        lock_release(&arenas[i].lock);
+    for (i = 0; i < scheduler.shards; i++) {
+        shard = &shards[i];
+        fork_forget_waiter(&shard->waiter);
+        fork_forget_waiter(&shard->retired);
+        shard->sleep_until = 0;
+        shard->woken = FALSE;
+        shard->running = FALSE;
+    }
+    /* Both are shared with the parent, which keeps writing them. */
+    page = NULL;
+    unmap_file(&page_file);
+    trace = NULL;
+    unmap_file(&trace_file);
+    /* Any writers were on threads the child doesn't have. */
+    trace_writers = 0;
+    /* A thread may have been taking a wall time reference. */
+    wall_writing = 0;
+    /* The parent's wall queue thread sleeps on the same timer. */
+    wall_running = wall_stopping = FALSE;
+#ifdef HAVE_TIMERFD
+    close(wall_fd);
+    wall_fd = -1;
+#else
+    cond_init(&wall_cond);
+#endif
+
+    scheduler.started = FALSE;
+    scheduler.shutdown = FALSE;
+    scheduler.forked = TRUE;
+    shards_unlock();
+    lock_release(&wall_lock);
+}
+
+#endif /* UNIX */
+
+/* Whether node is of a Timer made in interp, any if interp is NULL. A
+   tombstone's Timer may be gone already, it is nobody's. */
+#define NODE_OF(node, interp) \
+    ((node)->timer != NULL && (node)->state != NODE_TOMBSTONE && \
+     ((interp) == NULL || (node)->timer->interp == (interp)))
+
+/* Move the nodes of interp's Timers off a list onto *dropped. count may
+   be NULL, last too for a list that doesn't keep one. */
+static void
+timers_drop(PyInterpreterState *interp, timer_node **first,
+            timer_node **last, volatile Py_ssize_t *count,
+            timer_node **dropped)
+{
+    timer_node *node, *next, *kept_last = NULL;
+
+    node = *first;
+    *first = NULL;
+    for (; node != NULL; node = next) {
+        next = node->next;
+        if (!NODE_OF(node, interp)) {
+            node_append(first, &kept_last, node);
+            continue;
+        }
+        node->next = *dropped;
+        *dropped = node;
+        if (count != NULL)
+            (*count)--;
+    }
+    if (last != NULL)
+        *last = kept_last;
+}
+
+/* Take the Timers made in interp, or every one if it is NULL, off the
+   scheduler as if stopped: after a fork under the "discard" policy, or
+   when a subinterpreter ends. C API handles stay, their owners still
+   expect them to run or be cancelled. The GIL must be held, and the
+   scheduler threads stopped. */
+static void
+timers_discard(PyInterpreterState *interp)
+{
+    timer_shard *shard;
+    timer_queue kept;
+    timer_node *node, *next, *dropped = NULL, *last;
+    Timer *self;
+    int i, lane;
+
+    shards_lock();
+    for (i = 0; i < scheduler.shards; i++) {
+        shard = &shards[i];
+        for (lane = 0; lane < LANES; lane++) {
+            shard->ready_count -= shard->ready_lane[lane];
+            timers_drop(interp, &shard->ready[lane],
+                        &shard->ready_last[lane], &shard->ready_lane[lane],
+                        &dropped);
+            shard->ready_count += shard->ready_lane[lane];
+        }
+        if (shard->queue.ops == NULL)
+            continue;
+        shard_collect(shard);
+        timers_drop(interp, &shard->deferred, NULL, NULL, &dropped);
+        timers_drop(interp, &shard->dead, NULL, NULL, &dropped);
+        /* A queue can only be emptied all at once by popping it at the
+           end of time, so what stays goes into a fresh one. */
+        if (queue_init(&kept, shard->queue.ops, timer_clock_ns()) < 0)
+            continue; /* Out of memory, keep them all */
+        for (last = shard->deferred; last != NULL && last->next != NULL;)
+            last = last->next;
+        node = shard->queue.ops->pop_due(&shard->queue, INT64_MAX);
+        for (; node != NULL; node = next) {
+            next = node->next;
+            if (NODE_OF(node, interp)) {
+                node_unqueued(shard, node, NODE_CANCELLED);
+                node->next = dropped;
+                dropped = node;
+            } else if (kept.ops->insert(&kept, node) < 0) {
+                node_unqueued(shard, node, NODE_SUBMITTED);
+                node_append(&shard->deferred, &last, node);
+            }
+        }
+        shard->queue.ops->fini(&shard->queue);
+        shard->queue = kept;
+    }
+    shards_unlock();
+
+    for (i = 0; i < MAX_WORKERS; i++)
+        timers_drop(interp, &workers[i].first, &workers[i].last,
+                    &workers[i].count, &dropped);
+    timers_drop(interp, &main_first, &main_last, NULL, &dropped);
+    /* The wall queue only has Timers, linked both ways. */
+    lock_acquire(&wall_lock);
+    for (node = wall_first; node != NULL; node = next) {
+        next = node->next;
+        if (!NODE_OF(node, interp))
+            continue;
+        if (node->prev != NULL)
+            node->prev->next = next;
+        else
+            wall_first = next;
+        if (next != NULL)
+            next->prev = node->prev;
+        node->state = NODE_CANCELLED;
+        wall_count--;
+        node->next = dropped;
+        dropped = node;
+    }
+    lock_release(&wall_lock);
+
+    /* Without the locks, releasing a Timer can run arbitrary code. */
+    while (dropped != NULL) {
+        node = dropped;
+        dropped = node->next;
+        self = node->timer;
+        if (self->node == node) {
+            self->node = NULL;
+            self->started = FALSE;
+        }
+        node_done(node);
+    }
+}
+
+#ifdef UNIX
+/* Deal with the timers inherited over a fork, once, before the child's
+   scheduler starts. The GIL must be held. */
+static void
+fork_settle(void)
+{
+    if (!scheduler.forked)
+        return;
+    scheduler.forked = FALSE;
+    if (scheduler.fork_policy == FORK_DISCARD)
+        timers_discard(NULL);
+    else if (main_first != NULL)
+        /* The parent's pending call didn't necessarily come along. */
+        Py_AddPendingCall(main_drain, NULL);
+}
+#endif /* UNIX */
+
+/* Scheduler thread placement, see configure(affinity=, realtime=). Shard
+   i is pinned to affinity_cpus[i % affinity_count], or left where the OS
+   puts it when the count is 0. Each thread gets the settings as it
+   starts and whenever they change; what it really got, which may be less
+   without the privileges, is kept in its shard for stats(). Written with
+   the GIL held. */
+#if defined(MS_WINDOWS)
+#define MAX_CPU ((int)sizeof(DWORD_PTR) * 8)
+#define HAVE_AFFINITY
+#elif defined(__linux__)
+#define MAX_CPU CPU_SETSIZE
+#define HAVE_AFFINITY
+#endif
+
+static int affinity_cpus[MAX_SHARDS];
+static int affinity_count;
+static BOOL realtime_wanted;
+
+static void
+shard_tune(timer_shard *shard)
+{
+#ifdef HAVE_AFFINITY
+    int cpu = affinity_count > 0 ?
+              affinity_cpus[shard->index % affinity_count] : -1;
+#endif
+#ifdef MS_WINDOWS
+    DWORD_PTR process, system;
+
+    if (cpu >= 0 || shard->cpu >= 0) {
+        if (cpu < 0 && !GetProcessAffinityMask(GetCurrentProcess(),
+                                               &process, &system))
+            process = 0;
+        if (cpu >= 0 ? SetThreadAffinityMask(shard->thread,
+                                             (DWORD_PTR)1 << cpu) != 0
+                     : process != 0 &&
+                       SetThreadAffinityMask(shard->thread, process) != 0)
+            shard->cpu = cpu;
+    }
+    if (realtime_wanted != shard->realtime &&
+        SetThreadPriority(shard->thread, realtime_wanted ?
+                          THREAD_PRIORITY_TIME_CRITICAL :
+                          THREAD_PRIORITY_NORMAL))
+        shard->realtime = realtime_wanted;
+#elif defined(UNIX)
+    struct sched_param param;
+#ifdef HAVE_AFFINITY
+    cpu_set_t set;
+
+    if (cpu >= 0 || shard->cpu >= 0) {
+        /* Unpinning gives it the CPUs of the thread configuring it. */
+        CPU_ZERO(&set);
+        if (cpu >= 0)
+            CPU_SET(cpu, &set);
+        if ((cpu >= 0 || sched_getaffinity(0, sizeof(set), &set) == 0) &&
+            pthread_setaffinity_np(shard->thread, sizeof(set), &set) == 0)
+            shard->cpu = cpu;
+    }
+#endif
+    if (realtime_wanted != shard->realtime) {
+        /* The lowest realtime priority is still above every ordinary
+           thread, without starving the kernel's own. */
+        param.sched_priority = realtime_wanted ?
+                               sched_get_priority_min(SCHED_FIFO) : 0;
+        if (pthread_setschedparam(shard->thread, realtime_wanted ?
+                                  SCHED_FIFO : SCHED_OTHER, &param) == 0)
+            shard->realtime = realtime_wanted;
+    }
+#endif
+    /* It looks up its NUMA node again when it next wakes. */
+    shard->numa_stale = TRUE;
+}
+
+/* Change the placement of the scheduler threads, sorted out of the
+   arguments of configure(). cpus is a sequence of CPU numbers, empty to
+   unpin, or NULL to keep it; realtime is -1 to keep it. The GIL must be
+   held. */
+static BOOL
+set_placement(PyObject *cpus, int realtime)
+{
+    PyObject *seq;
+    Py_ssize_t i, n;
+    long cpu;
+
+    if (cpus != NULL) {
+        seq = PySequence_Fast(cpus, "affinity must be a sequence of CPUs");
+        if (seq == NULL)
+            return FALSE;
+        n = PySequence_Fast_GET_SIZE(seq);
+#ifndef HAVE_AFFINITY
+        if (n > 0) {
+            Py_DECREF(seq);
+            PyErr_SetString(PyExc_NotImplementedError,
+                            "thread affinity isn't available on this platform");
+            return FALSE;
+        }
+#else
+        if (n > MAX_SHARDS)
+            n = MAX_SHARDS; /* The rest would never be used */
+        for (i = 0; i < n; i++) {
+            cpu = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+            if (cpu == -1 && PyErr_Occurred()) {
+                Py_DECREF(seq);
+                return FALSE;
+            }
+            if (cpu < 0 || cpu >= MAX_CPU) {
+                Py_DECREF(seq);
+                PyErr_Format(PyExc_ValueError,
+                             "CPU numbers must be from 0 to %d", MAX_CPU - 1);
+                return FALSE;
+            }
+        }
+        for (i = 0; i < n; i++)
+            affinity_cpus[i] = (int)PyLong_AsLong(
+                PySequence_Fast_GET_ITEM(seq, i));
+#endif
+        affinity_count = (int)n;
+        Py_DECREF(seq);
+    }
+    if (realtime >= 0)
+        realtime_wanted = realtime;
+
+    for (i = 0; i < scheduler.shards; i++) {
+        if (shards[i].running)
+            shard_tune(&shards[i]);
+    }
+    return TRUE;
+}
+
+/* Start the shards' threads. The GIL must be held, or start_mutex without
+   one. In any error cases, set an exception and return FALSE. Shards
+   already running stay so, and a later call tries the others again. */
+static BOOL
+scheduler_start(void)
+{
+    timer_shard *shard;
+    int i;
+
+#ifdef UNIX
+    fork_settle();
+#endif
+
+#if PY_VERSION_HEX < 0x03070000
+    /* The scheduler calls back into Python from its own threads. */
+    PyEval_InitThreads();
+#endif
+
+    for (i = 0; i < scheduler.shards; i++) {
+        shard = &shards[i];
+        if (shard->running)
+            continue;
+
+        if (shard->queue.ops == NULL &&
+            queue_init(&shard->queue, scheduler.queue_type,
+                       timer_clock_ns()) < 0) {
+            shard->queue.ops = NULL;
+            PyErr_NoMemory();
+            return FALSE;
+        }
+
+        if (shard->waiter.ops == NULL) {
+            if (scheduler.backend_type->init(&shard->waiter) < 0) {
+                raise_backend_error();
+                return FALSE;
+            }
+            shard->waiter.ops = scheduler.backend_type;
+        }
+
+#ifdef MS_WINDOWS
+        if (!thread_start(&shard->thread, scheduler_win32_thread, shard)) {
+            PyErr_SetString(PyExc_WindowsError,
+                            "CreateThread error. Unable to start scheduler thread");
+            return FALSE;
+        }
+#elif defined(UNIX)
+        if (!thread_start(&shard->thread, scheduler_posix_thread, shard)) {
+            PyErr_SetString(PyExc_OSError,
+                            "pthread_create error. Unable to start scheduler thread");
+            return FALSE;
+        }
+#endif
+        shard->running = TRUE;
+        threads_started++;
+        /* It starts out like the thread that created it. */
+        shard->cpu = -1;
+        shard->realtime = FALSE;
+        shard_tune(shard);
+    }
+    if (!workers_start())
+        return FALSE;
+
+    scheduler.started = TRUE;
+    return TRUE;
+}
+
+MUTEX_DECLARE(start_mutex);
+
+/* Start the scheduler on first use, see scheduler_start. */
+static BOOL
+scheduler_ensure_started(void)
+{
+    BOOL started;
+
+    if (scheduler.started)
+        return TRUE;
+    MUTEX_LOCK(&start_mutex);
+    started = scheduler.started || scheduler_start();
+    MUTEX_UNLOCK(&start_mutex);
+    return started;
+}
+
+/* Hand nodes of one shard, linked newest first from first to last, to
+   it from any thread, see submissions_push. The scheduler owns them from
+   here on. now is a recent clock reading, only used to timestamp the
+   trace. */
+static void
+scheduler_submit_chain(timer_node *first, timer_node *last, int64_t now)
+{
+    timer_shard *shard = NODE_SHARD(first);
+    timer_node *node;
+    int64_t sleep_until, earliest = first->deadline;
+    BOOL lazy = TRUE;
+
+    for (node = first; ; node = node->next) {
+        TRACE(TRACE_ARM, node->timer != NULL ? node->timer->trace_id : 0,
+              now, node->deadline);
+        node->state = NODE_SUBMITTED;
+        if (node->deadline < earliest)
+            earliest = node->deadline;
+        lazy = lazy && node->lazy;
+        if (node == last)
+            break;
+    }
+    /* A chain with any eager node in it goes in eagerly, see LAZY_LEAD. */
+    if (lazy) {
+        submissions_push(&shard->lazy, first, last);
+        lazy_until_lower(shard, earliest);
+        earliest = lazy_sweep_time(shard);
+        if (earliest < 0)
+            return; /* Swept already */
+    } else
+        submissions_push(&shard->submitted, first, last);
+    /* Only a new earliest deadline changes how long the shard sleeps. */
+    sleep_until = sleep_until_load(shard);
+    if (sleep_until < 0 || earliest < sleep_until) {
+        lock_acquire(&shard->lock);
+        shard_wake(shard);
+        lock_release(&shard->lock);
+    }
+}
+
+/* Hand a single node to its shard. Returns 0. */
+static int
+scheduler_submit(timer_node *node, int64_t now)
+{
+    scheduler_submit_chain(node, node, now);
+    return 0;
+}
+
+/* Take a node of a started Timer away from its shard. Returns the node
+   if the caller now owns it, or NULL if the scheduler will release it.
+   Called with the shard's lock held. */
+static timer_node *
+shard_cancel(timer_shard *shard, timer_node *node)
+{
+    if (node->state == NODE_SUBMITTED)
+        shard_collect(shard);
+    if (node->state == NODE_SUBMITTED)
+        deferred_remove(shard, node);
+    else if (node->state == NODE_PENDING) {
+        queue_remove(node);
+        /* The shard would otherwise sleep, and then spin, towards a
+           deadline that no longer exists. Other nodes don't matter. */
+        if (node->deadline == shard->sleep_until)
+            shard_wake(shard);
+    } else {
+        node->state = NODE_CANCELLED;
+        return NULL;
+    }
+    return node;
+}
+
+/* Take a started Timer's node away from the scheduler, see
+   shard_cancel. */
+static timer_node *
+scheduler_cancel(Timer *self)
+{
+    timer_node *node = self->node;
+    timer_shard *shard;
+    Channel *channel;
+    int64_t tombstones;
+    int precision;
+
+    if (node == NULL)
+        return NULL;
+    self->node = NULL;
+    COUNTER_ADD(stats.cancelled, 1);
+    TRACE(TRACE_CANCEL, self->trace_id, timer_clock_ns(), 0);
+
+    if (node->state == NODE_WALL && wall_cancel(node) != NULL)
+        return node;
+    /* Once buried the node may be freed under us. */
+    shard = NODE_SHARD(node);
+    channel = node->u.channel;
+    precision = node->precision;
+    /* Lazy and not swept yet, shard_collect drops it. */
+    if (node->lazy && node_bury(node, NODE_SUBMITTED)) {
+        node_unref(self, channel);
+        return NULL;
+    }
+    if (node_bury(node, NODE_PENDING)) {
+        tombstones_add(shard, precision, 1);
+        tombstones = tombstones_count(shard);
+        if (tombstones >= COMPACT_MIN && tombstones * 2 > shard->pending &&
+            !shard->compact) {
+            lock_acquire(&shard->lock);
+            shard->compact = TRUE;
+            shard_wake(shard);
+            lock_release(&shard->lock);
+        }
+        node_unref(self, channel);
+        return NULL;
+    }
+    lock_acquire(&shard->lock);
+    node = shard_cancel(shard, node);
+    lock_release(&shard->lock);
+
+    return node;
+}
+
+/* Requeue a started Timer's node at an earlier deadline. A node that is
+   already due will fire soon enough and is left alone. */
+static void
+scheduler_advance(timer_node *node, int64_t deadline)
+{
+    timer_shard *shard = NODE_SHARD(node);
+
+    lock_acquire(&shard->lock);
+    if (node->state == NODE_SUBMITTED)
+        shard_collect(shard);
+    if (node->state == NODE_SUBMITTED)
+        node->deadline = deadline; /* Deferred, not in the queue */
+    else if (node->state == NODE_PENDING) {
+        queue_remove(node);
+        node->deadline = deadline;
+        /* The removal left room, so this can't fail. */
+        queue_insert(node);
+        if (shard->sleep_until < 0 || deadline < shard->sleep_until)
+            shard_wake(shard);
+    }
+    lock_release(&shard->lock);
+}
+
+/* Stop any pending expiration for a Timer. The GIL must be held. */
+static void
+Timer_cancel(Timer *self)
+{
+    timer_node *node = scheduler_cancel(self);
+
+    if (node != NULL) {
+        node_done(node);
+    }
+}
+
+/* Stop a started timer that lapsed, if it did. The GIL must be held. */
+static void
+Timer_settle(Timer *self)
+{
+    if (self->started && TIMER_LAPSED(self)) {
+        Timer_cancel(self);
+        Timer_lapse(self);
+    }
+}
+
+/* The C API in timer_api.h. Nodes scheduled through it have no Timer and
+   their callback runs on the scheduler thread without the GIL. */
+static int
+capi_start(void)
+{
+    return scheduler_ensure_started() ? 0 : -1;
+}
+
+static timer_api_handle *
+capi_schedule(int64_t deadline, void (*fn)(void *), void *arg)
+{
+    timer_node *node;
+
+    if (!scheduler.started)
+        return NULL;
+    /* No GIL, so the thread may not have a slot and mustn't take one. */
+    node = node_alloc(thread_slot);
+    if (node == NULL)
+        return NULL;
+    node->shard = (unsigned char)(thread_slot % scheduler.shards);
+    node->deadline = deadline;
+    node->timer = NULL;
+    node->main_thread = FALSE;
+    node->precision = PRECISION_HYBRID;
+    node->lane = LANE_NORMAL;
+    node->lazy = FALSE;
+    node->u.fn = fn;
+    node->v.arg = arg;
+    if (scheduler_submit(node, timer_clock_ns()) < 0) {
+        node_release(node);
+        return NULL;
+    }
+    return (timer_api_handle*)node;
+}
+
+static int
+capi_cancel(timer_api_handle *handle)
+{
+    timer_node *node = (timer_node*)handle;
+    timer_shard *shard = NODE_SHARD(node);
+    int cancelled = 1;
+
+    lock_acquire(&shard->lock);
+    if (node->state == NODE_SUBMITTED)
+        shard_collect(shard);
+    if (node->state == NODE_SUBMITTED) {
+        deferred_remove(shard, node);
+        node_release(node);
+    } else if (node->state == NODE_PENDING) {
+        queue_remove(node);
+        if (node->deadline == shard->sleep_until)
+            shard_wake(shard);
+        node_release(node);
+    } else if (node->state == NODE_DUE)
+        node->state = NODE_CANCELLED; /* native_run frees it */
+    else
+        cancelled = 0;
+    lock_release(&shard->lock);
+    return cancelled;
+}
+
+static Timer_CAPI timer_capi = {
+    TIMER_API_VERSION, capi_start, timer_clock_ns, capi_schedule, capi_cancel
+};
+
+/* Give a Timer a node to expire at an engine clock deadline, and mark it
+   started. The node still has to be submitted, which the caller does
+   before giving up the GIL, or the critical section on the Timer without
+   one. Returns NULL with an exception set if there is no memory for it
+   or for the inbox of a thread_affine Timer. */
+static timer_node *
+Timer_arm(Timer *self, Py_ssize_t slot, int64_t start_time, int64_t deadline)
+{
+    PyObject *channel = self->channel;
+    timer_node *node;
+
+    if (self->thread_affine && !self->main_thread) {
+        channel = (PyObject*)thread_inbox(TRUE);
+        if (channel == NULL)
+            return NULL;
+    }
+    node = node_alloc(slot);
+    if (node == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    node->shard = (unsigned char)(slot % scheduler.shards);
+
+    self->elapsed = 0;
+    self->start_time = start_time;
+    self->missed = 0;
+
+    Timer_aim(self, node, deadline);
+    node->timer = self;
+    node->u.channel = (Channel*)channel;
+    Py_XINCREF(channel);
+    node->main_thread = self->main_thread;
+    node->precision = self->precision;
+    node->lane = self->priority;
+    node->lazy = self->lazy;
+    self->origin = deadline;
+    self->tick = 0;
+    self->deadline = deadline;
+    if (TIMER_EXTRA(self, group, NULL) != NULL)
+        self->extra->generation =
+            ((TimerGroup*)self->extra->group)->generation;
+
+    TRACE(TRACE_START, self->trace_id, start_time, deadline);
+    /* The scheduler can't touch the node before it gets the GIL. Until
+       node_unref() its reference keeps self and everything self refers to
+       alive, so the collector has nothing to find there meanwhile. */
+    Py_INCREF(self);
+    PyObject_GC_UnTrack(self);
+    self->node = node;
+    self->started = TRUE;
+    COUNTER_ADD(stats.started, 1);
+    return node;
+}
+
+/* Timer_arm() for start_many() and restore(), unless self is already
+   started, setting *armed. key becomes the Timer's if it has none. With
+   the GIL the node is returned for the caller to submit with the rest of
+   the batch. Without one only the critical section keeps the scheduler
+   off self, so the node is submitted here and NULL returned. Returns
+   NULL with an exception set if Timer_arm() fails. */
+static timer_node *
+Timer_arm_batch(Timer *self, Py_ssize_t slot, int64_t now, int64_t deadline,
+                PyObject *key, BOOL *armed)
+{
+    timer_node *node = NULL;
+
+    *armed = FALSE;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    Timer_settle(self);
+    if (!self->started) {
+        if (key != NULL && TIMER_EXTRA(self, key, NULL) == NULL) {
+            if (Timer_extra(self) != NULL) {
+                Py_INCREF(key);
+                self->extra->key = key;
+            }
+        }
+        node = PyErr_Occurred() ? NULL :
+               Timer_arm(self, slot, now, deadline);
+        *armed = node != NULL;
+#ifdef FREE_THREADED
+        if (node != NULL) {
+            scheduler_submit(node, now);
+            node = NULL;
+        }
+#endif
+    }
+    Py_END_CRITICAL_SECTION();
+    return node;
+}
+
+/* The time a Timer's duration counts from: the engine clock, or the
+   coarse clock for a coarse timer. */
+static int64_t
+Timer_now(Timer *self)
+{
+    if (self->precision == PRECISION_COARSE)
+        return coarse_clock_ns();
+    return timer_clock_ns();
+}
+
+/* Hand a Timer to the scheduler to expire at an engine clock deadline.
+   The GIL must be held. */
+static PyObject *
+Timer_start_deadline(Timer *self, int64_t start_time, int64_t deadline)
+{
+    timer_node *node;
+
+    if (!scheduler_ensure_started())
+        return NULL;
+    node = Timer_arm(self, current_thread_slot(), start_time, deadline);
+    if (node == NULL)
+        return NULL;
+    scheduler_submit(node, start_time);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Timer_start_doc,
+"start()\n"
+"\n"
+"Start a Timer object.");
+
+static PyObject *
+Timer_start(Timer *self)
+{
+    int64_t now;
+
+    Timer_settle(self);
+    if (self->started)
+        Py_RETURN_NONE;
+
+    now = Timer_now(self);
+    return Timer_start_deadline(self, now,
+                                now + self->duration);
+}
+
+PyDoc_STRVAR(Timer_start_at_doc,
+"start_at(deadline_ns=None)\n"
+"\n"
+"Start a Timer object that expires when now_ns() reaches deadline_ns.\n"
+"A deadline in the past expires right away. duration is set to the\n"
+"time left. Without deadline_ns, the inherited deadline of the\n"
+"innermost within() or deadline() block is used, LookupError if there\n"
+"is none.");
+
+static int context_deadline(int64_t *deadline);
+
+static PyObject *
+Timer_start_at(Timer *self, PyObject *arg)
+{
+    long long deadline;
+    int64_t inherited;
+    int64_t now;
+    int found;
+
+    if (arg == Py_None) {
+        found = context_deadline(&inherited);
+        if (found < 0)
+            return NULL;
+        if (!found) {
+            PyErr_SetString(PyExc_LookupError, "no deadline to inherit");
+            return NULL;
+        }
+        deadline = inherited;
+    } else {
+        deadline = PyLong_AsLongLong(arg);
+        if (deadline == -1 && PyErr_Occurred())
+            return NULL;
+    }
+
+    Timer_settle(self);
+    if (self->started)
+        Py_RETURN_NONE;
+
+    now = timer_clock_ns();
+    self->duration = deadline > now ? (int64_t)deadline - now : 0;
+    return Timer_start_deadline(self, now, (int64_t)deadline);
+}
+
+PyDoc_STRVAR(Timer_start_at_wall_doc,
+"start_at_wall(deadline_ns)\n"
+"\n"
+"Start a Timer object that expires when the system clock, as wall_ns()\n"
+"reads it, reaches deadline_ns, even if the clock is set meanwhile. It\n"
+"waits in a queue of its own until then, so it costs nothing while it\n"
+"does. A deadline in the past expires right away.");
+
+static PyObject *
+Timer_start_at_wall(Timer *self, PyObject *arg)
+{
+    long long deadline;
+    timer_node *node;
+    int64_t now, estimate;
+
+    deadline = PyLong_AsLongLong(arg);
+    if (deadline == -1 && PyErr_Occurred())
+        return NULL;
+
+    Timer_settle(self);
+    if (self->started)
+        Py_RETURN_NONE;
+    if (!scheduler_ensure_started() || !wall_start())
+        return NULL;
+
+    /* Only an estimate on the engine clock, for duration. */
+    now = timer_clock_ns();
+    estimate = (int64_t)deadline - (wall_clock_ns() - now);
+    self->duration = estimate > now ? estimate - now : 0;
+    node = Timer_arm(self, current_thread_slot(), now, estimate);
+    if (node == NULL)
+        return NULL;
+    node->deadline = (int64_t)deadline;
+    wall_insert(node);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Timer_reset_doc,
+"reset()\n"
+"\n"
+"Reset a Timer object. Sets the expired and running members to False\n"
+"and sets the elapsed member to 0. Like stop(), this never waits for the\n"
+"scheduler thread.");
+
+static PyObject *
+Timer_reset(Timer *self)
+{
+    Timer_cancel(self);
+
+    self->started = FALSE;
+    self->expired = FALSE;
+    self->elapsed = 0;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Timer_stop_doc,
+"stop()\n"
+"\n"
+"Stop a timer object. Returns the current elapsed time.\n"
+"\n"
+"This only unlinks the timer from the scheduler's queue and never waits\n"
+"for the scheduler thread, even while it is running this timer's\n"
+"callback.");
+
+static PyObject *
+Timer_stop(Timer *self)
+{
+    Timer_settle(self);
+    if (!self->started)
+        goto done;
+
+    self->elapsed = timer_clock_ns() - self->start_time;
+    Timer_cancel(self);
+    RECORD_BOUND(self->histogram, self->elapsed);
+
+    self->started = FALSE;
+
+done:
+    return PyLong_FromLongLong(self->elapsed / 1000);
+}
+
+PyDoc_STRVAR(Timer_rearm_doc,
+"rearm(duration=None)\n"
+"\n"
+"Move a running timer's expiration to duration microseconds from now,\n"
+"or to its current duration if none is given. A stopped timer is\n"
+"started. Pushing the expiration back is a single store, the scheduler\n"
+"only requeues the timer when the old expiration is reached.\n"
+"A repeating timer restarts its schedule from the new expiration.");
+
+static PyObject *
+Timer_rearm(Timer *self, PyObject *duration_obj)
+{
+    Py_ssize_t duration;
+    int64_t deadline;
+
+    if (duration_obj != Py_None) {
+        duration = PyNumber_AsSsize_t(duration_obj, PyExc_OverflowError);
+        if (duration == -1 && PyErr_Occurred())
+            return NULL;
+        self->duration = (int64_t)duration * 1000;
+    }
+
+    Timer_settle(self);
+    if (!self->started || self->node == NULL) {
+        self->expired = FALSE;
+        return Timer_start(self);
+    }
+
+    deadline = Timer_now(self) + self->duration;
+    self->deadline = deadline;
+    self->origin = deadline;
+    self->tick = 0;
+    deadline = Timer_slack(self, deadline);
+    if (deadline < self->node->deadline)
+        scheduler_advance(self->node, deadline);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Timer_touch_doc,
+"touch()\n"
+"\n"
+"Push a running timer's expiration back to its duration from now. The\n"
+"same as rearm() without arguments.");
+
+static PyObject *
+Timer_touch(Timer *self)
+{
+    Timer_settle(self);
+    if (!self->started || self->node == NULL)
+        Py_RETURN_NONE;
+
+    self->deadline = Timer_now(self) + self->duration;
+    self->origin = self->deadline;
+    self->tick = 0;
+
+    Py_RETURN_NONE;
+}
+
+/* Timer_expire changes a Timer from the scheduler threads, see
+   FREE_THREADED. */
+CRITICAL_NOARGS(Timer_start, Timer)
+CRITICAL_OPTIONAL(Timer_start_at, Timer, "start_at")
+CRITICAL_ARGS(Timer_start_at_wall, Timer)
+CRITICAL_NOARGS(Timer_stop, Timer)
+CRITICAL_NOARGS(Timer_reset, Timer)
+CRITICAL_OPTIONAL(Timer_rearm, Timer, "rearm")
+CRITICAL_NOARGS(Timer_touch, Timer)
+
+static PyMethodDef Timer_methods[] = {
+    {"start", (PyCFunction)Timer_start_locked, METH_NOARGS, Timer_start_doc},
+    {"start_at", (PyCFunction)(void(*)(void))Timer_start_at_locked,
+     OPTIONAL_ARG_FLAGS, Timer_start_at_doc},
+    {"start_at_wall", (PyCFunction)Timer_start_at_wall_locked, METH_O,
+     Timer_start_at_wall_doc},
+    {"stop", (PyCFunction)Timer_stop_locked, METH_NOARGS, Timer_stop_doc},
+    {"reset", (PyCFunction)Timer_reset_locked, METH_NOARGS, Timer_reset_doc},
+    {"rearm", (PyCFunction)(void(*)(void))Timer_rearm_locked,
+     OPTIONAL_ARG_FLAGS, Timer_rearm_doc},
+    {"touch", (PyCFunction)Timer_touch_locked, METH_NOARGS, Timer_touch_doc},
+    {"from_ns", (PyCFunction)Timer_from_ns,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS, Timer_from_ns_doc},
+    {"many", (PyCFunction)Timer_many, METH_O | METH_CLASS, Timer_many_doc},
+    {"sequence", (PyCFunction)Timer_sequence,
+     METH_VARARGS | METH_KEYWORDS | METH_CLASS, Timer_sequence_doc},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(Timer_elapsed_doc,
+"Integer representing the current elapsed time in microseconds. It is\n"
+"read from the clock while the timer is running.");
+
+PyDoc_STRVAR(Timer_expired_doc,
+"Boolean representing whether or not the timer finished on it's \n"
+"own or if it reached the maximum duration.");
+
+PyDoc_STRVAR(Timer_running_doc,
+"Boolean representing whether or not the timer is currently running.");
+
+PyDoc_STRVAR(Timer_interval_doc,
+"Microseconds between expirations of a repeating timer. The first one is\n"
+"duration after start(), then one every interval until stopped. 0, the\n"
+"default, makes a one-shot timer.");
+
+PyDoc_STRVAR(Timer_slack_doc,
+"Microseconds the timer may expire late. The deadline is rounded up so\n"
+"that timers due around the same time share it and fire together, for\n"
+"fewer scheduler wake-ups and GIL acquisitions. lateness_ns counts from\n"
+"the rounded deadline. 0, the default, is exact. Takes effect on the\n"
+"next start() or rearm().");
+
+PyDoc_STRVAR(Timer_missed_doc,
+"Number of expirations of a repeating timer that were dropped or merged\n"
+"because a callback ran late, see overrun.");
+
+PyDoc_STRVAR(Timer_main_thread_doc,
+"Run the callback on the main thread, the next time the interpreter checks\n"
+"for pending calls there, rather than on the scheduler thread. Overrides\n"
+"channel. Takes effect on the next start(). On Python 3 that check only\n"
+"comes once the main thread has given up the GIL, such as for a sleep or\n"
+"I/O, or another thread asked for it.");
+
+PyDoc_STRVAR(Timer_thread_affine_doc,
+"Run the callback on the thread that called start(), when it next calls\n"
+"timer.run_pending(), rather than on the scheduler thread. Overrides\n"
+"channel, main_thread overrides it. Takes effect on the next start().");
+
+PyDoc_STRVAR(Timer_lazy_doc,
+"Leave the timer to the scheduler's next sweep of lazily started ones,\n"
+"instead of queueing it on start(). A lazy timer stopped before then\n"
+"never reaches the queue, which suits timeouts that are nearly always\n"
+"stopped soon after they start. False by default. Takes effect on the\n"
+"next start().");
+
+PyDoc_STRVAR(Timer_lateness_ns_doc,
+"Nanoseconds from the deadline to the start of the last callback.\n"
+"wake_latency_ns and gil_wait_ns are two parts of it, the rest is spent\n"
+"behind other callbacks that were due at the same time.");
+
+PyDoc_STRVAR(Timer_wake_latency_ns_doc,
+"Nanoseconds from the deadline to the scheduler noticing it, for the\n"
+"last callback.");
+
+PyDoc_STRVAR(Timer_gil_wait_ns_doc,
+"Nanoseconds the scheduler waited for the GIL before the last callback.");
+
+PyDoc_STRVAR(Timer_trace_id_doc,
+"Number identifying this timer in event traces, see timer.trace().");
+
+static PyMemberDef Timer_members[] = {
+    {"trace_id", T_ULONGLONG, offsetof(Timer, trace_id), READONLY,
+     Timer_trace_id_doc},
+    {"lateness_ns", T_LONGLONG, offsetof(Timer, lateness), READONLY,
+     Timer_lateness_ns_doc},
+    {"wake_latency_ns", T_LONGLONG, offsetof(Timer, wake_latency), READONLY,
+     Timer_wake_latency_ns_doc},
+    {"gil_wait_ns", T_LONGLONG, offsetof(Timer, gil_wait), READONLY,
+     Timer_gil_wait_ns_doc},
+    {"expired", T_BOOL, offsetof(Timer, expired), 0, Timer_expired_doc},
+    {"interval", T_PYSSIZET, offsetof(Timer, interval), 0,
+     Timer_interval_doc},
+    {"slack", T_PYSSIZET, offsetof(Timer, slack), 0, Timer_slack_doc},
+    {"missed", T_PYSSIZET, offsetof(Timer, missed), READONLY,
+     Timer_missed_doc},
+    {"main_thread", T_BOOL, offsetof(Timer, main_thread), 0,
+     Timer_main_thread_doc},
+    {"thread_affine", T_BOOL, offsetof(Timer, thread_affine), 0,
+     Timer_thread_affine_doc},
+    {"lazy", T_BOOL, offsetof(Timer, lazy), 0, Timer_lazy_doc},
+    {NULL}
+};
+
+PyDoc_STRVAR(Timer_overrun_doc,
+"What a repeating timer does when its callback ran so late that later\n"
+"expirations are already due: 'skip' (default) drops them, 'catch_up'\n"
+"fires each of them back to back and 'coalesce' fires once for all of\n"
+"them. The schedule itself never shifts.");
+
+static PyObject *
+Timer_get_overrun(Timer *self, void *closure)
+{
+    return Py_BuildValue("s", overrun_names[(int)self->overrun]);
+}
+
+/* Index of value in a NULL terminated list of names, -1 if it isn't one
+   of them or -2 with an exception set if comparing failed. */
+static int
+name_index(PyObject *value, const char **names)
+{
+    PyObject *name;
+    int i;
+
+    for (i = 0; names[i] != NULL; i++) {
+        name = Py_BuildValue("s", names[i]);
+        if (name == NULL)
+            return -2;
+        switch (PyObject_RichCompareBool(value, name, Py_EQ)) {
+        case 1:
+            Py_DECREF(name);
+            return i;
+        case -1:
+            Py_DECREF(name);
+            return -2;
+        }
+        Py_DECREF(name);
+    }
+    return -1;
+}
+
+static int
+Timer_set_overrun(Timer *self, PyObject *value, void *closure)
+{
+    int i;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError, "can't delete overrun");
+        return -1;
+    }
+    i = name_index(value, overrun_names);
+    if (i == -1)
+        PyErr_SetString(PyExc_ValueError,
+                        "overrun must be 'skip', 'catch_up' or 'coalesce'");
+    if (i < 0)
+        return -1;
+    self->overrun = i;
+    return 0;
+}
+
+PyDoc_STRVAR(Timer_precision_doc,
+"How closely the scheduler keeps to the deadline. 'hybrid' (default)\n"
+"sleeps until spin_margin before it and spins on the clock for the rest.\n"
+"'spin' spins for at least the last millisecond, for when the OS wakes\n"
+"threads late. 'coarse' only sleeps: no CPU spent waiting, but as late\n"
+"as the OS wakes the scheduler. It also counts from the time as of the\n"
+"last system tick, so it may fire up to a tick early as well. Takes\n"
+"effect on the next start().");
+
+static PyObject *
+Timer_get_precision(Timer *self, void *closure)
+{
+    return Py_BuildValue("s", precision_names[(int)self->precision]);
+}
+
+static int
+Timer_set_precision(Timer *self, PyObject *value, void *closure)
+{
+    int i;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError, "can't delete precision");
+        return -1;
+    }
+    i = name_index(value, precision_names);
+    if (i == -1)
+        PyErr_SetString(PyExc_ValueError,
+                        "precision must be 'hybrid', 'spin' or 'coarse'");
+    if (i < 0)
+        return -1;
+    self->precision = (char)i;
+    return 0;
+}
+
+PyDoc_STRVAR(Timer_priority_doc,
+"Which lane the callback waits in once due: 'high', 'normal' (default)\n"
+"or 'low'. Due callbacks of a higher lane run first. Takes effect on the\n"
+"next start().");
+
+static PyObject *
+Timer_get_priority(Timer *self, void *closure)
+{
+    return Py_BuildValue("s", lane_names[(int)self->priority]);
+}
+
+static int
+Timer_set_priority(Timer *self, PyObject *value, void *closure)
+{
+    int i;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError, "can't delete priority");
+        return -1;
+    }
+    i = name_index(value, lane_names);
+    if (i == -1)
+        PyErr_SetString(PyExc_ValueError,
+                        "priority must be 'high', 'normal' or 'low'");
+    if (i < 0)
+        return -1;
+    self->priority = (char)i;
+    return 0;
+}
+
+/* The closure of the time getsets is the unit in nanoseconds. */
+#define TIME_UNIT(closure) ((int64_t)(Py_ssize_t)(closure))
+
+static PyObject *
+Timer_get_elapsed(Timer *self, void *closure)
+{
+    Timer_settle(self);
+    if (self->started)
+        return PyLong_FromLongLong((timer_clock_ns() - self->start_time) /
+                                   TIME_UNIT(closure));
+    return PyLong_FromLongLong(self->elapsed / TIME_UNIT(closure));
+}
+
+static int
+Timer_set_elapsed(Timer *self, PyObject *value, void *closure)
+{
+    long long elapsed;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError, "can't delete elapsed");
+        return -1;
+    }
+    elapsed = PyLong_AsLongLong(value);
+    if (elapsed == -1 && PyErr_Occurred())
+        return -1;
+
+    /* A running timer keeps counting from the new value. */
+    if (self->started)
+        self->start_time = timer_clock_ns() - elapsed * TIME_UNIT(closure);
+    self->elapsed = elapsed * TIME_UNIT(closure);
+    return 0;
+}
+
+static PyObject *
+Timer_get_duration(Timer *self, void *closure)
+{
+    return PyLong_FromLongLong(self->duration / TIME_UNIT(closure));
+}
+
+static int
+Timer_set_duration(Timer *self, PyObject *value, void *closure)
+{
+    long long duration;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError, "can't delete duration");
+        return -1;
+    }
+    duration = PyLong_AsLongLong(value);
+    if (duration == -1 && PyErr_Occurred())
+        return -1;
+
+    /* Takes effect on the next start() or rearm(). */
+    self->duration = duration * TIME_UNIT(closure);
+    return 0;
+}
+
+PyDoc_STRVAR(Timer_elapsed_ns_doc,
+"The elapsed time in nanoseconds, see elapsed.");
+
+PyDoc_STRVAR(Timer_duration_doc,
+"Microseconds from start() until the timer expires. Changes take effect\n"
+"on the next start() or rearm().");
+
+PyDoc_STRVAR(Timer_duration_ns_doc,
+"The duration in nanoseconds.");
+
+static PyObject *
+Timer_get_channel(Timer *self, void *closure)
+{
+    PyObject *channel = self->channel != NULL ? self->channel : Py_None;
+
+    Py_INCREF(channel);
+    return channel;
+}
+
+static int
+Timer_set_channel(Timer *self, PyObject *value, void *closure)
+{
+    PyObject *old = self->channel;
+
+    if (value == Py_None)
+        value = NULL;
+    if (value != NULL && !PyObject_TypeCheck(value, &Channel_type)) {
+        PyErr_SetString(PyExc_TypeError, "channel must be a Channel");
+        return -1;
+    }
+    Py_XINCREF(value);
+    self->channel = value;
+    gc_adopt((PyObject*)self, value);
+    Py_XDECREF(old);
+    return 0;
+}
+
+static PyObject *
+Timer_get_future(Timer *self, void *closure)
+{
+    PyObject *future = TIMER_EXTRA(self, future, NULL);
+
+    if (future == NULL)
+        future = Py_None;
+
+    Py_INCREF(future);
+    return future;
+}
+
+static int
+Timer_set_future(Timer *self, PyObject *value, void *closure)
+{
+    PyObject *old;
+
+    if (value == Py_None)
+        value = NULL;
+    if (value != NULL && !PyObject_TypeCheck(value, &Future_type)) {
+        PyErr_SetString(PyExc_TypeError, "future must be a Future");
+        return -1;
+    }
+    if (Timer_extra(self) == NULL)
+        return -1;
+    old = self->extra->future;
+    Py_XINCREF(value);
+    self->extra->future = value;
+    gc_adopt((PyObject*)self, value);
+    Py_XDECREF(old);
+    return 0;
+}
+
+static PyObject *
+Timer_get_running(Timer *self, void *closure)
+{
+    Timer_settle(self);
+    return PyBool_FromLong(self->started);
+}
+
+static int
+Timer_set_running(Timer *self, PyObject *value, void *closure)
+{
+    int running;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError, "can't delete running");
+        return -1;
+    }
+    running = PyObject_IsTrue(value);
+    if (running < 0)
+        return -1;
+    self->started = running;
+    return 0;
+}
+
+static PyObject *
+Timer_get_group(Timer *self, void *closure)
+{
+    PyObject *group = TIMER_EXTRA(self, group, NULL);
+
+    if (group == NULL)
+        group = Py_None;
+
+    Py_INCREF(group);
+    return group;
+}
+
+static int
+Timer_set_group(Timer *self, PyObject *value, void *closure)
+{
+    PyObject *old;
+
+    if (value == Py_None)
+        value = NULL;
+    if (value != NULL && !PyObject_TypeCheck(value, &TimerGroup_type)) {
+        PyErr_SetString(PyExc_TypeError, "group must be a TimerGroup");
+        return -1;
+    }
+    if (Timer_extra(self) == NULL)
+        return -1;
+    /* A lapsed timer stays stopped, a running one joins right away. */
+    Timer_settle(self);
+    old = self->extra->group;
+    Py_XINCREF(value);
+    self->extra->group = value;
+    if (value != NULL)
+        self->extra->generation = ((TimerGroup*)value)->generation;
+    gc_adopt((PyObject*)self, value);
+    Py_XDECREF(old);
+    return 0;
+}
+
+static PyObject *
+Timer_get_key(Timer *self, void *closure)
+{
+    PyObject *key = TIMER_EXTRA(self, key, NULL);
+
+    if (key == NULL)
+        key = Py_None;
+
+    Py_INCREF(key);
+    return key;
+}
+
+static int
+Timer_set_key(Timer *self, PyObject *value, void *closure)
+{
+    PyObject *old;
+
+    if (value == Py_None)
+        value = NULL;
+    if (value != NULL && !PyBytes_Check(value)) {
+        PyErr_SetString(PyExc_TypeError, "key must be bytes");
+        return -1;
+    }
+    if (Timer_extra(self) == NULL)
+        return -1;
+    old = self->extra->key;
+    Py_XINCREF(value);
+    self->extra->key = value;
+    Py_XDECREF(old);
+    return 0;
+}
+
+PyDoc_STRVAR(Timer_group_doc,
+"TimerGroup the timer belongs to, or None. Cancelling the group stops\n"
+"the timer. Setting it on a running timer takes effect right away.");
+
+PyDoc_STRVAR(Timer_channel_doc,
+"Channel the callback is delivered through instead of running on the\n"
+"scheduler thread, or None. Takes effect on the next start().");
+
+PyDoc_STRVAR(Timer_future_doc,
+"Future the next callback completes with its result or exception, or\n"
+"None. Left in place once done; assign a new one for a later callback.");
+
+PyDoc_STRVAR(Timer_key_doc,
+"Opaque bytes timer.snapshot() saves the pending deadline under, or None\n"
+"to leave the timer out of snapshots.");
+
+static PyGetSetDef Timer_getset[] = {
+    {"elapsed", (getter)Timer_get_elapsed, (setter)Timer_set_elapsed,
+     Timer_elapsed_doc, (void*)1000},
+    {"elapsed_ns", (getter)Timer_get_elapsed, (setter)Timer_set_elapsed,
+     Timer_elapsed_ns_doc, (void*)1},
+    {"duration", (getter)Timer_get_duration, (setter)Timer_set_duration,
+     Timer_duration_doc, (void*)1000},
+    {"duration_ns", (getter)Timer_get_duration, (setter)Timer_set_duration,
+     Timer_duration_ns_doc, (void*)1},
+    {"overrun", (getter)Timer_get_overrun, (setter)Timer_set_overrun,
+     Timer_overrun_doc, NULL},
+    {"precision", (getter)Timer_get_precision, (setter)Timer_set_precision,
+     Timer_precision_doc, NULL},
+    {"priority", (getter)Timer_get_priority, (setter)Timer_set_priority,
+     Timer_priority_doc, NULL},
+    {"histogram", (getter)get_bound_histogram, (setter)set_bound_histogram,
+     bound_histogram_doc, (void*)offsetof(Timer, histogram)},
+    {"channel", (getter)Timer_get_channel, (setter)Timer_set_channel,
+     Timer_channel_doc, NULL},
+    {"future", (getter)Timer_get_future, (setter)Timer_set_future,
+     Timer_future_doc, NULL},
+    {"key", (getter)Timer_get_key, (setter)Timer_set_key,
+     Timer_key_doc, NULL},
+    {"running", (getter)Timer_get_running, (setter)Timer_set_running,
+     Timer_running_doc, NULL},
+    {"group", (getter)Timer_get_group, (setter)Timer_set_group,
+     Timer_group_doc, NULL},
+    {NULL}
+};
+
+PyDoc_STRVAR(Timer_class_doc,
+"Timer(duration, callback, args)\n"
+"\n"
+"Creates a timer object which can be started, stopped, or reset.\n"
+"This provides a microsecond resolution timer outside of the Python GIL.");
+
+static PyTypeObject Timer_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.Timer",                             /*tp_name*/
+    sizeof(Timer),                              /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    (destructor)Timer_dealloc,                  /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    (reprfunc)Timer_str,                        /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    (reprfunc)Timer_str,                        /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+        Py_TPFLAGS_HAVE_GC,                     /*tp_flags*/
+    Timer_class_doc,                            /*tp_doc*/
+    (traverseproc)Timer_traverse,               /*tp_traverse*/
+    (inquiry)Timer_clear,                       /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    Timer_methods,                              /*tp_methods*/
+    Timer_members,                              /*tp_members*/
+    Timer_getset,                               /*tp_getset*/
+    0,                                          /*tp_base*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    PyType_GenericAlloc,                        /*tp_alloc*/
+    Timer_new,                                  /*tp_new*/
+};
+
+
+/* A Ticker is a repeating Timer on a schedule of hz ticks a second, for
+   fixed-rate loops such as simulation steps. Its callback gets the tick
+   number and the lateness instead of arguments, see Timer_expire, and
+   each tick costs the one GIL acquisition any expiration does. */
+static PyObject *
+Ticker_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"hz", "callback", NULL};
+    Py_ssize_t hz;
+    PyObject *callback, *timer_args;
+    Timer *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nO:Ticker", kwlist,
+                                     &hz, &callback))
+        return NULL;
+    if (hz <= 0 || hz > 1000000000) {
+        PyErr_SetString(PyExc_ValueError,
+                        "hz must be between 1 and 1000000000");
+        return NULL;
+    }
+
+    /* The first tick is one period after start(). */
+    timer_args = Py_BuildValue("(nO)", (Py_ssize_t)(1000000000 / hz),
+                               callback);
+    if (timer_args == NULL)
+        return NULL;
+    self = (Timer*)Timer_create(type, timer_args, NULL, 1);
+    Py_DECREF(timer_args);
+    if (self == NULL)
+        return NULL;
+    self->hz = hz;
+    self->interval = hz < 1000000 ? 1000000 / hz : 1;
+    return (PyObject*)self;
+}
+
+PyDoc_STRVAR(Ticker_hz_doc,
+"Ticks per second.");
+
+static PyMemberDef Ticker_members[] = {
+    {"hz", T_PYSSIZET, offsetof(Timer, hz), READONLY, Ticker_hz_doc},
+    {NULL}
+};
+
+PyDoc_STRVAR(Ticker_class_doc,
+"Ticker(hz, callback)\n"
+"\n"
+"A Timer that calls callback(tick, lateness_ns) hz times a second once\n"
+"started. Ticks keep to a fixed schedule from start(), the first one\n"
+"period after it, and tick counts them from 0 on that schedule, so it\n"
+"jumps past those skipped by the overrun policy, which missed counts.\n"
+"lateness_ns is the time since the tick was due.");
+
+static PyTypeObject Ticker_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.Ticker",                            /*tp_name*/
+    sizeof(Timer),                              /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    0,                                          /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /*tp_flags*/
+    Ticker_class_doc,                           /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    0,                                          /*tp_methods*/
+    Ticker_members,                             /*tp_members*/
+    0,                                          /*tp_getset*/
+    0,                                          /*tp_base, Timer_type*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    0,                                          /*tp_alloc*/
+    Ticker_new,                                 /*tp_new*/
+};
+
+
+/* A Debouncer is a Timer that calling rearms, so a burst of calls runs
+   the callback once, duration after the last of them. While it is
+   pending a call is the single store of rearm(), the node only moves
+   when the old deadline comes due. */
+static PyObject *
+Debouncer_call(Timer *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *result;
+
+    if (PyTuple_GET_SIZE(args) != 0 ||
+        (kwargs != NULL && PyDict_Size(kwargs) != 0)) {
+        PyErr_SetString(PyExc_TypeError, "Debouncer takes no arguments");
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    result = Timer_rearm(self, Py_None);
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+PyDoc_STRVAR(Debouncer_class_doc,
+"Debouncer(duration, callback, *args, **kwargs)\n"
+"\n"
+"A Timer that is started or pushed back by calling it, so\n"
+"callback(*args, **kwargs) runs duration microseconds after the last\n"
+"of a burst of calls. stop() drops a pending call.");
+
+static PyTypeObject Debouncer_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.Debouncer",                         /*tp_name*/
+    sizeof(Timer),                              /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    0,                                          /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    (ternaryfunc)Debouncer_call,                /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /*tp_flags*/
+    Debouncer_class_doc,                        /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    0,                                          /*tp_methods*/
+    0,                                          /*tp_members*/
+    0,                                          /*tp_getset*/
+    0,                                          /*tp_base, Timer_type*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    0,                                          /*tp_alloc*/
+    0,                                          /*tp_new, Timer_new*/
+};
+
+
+/* A Throttler is a Timer, with its duration as the interval, that
+   calling starts at the end of the last interval or right away. While it
+   is pending a call only merges into the pending one. */
+typedef struct {
+    Timer timer;
+    int64_t next; /* Engine clock, the earliest the next call may run */
+} Throttler;
+
+static PyObject *
+Throttler_call(Throttler *self, PyObject *args, PyObject *kwargs)
+{
+    Timer *t = &self->timer;
+    int64_t now, due;
+
+    if (PyTuple_GET_SIZE(args) != 0 ||
+        (kwargs != NULL && PyDict_Size(kwargs) != 0)) {
+        PyErr_SetString(PyExc_TypeError, "Throttler takes no arguments");
+        return NULL;
+    }
+
+    Timer_settle(t);
+    if (t->started)
+        Py_RETURN_NONE;
+
+    now = Timer_now(t);
+    due = self->next > now ? self->next : now;
+    self->next = due + t->duration;
+    t->expired = FALSE;
+    return Timer_start_deadline(t, now, due);
+}
+
+PyDoc_STRVAR(Throttler_class_doc,
+"Throttler(interval, callback, *args, **kwargs)\n"
+"\n"
+"A Timer that runs callback(*args, **kwargs) when called, at most once\n"
+"every interval microseconds, its duration. A call within the interval\n"
+"is put off to its end, and merged with others made in the meantime.\n"
+"stop() drops a pending call.");
+
+CRITICAL_KEYWORDS(Throttler_call, Throttler)
+
+static PyTypeObject Throttler_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.Throttler",                         /*tp_name*/
+    sizeof(Throttler),                          /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    0,                                          /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    (ternaryfunc)Throttler_call_locked,         /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /*tp_flags*/
+    Throttler_class_doc,                        /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    0,                                          /*tp_methods*/
+    0,                                          /*tp_members*/
+    0,                                          /*tp_getset*/
+    0,                                          /*tp_base, Timer_type*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    0,                                          /*tp_alloc*/
+    0,                                          /*tp_new, Timer_new*/
+};
+
+
+/* A Backoff schedules retries itself: each retry() waits base, then
+   factor times longer than the last up to max, less a random part of
+   up to jitter of it so that many clients that failed together don't
+   retry together. The arithmetic and the random numbers, xorshift64*,
+   stay in C, and the callback gets the attempt number, from 1. */
+static PyObject *
+Backoff_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"base", "callback", "factor", "max", "jitter",
+                             NULL};
+    Py_ssize_t base, max = 60000000;
+    double factor = 2.0, jitter = 0.0;
+    PyObject *callback, *timer_args;
+    Backoff *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nO|dnd:Backoff", kwlist,
+                                     &base, &callback, &factor, &max,
+                                     &jitter))
+        return NULL;
+    if (base <= 0 || max < base) {
+        PyErr_SetString(PyExc_ValueError,
+                        "base must be positive and max at least base");
+        return NULL;
+    }
+    if (!(factor >= 1.0)) {
+        PyErr_SetString(PyExc_ValueError, "factor must be at least 1");
+        return NULL;
+    }
+    if (!(jitter >= 0.0 && jitter <= 1.0)) {
+        PyErr_SetString(PyExc_ValueError, "jitter must be between 0 and 1");
+        return NULL;
+    }
+
+    timer_args = Py_BuildValue("(nO)", base, callback);
+    if (timer_args == NULL)
+        return NULL;
+    self = (Backoff*)Timer_create(type, timer_args, NULL, 1000);
+    Py_DECREF(timer_args);
+    if (self == NULL)
+        return NULL;
+    self->timer.backoff = TRUE;
+    self->base = (int64_t)base * 1000;
+    self->delay = (double)self->base;
+    self->factor = factor;
+    self->max = (double)max * 1000;
+    self->jitter = jitter;
+    /* Never 0, or it would stay 0. */
+    self->rng = ((uint64_t)(uintptr_t)self ^ (uint64_t)real_clock_ns()) | 1;
+    return (PyObject*)self;
+}
+
+static uint64_t
+Backoff_random(Backoff *self)
+{
+    self->rng ^= self->rng >> 12;
+    self->rng ^= self->rng << 25;
+    self->rng ^= self->rng >> 27;
+    return self->rng * 0x2545F4914F6CDD1DULL;
+}
+
+PyDoc_STRVAR(Backoff_retry_doc,
+"retry() -> int\n"
+"\n"
+"Schedule the next attempt and return its delay in microseconds. Does\n"
+"nothing and returns None while one is pending.");
+
+static PyObject *
+Backoff_retry(Backoff *self)
+{
+    Timer *t = &self->timer;
+    PyObject *rslt;
+    double delay = self->delay;
+    int64_t now;
+
+    Timer_settle(t);
+    if (t->started)
+        Py_RETURN_NONE;
+
+    /* The top 53 bits make a double in [0, 1). */
+    if (self->jitter > 0.0)
+        delay -= delay * self->jitter *
+                 ((double)(Backoff_random(self) >> 11) / 9007199254740992.0);
+    self->delay *= self->factor;
+    if (self->delay > self->max)
+        self->delay = self->max;
+
+    now = Timer_now(t);
+    t->duration = (int64_t)delay;
+    t->expired = FALSE;
+    self->attempt++;
+    rslt = Timer_start_deadline(t, now, now + t->duration);
+    if (rslt == NULL) {
+        self->attempt--;
+        return NULL;
+    }
+    Py_DECREF(rslt);
+    return PyLong_FromLongLong((long long)(t->duration / 1000));
+}
+
+PyDoc_STRVAR(Backoff_reset_doc,
+"reset()\n"
+"\n"
+"Stop a pending attempt and start over from the first, after one\n"
+"succeeded.");
+
+static PyObject *
+Backoff_reset(Backoff *self)
+{
+    PyObject *rslt = Timer_stop(&self->timer);
+
+    if (rslt == NULL)
+        return NULL;
+    self->attempt = 0;
+    self->delay = (double)self->base;
+    return rslt;
+}
+
+CRITICAL_NOARGS(Backoff_retry, Backoff)
+CRITICAL_NOARGS(Backoff_reset, Backoff)
+
+static PyMethodDef Backoff_methods[] = {
+    {"retry", (PyCFunction)Backoff_retry_locked, METH_NOARGS,
+     Backoff_retry_doc},
+    {"reset", (PyCFunction)Backoff_reset_locked, METH_NOARGS,
+     Backoff_reset_doc},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(Backoff_attempt_doc,
+"Attempts scheduled since it was created or reset().");
+
+static PyMemberDef Backoff_members[] = {
+    {"attempt", T_PYSSIZET, offsetof(Backoff, attempt), READONLY,
+     Backoff_attempt_doc},
+    {NULL}
+};
+
+PyDoc_STRVAR(Backoff_class_doc,
+"Backoff(base, callback, factor=2.0, max=60000000, jitter=0.0)\n"
+"\n"
+"A Timer for retries. Each retry() calls callback(attempt) after a\n"
+"delay, base microseconds the first time and factor times the last one\n"
+"after that, up to max, less a random part of up to jitter of it.\n"
+"attempt counts from 1. reset() starts over.");
+
+static PyTypeObject Backoff_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.Backoff",                           /*tp_name*/
+    sizeof(Backoff),                            /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    0,                                          /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /*tp_flags*/
+    Backoff_class_doc,                          /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    Backoff_methods,                            /*tp_methods*/
+    Backoff_members,                            /*tp_members*/
+    0,                                          /*tp_getset*/
+    0,                                          /*tp_base, Timer_type*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    0,                                          /*tp_alloc*/
+    Backoff_new,                                /*tp_new*/
+};
+
+/* A Stopwatch only measures. It never goes near the scheduler, so start()
+   and stop() are a clock read each. */
+typedef struct {
+    PyObject_HEAD
+    BOOL started;
+    int64_t start_time; /* Engine clock, nanoseconds */
+    int64_t elapsed; /* Nanoseconds, once stopped */
+    int64_t lap_time; /* Engine clock at the last lap, or start */
+    int64_t *laps; /* Ring of lap times in nanoseconds */
+    Py_ssize_t lap_capacity;
+    Py_ssize_t lap_count; /* Laps since start, the newest is at
+                             (lap_count - 1 + lap_offset) % lap_capacity */
+    Py_ssize_t lap_offset; /* Moved by Stopwatch_buffer turning the ring */
+    Py_ssize_t exports; /* Buffers of the laps not yet released */
+    Py_ssize_t exported; /* Laps in them */
+    PyObject *histogram; /* Records stop() and lap() times, or NULL */
+} Stopwatch;
+
+static PyObject *
+Stopwatch_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"laps", NULL};
+    Stopwatch *self;
+    Py_ssize_t capacity = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n:Stopwatch", kwlist,
+                                     &capacity))
+        return NULL;
+    if (capacity < 0) {
+        PyErr_SetString(PyExc_ValueError, "laps must not be negative");
+        return NULL;
+    }
+
+    self = (Stopwatch*)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+
+    if (capacity > 0) {
+        self->laps = (int64_t*)PyMem_Malloc(capacity * sizeof(int64_t));
+        if (self->laps == NULL) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+        self->lap_capacity = capacity;
+    }
+
+    return (PyObject*)self;
+}
+
+static void
+Stopwatch_dealloc(Stopwatch *self)
+{
+    PyMem_Free(self->laps);
+    Py_XDECREF(self->histogram);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int64_t
+Stopwatch_elapsed(Stopwatch *self)
+{
+    if (self->started)
+        return timer_clock_ns() - self->start_time;
+    return self->elapsed;
+}
+
+PyDoc_STRVAR(Stopwatch_start_doc,
+"start()\n"
+"\n"
+"Start measuring from now.");
+
+/* Laps can't change under an exported buffer of them. */
+static BOOL
+Stopwatch_exported(Stopwatch *self)
+{
+    if (self->exports == 0)
+        return FALSE;
+    PyErr_SetString(PyExc_BufferError,
+                    "laps can't be recorded while exported as a buffer");
+    return TRUE;
+}
+
+/* What start() does, also on entering a with block and on each call of
+   a function it decorates. */
+static BOOL
+stopwatch_begin(Stopwatch *self)
+{
+    if (Stopwatch_exported(self))
+        return FALSE;
+    self->elapsed = 0;
+    self->start_time = timer_clock_ns();
+    self->lap_time = self->start_time;
+    self->lap_count = 0;
+    self->lap_offset = 0;
+    self->started = TRUE;
+    return TRUE;
+}
+
+/* And what stop() does, without creating the result. */
+static void
+stopwatch_end(Stopwatch *self)
+{
+    if (self->started) {
+        self->elapsed = timer_clock_ns() - self->start_time;
+        self->started = FALSE;
+        RECORD_BOUND(self->histogram, self->elapsed);
+    }
+}
+
+static PyObject *
+Stopwatch_start(Stopwatch *self)
+{
+    if (!stopwatch_begin(self))
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Stopwatch_lap_doc,
+"lap()\n"
+"\n"
+"Record the time since the previous lap, or since start(), in the lap\n"
+"buffer and the histogram. Once the buffer is full the oldest lap is\n"
+"overwritten. Raises BufferError while the laps are exported.");
+
+static PyObject *
+Stopwatch_lap(Stopwatch *self)
+{
+    int64_t now;
+
+    if (!self->started) {
+        PyErr_SetString(PyExc_RuntimeError, "Stopwatch is not running");
+        return NULL;
+    }
+    if (self->lap_capacity == 0 && self->histogram == NULL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Stopwatch has no lap buffer or histogram");
+        return NULL;
+    }
+    if (Stopwatch_exported(self))
+        return NULL;
+
+    now = timer_clock_ns();
+    if (self->lap_capacity > 0)
+        self->laps[(self->lap_count + self->lap_offset) %
+                   self->lap_capacity] = now - self->lap_time;
+    RECORD_BOUND(self->histogram, now - self->lap_time);
+    self->lap_time = now;
+    self->lap_count++;
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Stopwatch_laps_doc,
+"laps()\n"
+"\n"
+"Return the recorded laps in nanoseconds, oldest first, as an\n"
+"array.array('q'). On Python 2, whose array has no 'q', a list.");
+
+static PyObject *
+Stopwatch_laps(Stopwatch *self)
+{
+    Py_ssize_t count, first;
+    PyObject *rslt;
+#ifdef PYTHON3
+    PyObject *array, *bytes, *call_rslt;
+    Py_ssize_t tail;
+    char *buf;
+#else
+    PyObject *item;
+    Py_ssize_t i;
+#endif
+
+    count = self->lap_count < self->lap_capacity ?
+            self->lap_count : self->lap_capacity;
+    first = self->lap_count - count + self->lap_offset;
+    first = self->lap_capacity > 0 ? first % self->lap_capacity : 0;
+
+#ifdef PYTHON3
+    array = PyImport_ImportModule("array");
+    if (array == NULL)
+        return NULL;
+    rslt = PyObject_CallMethod(array, "array", "s", "q");
+    Py_DECREF(array);
+    if (rslt == NULL)
+        return NULL;
+
+    bytes = PyBytes_FromStringAndSize(NULL, count * sizeof(int64_t));
+    if (bytes == NULL)
+        goto fail;
+    buf = PyBytes_AS_STRING(bytes);
+    if (count > 0) {
+        /* From first up to the end of the ring, then from its start. */
+        tail = count < self->lap_capacity - first ?
+               count : self->lap_capacity - first;
+        memcpy(buf, self->laps + first, tail * sizeof(int64_t));
+        memcpy(buf + tail * sizeof(int64_t), self->laps,
+               (count - tail) * sizeof(int64_t));
+    }
+
+    call_rslt = PyObject_CallMethod(rslt, "frombytes", "O", bytes);
+    Py_DECREF(bytes);
+    if (call_rslt == NULL)
+        goto fail;
+    Py_DECREF(call_rslt);
+    return rslt;
+
+fail:
+    Py_DECREF(rslt);
+    return NULL;
+#else
+    rslt = PyList_New(count);
+    if (rslt == NULL)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        item = PyLong_FromLongLong(self->laps[(first + i) %
+                                              self->lap_capacity]);
+        if (item == NULL) {
+            Py_DECREF(rslt);
+            return NULL;
+        }
+        PyList_SET_ITEM(rslt, i, item);
+    }
+    return rslt;
+#endif
+}
+
+/* Reverse laps[from, to). */
+static void
+laps_reverse(int64_t *laps, Py_ssize_t from, Py_ssize_t to)
+{
+    int64_t lap;
+
+    while (from < --to) {
+        lap = laps[from];
+        laps[from++] = laps[to];
+        laps[to] = lap;
+    }
+}
+
+/* The laps, oldest first, read-only and without copying them, as an
+   array of int64. A ring that wrapped is turned in place first, so the
+   oldest lap is at its start; lap_offset keeps where the next goes. */
+static int
+Stopwatch_buffer(Stopwatch *self, Py_buffer *view, int flags)
+{
+    Py_ssize_t first, capacity = self->lap_capacity;
+
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "Stopwatch laps are read-only");
+        view->obj = NULL;
+        return -1;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (self->exports == 0) {
+        self->exported = self->lap_count < capacity ?
+                         self->lap_count : capacity;
+        first = capacity > 0 ? (self->lap_count - self->exported +
+                                self->lap_offset) % capacity : 0;
+        if (first != 0) {
+            laps_reverse(self->laps, 0, first);
+            laps_reverse(self->laps, first, capacity);
+            laps_reverse(self->laps, 0, capacity);
+            self->lap_offset = (self->lap_offset - first + capacity) %
+                               capacity;
+        }
+    }
+    view->buf = self->laps != NULL ? (void*)self->laps : (void*)&self->laps;
+    view->obj = (PyObject*)self;
+    Py_INCREF(self);
+    view->len = self->exported * (Py_ssize_t)sizeof(int64_t);
+    view->readonly = 1;
+    view->itemsize = sizeof(int64_t);
+    view->format = (flags & PyBUF_FORMAT) ? "q" : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->exported : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ?
+                    &view->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    self->exports++;
+    Py_END_CRITICAL_SECTION();
+    return 0;
+}
+
+static void
+Stopwatch_release_buffer(Stopwatch *self, Py_buffer *view)
+{
+    Py_BEGIN_CRITICAL_SECTION(self);
+    self->exports--;
+    Py_END_CRITICAL_SECTION();
+}
+
+static PyBufferProcs Stopwatch_as_buffer = BUFFER_PROCS(
+    Stopwatch_buffer, Stopwatch_release_buffer);
+
+PyDoc_STRVAR(Stopwatch_stop_doc,
+"stop()\n"
+"\n"
+"Stop measuring. Returns the elapsed time in microseconds.");
+
+static PyObject *
+Stopwatch_stop(Stopwatch *self)
+{
+    stopwatch_end(self);
+    return PyLong_FromLongLong(self->elapsed / 1000);
+}
+
+PyDoc_STRVAR(Stopwatch_reset_doc,
+"reset()\n"
+"\n"
+"Stop measuring and set elapsed to 0.");
+
+static PyObject *
+Stopwatch_reset(Stopwatch *self)
+{
+    self->started = FALSE;
+    self->elapsed = 0;
+
+    Py_RETURN_NONE;
+}
+
+/* A with block starts and stops the stopwatch. Neither creates an object:
+   __enter__ returns the stopwatch itself, __exit__ False, and where the
+   interpreter has vectorcall __exit__ takes its arguments without a
+   tuple. */
+static PyObject *
+Stopwatch_enter(Stopwatch *self)
+{
+    if (!stopwatch_begin(self))
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject *
+Stopwatch_exit(Stopwatch *self)
+{
+    stopwatch_end(self);
+    Py_RETURN_FALSE;
+}
+
+#ifdef HAVE_VECTORCALL
+#define STOPWATCH_EXIT_FLAGS METH_FASTCALL
+
+static PyObject *
+Stopwatch_exit_locked(Stopwatch *self, PyObject *const *args,
+                      Py_ssize_t nargs)
+{
+    PyObject *result;
+
+    (void)args;
+    if (nargs != 3) {
+        PyErr_Format(PyExc_TypeError,
+                     "__exit__ expected 3 arguments, got %zd", nargs);
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    result = Stopwatch_exit(self);
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+#else
+#define STOPWATCH_EXIT_FLAGS METH_VARARGS
+
+static PyObject *
+Stopwatch_exit_locked(Stopwatch *self, PyObject *args)
+{
+    PyObject *exc_type, *exc, *tb;
+
+    if (!PyArg_ParseTuple(args, "OOO:__exit__", &exc_type, &exc, &tb))
+        return NULL;
+    return Stopwatch_exit(self);
+}
+#endif
+
+static PyObject *Profile_create(PyObject *histogram, PyObject *func,
+                                Stopwatch *stopwatch);
+
+/* Decorating a function with a stopwatch times its calls with it. */
+static PyObject *
+Stopwatch_call(Stopwatch *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *func;
+
+    if (!PyArg_ParseTuple(args, "O:Stopwatch", &func))
+        return NULL;
+    if (kwargs != NULL && PyDict_Size(kwargs) != 0) {
+        PyErr_SetString(PyExc_TypeError,
+                        "Stopwatch takes no keyword arguments");
+        return NULL;
+    }
+    return Profile_create(NULL, func, self);
+}
+
+CRITICAL_NOARGS(Stopwatch_start, Stopwatch)
+CRITICAL_NOARGS(Stopwatch_lap, Stopwatch)
+CRITICAL_NOARGS(Stopwatch_laps, Stopwatch)
+CRITICAL_NOARGS(Stopwatch_stop, Stopwatch)
+CRITICAL_NOARGS(Stopwatch_reset, Stopwatch)
+CRITICAL_NOARGS(Stopwatch_enter, Stopwatch)
+
+static PyMethodDef Stopwatch_methods[] = {
+    {"start", (PyCFunction)Stopwatch_start_locked, METH_NOARGS,
+     Stopwatch_start_doc},
+    {"lap", (PyCFunction)Stopwatch_lap_locked, METH_NOARGS, Stopwatch_lap_doc},
+    {"laps", (PyCFunction)Stopwatch_laps_locked, METH_NOARGS,
+     Stopwatch_laps_doc},
+    {"stop", (PyCFunction)Stopwatch_stop_locked, METH_NOARGS,
+     Stopwatch_stop_doc},
+    {"reset", (PyCFunction)Stopwatch_reset_locked, METH_NOARGS,
+     Stopwatch_reset_doc},
+    {"__enter__", (PyCFunction)Stopwatch_enter_locked, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)(void(*)(void))Stopwatch_exit_locked,
+     STOPWATCH_EXIT_FLAGS, NULL},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(Stopwatch_running_doc,
+"Boolean representing whether or not the stopwatch is measuring.");
+
+PyDoc_STRVAR(Stopwatch_lap_count_doc,
+"Number of laps recorded since start(), including overwritten ones.");
+
+static PyMemberDef Stopwatch_members[] = {
+    {"running", T_BOOL, offsetof(Stopwatch, started), READONLY,
+     Stopwatch_running_doc},
+    {"lap_count", T_PYSSIZET, offsetof(Stopwatch, lap_count), READONLY,
+     Stopwatch_lap_count_doc},
+    {NULL}
+};
+
+static PyObject *
+Stopwatch_get_elapsed(Stopwatch *self, void *closure)
+{
+    return PyLong_FromLongLong(Stopwatch_elapsed(self) / TIME_UNIT(closure));
+}
+
+PyDoc_STRVAR(Stopwatch_elapsed_doc,
+"Integer representing the elapsed time in microseconds. It is read from\n"
+"the clock while the stopwatch is running.");
+
+PyDoc_STRVAR(Stopwatch_elapsed_ns_doc,
+"The elapsed time in nanoseconds, see elapsed.");
+
+static PyGetSetDef Stopwatch_getset[] = {
+    {"elapsed", (getter)Stopwatch_get_elapsed, NULL,
+     Stopwatch_elapsed_doc, (void*)1000},
+    {"elapsed_ns", (getter)Stopwatch_get_elapsed, NULL,
+     Stopwatch_elapsed_ns_doc, (void*)1},
+    {"histogram", (getter)get_bound_histogram, (setter)set_bound_histogram,
+     bound_histogram_doc, (void*)offsetof(Stopwatch, histogram)},
+    {NULL}
+};
+
+PyDoc_STRVAR(Stopwatch_class_doc,
+"Stopwatch(laps=0)\n"
+"\n"
+"Measures time on the same clock as Timer, without a callback and without\n"
+"involving the scheduler thread. laps is the capacity of the buffer\n"
+"lap() records into, which is exported, oldest first, as a read-only\n"
+"buffer of int64 nanoseconds. A with block is timed from entering it to\n"
+"leaving it, and a function decorated with a Stopwatch on every call.");
+
+static PyTypeObject Stopwatch_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.Stopwatch",                         /*tp_name*/
+    sizeof(Stopwatch),                          /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    (destructor)Stopwatch_dealloc,              /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    (ternaryfunc)Stopwatch_call,                /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    &Stopwatch_as_buffer,                       /*tp_as_buffer*/
+    BUFFER_FLAGS,                               /*tp_flags*/
+    Stopwatch_class_doc,                        /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    Stopwatch_methods,                          /*tp_methods*/
+    Stopwatch_members,                          /*tp_members*/
+    Stopwatch_getset,                           /*tp_getset*/
+    0,                                          /*tp_base*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    PyType_GenericAlloc,                        /*tp_alloc*/
+    Stopwatch_new,                              /*tp_new*/
+};
+
+
+static PyObject *
+Channel_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {NULL};
+#ifdef UNIX
+    Channel *self;
+    int fds[2];
+#endif
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":Channel", kwlist))
+        return NULL;
+#ifdef MS_WINDOWS
+    /* Selector loops there only watch sockets. */
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "channels are not supported on Windows");
+    return NULL;
+#elif defined(UNIX)
+#ifdef HAVE_TIMERFD /* Which means eventfd too */
+    fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fds[0] < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+#else
+    if (pipe(fds) < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+    self = (Channel*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        close(fds[0]);
+        if (fds[1] != fds[0])
+            close(fds[1]);
+        return NULL;
+    }
+    lock_init(&self->lock);
+    self->first = self->last = NULL;
+    self->read_fd = fds[0];
+    self->write_fd = fds[1];
+    return (PyObject*)self;
+#endif
+}
+
+static void
+Channel_close_fds(Channel *self)
+{
+#ifdef UNIX
+    lock_acquire(&self->lock);
+    if (self->read_fd >= 0) {
+        close(self->read_fd);
+        if (self->write_fd != self->read_fd)
+            close(self->write_fd);
+        self->read_fd = self->write_fd = -1;
+    }
+    lock_release(&self->lock);
+#endif
+}
+
+static void
+Channel_dealloc(Channel *self)
+{
+    /* Delivered nodes hold a reference, so there are none left. */
+    Channel_close_fds(self);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+PyDoc_STRVAR(Channel_fileno_doc,
+"fileno()\n"
+"\n"
+"Return the file descriptor that becomes readable when callbacks are\n"
+"waiting for drain().");
+
+static PyObject *
+Channel_fileno(Channel *self)
+{
+    if (self->read_fd < 0) {
+        PyErr_SetString(PyExc_ValueError, "channel is closed");
+        return NULL;
+    }
+    return PyLong_FromLong(self->read_fd);
+}
+
+PyDoc_STRVAR(Channel_drain_doc,
+"drain() -> int\n"
+"\n"
+"Run the callbacks of the timers delivered so far in this thread and\n"
+"make fileno() unreadable again. Returns the number of callbacks run.");
+
+static PyObject *
+Channel_drain(Channel *self)
+{
+    timer_node *due, *node;
+    int64_t now;
+    Py_ssize_t fired = 0;
+#ifdef UNIX
+    char buffer[64];
+
+    /* Clear the descriptor before taking the nodes. A delivery after this
+       either lands in the batch or makes it readable again. */
+    if (self->read_fd >= 0) {
+        while (read(self->read_fd, buffer, sizeof(buffer)) > 0)
+            ;
+    }
+#endif
+
+    lock_acquire(&self->lock);
+    due = self->first;
+    self->first = self->last = NULL;
+    lock_release(&self->lock);
+
+    now = timer_clock_ns();
+    while (due != NULL) {
+        node = due;
+        due = node->next;
+        if (Timer_expire(node, now))
+            fired++;
+    }
+
+    return PyLong_FromSsize_t(fired);
+}
+
+PyDoc_STRVAR(Channel_close_doc,
+"close()\n"
+"\n"
+"Close the file descriptor. Timers still deliver to the channel, but\n"
+"only drain() notices.");
+
+static PyObject *
+Channel_close(Channel *self)
+{
+    Channel_close_fds(self);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Channel_methods[] = {
+    {"fileno", (PyCFunction)Channel_fileno, METH_NOARGS, Channel_fileno_doc},
+    {"drain", (PyCFunction)Channel_drain, METH_NOARGS, Channel_drain_doc},
+    {"close", (PyCFunction)Channel_close, METH_NOARGS, Channel_close_doc},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(Channel_class_doc,
+"Channel()\n"
+"\n"
+"Receives the expirations of timers whose channel attribute is set to it,\n"
+"so their callbacks run in the thread that calls drain(), typically an\n"
+"event loop watching fileno(), instead of on the scheduler thread.");
+
+static PyTypeObject Channel_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.Channel",                           /*tp_name*/
+    sizeof(Channel),                            /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    (destructor)Channel_dealloc,                /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,                         /*tp_flags*/
+    Channel_class_doc,                          /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    Channel_methods,                            /*tp_methods*/
+    0,                                          /*tp_members*/
+    0,                                          /*tp_getset*/
+    0,                                          /*tp_base*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    PyType_GenericAlloc,                        /*tp_alloc*/
+    Channel_new,                                /*tp_new*/
+};
+
+
+/* Timer service, one scheduler for a host's worker processes. The daemon
+   calls serve(), which lays out a file with a block for each client and
+   starts a service thread. A Remote in a worker claims a free block and
+   puts requests in its ring; the service thread turns them into C API
+   nodes of the daemon's engine, whose callbacks put records in the
+   block's other ring. Each side sleeps on a FIFO, path.wake for the
+   service thread and path.N for the client of block N, and the other
+   writes it a byte only when it has said it is idle, the handshake
+   sleep_until and submitted use. A record is owed for every id armed,
+   one reset each for the client that left the block and the one that
+   claimed it, and stale ones from before that, so rings of twice the
+   capacity never fill. Deadlines are on the engine clock, the host's
+   monotonic clock, so they are the same in every process. */
+#define SERVICE_MAGIC "PYTIMSV\0"
+#define SERVICE_VERSION 1
+#define SERVICE_MAX_CLIENTS 4096
+#define SERVICE_MAX_CAPACITY (1 << 20)
+
+enum {
+    SERVICE_ARM,    /* Call id back at deadline */
+    SERVICE_CANCEL,
+    SERVICE_RESET   /* Cancel every id, deadline is the claim's tag */
+};
+
+enum {
+    SERVICE_FIRED,
+    SERVICE_CANCELLED,
+    SERVICE_RESET_DONE /* id is the tag */
+};
+
+typedef struct {
+    int64_t deadline;
+    uint32_t id;
+    uint32_t op;
+} service_request;
+
+typedef struct {
+    uint32_t id;
+    uint32_t kind;
+} service_record;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t clients;
+    uint32_t capacity; /* Ids per client */
+    uint32_t ring; /* Entries in each ring, a power of two */
+    int64_t pid; /* Of the daemon */
+    uint64_t block_size;
+    volatile uint32_t idle; /* The service thread is going to sleep */
+    char reserved[20];
+} service_header;
+
+/* Each party's indexes on cache lines of their own. requests and then
+   records follow. */
+typedef struct {
+    volatile int64_t owner; /* pid of the client, 0 free */
+    volatile uint32_t generation; /* Claims so far, tags their resets */
+    char pad0[52];
+    volatile uint64_t requests_head; /* Client's */
+    char pad1[56];
+    volatile uint64_t requests_tail; /* Service's */
+    char pad2[56];
+    volatile uint64_t records_head; /* Service's */
+    char pad3[56];
+    volatile uint64_t records_tail; /* Client's */
+    volatile uint32_t client_idle;
+    char pad4[52];
+} service_block;
+
+#define SERVICE_BLOCK(header, i) ((service_block*)((char*)(header) + \
+    sizeof(service_header) + (size_t)(i) * (header)->block_size))
+#define SERVICE_REQUESTS(block) ((service_request*)((block) + 1))
+#define SERVICE_RECORDS(block, ring) \
+    ((service_record*)(SERVICE_REQUESTS(block) + (ring)))
+
+#ifdef UNIX
+/* The daemon's side. handles[client * capacity + id] is the node of an
+   armed id, only changed with locks[client] held, so the node's callback
+   and a cancel can't both report it. */
+typedef struct {
+    mapped_file map;
+    service_header *header;
+    int wake_fd;
+    int *client_fds;
+    timer_lock *locks;
+    timer_api_handle **handles;
+    pthread_t thread;
+} timer_service;
+
+static timer_service *service;
+
+/* Put a record in a client's ring. Called with its lock held. */
+static void
+service_put(uint32_t client, uint32_t id, uint32_t kind)
+{
+    service_block *block = SERVICE_BLOCK(service->header, client);
+    uint64_t head = block->records_head;
+    service_record *record;
+
+    record = &SERVICE_RECORDS(block, service->header->ring)[
+        head & (service->header->ring - 1)];
+    record->id = id;
+    record->kind = kind;
+    __atomic_store_n(&block->records_head, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&block->client_idle, 0, __ATOMIC_SEQ_CST)) {
+        if (write(service->client_fds[client], "", 1) < 0) {
+            /* Full, it is readable already. */
+        }
+    }
+}
+
+/* C API callback of an armed id, on a scheduler thread. */
+static void
+service_fire(void *arg)
+{
+    uint32_t index = (uint32_t)(uintptr_t)arg;
+    uint32_t capacity = service->header->capacity;
+    uint32_t client = index / capacity;
+
+    lock_acquire(&service->locks[client]);
+    if (service->handles[index] != NULL) {
+        service->handles[index] = NULL;
+        service_put(client, index % capacity, SERVICE_FIRED);
+    }
+    lock_release(&service->locks[client]);
+}
+
+/* Cancel an armed id, if it is. Called with its client's lock held. A
+   callback that is already running waits for the lock and then finds
+   nothing to report. */
+static BOOL
+service_drop(uint32_t index)
+{
+    timer_api_handle *handle = service->handles[index];
+
+    if (handle == NULL)
+        return FALSE;
+    capi_cancel(handle);
+    service->handles[index] = NULL;
+    return TRUE;
+}
+
+static void
+service_handle(uint32_t client, service_request *request)
+{
+    uint32_t capacity = service->header->capacity, id;
+    uint32_t index = client * capacity + request->id;
+    timer_api_handle *handle;
+
+    lock_acquire(&service->locks[client]);
+    switch (request->op) {
+    case SERVICE_ARM:
+        if (request->id >= capacity)
+            break;
+        service_drop(index);
+        /* Held across, so the callback can't look before it is set. */
+        handle = capi_schedule(request->deadline, service_fire,
+                               (void*)(uintptr_t)index);
+        if (handle != NULL)
+            service->handles[index] = handle;
+        else
+            /* Firing early beats never firing. */
+            service_put(client, request->id, SERVICE_FIRED);
+        break;
+    case SERVICE_CANCEL:
+        if (request->id < capacity && service_drop(index))
+            service_put(client, request->id, SERVICE_CANCELLED);
+        break;
+    case SERVICE_RESET:
+        for (id = 0; id < capacity; id++)
+            service_drop(client * capacity + id);
+        service_put(client, (uint32_t)request->deadline, SERVICE_RESET_DONE);
+        break;
+    }
+    lock_release(&service->locks[client]);
+}
+
+/* Take and handle requests from every block. Returns TRUE if there were
+   any. */
+static BOOL
+service_poll(void)
+{
+    service_header *header = service->header;
+    service_block *block;
+    uint64_t tail, head;
+    uint32_t i;
+    BOOL busy = FALSE;
+
+    for (i = 0; i < header->clients; i++) {
+        block = SERVICE_BLOCK(header, i);
+        tail = block->requests_tail;
+        head = __atomic_load_n(&block->requests_head, __ATOMIC_SEQ_CST);
+        if (tail == head)
+            continue;
+        for (; tail != head; tail++)
+            service_handle(i, &SERVICE_REQUESTS(block)[
+                tail & (header->ring - 1)]);
+        __atomic_store_n(&block->requests_tail, tail, __ATOMIC_SEQ_CST);
+        busy = TRUE;
+    }
+    return busy;
+}
+
+static void *
+service_thread(void *data)
+{
+    service_header *header = service->header;
+    char buffer[64];
+    uint32_t i;
+    BOOL waiting;
+
+    while (1) {
+        if (service_poll())
+            continue;
+        __atomic_store_n(&header->idle, 1, __ATOMIC_SEQ_CST);
+        /* A client that pushed before it could see idle. */
+        waiting = FALSE;
+        for (i = 0; i < header->clients && !waiting; i++) {
+            waiting = SERVICE_BLOCK(header, i)->requests_tail !=
+                __atomic_load_n(&SERVICE_BLOCK(header, i)->requests_head,
+                                __ATOMIC_SEQ_CST);
+        }
+        if (!waiting) {
+            if (read(service->wake_fd, buffer, sizeof(buffer)) < 0) {
+                /* Interrupted, look again. */
+            }
+        }
+        __atomic_store_n(&header->idle, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/* Make the FIFO path.suffix and open it for reading and writing, which
+   it can be without the other side. Returns -1 with an exception set. */
+static int
+service_fifo(const char *path, const char *suffix, int flags)
+{
+    char name[4096];
+    int fd;
+
+    if (PyOS_snprintf(name, sizeof(name), "%s.%s", path, suffix) >=
+        (int)sizeof(name)) {
+        PyErr_SetString(PyExc_ValueError, "path is too long");
+        return -1;
+    }
+    unlink(name);
+    if (mkfifo(name, 0600) < 0 ||
+        (fd = open(name, O_RDWR | O_CLOEXEC | flags)) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, name);
+        return -1;
+    }
+    return fd;
+}
+#endif /* UNIX */
+
+/* Entries in each ring for capacity ids, see above. */
+static uint32_t
+service_ring(uint32_t capacity)
+{
+    uint32_t ring = 1;
+
+    while (ring < 2 * capacity + 2)
+        ring <<= 1;
+    return ring;
+}
+
+PyDoc_STRVAR(module_serve_doc,
+"serve(path, clients=64, capacity=4096)\n"
+"\n"
+"Make this process the host's timer service: lay out a file at path\n"
+"with room for clients worker processes, each with up to capacity\n"
+"pending timers, and start a thread that runs their timers on this\n"
+"process's scheduler. Workers use them through Remote(path). Not\n"
+"available on Windows.");
+
+static PyObject *
+module_serve(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "clients", "capacity", NULL};
+    const char *path;
+    Py_ssize_t clients = 64, capacity = 4096;
+#ifdef UNIX
+    timer_service *made;
+    service_header *header;
+    uint32_t ring, i;
+    size_t block_size;
+    char suffix[16];
+#endif
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|nn:serve", kwlist,
+                                     &path, &clients, &capacity))
+        return NULL;
+#ifdef MS_WINDOWS
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "the timer service is not supported on Windows");
+    return NULL;
+#elif defined(UNIX)
+    if (clients < 1 || clients > SERVICE_MAX_CLIENTS) {
+        PyErr_Format(PyExc_ValueError, "clients must be between 1 and %d",
+                     SERVICE_MAX_CLIENTS);
+        return NULL;
+    }
+    if (capacity < 1 || capacity > SERVICE_MAX_CAPACITY) {
+        PyErr_Format(PyExc_ValueError, "capacity must be between 1 and %d",
+                     SERVICE_MAX_CAPACITY);
+        return NULL;
+    }
+    if (service != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "already serving");
+        return NULL;
+    }
+    if (capi_start() < 0)
+        return NULL;
+
+    made = (timer_service*)calloc(1, sizeof(timer_service));
+    if (made == NULL)
+        return PyErr_NoMemory();
+    made->wake_fd = -1;
+    made->client_fds = (int*)malloc(clients * sizeof(int));
+    made->locks = (timer_lock*)malloc(clients * sizeof(timer_lock));
+    made->handles = (timer_api_handle**)calloc(
+        (size_t)clients * capacity, sizeof(timer_api_handle*));
+    if (made->client_fds == NULL || made->locks == NULL ||
+        made->handles == NULL) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+    for (i = 0; i < (uint32_t)clients; i++)
+        made->client_fds[i] = -1;
+
+    ring = service_ring((uint32_t)capacity);
+    block_size = sizeof(service_block) + ring * (sizeof(service_request) +
+                                                 sizeof(service_record));
+    block_size = (block_size + 63) & ~(size_t)63;
+    if (!map_file(&made->map, path,
+                  sizeof(service_header) + clients * block_size))
+        goto fail;
+    header = (service_header*)made->map.memory;
+    header->version = SERVICE_VERSION;
+    header->clients = (uint32_t)clients;
+    header->capacity = (uint32_t)capacity;
+    header->ring = ring;
+    header->pid = (int64_t)getpid();
+    header->block_size = block_size;
+    made->header = header;
+
+    made->wake_fd = service_fifo(path, "wake", 0);
+    if (made->wake_fd < 0)
+        goto fail;
+    for (i = 0; i < (uint32_t)clients; i++) {
+        lock_init(&made->locks[i]);
+        PyOS_snprintf(suffix, sizeof(suffix), "%u", (unsigned int)i);
+        made->client_fds[i] = service_fifo(path, suffix, O_NONBLOCK);
+        if (made->client_fds[i] < 0)
+            goto fail;
+    }
+
+    service = made;
+    if (!thread_start(&made->thread, service_thread, NULL)) {
+        service = NULL;
+        PyErr_SetString(PyExc_OSError,
+                        "pthread_create error. Unable to start service thread");
+        goto fail;
+    }
+    threads_started++;
+    /* Clients check the magic last. */
+    WRITE_BARRIER();
+    memcpy(header->magic, SERVICE_MAGIC, sizeof(header->magic));
+    Py_RETURN_NONE;
+
+fail:
+    if (made->map.memory != NULL)
+        unmap_file(&made->map);
+    if (made->wake_fd >= 0)
+        close(made->wake_fd);
+    for (i = 0; made->client_fds != NULL && i < (uint32_t)clients; i++) {
+        if (made->client_fds[i] >= 0)
+            close(made->client_fds[i]);
+    }
+    free(made->client_fds);
+    free(made->locks);
+    free(made->handles);
+    free(made);
+    return NULL;
+#endif
+}
+
+
+/* A worker's connection to the timer service, see module_serve. Ids are
+   handed out from free_ids and only go back once their record has come,
+   so the service never sees an id reused early. */
+enum {
+    REMOTE_FREE,
+    REMOTE_ARMED,
+    REMOTE_CANCELLING /* Its record is dropped, whichever it is */
+};
+
+typedef struct {
+    PyObject_HEAD
+    void *memory; /* The mapped file, NULL once closed */
+    size_t size;
+    service_header *header;
+    service_block *block;
+    uint32_t tag; /* Of this claim */
+    BOOL synced; /* Seen the reset of this claim */
+    int fd; /* path.N */
+    int wake_fd; /* path.wake */
+    PyObject **keys; /* By id */
+    char *states;
+    uint32_t *free_ids;
+    uint32_t free_count;
+} Remote;
+
+#ifdef UNIX
+static void
+Remote_push(Remote *self, uint32_t op, uint32_t id, int64_t deadline)
+{
+    service_block *block = self->block;
+    uint64_t head = block->requests_head;
+    service_request *request;
+
+    request = &SERVICE_REQUESTS(block)[head & (self->header->ring - 1)];
+    request->deadline = deadline;
+    request->id = id;
+    request->op = op;
+    __atomic_store_n(&block->requests_head, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&self->header->idle, 0, __ATOMIC_SEQ_CST)) {
+        if (write(self->wake_fd, "", 1) < 0) {
+            /* Full, the service thread is awake anyway. */
+        }
+    }
+}
+
+/* Open path.suffix, made by the service. */
+static int
+Remote_open_fifo(const char *path, const char *suffix, int flags)
+{
+    char name[4096];
+    int fd;
+
+    PyOS_snprintf(name, sizeof(name), "%s.%s", path, suffix);
+    fd = open(name, flags | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, name);
+    return fd;
+}
+
+/* Claim a free block, or one whose client has died. */
+static service_block *
+Remote_claim(service_header *header, uint32_t *index)
+{
+    service_block *block;
+    int64_t owner, pid = (int64_t)getpid();
+    uint32_t i;
+
+    for (i = 0; i < header->clients; i++) {
+        block = SERVICE_BLOCK(header, i);
+        owner = block->owner;
+        if (owner != 0 && (kill((pid_t)owner, 0) == 0 || errno != ESRCH))
+            continue;
+        if (__atomic_compare_exchange_n(&block->owner, &owner, pid, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            *index = i;
+            return block;
+        }
+    }
+    return NULL;
+}
+#endif /* UNIX */
+
+static void
+Remote_close_all(Remote *self)
+{
+    uint32_t id, capacity;
+
+    if (self->memory == NULL)
+        return;
+    capacity = self->header->capacity;
+#ifdef UNIX
+    /* Cancels whatever is left, and frees the block for the next one. */
+    Remote_push(self, SERVICE_RESET, 0, 0);
+    __atomic_store_n(&self->block->owner, 0, __ATOMIC_SEQ_CST);
+    munmap(self->memory, self->size);
+    close(self->fd);
+    close(self->wake_fd);
+#endif
+    self->memory = NULL;
+    for (id = 0; id < capacity; id++) {
+        if (self->states[id] != REMOTE_FREE)
+            Py_DECREF(self->keys[id]);
+    }
+    free(self->keys);
+    free(self->states);
+    free(self->free_ids);
+    self->keys = NULL;
+}
+
+static PyObject *
+Remote_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", NULL};
+    const char *path;
+#ifdef UNIX
+    Remote *self;
+    service_header header, *shared;
+    struct stat status;
+    char suffix[16];
+    uint32_t index, id;
+    void *memory;
+    int fd;
+#endif
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s:Remote", kwlist,
+                                     &path))
+        return NULL;
+#ifdef MS_WINDOWS
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "the timer service is not supported on Windows");
+    return NULL;
+#elif defined(UNIX)
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char*)path);
+    if (fstat(fd, &status) < 0 || status.st_size < (off_t)sizeof(header)) {
+        close(fd);
+        PyErr_SetString(PyExc_ValueError, "not a timer service file");
+        return NULL;
+    }
+    memory = mmap(NULL, (size_t)status.st_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char*)path);
+    shared = (service_header*)memory;
+    header = *shared;
+    if (memcmp(header.magic, SERVICE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SERVICE_VERSION ||
+        sizeof(header) + header.clients * header.block_size >
+            (uint64_t)status.st_size) {
+        munmap(memory, (size_t)status.st_size);
+        PyErr_SetString(PyExc_ValueError, "not a timer service file");
+        return NULL;
+    }
+
+    self = (Remote*)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        munmap(memory, (size_t)status.st_size);
+        return NULL;
+    }
+    self->fd = self->wake_fd = -1;
+    self->keys = (PyObject**)malloc(header.capacity * sizeof(PyObject*));
+    self->states = (char*)calloc(header.capacity, 1);
+    self->free_ids = (uint32_t*)malloc(header.capacity * sizeof(uint32_t));
+    if (self->keys == NULL || self->states == NULL ||
+        self->free_ids == NULL) {
+        munmap(memory, (size_t)status.st_size);
+        free(self->keys);
+        free(self->states);
+        free(self->free_ids);
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    for (id = 0; id < header.capacity; id++)
+        self->free_ids[id] = header.capacity - 1 - id;
+    self->free_count = header.capacity;
+
+    /* The service's end of path.wake is open, so a failure here means
+       it is not running. */
+    self->wake_fd = Remote_open_fifo(path, "wake", O_WRONLY);
+    self->block = self->wake_fd < 0 ? NULL : Remote_claim(shared, &index);
+    if (self->block == NULL) {
+        if (self->wake_fd >= 0) {
+            close(self->wake_fd);
+            PyErr_SetString(PyExc_RuntimeError,
+                            "the timer service has no free client slots");
+        }
+        goto fail;
+    }
+    PyOS_snprintf(suffix, sizeof(suffix), "%u", (unsigned int)index);
+    self->fd = Remote_open_fifo(path, suffix, O_RDONLY);
+    if (self->fd < 0) {
+        __atomic_store_n(&self->block->owner, 0, __ATOMIC_SEQ_CST);
+        close(self->wake_fd);
+        goto fail;
+    }
+    self->memory = memory;
+    self->size = (size_t)status.st_size;
+    self->header = shared;
+
+    /* Whatever is in the ring is the last client's. Its ids may still
+       come, until the service has seen the reset. */
+    self->tag = __atomic_add_fetch(&self->block->generation, 1,
+                                   __ATOMIC_SEQ_CST);
+    self->block->records_tail = __atomic_load_n(&self->block->records_head,
+                                                __ATOMIC_SEQ_CST);
+    __atomic_store_n(&self->block->client_idle, 1, __ATOMIC_SEQ_CST);
+    Remote_push(self, SERVICE_RESET, 0, self->tag);
+    return (PyObject*)self;
+
+fail:
+    munmap(memory, (size_t)status.st_size);
+    free(self->keys);
+    free(self->states);
+    free(self->free_ids);
+    self->keys = NULL;
+    Py_DECREF(self);
+    return NULL;
+#endif
+}
+
+static void
+Remote_dealloc(Remote *self)
+{
+    Remote_close_all(self);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static BOOL
+Remote_check(Remote *self)
+{
+    if (self->memory == NULL) {
+        PyErr_SetString(PyExc_ValueError, "remote is closed");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Arm an id for key at an engine clock deadline. */
+static PyObject *
+Remote_arm(Remote *self, int64_t deadline, PyObject *key)
+{
+    uint32_t id;
+
+    if (!Remote_check(self))
+        return NULL;
+    if (self->free_count == 0) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "too many pending remote timers");
+        return NULL;
+    }
+    id = self->free_ids[--self->free_count];
+    Py_INCREF(key);
+    self->keys[id] = key;
+    self->states[id] = REMOTE_ARMED;
+#ifdef UNIX
+    Remote_push(self, SERVICE_ARM, id, deadline);
+#endif
+    return PyLong_FromUnsignedLong(id);
+}
+
+PyDoc_STRVAR(Remote_call_at_doc,
+"call_at(deadline_ns, key) -> handle\n"
+"\n"
+"Have the service expire key once its engine clock, the same as\n"
+"now_ns() in any process on the host, reaches deadline_ns. Returns a\n"
+"handle for cancel().");
+
+static PyObject *
+Remote_call_at(Remote *self, PyObject *args)
+{
+    long long deadline;
+    PyObject *key;
+
+    if (!PyArg_ParseTuple(args, "LO:call_at", &deadline, &key))
+        return NULL;
+    return Remote_arm(self, (int64_t)deadline, key);
+}
+
+PyDoc_STRVAR(Remote_call_later_doc,
+"call_later(delay, key) -> handle\n"
+"\n"
+"Have the service expire key delay microseconds from now.");
+
+static PyObject *
+Remote_call_later(Remote *self, PyObject *args)
+{
+    long long delay;
+    PyObject *key;
+
+    if (!PyArg_ParseTuple(args, "LO:call_later", &delay, &key))
+        return NULL;
+    /* The real clock, a virtual one is this process's own. */
+    return Remote_arm(self, real_clock_ns() + (int64_t)delay * 1000, key);
+}
+
+PyDoc_STRVAR(Remote_cancel_doc,
+"cancel(handle) -> bool\n"
+"\n"
+"Make sure a pending timer's key won't come out of drain(). Returns\n"
+"False if it is not pending.");
+
+static PyObject *
+Remote_cancel(Remote *self, PyObject *arg)
+{
+    unsigned long id = PyLong_AsUnsignedLong(arg);
+
+    if (id == (unsigned long)-1 && PyErr_Occurred())
+        return NULL;
+    if (!Remote_check(self))
+        return NULL;
+    if (id >= self->header->capacity || self->states[id] != REMOTE_ARMED)
+        Py_RETURN_FALSE;
+    self->states[id] = REMOTE_CANCELLING;
+#ifdef UNIX
+    Remote_push(self, SERVICE_CANCEL, (uint32_t)id, 0);
+#endif
+    Py_RETURN_TRUE;
+}
+
+PyDoc_STRVAR(Remote_drain_doc,
+"drain() -> list\n"
+"\n"
+"Return the keys of the timers that have expired since the last call,\n"
+"and make fileno() unreadable again.");
+
+static PyObject *
+Remote_drain(Remote *self)
+{
+    PyObject *result;
+    int failed = 0;
+#ifdef UNIX
+    service_block *block = self->block;
+    service_record record;
+    uint64_t tail, head;
+    char buffer[64];
+#endif
+
+    if (!Remote_check(self))
+        return NULL;
+    result = PyList_New(0);
+    if (result == NULL)
+        return NULL;
+#ifdef UNIX
+    /* Clear the FIFO first, a record after this makes it readable. */
+    while (read(self->fd, buffer, sizeof(buffer)) > 0)
+        ;
+    tail = block->records_tail;
+    while (1) {
+        head = __atomic_load_n(&block->records_head, __ATOMIC_SEQ_CST);
+        if (tail == head) {
+            __atomic_store_n(&block->records_tail, tail, __ATOMIC_SEQ_CST);
+            /* Once idle a record comes with a byte, see service_put. */
+            __atomic_store_n(&block->client_idle, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&block->records_head, __ATOMIC_SEQ_CST) ==
+                tail)
+                break;
+            __atomic_store_n(&block->client_idle, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        record = SERVICE_RECORDS(block, self->header->ring)[
+            tail & (self->header->ring - 1)];
+        tail++;
+        if (record.kind == SERVICE_RESET_DONE) {
+            if (record.id == self->tag)
+                self->synced = TRUE;
+            continue;
+        }
+        if (!self->synced || record.id >= self->header->capacity ||
+            self->states[record.id] == REMOTE_FREE)
+            continue;
+        if (record.kind == SERVICE_FIRED &&
+            self->states[record.id] == REMOTE_ARMED && !failed)
+            failed = PyList_Append(result, self->keys[record.id]);
+        Py_DECREF(self->keys[record.id]);
+        self->states[record.id] = REMOTE_FREE;
+        self->free_ids[self->free_count++] = record.id;
+    }
+#endif
+    if (failed) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+PyDoc_STRVAR(Remote_fileno_doc,
+"fileno()\n"
+"\n"
+"Return the file descriptor that becomes readable when expirations are\n"
+"waiting for drain().");
+
+static PyObject *
+Remote_fileno(Remote *self)
+{
+    if (!Remote_check(self))
+        return NULL;
+    return PyLong_FromLong(self->fd);
+}
+
+PyDoc_STRVAR(Remote_close_doc,
+"close()\n"
+"\n"
+"Cancel the pending timers and give the slot back to the service.");
+
+static PyObject *
+Remote_close(Remote *self)
+{
+    Remote_close_all(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Remote_get_pending(Remote *self, void *closure)
+{
+    if (!Remote_check(self))
+        return NULL;
+    return PyLong_FromUnsignedLong(self->header->capacity - self->free_count);
+}
+
+static PyMethodDef Remote_methods[] = {
+    {"call_at", (PyCFunction)Remote_call_at, METH_VARARGS,
+     Remote_call_at_doc},
+    {"call_later", (PyCFunction)Remote_call_later, METH_VARARGS,
+     Remote_call_later_doc},
+    {"cancel", (PyCFunction)Remote_cancel, METH_O, Remote_cancel_doc},
+    {"drain", (PyCFunction)Remote_drain, METH_NOARGS, Remote_drain_doc},
+    {"fileno", (PyCFunction)Remote_fileno, METH_NOARGS, Remote_fileno_doc},
+    {"close", (PyCFunction)Remote_close, METH_NOARGS, Remote_close_doc},
+    {NULL}
+};
+
+static PyGetSetDef Remote_getset[] = {
+    {"pending", (getter)Remote_get_pending, NULL,
+     "Timers armed and not yet drained or confirmed cancelled.", NULL},
+    {NULL}
+};
+
+PyDoc_STRVAR(Remote_class_doc,
+"Remote(path)\n"
+"\n"
+"A worker process's connection to the timer service serving path, see\n"
+"serve(). Its timers run on the service's scheduler, so the worker\n"
+"starts no scheduler thread of its own, and their keys come back from\n"
+"drain(), typically called by an event loop watching fileno().");
+
+static PyTypeObject Remote_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.Remote",                            /*tp_name*/
+    sizeof(Remote),                             /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    (destructor)Remote_dealloc,                 /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,                         /*tp_flags*/
+    Remote_class_doc,                           /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    Remote_methods,                             /*tp_methods*/
+    0,                                          /*tp_members*/
+    Remote_getset,                              /*tp_getset*/
+    0,                                          /*tp_base*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    PyType_GenericAlloc,                        /*tp_alloc*/
+    Remote_new,                                 /*tp_new*/
+};
+
+
+static PyObject *
+TimerGroup_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":TimerGroup", kwlist))
+        return NULL;
+    return type->tp_alloc(type, 0);
+}
+
+static void
+TimerGroup_dealloc(TimerGroup *self)
+{
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+PyDoc_STRVAR(TimerGroup_cancel_doc,
+"cancel()\n"
+"\n"
+"Stop every running timer in the group, as if stop() had been called on\n"
+"each, in constant time however many there are. Each one's callback is\n"
+"skipped when it comes due; until then it still counts as pending in\n"
+"stats(). Timers started afterwards run as usual.");
+
+static PyObject *
+TimerGroup_cancel(TimerGroup *self)
+{
+    self->generation++;
+    self->cancelled_at = timer_clock_ns();
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef TimerGroup_methods[] = {
+    {"cancel", (PyCFunction)TimerGroup_cancel, METH_NOARGS,
+     TimerGroup_cancel_doc},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(TimerGroup_generation_doc,
+"Number of times the group was cancelled.");
+
+static PyMemberDef TimerGroup_members[] = {
+    {"generation", T_ULONGLONG, offsetof(TimerGroup, generation), READONLY,
+     TimerGroup_generation_doc},
+    {NULL}
+};
+
+PyDoc_STRVAR(TimerGroup_class_doc,
+"TimerGroup()\n"
+"\n"
+"Timers whose group attribute is set to it, such as the timeouts of one\n"
+"connection, can all be stopped at once with cancel().");
+
+static PyTypeObject TimerGroup_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.TimerGroup",                        /*tp_name*/
+    sizeof(TimerGroup),                         /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    (destructor)TimerGroup_dealloc,             /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,                         /*tp_flags*/
+    TimerGroup_class_doc,                       /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    TimerGroup_methods,                         /*tp_methods*/
+    TimerGroup_members,                         /*tp_members*/
+    0,                                          /*tp_getset*/
+    0,                                          /*tp_base*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    PyType_GenericAlloc,                        /*tp_alloc*/
+    TimerGroup_new,                             /*tp_new*/
+};
+
+
+/* Deadline propagation. The innermost deadline of the code running is an
+   engine clock int, kept in a context variable so that it follows the
+   code into asyncio tasks, or in the thread's state dict before 3.7.
+   Entering within() or deadline() sets it to the earlier of their own
+   and the one inherited, leaving restores the inherited one, so nested
+   calls only ever see it tighten. Reading it is a lookup in C, without
+   reading the clock. */
+#ifdef HAVE_CONTEXTVARS
+static PyObject *deadline_var; /* Shared like the histograms */
+#else
+#define DEADLINE_KEY "_timer.deadline"
+#endif
+
+/* Read the inherited deadline into *deadline. Returns 1, 0 if there is
+   none, or -1 with an exception set. */
+static int
+context_deadline(int64_t *deadline)
+{
+    PyObject *value;
+
+#ifdef HAVE_CONTEXTVARS
+    if (PyContextVar_Get(deadline_var, NULL, &value) < 0)
+        return -1;
+#else
+    PyObject *dict = PyThreadState_GetDict();
+
+    value = dict != NULL ? PyDict_GetItemString(dict, DEADLINE_KEY) : NULL;
+    Py_XINCREF(value);
+#endif
+    if (value == NULL)
+        return 0;
+    *deadline = PyLong_AsLongLong(value);
+    Py_DECREF(value);
+    if (*deadline == -1 && PyErr_Occurred())
+        return -1;
+    return 1;
+}
+
+/* Make deadline the inherited one, unless that is earlier already, and
+   store it in *effective. Returns what context_restore() needs to undo
+   it, or NULL with an exception set. */
+static PyObject *
+context_narrow(int64_t deadline, int64_t *effective)
+{
+    PyObject *value, *saved;
+    int64_t inherited;
+    int found;
+#ifndef HAVE_CONTEXTVARS
+    PyObject *dict;
+#endif
+
+    found = context_deadline(&inherited);
+    if (found < 0)
+        return NULL;
+    if (found && inherited < deadline)
+        deadline = inherited;
+    *effective = deadline;
+    value = PyLong_FromLongLong(deadline);
+    if (value == NULL)
+        return NULL;
+#ifdef HAVE_CONTEXTVARS
+    saved = PyContextVar_Set(deadline_var, value);
+#else
+    dict = PyThreadState_GetDict();
+    if (dict == NULL) {
+        Py_DECREF(value);
+        PyErr_SetString(PyExc_RuntimeError, "no thread state dict");
+        return NULL;
+    }
+    saved = PyDict_GetItemString(dict, DEADLINE_KEY);
+    if (saved == NULL)
+        saved = Py_None;
+    Py_INCREF(saved);
+    if (PyDict_SetItemString(dict, DEADLINE_KEY, value) < 0)
+        Py_CLEAR(saved);
+#endif
+    Py_DECREF(value);
+    return saved;
+}
+
+/* Undo context_narrow(), consuming saved. Returns -1 with an exception
+   set if that fails. */
+static int
+context_restore(PyObject *saved)
+{
+    int rslt;
+#ifdef HAVE_CONTEXTVARS
+    rslt = PyContextVar_Reset(deadline_var, saved);
+#else
+    PyObject *dict = PyThreadState_GetDict();
+
+    if (dict == NULL)
+        rslt = 0;
+    else if (saved == Py_None)
+        rslt = PyDict_DelItemString(dict, DEADLINE_KEY);
+    else
+        rslt = PyDict_SetItemString(dict, DEADLINE_KEY, saved);
+#endif
+    Py_DECREF(saved);
+    return rslt;
+}
+
+/* with deadline(us): bounds the time a block of Python code runs. Entering
+   schedules a C API node for the deadline; if it fires first, its
+   callback takes the GIL and has the entering thread raise
+   DeadlineExceeded at its next bytecode, the way KeyboardInterrupt
+   arrives. Leaving cancels the node, O(1) for every queue type. The node
+   holds a reference to the Deadline until it is cancelled or has run.
+   One that already runs can't be cancelled, and may still be waiting for
+   the GIL when the same Deadline is entered again, so each entry has a
+   generation, which the node is scheduled with like gil_generation. The
+   callback only raises while the block of its own generation is active,
+   which both sides check with the GIL held. */
+#if PY_VERSION_HEX >= 0x03070000
+typedef unsigned long thread_ident;
+#else
+typedef long thread_ident;
+#endif
+
+typedef struct {
+    PyObject_HEAD
+    int64_t duration; /* Nanoseconds */
+    timer_api_handle *handle; /* While entered and not yet fired */
+    thread_ident thread; /* The one that entered it */
+    PyInterpreterState *interp; /* The thread's */
+    BOOL active; /* Inside the with block */
+    BOOL expired;
+    PyObject *saved; /* The inherited deadline, see context_narrow */
+    unsigned long generation; /* Of the latest entry */
+    struct deadline_ticket *ticket; /* handle's arg */
+} Deadline;
+
+/* What a Deadline's node is scheduled with, freed by whoever of the
+   callback and a successful cancel gets to it. */
+typedef struct deadline_ticket {
+    Deadline *deadline; /* A reference */
+    unsigned long generation;
+} deadline_ticket;
+
+static PyObject *DeadlineExceeded;
+
+static PyObject *
+Deadline_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"us", NULL};
+    Py_ssize_t us;
+    Deadline *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n:deadline", kwlist, &us))
+        return NULL;
+    if (us < 0) {
+        PyErr_SetString(PyExc_ValueError, "deadline must be non-negative");
+        return NULL;
+    }
+    self = (Deadline*)type->tp_alloc(type, 0);
+    if (self != NULL)
+        self->duration = (int64_t)us * 1000;
+    return (PyObject*)self;
+}
+
+static void
+Deadline_dealloc(Deadline *self)
+{
+    Py_XDECREF(self->saved);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* On the scheduler thread, without the GIL. */
+static void
+Deadline_fire(void *arg)
+{
+    deadline_ticket *ticket = (deadline_ticket*)arg;
+    Deadline *self = ticket->deadline;
+    interpreter_entry entry;
+
+    /* The exception can only be set on a thread of the current one. */
+    interpreter_enter(self->interp, &entry);
+    if (self->active && ticket->generation == self->generation) {
+        self->handle = NULL;
+        self->ticket = NULL;
+        self->expired = TRUE;
+        PyThreadState_SetAsyncExc(self->thread, DeadlineExceeded);
+    }
+    free(ticket);
+    Py_DECREF(self);
+    interpreter_leave(&entry);
+}
+
+static PyObject *
+Deadline_enter(Deadline *self)
+{
+    deadline_ticket *ticket;
+    int64_t deadline, inherited;
+
+    if (self->active) {
+        PyErr_SetString(PyExc_RuntimeError, "deadline already entered");
+        return NULL;
+    }
+    if (!scheduler_ensure_started())
+        return NULL;
+    ticket = (deadline_ticket*)malloc(sizeof(*ticket));
+    if (ticket == NULL)
+        return PyErr_NoMemory();
+    deadline = timer_clock_ns() + self->duration;
+    /* Code in the block sees it, or an earlier one it inherited. */
+    self->saved = context_narrow(deadline, &inherited);
+    if (self->saved == NULL) {
+        free(ticket);
+        return NULL;
+    }
+    self->thread = (thread_ident)PyThread_get_thread_ident();
+    self->interp = CURRENT_INTERPRETER();
+    self->expired = FALSE;
+    self->active = TRUE;
+    self->generation++;
+    Py_INCREF(self);
+    ticket->deadline = self;
+    ticket->generation = self->generation;
+    self->handle = capi_schedule(deadline, Deadline_fire, ticket);
+    if (self->handle == NULL) {
+        self->active = FALSE;
+        free(ticket);
+        Py_DECREF(self);
+        context_restore(self->saved);
+        self->saved = NULL;
+        return PyErr_NoMemory();
+    }
+    self->ticket = ticket;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject *
+Deadline_exit(Deadline *self, PyObject *args)
+{
+    PyObject *exc_type, *exc, *tb, *saved;
+
+    if (!PyArg_ParseTuple(args, "OOO:__exit__", &exc_type, &exc, &tb))
+        return NULL;
+    if (!self->active)
+        Py_RETURN_FALSE;
+    self->active = FALSE;
+    /* Otherwise Deadline_fire is waiting for the GIL and does nothing,
+       now or once this is entered again. */
+    if (self->handle != NULL && capi_cancel(self->handle)) {
+        free(self->ticket);
+        Py_DECREF(self);
+    }
+    self->handle = NULL;
+    self->ticket = NULL;
+    /* The block finished before the exception was raised in it. */
+    if (self->expired && exc_type == Py_None)
+        PyThreadState_SetAsyncExc(self->thread, NULL);
+    saved = self->saved;
+    self->saved = NULL;
+    if (saved != NULL && context_restore(saved) < 0)
+        return NULL;
+    Py_RETURN_FALSE;
+}
+
+static PyMethodDef Deadline_methods[] = {
+    {"__enter__", (PyCFunction)Deadline_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)Deadline_exit, METH_VARARGS, NULL},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(Deadline_expired_doc,
+"Whether the deadline passed while the block ran.");
+
+static PyMemberDef Deadline_members[] = {
+    {"expired", T_BOOL, offsetof(Deadline, expired), READONLY,
+     Deadline_expired_doc},
+    {NULL}
+};
+
+PyDoc_STRVAR(Deadline_class_doc,
+"deadline(us)\n"
+"\n"
+"Context manager that raises DeadlineExceeded, a TimeoutError, in the\n"
+"thread running the with block if it hasn't left it after us\n"
+"microseconds. The exception arrives between bytecodes, so a call that\n"
+"blocks in C only sees it once it returns. Code in the block inherits\n"
+"the deadline like within()'s.");
+
+static PyTypeObject Deadline_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.deadline",                          /*tp_name*/
+    sizeof(Deadline),                           /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    (destructor)Deadline_dealloc,               /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,                         /*tp_flags*/
+    Deadline_class_doc,                         /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    Deadline_methods,                           /*tp_methods*/
+    Deadline_members,                           /*tp_members*/
+    0,                                          /*tp_getset*/
+    0,                                          /*tp_base*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    PyType_GenericAlloc,                        /*tp_alloc*/
+    Deadline_new,                               /*tp_new*/
+};
+
+/* with within(us): only sets the inherited deadline, for the code in the
+   block to check with remaining_us() or arm against with start_at(). */
+typedef struct {
+    PyObject_HEAD
+    int64_t duration; /* Nanoseconds */
+    int64_t deadline; /* In effect in the block, engine clock */
+    PyObject *saved; /* While entered, see context_narrow */
+} Within;
+
+static PyObject *
+Within_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"us", NULL};
+    Py_ssize_t us;
+    Within *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n:within", kwlist, &us))
+        return NULL;
+    if (us < 0) {
+        PyErr_SetString(PyExc_ValueError, "us must be non-negative");
+        return NULL;
+    }
+    self = (Within*)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->duration = (int64_t)us * 1000;
+        self->deadline = -1;
+    }
+    return (PyObject*)self;
+}
+
+static void
+Within_dealloc(Within *self)
+{
+    Py_XDECREF(self->saved);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+Within_enter(Within *self)
+{
+    if (self->saved != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "within already entered");
+        return NULL;
+    }
+    self->saved = context_narrow(timer_clock_ns() + self->duration,
+                                 &self->deadline);
+    if (self->saved == NULL)
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject *
+Within_exit(Within *self, PyObject *args)
+{
+    PyObject *saved = self->saved;
+
+    if (saved == NULL)
+        Py_RETURN_FALSE;
+    self->saved = NULL;
+    if (context_restore(saved) < 0)
+        return NULL;
+    Py_RETURN_FALSE;
+}
+
+static PyMethodDef Within_methods[] = {
+    {"__enter__", (PyCFunction)Within_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)Within_exit, METH_VARARGS, NULL},
+    {NULL, NULL}
+};
+
+static PyObject *
+Within_get_deadline_ns(Within *self, void *closure)
+{
+    if (self->deadline < 0)
+        Py_RETURN_NONE;
+    return PyLong_FromLongLong(self->deadline);
+}
+
+static PyObject *
+Within_get_remaining_us(Within *self, void *closure)
+{
+    int64_t left;
+
+    if (self->deadline < 0)
+        Py_RETURN_NONE;
+    left = self->deadline - timer_clock_ns();
+    return PyLong_FromLongLong(left > 0 ? left / 1000 : 0);
+}
+
+PyDoc_STRVAR(Within_deadline_ns_doc,
+"The deadline in effect in the block, on the now_ns() clock: its own or\n"
+"an earlier one it inherited. None until entered.");
+
+PyDoc_STRVAR(Within_remaining_us_doc,
+"Microseconds left until deadline_ns, 0 once it passed. None until\n"
+"entered.");
+
+static PyGetSetDef Within_getset[] = {
+    {"deadline_ns", (getter)Within_get_deadline_ns, NULL,
+     Within_deadline_ns_doc, NULL},
+    {"remaining_us", (getter)Within_get_remaining_us, NULL,
+     Within_remaining_us_doc, NULL},
+    {NULL}
+};
+
+PyDoc_STRVAR(Within_class_doc,
+"within(us)\n"
+"\n"
+"Context manager giving the code in the with block a deadline us\n"
+"microseconds away, or the one it inherited if that is earlier. Calls\n"
+"made in the block read it with remaining_us() and deadline_ns(), and\n"
+"Timer.start_at() without arguments arms against it. Nothing is raised\n"
+"when it passes, see deadline() for that. It follows the code into\n"
+"asyncio tasks created in the block.");
+
+static PyTypeObject Within_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.within",                            /*tp_name*/
+    sizeof(Within),                             /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    (destructor)Within_dealloc,                 /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,                         /*tp_flags*/
+    Within_class_doc,                           /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    Within_methods,                             /*tp_methods*/
+    0,                                          /*tp_members*/
+    Within_getset,                              /*tp_getset*/
+    0,                                          /*tp_base*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    PyType_GenericAlloc,                        /*tp_alloc*/
+    Within_new,                                 /*tp_new*/
+};
+
+/* profile(histogram) is a decorator: called with a function, it returns a
+   profile for the same histogram wrapping it, whose calls are timed. A
+   Stopwatch decorating a function makes one that times them with it. */
+typedef struct {
+    PyObject_HEAD
+    PyObject *histogram; /* NULL for a stopwatch */
+    Stopwatch *stopwatch;
+    PyObject *func; /* NULL until applied to one */
+    PyObject *dict; /* What functools.update_wrapper() copies over */
+#ifdef HAVE_VECTORCALL
+    vectorcallfunc vectorcall;
+#endif
+} Profile;
+
+static PyTypeObject Profile_type;
+
+#ifdef HAVE_VECTORCALL
+static PyObject *Profile_vectorcall(PyObject *self, PyObject *const *args,
+                                    size_t nargsf, PyObject *kwnames);
+#endif
+
+static PyObject *
+Profile_create(PyObject *histogram, PyObject *func, Stopwatch *stopwatch)
+{
+    Profile *self;
+    PyObject *functools, *rslt;
+
+    if (stopwatch == NULL && !PyObject_TypeCheck(histogram, &Histogram_type)) {
+        PyErr_SetString(PyExc_TypeError, "histogram must be a Histogram");
+        return NULL;
+    }
+    if (func != NULL && !PyCallable_Check(func)) {
+        PyErr_SetString(PyExc_TypeError, "func must be callable");
+        return NULL;
+    }
+    self = (Profile*)Profile_type.tp_alloc(&Profile_type, 0);
+    if (self == NULL)
+        return NULL;
+    Py_XINCREF(histogram);
+    self->histogram = histogram;
+    Py_XINCREF(stopwatch);
+    self->stopwatch = stopwatch;
+#ifdef HAVE_VECTORCALL
+    self->vectorcall = Profile_vectorcall;
+#endif
+    if (func == NULL)
+        return (PyObject*)self;
+    Py_INCREF(func);
+    self->func = func;
+
+    functools = PyImport_ImportModule("functools");
+    rslt = functools ? PyObject_CallMethod(functools, "update_wrapper", "OO",
+                                           self, func) : NULL;
+    Py_XDECREF(functools);
+    if (rslt == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    Py_DECREF(rslt);
+    return (PyObject*)self;
+}
+
+static PyObject *
+Profile_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"histogram", "func", NULL};
+    PyObject *histogram, *func = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:profile", kwlist,
+                                     &histogram, &func))
+        return NULL;
+    return Profile_create(histogram, func, NULL);
+}
+
+static void
+Profile_dealloc(Profile *self)
+{
+    Py_XDECREF(self->histogram);
+    Py_XDECREF(self->stopwatch);
+    Py_XDECREF(self->func);
+    Py_XDECREF(self->dict);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* The decorator being applied, to func if it was called with just that. */
+static PyObject *
+Profile_apply(Profile *self, PyObject *func)
+{
+    if (func == NULL) {
+        PyErr_SetString(PyExc_TypeError,
+                        "profile() takes the function to wrap");
+        return NULL;
+    }
+    return Profile_create(self->histogram, func, self->stopwatch);
+}
+
+/* A call through a stopwatch restarts it, so it measures the latest one. */
+static BOOL
+profile_begin(Profile *self, int64_t *start)
+{
+    BOOL rslt = TRUE;
+
+    if (self->stopwatch == NULL) {
+        *start = timer_clock_ns();
+        return TRUE;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self->stopwatch);
+    rslt = stopwatch_begin(self->stopwatch);
+    Py_END_CRITICAL_SECTION();
+    return rslt;
+}
+
+static void
+profile_end(Profile *self, int64_t start)
+{
+    if (self->stopwatch == NULL) {
+        histogram_record((Histogram*)self->histogram,
+                         timer_clock_ns() - start, 1);
+        return;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self->stopwatch);
+    stopwatch_end(self->stopwatch);
+    Py_END_CRITICAL_SECTION();
+}
+
+#ifdef HAVE_VECTORCALL
+static PyObject *
+Profile_vectorcall(PyObject *callable, PyObject *const *args, size_t nargsf,
+                   PyObject *kwnames)
+{
+    Profile *self = (Profile*)callable;
+    PyObject *rslt;
+    int64_t start = 0;
+
+    if (self->func == NULL)
+        return Profile_apply(self, kwnames == NULL &&
+                             PyVectorcall_NARGS(nargsf) == 1 ? args[0] : NULL);
+    if (!profile_begin(self, &start))
+        return NULL;
+    rslt = PyObject_Vectorcall(self->func, args, nargsf, kwnames);
+    profile_end(self, start);
+    return rslt;
+}
+
+#define Profile_call PyVectorcall_Call
+#else
+static PyObject *
+Profile_call(Profile *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *rslt;
+    int64_t start = 0;
+
+    if (self->func == NULL)
+        return Profile_apply(self, kwargs == NULL &&
+                             PyTuple_GET_SIZE(args) == 1 ?
+                             PyTuple_GET_ITEM(args, 0) : NULL);
+    if (!profile_begin(self, &start))
+        return NULL;
+    rslt = PyObject_Call(self->func, args, kwargs);
+    profile_end(self, start);
+    return rslt;
+}
+#endif
+
+/* Bind like a function does, so that methods can be profiled. */
+static PyObject *
+Profile_descr_get(PyObject *self, PyObject *obj, PyObject *type)
+{
+    if (obj == NULL || obj == Py_None || ((Profile*)self)->func == NULL) {
+        Py_INCREF(self);
+        return self;
+    }
+#ifdef PYTHON3
+    return PyMethod_New(self, obj);
+#else
+    return PyMethod_New(self, obj, type);
+#endif
+}
+
+PyDoc_STRVAR(Profile_histogram_doc,
+"Histogram the call times are recorded into, in nanoseconds.");
+
+PyDoc_STRVAR(Profile_stopwatch_doc,
+"Stopwatch the calls are timed with, or None.");
+
+static PyMemberDef Profile_members[] = {
+    {"histogram", T_OBJECT, offsetof(Profile, histogram), READONLY,
+     Profile_histogram_doc},
+    {"stopwatch", T_OBJECT, offsetof(Profile, stopwatch), READONLY,
+     Profile_stopwatch_doc},
+    {NULL}
+};
+
+static PyObject *
+Profile_get_dict(Profile *self, void *closure)
+{
+    if (self->dict == NULL && (self->dict = PyDict_New()) == NULL)
+        return NULL;
+    Py_INCREF(self->dict);
+    return self->dict;
+}
+
+static PyGetSetDef Profile_getset[] = {
+    {"__dict__", (getter)Profile_get_dict, NULL, NULL, NULL},
+    {NULL}
+};
+
+PyDoc_STRVAR(Profile_class_doc,
+"profile(histogram, func=None)\n"
+"\n"
+"Decorator recording how long each call of the function takes into\n"
+"histogram, in nanoseconds, timed in C on the engine clock. Calls that\n"
+"raise are recorded too.");
+
+#if PY_VERSION_HEX >= 0x03090000
+#define PROFILE_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL | \
+                       Py_TPFLAGS_METHOD_DESCRIPTOR)
+#define PROFILE_VECTORCALL_OFFSET offsetof(Profile, vectorcall)
+#elif defined(HAVE_VECTORCALL)
+#define PROFILE_FLAGS (Py_TPFLAGS_DEFAULT | _Py_TPFLAGS_HAVE_VECTORCALL | \
+                       Py_TPFLAGS_METHOD_DESCRIPTOR)
+#define PROFILE_VECTORCALL_OFFSET offsetof(Profile, vectorcall)
+#else
+#define PROFILE_FLAGS Py_TPFLAGS_DEFAULT
+#define PROFILE_VECTORCALL_OFFSET 0
+#endif
+
+static PyTypeObject Profile_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.profile",                           /*tp_name*/
+    sizeof(Profile),                            /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    (destructor)Profile_dealloc,                /*tp_dealloc*/
+    PROFILE_VECTORCALL_OFFSET,                  /*tp_vectorcall_offset*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    (ternaryfunc)Profile_call,                  /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    PROFILE_FLAGS,                              /*tp_flags*/
+    Profile_class_doc,                          /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    0,                                          /*tp_methods*/
+    Profile_members,                            /*tp_members*/
+    Profile_getset,                             /*tp_getset*/
+    0,                                          /*tp_base*/
+    0,                                          /*tp_dict*/
+    Profile_descr_get,                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    offsetof(Profile, dict),                    /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    PyType_GenericAlloc,                        /*tp_alloc*/
+    Profile_new,                                /*tp_new*/
+};
+
+/* RateLimiter, a token bucket kept as one number, the generic cell rate
+   algorithm: tat is the engine time at which the bucket would be full
+   again. Taking n tokens pushes it n intervals further, which is allowed
+   while it stays within burst intervals of now. A compare-and-swap
+   updates it, so no lock is taken even where the GIL isn't held. */
+typedef struct {
+    PyObject_HEAD
+    volatile int64_t tat;
+    int64_t interval; /* Nanoseconds per token */
+    int64_t tolerance; /* burst intervals */
+    double rate;
+    Py_ssize_t burst;
+} RateLimiter;
+
+static PyObject *precise_sleep(int64_t deadline);
+
+static BOOL
+tat_swap(RateLimiter *self, int64_t expected, int64_t desired)
+{
+#ifdef _MSC_VER
+    return InterlockedCompareExchange64((LONG64 volatile*)&self->tat,
+                                        desired, expected) == expected;
+#else
+    return __atomic_compare_exchange_n(&self->tat, &expected, desired, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Take n tokens, early by as much as wait allows, and return when the
+   last of them is due, -1 if that is more than wait away. */
+static int64_t
+rate_take(RateLimiter *self, Py_ssize_t n, int64_t wait)
+{
+    int64_t now = timer_clock_ns(), tat, base, due;
+
+    do {
+        tat = self->tat;
+        base = tat > now ? tat : now;
+        due = base + n * self->interval - self->tolerance;
+        if (due - now > wait)
+            return -1;
+    } while (!tat_swap(self, tat, base + n * self->interval));
+    return due;
+}
+
+static PyObject *
+RateLimiter_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"rate", "burst", NULL};
+    double rate;
+    Py_ssize_t burst = 1;
+    RateLimiter *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "d|n:RateLimiter", kwlist,
+                                     &rate, &burst))
+        return NULL;
+    if (!(rate > 0 && rate <= 1e9)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "rate must be above 0 and at most 1e9 per second");
+        return NULL;
+    }
+    if (burst < 1) {
+        PyErr_SetString(PyExc_ValueError, "burst must be at least 1");
+        return NULL;
+    }
+    self = (RateLimiter*)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->rate = rate;
+    self->burst = burst;
+    self->interval = (int64_t)(1e9 / rate);
+    self->tolerance = self->interval * burst;
+    return (PyObject*)self;
+}
+
+static void
+RateLimiter_dealloc(RateLimiter *self)
+{
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* n, the argument, must be from 1 to burst. */
+static BOOL
+rate_check(RateLimiter *self, Py_ssize_t n)
+{
+    if (n < 1 || n > self->burst) {
+        PyErr_SetString(PyExc_ValueError, "n must be from 1 to burst");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static PyObject *
+RateLimiter_try_acquire(RateLimiter *self, PyObject *args)
+{
+    Py_ssize_t n = 1;
+
+    if (!PyArg_ParseTuple(args, "|n:try_acquire", &n) || !rate_check(self, n))
+        return NULL;
+    return PyBool_FromLong(rate_take(self, n, 0) >= 0);
+}
+
+static PyObject *
+RateLimiter_acquire(RateLimiter *self, PyObject *args)
+{
+    Py_ssize_t n = 1;
+    int64_t due;
+
+    if (!PyArg_ParseTuple(args, "|n:acquire", &n) || !rate_check(self, n))
+        return NULL;
+    due = rate_take(self, n, INT64_MAX / 2);
+    if (due <= timer_clock_ns())
+        Py_RETURN_NONE;
+    return precise_sleep(due);
+}
+
+static PyObject *
+RateLimiter_get_tokens(RateLimiter *self, void *closure)
+{
+    int64_t now = timer_clock_ns(), tat = self->tat;
+
+    if (tat < now)
+        tat = now;
+    return PyFloat_FromDouble((double)(self->tolerance - (tat - now)) /
+                              (double)self->interval);
+}
+
+PyDoc_STRVAR(RateLimiter_try_acquire_doc,
+"try_acquire(n=1) -> bool\n"
+"\n"
+"Take n tokens if there are that many, without waiting.");
+
+PyDoc_STRVAR(RateLimiter_acquire_doc,
+"acquire(n=1)\n"
+"\n"
+"Take n tokens, sleeping like sleep_until() until they are there.");
+
+static PyMethodDef RateLimiter_methods[] = {
+    {"try_acquire", (PyCFunction)RateLimiter_try_acquire, METH_VARARGS,
+     RateLimiter_try_acquire_doc},
+    {"acquire", (PyCFunction)RateLimiter_acquire, METH_VARARGS,
+     RateLimiter_acquire_doc},
+    {NULL, NULL}
+};
+
+PyDoc_STRVAR(RateLimiter_rate_doc, "Tokens added per second.");
+PyDoc_STRVAR(RateLimiter_burst_doc, "Tokens the bucket holds.");
+PyDoc_STRVAR(RateLimiter_tokens_doc,
+"Tokens there are now, fractions included.");
+
+static PyMemberDef RateLimiter_members[] = {
+    {"rate", T_DOUBLE, offsetof(RateLimiter, rate), READONLY,
+     RateLimiter_rate_doc},
+    {"burst", T_PYSSIZET, offsetof(RateLimiter, burst), READONLY,
+     RateLimiter_burst_doc},
+    {NULL}
+};
+
+static PyGetSetDef RateLimiter_getset[] = {
+    {"tokens", (getter)RateLimiter_get_tokens, NULL, RateLimiter_tokens_doc,
+     NULL},
+    {NULL}
+};
+
+PyDoc_STRVAR(RateLimiter_class_doc,
+"RateLimiter(rate, burst=1)\n"
+"\n"
+"Token bucket on the engine clock, refilled with rate tokens a second up\n"
+"to burst, starting full. Taking tokens is one compare-and-swap.");
+
+static PyTypeObject RateLimiter_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "_timer.RateLimiter",                       /*tp_name*/
+    sizeof(RateLimiter),                        /*tp_basicsize*/
+    0,                                          /*tp_itemsize*/
+    (destructor)RateLimiter_dealloc,            /*tp_dealloc*/
+    0,                                          /*tp_print*/
+    0,                                          /*tp_getattr*/
+    0,                                          /*tp_setattr*/
+    0,                                          /*tp_compare*/
+    0,                                          /*tp_repr*/
+    0,                                          /*tp_as_number*/
+    0,                                          /*tp_as_sequence*/
+    0,                                          /*tp_as_mapping*/
+    0,                                          /*tp_hash*/
+    0,                                          /*tp_call*/
+    0,                                          /*tp_str*/
+    0,                                          /*tp_getattro*/
+    0,                                          /*tp_setattro*/
+    0,                                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,                         /*tp_flags*/
+    RateLimiter_class_doc,                      /*tp_doc*/
+    0,		                                    /*tp_traverse*/
+    0,		                                    /*tp_clear*/
+    0,		                                    /*tp_richcompare*/
+    0,		                                    /*tp_weaklistoffset*/
+    0,		                                    /*tp_iter*/
+    0,		                                    /*tp_iternext*/
+    RateLimiter_methods,                        /*tp_methods*/
+    RateLimiter_members,                        /*tp_members*/
+    RateLimiter_getset,                         /*tp_getset*/
+    0,                                          /*tp_base*/
+    0,                                          /*tp_dict*/
+    0,                                          /*tp_descr_get*/
+    0,                                          /*tp_descr_set*/
+    0,                                          /*tp_dictoffset*/
+    0,                                          /*tp_init*/
+    PyType_GenericAlloc,                        /*tp_alloc*/
+    RateLimiter_new,                            /*tp_new*/
+};
+
+
+/* GIL watchdog, see watch_gil(). A C API node on the scheduler probes
+   how long taking the GIL takes, every half threshold, so a thread that
+   keeps it for longer than threshold shows up in at most one and a half.
+   The probe reschedules itself with the GIL held, and gil_generation,
+   which only changes with the GIL held too, tells a probe that was
+   waiting for the GIL when watch_gil() replaced it to stop. */
+static int64_t gil_threshold; /* Nanoseconds, 0 when not watching */
+static uintptr_t gil_generation;
+static timer_api_handle *gil_probe_handle;
+static PyObject *gil_callback; /* Called with the stall, or NULL to log */
+static Py_ssize_t gil_stalls;
+static int64_t gil_stall_max;
+
+/* "<ident> at <file>:<line>" for every thread running Python code, with
+   the GIL held. The thread that had the GIL has just come back from
+   whatever held it and is at the top of its frame. */
+static PyObject *
+gil_stall_threads(void)
+{
+    PyObject *sys, *frames, *ident, *frame, *code, *item, *parts, *sep;
+    PyObject *filename, *lineno, *result;
+    Py_ssize_t pos = 0;
+
+    sys = PyImport_ImportModule("sys");
+    if (sys == NULL)
+        return NULL;
+    frames = PyObject_CallMethod(sys, "_current_frames", NULL);
+    Py_DECREF(sys);
+    if (frames == NULL)
+        return NULL;
+    parts = PyList_New(0);
+    if (parts == NULL) {
+        Py_DECREF(frames);
+        return NULL;
+    }
+    while (PyDict_Next(frames, &pos, &ident, &frame)) {
+        code = PyObject_GetAttrString(frame, "f_code");
+        filename = code ? PyObject_GetAttrString(code, "co_filename") : NULL;
+        lineno = PyObject_GetAttrString(frame, "f_lineno");
+        item = filename && lineno ?
+            PyUnicode_FromFormat("%S at %S:%S", ident, filename, lineno) :
+            NULL;
+        Py_XDECREF(code);
+        Py_XDECREF(filename);
+        Py_XDECREF(lineno);
+        if (item == NULL || PyList_Append(parts, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(parts);
+            Py_DECREF(frames);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    Py_DECREF(frames);
+    sep = PyUnicode_FromString(", ");
+    result = sep ? PyUnicode_Join(sep, parts) : NULL;
+    Py_XDECREF(sep);
+    Py_DECREF(parts);
+    return result;
+}
+
+/* Tell somebody, with the GIL held. */
+static void
+gil_stall_report(int64_t held)
+{
+    PyObject *rslt, *logger, *logging, *threads;
+
+    if (gil_callback != NULL)
+        rslt = PyObject_CallFunction(gil_callback, "L", (long long)held);
+    else {
+        logging = PyImport_ImportModule("logging");
+        threads = gil_stall_threads();
+        logger = logging && threads ?
+            PyObject_CallMethod(logging, "getLogger", "s", "timer") : NULL;
+        rslt = logger ? PyObject_CallMethod(
+            logger, "warning", "sLO", "GIL held for %d us, threads: %s",
+            (long long)(held / 1000), threads) : NULL;
+        Py_XDECREF(logger);
+        Py_XDECREF(threads);
+        Py_XDECREF(logging);
+    }
+    if (rslt == NULL)
+        PyErr_Print();
+    Py_XDECREF(rslt);
+}
+
+/* On the scheduler thread, without the GIL. */
+static void
+gil_probe(void *arg)
+{
+    PyGILState_STATE gil_state;
+    int64_t asked, held;
+
+    asked = timer_clock_ns();
+    gil_state = PyGILState_Ensure();
+    held = timer_clock_ns() - asked;
+    if ((uintptr_t)arg == gil_generation && gil_threshold > 0) {
+        gil_probe_handle = capi_schedule(timer_clock_ns() + gil_threshold / 2,
+                                         gil_probe, arg);
+        if (held >= gil_threshold) {
+            gil_stalls++;
+            if (held > gil_stall_max)
+                gil_stall_max = held;
+            gil_stall_report(held);
+        }
+    }
+    PyGILState_Release(gil_state);
+}
+
+PyDoc_STRVAR(module_watch_gil_doc,
+"watch_gil(threshold, callback=None)\n"
+"\n"
+"Watch for threads keeping the GIL for threshold microseconds or more,\n"
+"such as a C extension that doesn't release it. The scheduler probes how\n"
+"long taking the GIL takes every half threshold, and on a stall calls\n"
+"callback(nanoseconds), or by default logs a warning to the 'timer'\n"
+"logger with where each thread is. stats() counts them. 0 stops.");
+
+static PyObject *
+module_watch_gil(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"threshold", "callback", NULL};
+    Py_ssize_t threshold;
+    PyObject *callback = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n|O:watch_gil", kwlist,
+                                     &threshold, &callback))
+        return NULL;
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be non-negative");
+        return NULL;
+    }
+    if (callback != Py_None && !PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    if (threshold > 0 && !scheduler_ensure_started())
+        return NULL;
+
+    /* A probe that can't be cancelled sees the new generation. */
+    if (gil_probe_handle != NULL)
+        capi_cancel(gil_probe_handle);
+    gil_probe_handle = NULL;
+    gil_generation++;
+    gil_threshold = (int64_t)threshold * 1000;
+    Py_CLEAR(gil_callback);
+    if (callback != Py_None) {
+        Py_INCREF(callback);
+        gil_callback = callback;
+    }
+    if (gil_threshold == 0)
+        Py_RETURN_NONE;
+
+    gil_probe_handle = capi_schedule(timer_clock_ns() + gil_threshold / 2,
+                                     gil_probe, (void*)gil_generation);
+    if (gil_probe_handle == NULL) {
+        gil_threshold = 0;
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(module_watch_callbacks_doc,
+"watch_callbacks(enable=True, threshold=0, callback=None)\n"
+"\n"
+"Count the calls and running time of every timer callback, by callback\n"
+"object, for callback_stats(). With threshold, in microseconds, a call\n"
+"that runs for that long or longer calls callback(callback, nanoseconds),\n"
+"or by default logs a warning to the 'timer' logger. stats() counts them.\n"
+"watch_callbacks(False) stops and forgets the counts.");
+
+static PyObject *
+module_watch_callbacks(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"enable", "threshold", "callback", NULL};
+    int enable = TRUE;
+    Py_ssize_t threshold = 0;
+    PyObject *callback = Py_None, *watched = NULL, *old, *old_callback;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|inO:watch_callbacks",
+                                     kwlist, &enable, &threshold, &callback))
+        return NULL;
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be non-negative");
+        return NULL;
+    }
+    if (callback != Py_None && !PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    if (enable && callbacks_watched == NULL) {
+        watched = PyDict_New();
+        if (watched == NULL)
+            return NULL;
+    }
+    if (callback == Py_None)
+        callback = NULL;
+    Py_XINCREF(callback);
+
+    MUTEX_LOCK(&callbacks_mutex);
+    old = NULL;
+    if (!enable) {
+        old = callbacks_watched;
+        callbacks_watched = NULL;
+    }
+    else if (watched != NULL)
+        callbacks_watched = watched;
+    callbacks_threshold = enable ? (int64_t)threshold * 1000 : 0;
+    old_callback = callbacks_callback;
+    callbacks_callback = enable ? callback : NULL;
+    MUTEX_UNLOCK(&callbacks_mutex);
+
+    if (!enable)
+        Py_XDECREF(callback);
+    Py_XDECREF(old_callback);
+    Py_XDECREF(old);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(module_callback_stats_doc,
+"callback_stats(reset=False)\n"
+"\n"
+"Return a dict from each callback counted since watch_callbacks() to a\n"
+"(calls, total_ns, max_ns) tuple. With reset, start counting afresh.");
+
+static PyObject *
+module_callback_stats(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"reset", NULL};
+    int reset = FALSE;
+    PyObject *fresh = NULL, *watched, *result, *key, *capsule, *item;
+    callback_counters *counters;
+    Py_ssize_t pos = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:callback_stats",
+                                     kwlist, &reset))
+        return NULL;
+    if (reset && (fresh = PyDict_New()) == NULL)
+        return NULL;
+
+    /* A copy, which doesn't hash the callbacks again, to read without the
+       mutex. */
+    MUTEX_LOCK(&callbacks_mutex);
+    watched = callbacks_watched;
+    if (watched != NULL && fresh != NULL) {
+        callbacks_watched = fresh;
+        fresh = NULL;
+    }
+    else if (watched != NULL)
+        watched = PyDict_Copy(watched);
+    MUTEX_UNLOCK(&callbacks_mutex);
+    Py_XDECREF(fresh);
+    if (watched == NULL)
+        return PyErr_Occurred() ? NULL : PyDict_New();
+
+    result = PyDict_New();
+    while (result != NULL && PyDict_Next(watched, &pos, &key, &capsule)) {
+        counters = (callback_counters*)PyCapsule_GetPointer(
+            capsule, CALLBACK_COUNTERS);
+        item = Py_BuildValue("LLL", (long long)counters->calls,
+                             (long long)counters->total_ns,
+                             (long long)counters->max_ns);
+        if (item == NULL || PyDict_SetItem(result, key, item) < 0)
+            Py_CLEAR(result);
+        Py_XDECREF(item);
+    }
+    Py_DECREF(watched);
+    return result;
+}
+
+/* Sampling profiler, see sample_stacks(). Like the GIL watchdog, a C API
+   node on the scheduler takes the GIL every interval, and walks the frames
+   of every thread into a ring of slots. A stack is a slot with no code
+   holding the thread's ident, then one slot per frame from the innermost
+   out, each with a reference to the code object and the line. Nothing is
+   formatted until folded_stacks(), and the oldest stacks are overwritten
+   once the ring is full, a stack cut short by that being skipped. */
+typedef struct {
+    PyObject *code; /* NULL in the first slot of a stack */
+    unsigned long value; /* The line, or the thread's ident */
+} sample_slot;
+
+static sample_slot *sample_ring;
+static size_t sample_capacity;
+static size_t sample_next; /* Slots ever written */
+static Py_ssize_t sample_depth;
+static int64_t sample_interval; /* Nanoseconds, 0 when not sampling */
+static int64_t sample_due;
+static uintptr_t sample_generation;
+static timer_api_handle *sample_handle;
+
+/* New references, which older versions only have as struct fields. */
+#if PY_VERSION_HEX >= 0x03090000
+#define SAMPLE_FRAME(tstate) PyThreadState_GetFrame(tstate)
+#define SAMPLE_BACK(frame) PyFrame_GetBack(frame)
+#define SAMPLE_CODE(frame) ((PyObject*)PyFrame_GetCode(frame))
+#else
+static PyFrameObject *
+sample_ref(PyFrameObject *frame)
+{
+    Py_XINCREF(frame);
+    return frame;
+}
+#define SAMPLE_FRAME(tstate) sample_ref((tstate)->frame)
+#define SAMPLE_BACK(frame) sample_ref((frame)->f_back)
+#define SAMPLE_CODE(frame) \
+    (Py_INCREF((frame)->f_code), (PyObject*)(frame)->f_code)
+#endif
+
+/* Takes code's reference. */
+static void
+sample_put(PyObject *code, unsigned long value)
+{
+    sample_slot *slot = &sample_ring[sample_next++ % sample_capacity];
+
+    Py_XDECREF(slot->code);
+    slot->code = code;
+    slot->value = value;
+}
+
+static void
+sample_clear(void)
+{
+    size_t i;
+
+    for (i = 0; i < sample_capacity; i++)
+        Py_XDECREF(sample_ring[i].code);
+    PyMem_Free(sample_ring);
+    sample_ring = NULL;
+    sample_capacity = sample_next = 0;
+}
+
+/* With the GIL held. */
+static void
+sample_threads(void)
+{
+    PyThreadState *tstate;
+    PyFrameObject *frame, *back;
+    Py_ssize_t depth;
+
+    tstate = PyInterpreterState_ThreadHead(PyInterpreterState_Head());
+    for (; tstate != NULL; tstate = PyThreadState_Next(tstate)) {
+        frame = SAMPLE_FRAME(tstate);
+        if (frame == NULL)
+            continue;
+        sample_put(NULL, (unsigned long)tstate->thread_id);
+        for (depth = 0; frame != NULL && depth < sample_depth; depth++) {
+            sample_put(SAMPLE_CODE(frame),
+                       (unsigned long)PyFrame_GetLineNumber(frame));
+            back = SAMPLE_BACK(frame);
+            Py_DECREF(frame);
+            frame = back;
+        }
+        Py_XDECREF(frame);
+    }
+}
+
+/* On the scheduler thread, without the GIL. */
+static void
+sample_probe(void *arg)
+{
+    PyGILState_STATE gil_state;
+    int64_t now;
+
+    gil_state = PyGILState_Ensure();
+    if ((uintptr_t)arg == sample_generation && sample_interval > 0) {
+        sample_threads();
+        /* Keep to the rate, but don't catch up on samples the GIL
+           held up. */
+        now = timer_clock_ns();
+        sample_due += sample_interval;
+        if (sample_due <= now)
+            sample_due = now + sample_interval;
+        sample_handle = capi_schedule(sample_due, sample_probe, arg);
+    }
+    PyGILState_Release(gil_state);
+}
+
+PyDoc_STRVAR(module_sample_stacks_doc,
+"sample_stacks(hz, capacity=65536, depth=64)\n"
+"\n"
+"Sample the Python stacks of all threads hz times a second from the\n"
+"scheduler thread, keeping the last capacity frames, up to depth per\n"
+"stack. Clears earlier samples. sample_stacks(0) stops, keeping them for\n"
+"folded_stacks().");
+
+static PyObject *
+module_sample_stacks(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"hz", "capacity", "depth", NULL};
+    Py_ssize_t hz, capacity = 65536, depth = 64;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n|nn:sample_stacks",
+                                     kwlist, &hz, &capacity, &depth))
+        return NULL;
+    if (hz < 0 || hz > 1000000) {
+        PyErr_SetString(PyExc_ValueError, "hz must be between 0 and 1000000");
+        return NULL;
+    }
+    if (capacity < 1 || capacity > (1 << 24)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "capacity must be between 1 and 2 ** 24");
+        return NULL;
+    }
+    if (depth < 1) {
+        PyErr_SetString(PyExc_ValueError, "depth must be positive");
+        return NULL;
+    }
+    if (hz > 0 && !scheduler_ensure_started())
+        return NULL;
+
+    if (sample_handle != NULL)
+        capi_cancel(sample_handle);
+    sample_handle = NULL;
+    sample_generation++;
+    sample_interval = 0;
+    if (hz == 0)
+        Py_RETURN_NONE;
+
+    sample_clear();
+    sample_ring = PyMem_Malloc((size_t)capacity * sizeof(sample_slot));
+    if (sample_ring == NULL)
+        return PyErr_NoMemory();
+    memset(sample_ring, 0, (size_t)capacity * sizeof(sample_slot));
+    sample_capacity = (size_t)capacity;
+    sample_depth = depth;
+    sample_interval = 1000000000 / hz;
+    sample_due = timer_clock_ns() + sample_interval;
+    sample_handle = capi_schedule(sample_due, sample_probe,
+                                  (void*)sample_generation);
+    if (sample_handle == NULL) {
+        sample_interval = 0;
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+/* "name (file:line)" */
+static PyObject *
+sample_frame_name(sample_slot *slot)
+{
+    PyCodeObject *code = (PyCodeObject*)slot->code;
+
+    return PyUnicode_FromFormat("%S (%S:%lu)", code->co_name,
+                                code->co_filename, slot->value);
+}
+
+/* Add one to counts[stack], stack being the frames in slots first to
+   end, innermost first. */
+static int
+sample_fold(PyObject *counts, size_t first, size_t end, unsigned long ident,
+            int threads)
+{
+    PyObject *names, *name, *sep, *stack, *count;
+    Py_ssize_t n = (Py_ssize_t)(end - first), i;
+    int err = -1;
+
+    names = PyList_New(n + (threads ? 1 : 0));
+    if (names == NULL)
+        return -1;
+    if (threads) {
+        name = PyUnicode_FromFormat("thread %lu", ident);
+        if (name == NULL)
+            goto done;
+        PyList_SET_ITEM(names, 0, name);
+    }
+    for (i = 0; i < n; i++) {
+        name = sample_frame_name(&sample_ring[(end - 1 - i) % sample_capacity]);
+        if (name == NULL)
+            goto done;
+        PyList_SET_ITEM(names, i + (threads ? 1 : 0), name);
+    }
+    sep = PyUnicode_FromString(";");
+    stack = sep ? PyUnicode_Join(sep, names) : NULL;
+    Py_XDECREF(sep);
+    if (stack == NULL)
+        goto done;
+    count = PyDict_GetItem(counts, stack);
+    count = PyLong_FromSsize_t(count ? PyLong_AsSsize_t(count) + 1 : 1);
+    if (count != NULL) {
+        err = PyDict_SetItem(counts, stack, count);
+        Py_DECREF(count);
+    }
+    Py_DECREF(stack);
+done:
+    Py_DECREF(names);
+    return err;
+}
+
+PyDoc_STRVAR(module_folded_stacks_doc,
+"folded_stacks(threads=False)\n"
+"\n"
+"The stacks sample_stacks() has taken in the folded format of\n"
+"flamegraph.pl, one 'outer;...;inner count' line per distinct stack,\n"
+"frames being 'function (file:line)'. With threads, each stack starts\n"
+"with 'thread <ident>'.");
+
+static PyObject *
+module_folded_stacks(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"threads", NULL};
+    PyObject *counts, *stacks, *lines, *line, *result = NULL;
+    int threads = 0;
+    size_t i, first, start;
+    unsigned long ident = 0;
+    Py_ssize_t n;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:folded_stacks",
+                                     kwlist, &threads))
+        return NULL;
+    counts = PyDict_New();
+    if (counts == NULL)
+        return NULL;
+
+    /* Skip to the first whole stack; first is 0 until one is found. */
+    start = sample_next > sample_capacity ? sample_next - sample_capacity : 0;
+    first = 0;
+    for (i = start; i <= sample_next; i++) {
+        if (i < sample_next && sample_ring[i % sample_capacity].code != NULL)
+            continue;
+        if (first != 0 && sample_fold(counts, first, i, ident, threads) < 0)
+            goto done;
+        if (i < sample_next) {
+            ident = sample_ring[i % sample_capacity].value;
+            first = i + 1;
+        }
+    }
+
+    stacks = PyDict_Keys(counts);
+    if (stacks == NULL || PyList_Sort(stacks) < 0) {
+        Py_XDECREF(stacks);
+        goto done;
+    }
+    lines = PyList_New(PyList_GET_SIZE(stacks));
+    for (n = 0; lines != NULL && n < PyList_GET_SIZE(stacks); n++) {
+        line = PyUnicode_FromFormat(
+            "%S %S\n", PyList_GET_ITEM(stacks, n),
+            PyDict_GetItem(counts, PyList_GET_ITEM(stacks, n)));
+        if (line == NULL)
+            Py_CLEAR(lines);
+        else
+            PyList_SET_ITEM(lines, n, line);
+    }
+    Py_DECREF(stacks);
+    if (lines != NULL) {
+        line = PyUnicode_FromString("");
+        result = line ? PyUnicode_Join(line, lines) : NULL;
+        Py_XDECREF(line);
+        Py_DECREF(lines);
+    }
+done:
+    Py_DECREF(counts);
+    return result;
+}
+
+
+/* Stop the scheduler threads, and the wall queue's. Timers stay where
+   they are, see scheduler_resume. The GIL must be held. */
+static void
+scheduler_stop(void)
+{
+    int i;
+
+    /* It hands due nodes to the shards. */
+    wall_stop();
+    if (!scheduler.started)
+        return;
+
+    shards_lock();
+    scheduler.shutdown = TRUE;
+    for (i = 0; i < scheduler.shards; i++)
+        shard_wake(&shards[i]);
+    shards_unlock();
+
+    /* A shard may be waiting for the GIL to run a callback. */
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < scheduler.shards; i++) {
+        if (!shards[i].running)
+            continue;
+#ifdef MS_WINDOWS
+        WaitForSingleObject(shards[i].thread, INFINITE);
+        CloseHandle(shards[i].thread);
+#elif defined(UNIX)
+        pthread_join(shards[i].thread, NULL);
+#endif
+        shards[i].running = FALSE;
+    }
+    Py_END_ALLOW_THREADS
+    /* Nothing hands them nodes any more, let them finish what they have. */
+    workers_stop(0);
+
+    /* Anything still pending is picked up again if a timer gets started. */
+    scheduler.started = FALSE;
+    scheduler.shutdown = FALSE;
+}
+
+static BOOL shards_pending(void);
+
+/* Start the scheduler threads again if any timers are left for them.
+   Returns FALSE with an exception set if they can't be. */
+static BOOL
+scheduler_resume(void)
+{
+    BOOL pending;
+    int i;
+
+    shards_lock();
+    pending = shards_pending();
+    for (i = 0; i < scheduler.shards; i++) {
+        if (shards[i].ready_count > 0)
+            pending = TRUE;
+    }
+    shards_unlock();
+    for (i = 0; i < MAX_WORKERS; i++) {
+        if (workers[i].count > 0)
+            pending = TRUE;
+    }
+    if (wall_first != NULL)
+        pending = TRUE;
+    if (pending && !scheduler_ensure_started())
+        return FALSE;
+    if (wall_first != NULL && !wall_start())
+        return FALSE;
+    return TRUE;
+}
+
+/* A subinterpreter that ends takes its Timers with it. The engine carries
+   on for the others, but its threads stop meanwhile: one may be about to
+   call into the interpreter, and none may be left in it when it ends. */
+static PyObject *
+interpreter_shutdown(PyInterpreterState *interp)
+{
+    BOOL started = scheduler.started;
+
+    scheduler_stop();
+    timers_discard(interp);
+    if (started && !scheduler_resume())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(module_shutdown_doc,
+"_shutdown()\n"
+"\n"
+"Stop the scheduler threads. Registered with atexit so they are not left\n"
+"calling into an interpreter that is being finalized. A subinterpreter's\n"
+"only stops its own timers.");
+
+static PyObject *
+module_shutdown(PyObject *module)
+{
+    PyInterpreterState *interp = CURRENT_INTERPRETER();
+
+    if (interp != MAIN_INTERPRETER())
+        return interpreter_shutdown(interp);
+    scheduler_stop();
+    Py_RETURN_NONE;
+}
+
+/* Whether any shard has timers pending. Called with every shard's lock
+   held. */
+static BOOL
+shards_pending(void)
+{
+    int i;
+
+    for (i = 0; i < scheduler.shards; i++) {
+        if (shards[i].queue.ops != NULL)
+            shard_collect(&shards[i]);
+        if (shard_live(&shards[i]) > 0 || shards[i].deferred != NULL)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+#ifdef UNIX
+PyDoc_STRVAR(module_after_fork_doc,
+"_after_fork()\n"
+"\n"
+"Called in the child after os.fork(). Deals with the inherited timers as\n"
+"configure(fork=) says and restarts the scheduler for those left.");
+
+static PyObject *
+module_after_fork(PyObject *module)
+{
+    if (!scheduler.forked)
+        Py_RETURN_NONE;
+    fork_settle();
+    if (!scheduler_resume())
+        return NULL;
+    Py_RETURN_NONE;
+}
+#endif /* UNIX */
+
+/* Clear the tombstones out of every shard, before their queues are
+   replaced. The GIL must be held, and no shard lock. */
+static void
+shards_compact(void)
+{
+    timer_node *dead, *node;
+    int i;
+
+    for (i = 0; i < scheduler.shards; i++) {
+        lock_acquire(&shards[i].lock);
+        if (shards[i].queue.ops != NULL)
+            shard_collect(&shards[i]);
+        dead = shard_compact(&shards[i], timer_clock_ns());
+        lock_release(&shards[i].lock);
+        /* Bare, see node_reap. */
+        while (dead != NULL) {
+            node = dead;
+            dead = node->next;
+            node_release(node);
+        }
+    }
+}
+
+/* Give every shard that has a queue a new, empty one of type, all of them
+   or, out of memory, none. Called with every shard's lock held and
+   nothing pending. */
+static BOOL
+shards_replace_queues(const timer_queue_ops *type)
+{
+    timer_queue queues[MAX_SHARDS];
+    int i, made;
+
+    for (made = 0; made < scheduler.shards; made++) {
+        if (shards[made].queue.ops != NULL &&
+            queue_init(&queues[made], type, timer_clock_ns()) < 0) {
+            while (--made >= 0) {
+                if (shards[made].queue.ops != NULL)
+                    queues[made].ops->fini(&queues[made]);
+            }
+            PyErr_NoMemory();
+            return FALSE;
+        }
+    }
+    for (i = 0; i < scheduler.shards; i++) {
+        if (shards[i].queue.ops != NULL) {
+            shards[i].queue.ops->fini(&shards[i].queue);
+            shards[i].queue = queues[i];
+        }
+    }
+    return TRUE;
+}
+
+/* Switch the shards to another queue type. Only allowed while nothing is
+   pending, so no nodes need to be moved across. */
+static BOOL
+set_queue_type(const char *name)
+{
+    const timer_queue_ops *type = find_queue_type(name);
+    BOOL ok = TRUE;
+
+    if (type == NULL)
+        return FALSE;
+
+    shards_compact();
+    shards_lock();
+    if (type == scheduler.queue_type)
+        goto done;
+    if (shards_pending()) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "cannot change the queue while timers are pending");
+        ok = FALSE;
+        goto done;
+    }
+    if (!shards_replace_queues(type)) {
+        ok = FALSE;
+        goto done;
+    }
+    scheduler.queue_type = type;
+
+done:
+    shards_unlock();
+    return ok;
+}
+
+/* Switch the shards to another wait backend. A running shard thread may be
+   blocked in the current one, so that is woken and handed to the thread
+   to clean up once it has left it. */
+static BOOL
+set_backend_type(const char *name)
+{
+    const timer_backend *type = find_backend_type(name);
+    timer_waiter waiters[MAX_SHARDS];
+    timer_shard *shard;
+    BOOL ok = TRUE;
+    int i, made;
+
+    if (type == NULL)
+        return FALSE;
+
+    shards_lock();
+    if (type == scheduler.backend_type)
+        goto done;
+    for (i = 0; i < scheduler.shards; i++) {
+        if (shards[i].retired.ops != NULL) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "a backend change is already in progress");
+            ok = FALSE;
+            goto done;
+        }
+    }
+    for (made = 0; made < scheduler.shards; made++) {
+        if (shards[made].waiter.ops != NULL &&
+            type->init(&waiters[made]) < 0) {
+            raise_backend_error();
+            while (--made >= 0) {
+                if (shards[made].waiter.ops != NULL)
+                    type->fini(&waiters[made]);
+            }
+            ok = FALSE;
+            goto done;
+        }
+        waiters[made].ops = type;
+    }
+    for (i = 0; i < scheduler.shards; i++) {
+        shard = &shards[i];
+        if (shard->waiter.ops != NULL) {
+            shard_wake(shard);
+            shard->retired = shard->waiter;
+            shard->waiter = waiters[i];
+        }
+        /* What it learned was about the old one. */
+        shard->oversleep = -1;
+    }
+    scheduler.backend_type = type;
+
+done:
+    shards_unlock();
+    return ok;
+}
+
+/* Set the errors policy of configure(). The GIL must be held. */
+static BOOL
+set_error_policy(PyObject *errors)
+{
+    PyObject *handler = NULL, *print, *old;
+    const char *name;
+    int policy;
+
+    if (PyCallable_Check(errors)) {
+        policy = ERRORS_CALL;
+        handler = errors;
+        Py_INCREF(handler);
+    }
+    else {
+        if (!PyArg_Parse(errors, "s;errors must be a string or callable",
+                         &name))
+            return FALSE;
+        for (policy = 0; error_names[policy] != NULL; policy++) {
+            if (strcmp(name, error_names[policy]) == 0)
+                break;
+        }
+        if (error_names[policy] == NULL) {
+            PyErr_SetString(PyExc_ValueError, "errors must be 'print', "
+                            "'count', 'defer' or a callable");
+            return FALSE;
+        }
+    }
+    if (policy == ERRORS_DEFER && deferred_timer == NULL) {
+        print = PyCFunction_New(&errors_print_def, NULL);
+        deferred_timer = print != NULL ? PyObject_CallFunction(
+            (PyObject*)&Timer_type, "nN", (Py_ssize_t)DEFERRED_ERRORS_DELAY,
+            print) : NULL;
+        if (deferred_timer == NULL)
+            return FALSE;
+    }
+
+    MUTEX_LOCK(&errors_mutex);
+    old = error_handler;
+    error_handler = handler;
+    error_policy = policy;
+    MUTEX_UNLOCK(&errors_mutex);
+    Py_XDECREF(old);
+    return TRUE;
+}
+
+/* Resize the callback worker pool to n workers, or to from n to most
+   with autoscaling, either -1 to keep it. The pool starts over from n.
+   The GIL must be held. */
+static BOOL
+set_workers(Py_ssize_t n, Py_ssize_t most)
+{
+    int before = workers_threads(), threads;
+
+    if (n < 0)
+        n = workers_floor;
+    if (most < 0)
+        most = workers_ceiling;
+    if (n > MAX_WORKERS || most > MAX_WORKERS) {
+        PyErr_Format(PyExc_ValueError,
+                     "workers and workers_max must be at most %d",
+                     MAX_WORKERS);
+        return FALSE;
+    }
+    threads = (int)(most > n ? most : n);
+    if (threads < before && current_worker != NULL &&
+        current_worker->index >= threads) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "a callback can't stop its own worker");
+        return FALSE;
+    }
+    workers_floor = (int)n;
+    workers_ceiling = (int)most;
+    scheduler.workers = (int)n;
+    if (threads < before)
+        workers_stop(threads);
+    /* Those autoscaling brought in past n leave as if idle. */
+    workers_close((int)n, threads);
+    /* Otherwise they start with the scheduler. */
+    return !scheduler.started || workers_start();
+}
+
+PyDoc_STRVAR(module_configure_doc,
+"configure(queue=None, spin_margin=None, backend=None, batch_limit=None,\n"
+"          workers=None, fork=None, affinity=None, realtime=None,\n"
+"          adaptive=None, wall_resync=None, overload=None,\n"
+"          overload_after=None, errors=None, stack_size=None,\n"
+"          workers_max=None, workers_idle=None, huge_pages=None,\n"
+"          numa=None) -> dict\n"
+"\n"
+"Change engine settings and return the ones in effect afterwards.\n"
+"\n"
+"queue -- Scheduler queue type, 'wheel' (default), 'heap' or 'list'.\n"
+"         Can't be changed while timers are pending. The TIMER_QUEUE\n"
+"         environment variable sets it at import time.\n"
+"batch_limit -- Timers due together have their callbacks run under one\n"
+"         GIL acquisition; the GIL is handed back after this many. 0 runs\n"
+"         the whole burst at once.\n"
+"spin_margin -- Microseconds before each deadline the scheduler stops\n"
+"         sleeping and spins on the clock instead. Larger is more\n"
+"         accurate, smaller costs less CPU. 0 never spins.\n"
+"backend -- How the scheduler thread sleeps: 'condvar' (default),\n"
+"         'timerfd', 'io_uring' or 'posix_timer' on Linux, 'kqueue' on\n"
+"         Mac and FreeBSD or 'waitable' or 'threadpool' on Windows. The\n"
+"         TIMER_BACKEND environment variable sets it at import time.\n"
+"workers -- Threads that run callbacks needing the GIL, so a slow one\n"
+"         doesn't hold back the timers after it. 0 (default) runs them\n"
+"         on the scheduler threads.\n"
+"workers_max -- Let the pool grow from workers up to this many while\n"
+"         callbacks queue up or run late, and shrink back once they are\n"
+"         idle. 0 (default) keeps it at workers.\n"
+"workers_idle -- Microseconds the last worker of an autoscaled pool has\n"
+"         to be idle before it leaves, 1000000 by default.\n"
+"huge_pages -- Back the slabs of timer nodes allocated from then on with\n"
+"         huge pages: 'transparent' asks the kernel for them, Linux\n"
+"         only, 'explicit' takes reserved ones, falling back to regular\n"
+"         pages without. 'off' (default) doesn't.\n"
+"numa -- Whether each scheduler shard's nodes are allocated on the NUMA\n"
+"         node its thread runs on. Linux and Windows only.\n"
+"fork -- What the child of os.fork() does with the timers it inherits:\n"
+"         'keep' (default) runs them, 'discard' stops them all.\n"
+"affinity -- CPU numbers to pin the scheduler threads to, one each in\n"
+"         turn. Empty unpins them. Linux and Windows only.\n"
+"realtime -- Whether the scheduler threads run at realtime priority,\n"
+"         SCHED_FIFO or THREAD_PRIORITY_TIME_CRITICAL. stats() reports\n"
+"         what they got, which needs the privileges.\n"
+"adaptive -- Whether the scheduler spins for as long as it measured its\n"
+"         backend to oversleep, rather than for spin_margin.\n"
+"wall_resync -- Microseconds between refreshes of the reference\n"
+"         wall_ns() extrapolates from. 0 keeps the current one.\n"
+"overload -- What to do with callbacks running overload_after or more\n"
+"         late: 'none' (default) runs them, 'drop_oldest' skips them,\n"
+"         'coalesce' skips those making the same call as another late\n"
+"         one just run, 'shed_tolerant' skips those of timers with slack\n"
+"         or coarse precision. stats() counts them as shed or coalesced.\n"
+"overload_after -- Microseconds late a callback has to be for the\n"
+"         overload policy to apply, 10000 by default.\n"
+"errors -- What happens to the exception of a callback without a\n"
+"         future: 'print' (default) prints it, 'count' only counts it\n"
+"         in stats(), 'defer' prints up to 100 in a batch a moment\n"
+"         later and counts the rest, and a callable is called with\n"
+"         callback, type, value and traceback.\n"
+"stack_size -- Bytes of stack the engine's threads started from then on\n"
+"         get, at least 32768, or 0 (default) for the platform's. Those\n"
+"         running callbacks need enough for them.\n"
+"\n"
+"The result also reports shards, the number of scheduler threads, which\n"
+"the TIMER_SHARDS environment variable sets at import time.");
+
+static PyObject *
+module_configure(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"queue", "spin_margin", "backend",
+                             "batch_limit", "workers", "fork", "affinity",
+                             "realtime", "adaptive", "wall_resync",
+                             "overload", "overload_after", "errors",
+                             "stack_size", "workers_max", "workers_idle",
+                             "huge_pages", "numa", NULL};
+    const char *queue = NULL, *backend = NULL, *fork_name = NULL;
+    const char *overload = NULL, *huge_name = NULL;
+    Py_ssize_t spin_margin = -1, batch_limit = -1, worker_count = -1;
+    Py_ssize_t wall_resync_us = -1, overload_after_us = -1, stack_size = -1;
+    Py_ssize_t workers_max = -1, workers_idle_us = -1;
+    PyObject *affinity = Py_None, *realtime = Py_None, *adaptive = Py_None;
+    PyObject *errors = Py_None, *numa = Py_None, *cpus, *rslt;
+    int i, realtime_flag = -1, adaptive_flag = -1, numa_flag = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "|snsnnsOOOnsnOnnnsO:configure", kwlist,
+                                     &queue, &spin_margin, &backend,
+                                     &batch_limit, &worker_count, &fork_name,
+                                     &affinity, &realtime, &adaptive,
+                                     &wall_resync_us, &overload,
+                                     &overload_after_us, &errors,
+                                     &stack_size, &workers_max,
+                                     &workers_idle_us, &huge_name, &numa))
+        return NULL;
+
+    /* Before workers=, so their threads get it. */
+    if (stack_size >= 0 && !set_stack_size(stack_size))
+        return NULL;
+
+    if (errors != Py_None && !set_error_policy(errors))
+        return NULL;
+
+    if (overload != NULL) {
+        for (i = 0; overload_names[i] != NULL; i++) {
+            if (strcmp(overload, overload_names[i]) == 0)
+                break;
+        }
+        if (overload_names[i] == NULL) {
+            PyErr_SetString(PyExc_ValueError, "overload must be 'none', "
+                            "'drop_oldest', 'coalesce' or 'shed_tolerant'");
+            return NULL;
+        }
+        overload_policy = i;
+        coalesce_reset(0);
+    }
+    if (overload_after_us >= 0)
+        overload_after = (int64_t)overload_after_us * 1000;
+
+    if (fork_name != NULL) {
+        for (i = 0; fork_names[i] != NULL; i++) {
+            if (strcmp(fork_name, fork_names[i]) == 0)
+                break;
+        }
+        if (fork_names[i] == NULL) {
+            PyErr_SetString(PyExc_ValueError,
+                            "fork must be 'keep' or 'discard'");
+            return NULL;
+        }
+        scheduler.fork_policy = i;
+    }
+    if (realtime != Py_None && (realtime_flag = PyObject_IsTrue(realtime)) < 0)
+        return NULL;
+    if (adaptive != Py_None && (adaptive_flag = PyObject_IsTrue(adaptive)) < 0)
+        return NULL;
+    if (!set_placement(affinity != Py_None ? affinity : NULL, realtime_flag))
+        return NULL;
+
+    if (batch_limit >= 0)
+        scheduler.batch_limit = batch_limit;
+    if (wall_resync_us >= 0) {
+        wall_interval = (int64_t)wall_resync_us * 1000;
+        /* Whoever reads or wakes next sets the new due time. */
+        if (wall_syncs > 0)
+            wall_due = wall_interval > 0 ? 0 : INT64_MAX;
+    }
+    if (huge_name != NULL) {
+        for (i = 0; huge_page_names[i] != NULL; i++) {
+            if (strcmp(huge_name, huge_page_names[i]) == 0)
+                break;
+        }
+        if (huge_page_names[i] == NULL) {
+            PyErr_SetString(PyExc_ValueError, "huge_pages must be 'off', "
+                            "'transparent' or 'explicit'");
+            return NULL;
+        }
+#ifndef MADV_HUGEPAGE
+        if (i == HUGE_PAGES_TRANSPARENT) {
+            PyErr_SetString(PyExc_NotImplementedError, "transparent huge "
+                            "pages aren't available on this platform");
+            return NULL;
+        }
+#endif
+#if !defined(MAP_HUGETLB) && !defined(MS_WINDOWS)
+        if (i == HUGE_PAGES_EXPLICIT) {
+            PyErr_SetString(PyExc_NotImplementedError, "explicit huge "
+                            "pages aren't available on this platform");
+            return NULL;
+        }
+#endif
+        huge_pages = i;
+    }
+    if (numa != Py_None) {
+        numa_flag = PyObject_IsTrue(numa);
+        if (numa_flag < 0)
+            return NULL;
+#ifndef HAVE_NUMA
+        if (numa_flag) {
+            PyErr_SetString(PyExc_NotImplementedError,
+                            "NUMA placement isn't available on this "
+                            "platform");
+            return NULL;
+        }
+#endif
+        numa_placement = numa_flag;
+    }
+
+    if (workers_idle_us >= 0)
+        workers_idle = (int64_t)workers_idle_us * 1000;
+    if ((worker_count >= 0 || workers_max >= 0) &&
+        !set_workers(worker_count, workers_max))
+        return NULL;
+
+    if (queue != NULL && !set_queue_type(queue))
+        return NULL;
+    if (backend != NULL && !set_backend_type(backend))
+        return NULL;
+
+    if (spin_margin >= 0 || adaptive_flag >= 0) {
+        shards_lock();
+        if (spin_margin >= 0)
+            scheduler.spin_margin = (int64_t)spin_margin * 1000;
+        if (adaptive_flag >= 0)
+            scheduler.adaptive = adaptive_flag;
+        for (i = 0; i < scheduler.shards; i++)
+            shard_wake(&shards[i]);
+        shards_unlock();
+    }
+
+    cpus = PyTuple_New(affinity_count);
+    if (cpus == NULL)
+        return NULL;
+    for (i = 0; i < affinity_count; i++) {
+        rslt = PyLong_FromLong(affinity_cpus[i]);
+        if (rslt == NULL) {
+            Py_DECREF(cpus);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(cpus, i, rslt);
+    }
+
+    if (error_handler != NULL) {
+        errors = error_handler;
+        Py_INCREF(errors);
+    }
+    else
+        errors = Py_BuildValue("s", error_names[error_policy]);
+    if (errors == NULL) {
+        Py_DECREF(cpus);
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:s,s:n,s:s,s:n,s:i,s:i,s:s,s:N,s:O,s:O,s:n,s:s,"
+                         "s:n,s:N,s:n,s:i,s:n,s:s,s:O}",
+                         "queue", scheduler.queue_type->name,
+                         "spin_margin",
+                         (Py_ssize_t)(scheduler.spin_margin / 1000),
+                         "backend", scheduler.backend_type->name,
+                         "batch_limit", scheduler.batch_limit,
+                         "shards", scheduler.shards,
+                         "workers", workers_floor,
+                         "fork", fork_names[scheduler.fork_policy],
+                         "affinity", cpus,
+                         "realtime", realtime_wanted ? Py_True : Py_False,
+                         "adaptive", scheduler.adaptive ? Py_True : Py_False,
+                         "wall_resync", (Py_ssize_t)(wall_interval / 1000),
+                         "overload", overload_names[overload_policy],
+                         "overload_after",
+                         (Py_ssize_t)(overload_after / 1000),
+                         "errors", errors,
+                         "stack_size", (Py_ssize_t)thread_stack_size,
+                         "workers_max", workers_ceiling,
+                         "workers_idle", (Py_ssize_t)(workers_idle / 1000),
+                         "huge_pages", huge_page_names[huge_pages],
+                         "numa", numa_placement ? Py_True : Py_False);
+}
+
+MUTEX_DECLARE(configure_mutex);
+
+/* configure() changes engine-wide state, so one thread at a time. */
+static PyObject *
+module_configure_locked(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    PyObject *result;
+
+    MUTEX_LOCK(&configure_mutex);
+    result = module_configure(module, args, kwargs);
+    MUTEX_UNLOCK(&configure_mutex);
+    return result;
+}
+
+/* The items of a sequence of Timers, or NULL with TypeError set. */
+static PyObject *
+timer_sequence(PyObject *timers, const char *name)
+{
+    PyObject *seq;
+    Py_ssize_t i;
+
+    seq = PySequence_Fast(timers, "expected a sequence of Timers");
+    if (seq == NULL)
+        return NULL;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        if (!PyObject_TypeCheck(PySequence_Fast_GET_ITEM(seq, i),
+                                &Timer_type)) {
+            PyErr_Format(PyExc_TypeError, "%s() takes Timers, not '%.200s'",
+                         name,
+                         Py_TYPE(PySequence_Fast_GET_ITEM(seq, i))->tp_name);
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+    return seq;
+}
+
+PyDoc_STRVAR(module_start_many_doc,
+"start_many(timers)\n"
+"\n"
+"Start every Timer in timers that isn't running, the same as calling\n"
+"start() on each, but handed to the scheduler in a single operation.");
+
+static PyObject *
+module_start_many(PyObject *module, PyObject *timers)
+{
+    PyObject *seq;
+    Timer *self;
+    timer_node *node, *first = NULL, *last = NULL;
+    Py_ssize_t i, slot = current_thread_slot();
+    int64_t now;
+    BOOL armed;
+
+    seq = timer_sequence(timers, "start_many");
+    if (seq == NULL)
+        return NULL;
+    if (!scheduler_ensure_started()) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    /* All from this thread, so all for the same shard. */
+    now = timer_clock_ns();
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        self = (Timer*)PySequence_Fast_GET_ITEM(seq, i);
+        node = Timer_arm_batch(self, slot, now, now + self->duration, NULL,
+                               &armed);
+        if (PyErr_Occurred())
+            break; /* Those before it still start */
+        if (node == NULL)
+            continue;
+        node->next = first;
+        first = node;
+        if (last == NULL)
+            last = node;
+    }
+    if (first != NULL)
+        scheduler_submit_chain(first, last, now);
+    Py_DECREF(seq);
+    if (PyErr_Occurred())
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/* Layout of a snapshot() file: the header, count records sorted by
+   deadline, then their keys back to back. restore() maps it and reads
+   the records in place. */
+#define SNAPSHOT_MAGIC "PYTIMSN"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+    char magic[8]; /* SNAPSHOT_MAGIC, written last */
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    int64_t written; /* Wall clock, nanoseconds */
+} snapshot_header;
+
+typedef struct {
+    int64_t deadline; /* Wall clock, nanoseconds */
+    uint64_t key_offset; /* From the start of the file */
+    uint64_t key_size;
+} snapshot_record;
+
+typedef struct {
+    int64_t deadline; /* Engine clock */
+    PyObject *key;
+} snapshot_entry;
+
+typedef struct {
+    snapshot_entry *entries;
+    size_t count;
+    size_t capacity;
+    BOOL failed; /* Out of memory, some are missing */
+} snapshot_list;
+
+/* shard_rebuild()'s visit, collecting the keyed timers that are still
+   pending. The shard's lock and the GIL are held. */
+static void
+snapshot_visit(timer_node *node, void *arg)
+{
+    snapshot_list *list = (snapshot_list*)arg;
+    snapshot_entry *entries;
+    Timer *self = node->timer;
+
+    if (self == NULL || self->node != node ||
+        TIMER_EXTRA(self, key, NULL) == NULL || !self->started ||
+        TIMER_LAPSED(self))
+        return;
+    if (list->count == list->capacity) {
+        entries = (snapshot_entry*)realloc(
+            list->entries, (list->capacity * 2 + 64) * sizeof(*entries));
+        if (entries == NULL) {
+            list->failed = TRUE;
+            return;
+        }
+        list->entries = entries;
+        list->capacity = list->capacity * 2 + 64;
+    }
+    Py_INCREF(self->extra->key);
+    list->entries[list->count].deadline = self->deadline;
+    list->entries[list->count].key = self->extra->key;
+    list->count++;
+}
+
+static int
+snapshot_compare(const void *a, const void *b)
+{
+    int64_t x = ((const snapshot_entry*)a)->deadline;
+    int64_t y = ((const snapshot_entry*)b)->deadline;
+
+    return x < y ? -1 : x > y;
+}
+
+PyDoc_STRVAR(module_snapshot_doc,
+"snapshot(path)\n"
+"\n"
+"Write the deadline and key of every running Timer that has a key to a\n"
+"file at path, for restore() to start them again, typically after a\n"
+"restart. Deadlines are saved on the wall clock. Returns how many were\n"
+"written. Timers already due and waiting for their callback are left\n"
+"out.");
+
+static PyObject *
+module_snapshot(PyObject *module, PyObject *args)
+{
+    const char *path;
+    snapshot_list list = {NULL, 0, 0, FALSE};
+    snapshot_header *header;
+    snapshot_record *record;
+    mapped_file file;
+    timer_node *dead, *node;
+    char *keys;
+    size_t i, size;
+    int64_t offset;
+    int shard, failed = 0;
+
+    if (!PyArg_ParseTuple(args, "s:snapshot", &path))
+        return NULL;
+
+    /* Queues can't be walked, so each is rebuilt, visiting what's in it.
+       Tombstones found on the way are cleared out as compaction would. */
+    for (shard = 0; shard < scheduler.shards; shard++) {
+        lock_acquire(&shards[shard].lock);
+        if (shards[shard].queue.ops != NULL)
+            shard_collect(&shards[shard]);
+        if (shard_rebuild(&shards[shard], timer_clock_ns(), snapshot_visit,
+                          &list, &dead) < 0)
+            failed = 1;
+        lock_release(&shards[shard].lock);
+        while (dead != NULL) {
+            node = dead;
+            dead = node->next;
+            node_release(node);
+        }
+    }
+    if (failed || list.failed) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    qsort(list.entries, list.count, sizeof(*list.entries), snapshot_compare);
+
+    size = sizeof(*header) + list.count * sizeof(*record);
+    for (i = 0; i < list.count; i++)
+        size += (size_t)PyBytes_GET_SIZE(list.entries[i].key);
+    if (!map_file(&file, path, size))
+        goto done;
+    header = (snapshot_header*)file.memory;
+    record = (snapshot_record*)(header + 1);
+    keys = (char*)(record + list.count);
+    offset = wall_clock_ns() - timer_clock_ns();
+    for (i = 0; i < list.count; i++, record++) {
+        record->deadline = list.entries[i].deadline + offset;
+        record->key_offset = (uint64_t)(keys - (char*)file.memory);
+        record->key_size = (uint64_t)PyBytes_GET_SIZE(list.entries[i].key);
+        memcpy(keys, PyBytes_AS_STRING(list.entries[i].key),
+               (size_t)record->key_size);
+        keys += record->key_size;
+    }
+    header->version = SNAPSHOT_VERSION;
+    header->record_size = (uint32_t)sizeof(*record);
+    header->count = (uint64_t)list.count;
+    header->written = offset + timer_clock_ns();
+    /* Without the magic a file cut short by a crash is refused. */
+    WRITE_BARRIER();
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    unmap_file(&file);
+
+done:
+    for (i = 0; i < list.count; i++)
+        Py_DECREF(list.entries[i].key);
+    free(list.entries);
+    if (PyErr_Occurred())
+        return NULL;
+    return PyLong_FromSize_t(list.count);
+}
+
+PyDoc_STRVAR(module_restore_doc,
+"restore(path, resolver)\n"
+"\n"
+"Start the timers in a file written by snapshot(). resolver(key) is\n"
+"called with each key, soonest deadline first, and returns the Timer to\n"
+"start or None to skip it. The Timer expires at the saved deadline, at\n"
+"once if that has passed, and gets the key if it has none. Those\n"
+"already running are left alone. All of them are handed to the\n"
+"scheduler in a single operation. Returns how many were started. If\n"
+"resolver raises, the exception propagates and those before it still\n"
+"start.");
+
+static PyObject *
+module_restore(PyObject *module, PyObject *args)
+{
+    const char *path;
+    PyObject *resolver, *key, *rslt;
+    const snapshot_header *header;
+    const snapshot_record *record;
+    mapped_file file;
+    Timer *self;
+    timer_node *node, *first = NULL, *last = NULL;
+    Py_ssize_t slot, started = 0;
+    uint64_t i;
+    int64_t now, offset;
+    BOOL armed;
+
+    if (!PyArg_ParseTuple(args, "sO:restore", &path, &resolver))
+        return NULL;
+    if (!PyCallable_Check(resolver)) {
+        PyErr_SetString(PyExc_TypeError, "resolver must be callable");
+        return NULL;
+    }
+    if (!map_existing(&file, path))
+        return NULL;
+    header = (const snapshot_header*)file.memory;
+    if (file.size < sizeof(*header) ||
+        memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->record_size != sizeof(*record) ||
+        header->count > (file.size - sizeof(*header)) / sizeof(*record)) {
+        PyErr_Format(PyExc_ValueError, "%s is not a timer snapshot", path);
+        unmap_file(&file);
+        return NULL;
+    }
+    if (!scheduler_ensure_started()) {
+        unmap_file(&file);
+        return NULL;
+    }
+
+    /* All from this thread, so all for the same shard. */
+    slot = current_thread_slot();
+    record = (const snapshot_record*)(header + 1);
+    for (i = 0; i < header->count; i++, record++) {
+        if (record->key_offset > file.size ||
+            record->key_size > file.size - record->key_offset) {
+            PyErr_Format(PyExc_ValueError, "%s is not a timer snapshot",
+                         path);
+            break;
+        }
+        key = PyBytes_FromStringAndSize(
+            (const char*)file.memory + record->key_offset,
+            (Py_ssize_t)record->key_size);
+        if (key == NULL)
+            break;
+        rslt = PyObject_CallFunctionObjArgs(resolver, key, NULL);
+        if (rslt == NULL) {
+            Py_DECREF(key);
+            break;
+        }
+        if (rslt != Py_None && !PyObject_TypeCheck(rslt, &Timer_type)) {
+            PyErr_Format(PyExc_TypeError,
+                         "resolver must return a Timer or None, not '%.200s'",
+                         Py_TYPE(rslt)->tp_name);
+            Py_DECREF(rslt);
+            Py_DECREF(key);
+            break;
+        }
+        if (rslt == Py_None) {
+            Py_DECREF(rslt);
+            Py_DECREF(key);
+            continue;
+        }
+        self = (Timer*)rslt;
+        /* The clocks are read again for each, resolver may be slow. */
+        now = timer_clock_ns();
+        offset = wall_clock_ns() - now;
+        node = Timer_arm_batch(self, slot, now, record->deadline - offset, key,
+                               &armed);
+        Py_DECREF(rslt);
+        Py_DECREF(key);
+        if (PyErr_Occurred())
+            break;
+        if (armed)
+            started++;
+        if (node == NULL)
+            continue;
+        node->next = first;
+        first = node;
+        if (last == NULL)
+            last = node;
+    }
+    if (first != NULL)
+        scheduler_submit_chain(first, last, timer_clock_ns());
+    unmap_file(&file);
+    if (PyErr_Occurred())
+        return NULL;
+    return PyLong_FromSsize_t(started);
+}
+
+PyDoc_STRVAR(module_stop_many_doc,
+"stop_many(timers)\n"
+"\n"
+"Stop every Timer in timers, the same as calling stop() on each, but\n"
+"taking each scheduler shard's lock once for all of them.");
+
+static PyObject *
+module_stop_many(PyObject *module, PyObject *timers)
+{
+    PyObject *seq;
+    Timer *self;
+    timer_shard *shard;
+    timer_node *node, *owned = NULL;
+    Py_ssize_t i, n;
+    uint64_t involved = 0;
+    int64_t now;
+    int index;
+
+    seq = timer_sequence(timers, "stop_many");
+    if (seq == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+
+#ifdef FREE_THREADED
+    /* The passes below rely on the GIL to keep the Timers as they were
+       between them, without it each is stopped on its own. */
+    for (i = 0; i < n; i++) {
+        Py_XDECREF(Timer_stop_locked(
+            (Timer*)PySequence_Fast_GET_ITEM(seq, i), NULL));
+    }
+    Py_DECREF(seq);
+    Py_RETURN_NONE;
+#endif
+
+    now = timer_clock_ns();
+    for (i = 0; i < n; i++) {
+        self = (Timer*)PySequence_Fast_GET_ITEM(seq, i);
+        Timer_settle(self);
+        if (!self->started)
+            continue;
+        self->elapsed = now - self->start_time;
+        node = self->node;
+        if (node != NULL && node->state == NODE_WALL &&
+            wall_cancel(node) != NULL) {
+            self->node = NULL;
+            COUNTER_ADD(stats.cancelled, 1);
+            TRACE(TRACE_CANCEL, self->trace_id, now, 0);
+            node->next = owned;
+            owned = node;
+        } else if (node != NULL)
+            involved |= (uint64_t)1 << node->shard;
+    }
+
+    while (involved != 0) {
+        index = bit_scan_forward(involved);
+        involved &= involved - 1;
+        shard = &shards[index];
+        lock_acquire(&shard->lock);
+        for (i = 0; i < n; i++) {
+            self = (Timer*)PySequence_Fast_GET_ITEM(seq, i);
+            node = self->node;
+            if (node == NULL || node->shard != index)
+                continue;
+            self->node = NULL;
+            COUNTER_ADD(stats.cancelled, 1);
+            TRACE(TRACE_CANCEL, self->trace_id, now, 0);
+            node = shard_cancel(shard, node);
+            if (node != NULL) {
+                node->next = owned;
+                owned = node;
+            }
+        }
+        lock_release(&shard->lock);
+    }
+
+    /* Without the locks, releasing a Timer can run arbitrary code. */
+    while (owned != NULL) {
+        node = owned;
+        owned = node->next;
+        node_done(node);
+    }
+    for (i = 0; i < n; i++) {
+        self = (Timer*)PySequence_Fast_GET_ITEM(seq, i);
+        if (!self->started)
+            continue;
+        RECORD_BOUND(self->histogram, self->elapsed);
+        self->started = FALSE;
+    }
+    Py_DECREF(seq);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(module_deadline_ns_doc,
+"deadline_ns()\n"
+"\n"
+"Return the deadline the caller inherited from the innermost within() or\n"
+"deadline() block, on the now_ns() clock, or None outside of any.");
+
+static PyObject *
+module_deadline_ns(PyObject *module)
+{
+    int64_t deadline;
+    int found = context_deadline(&deadline);
+
+    if (found < 0)
+        return NULL;
+    if (!found)
+        Py_RETURN_NONE;
+    return PyLong_FromLongLong(deadline);
+}
+
+PyDoc_STRVAR(module_remaining_us_doc,
+"remaining_us()\n"
+"\n"
+"Return the microseconds left until the deadline_ns() the caller\n"
+"inherited, 0 once it passed, or None if it has none.");
+
+static PyObject *
+module_remaining_us(PyObject *module)
+{
+    int64_t deadline, left;
+    int found = context_deadline(&deadline);
+
+    if (found < 0)
+        return NULL;
+    if (!found)
+        Py_RETURN_NONE;
+    left = deadline - timer_clock_ns();
+    return PyLong_FromLongLong(left > 0 ? left / 1000 : 0);
+}
+
+PyDoc_STRVAR(module_now_ns_doc,
+"now_ns()\n"
+"\n"
+"Return the scheduler's monotonic clock in nanoseconds, the timebase of\n"
+"Timer.start_at() deadlines.");
+
+static PyObject *
+module_now_ns(PyObject *module)
+{
+    return PyLong_FromLongLong(timer_clock_ns());
+}
+
+PyDoc_STRVAR(module_now_us_doc,
+"now_us()\n"
+"\n"
+"Return the scheduler's monotonic clock in microseconds, the unit of\n"
+"Timer durations.");
+
+static PyObject *
+module_now_us(PyObject *module)
+{
+    return PyLong_FromLongLong(timer_clock_ns() / 1000);
+}
+
+PyDoc_STRVAR(module_wall_ns_doc,
+"wall_ns()\n"
+"\n"
+"Return the system time in nanoseconds since the epoch, like\n"
+"time.time_ns(), derived from the engine clock and a reference to the\n"
+"system time that is refreshed every configure(wall_resync=).");
+
+static PyObject *
+module_wall_ns(PyObject *module)
+{
+    return PyLong_FromLongLong(wall_clock_ns());
+}
+
+/* sleep_us() and sleep_until(), for threads that have to be on time
+   themselves, like a game loop. Without the GIL, the thread sleeps in the
+   kernel until spin_margin before the deadline, or for as long as the
+   first shard learned its backend oversleeps with configure(adaptive=True),
+   and spins on the engine clock for the rest. */
+#ifdef MS_WINDOWS
+#define SYSTEM_TICK 15625000 /* Nanoseconds, a regular waitable timer's */
+#endif
+
+static PyObject *
+precise_sleep(int64_t deadline)
+{
+    int64_t margin, remaining;
+#ifdef MS_WINDOWS
+    HANDLE timer;
+    LARGE_INTEGER due;
+    BOOL high_resolution;
+#elif defined(UNIX)
+    struct timespec ts;
+    int rc, err;
+#endif
+
+    if (virtual_clock) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "can't sleep on the virtual clock, use advance()");
+        return NULL;
+    }
+    margin = scheduler.spin_margin;
+    if (margin > 0 && scheduler.adaptive && shards[0].oversleep >= 0)
+        margin = shards[0].oversleep + SPIN_CUSHION;
+
+#ifdef MS_WINDOWS
+    timer = CreateWaitableTimerExW(NULL, NULL,
+                                   CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                   TIMER_ALL_ACCESS);
+    high_resolution = timer != NULL;
+    if (timer == NULL)
+        timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+    if (timer == NULL)
+        return PyErr_SetFromWindowsErr(0);
+    /* Which wakes up on the system tick, so spin for all of the last. */
+    if (!high_resolution && margin > 0 && margin < SYSTEM_TICK)
+        margin = SYSTEM_TICK;
+
+    Py_BEGIN_ALLOW_THREADS
+    remaining = deadline - margin - timer_clock_ns();
+    if (remaining > 0) {
+        due.QuadPart = -(remaining / 100);
+        if (SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE))
+            WaitForSingleObject(timer, INFINITE);
+    }
+    spin_until(deadline, NULL);
+    Py_END_ALLOW_THREADS
+    CloseHandle(timer);
+#elif defined(UNIX)
+    for (;;) {
+        rc = 0;
+        Py_BEGIN_ALLOW_THREADS
+        remaining = deadline - margin - timer_clock_ns();
+        if (remaining > 0) {
+            ns_to_timespec(remaining, &ts);
+            rc = nanosleep(&ts, NULL);
+            err = errno;
+        }
+        if (rc == 0)
+            spin_until(deadline, NULL);
+        Py_END_ALLOW_THREADS
+        if (rc == 0)
+            break;
+        if (err != EINTR) {
+            errno = err;
+            return PyErr_SetFromErrno(PyExc_OSError);
+        }
+        /* Like time.sleep(), a signal handler that raises ends it. */
+        if (PyErr_CheckSignals() < 0)
+            return NULL;
+    }
+#endif
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(module_sleep_us_doc,
+"sleep_us(delay)\n"
+"\n"
+"Block for delay microseconds without the GIL, sleeping until a margin\n"
+"before the end and spinning on the engine clock for the rest, so it\n"
+"wakes up within about a microsecond where time.sleep() can be late by\n"
+"a millisecond or more.");
+
+static PyObject *
+module_sleep_us(PyObject *module, PyObject *args)
+{
+    Py_ssize_t delay;
+
+    if (!PyArg_ParseTuple(args, "n:sleep_us", &delay))
+        return NULL;
+    if (delay < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "sleep length must be non-negative");
+        return NULL;
+    }
+    return precise_sleep(timer_clock_ns() + (int64_t)delay * 1000);
+}
+
+PyDoc_STRVAR(module_sleep_until_doc,
+"sleep_until(deadline_ns)\n"
+"\n"
+"Block without the GIL until now_ns() reaches deadline_ns, the same way\n"
+"as sleep_us(). A deadline in the past returns right away.");
+
+static PyObject *
+module_sleep_until(PyObject *module, PyObject *args)
+{
+    long long deadline;
+
+    if (!PyArg_ParseTuple(args, "L:sleep_until", &deadline))
+        return NULL;
+    return precise_sleep((int64_t)deadline);
+}
+
+/* replay(): fires a callback at recorded times from the caller's thread,
+   with precise_sleep() between them. */
+
+/* Whether a buffer's items are native int64, as array.array('q') and a
+   numpy int64 array export them. */
+static int
+buffer_is_int64(Py_buffer *view)
+{
+    const char *format = view->format;
+
+    if (view->itemsize != 8)
+        return 0;
+    if (format == NULL)
+        return 0;
+    if (*format == '@' || *format == '=')
+        format++;
+    if (format[1] != '\0')
+        return 0;
+    return *format == 'q' || (*format == 'l' && sizeof(long) == 8);
+}
+
+/* When an event offset from the first fires, saturating rather than
+   overflowing for a slow speed. */
+static int64_t
+replay_due(int64_t start, int64_t offset, double speed)
+{
+    double scaled = (double)offset / speed;
+
+    return start + (scaled < 4e18 ? (int64_t)scaled : (int64_t)4e18);
+}
+
+PyDoc_STRVAR(module_replay_doc,
+"replay(timestamps, callback, speed=1.0)\n"
+"\n"
+"Call callback(i) for each of timestamps, in nanoseconds and not\n"
+"decreasing, at the time it has after the first, divided by speed,\n"
+"counted from now. timestamps is a buffer of int64 like array.array('q'),\n"
+"or a sequence of integers. The waits are without the GIL like\n"
+"sleep_until()'s, with one wait for all the events due within the same\n"
+"microsecond. Events that fall behind are called at once rather than\n"
+"dropped. Returns the worst lateness, in nanoseconds.");
+
+static PyObject *
+module_replay(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"timestamps", "callback", "speed", NULL};
+    PyObject *timestamps, *callback, *seq = NULL, *index, *rslt;
+    Py_buffer view;
+    int have_view = 0;
+    double speed = 1.0;
+    const int64_t *values;
+    int64_t *copy = NULL, start, due, batch, now, worst = 0;
+    Py_ssize_t n, i, j;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|d:replay", kwlist,
+                                     &timestamps, &callback, &speed))
+        return NULL;
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    if (!(speed > 0)) {
+        PyErr_SetString(PyExc_ValueError, "speed must be positive");
+        return NULL;
+    }
+    if (virtual_clock) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "can't replay on the virtual clock");
+        return NULL;
+    }
+
+    if (PyObject_CheckBuffer(timestamps)) {
+        if (PyObject_GetBuffer(timestamps, &view,
+                               PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+            return NULL;
+        have_view = 1;
+        if (!buffer_is_int64(&view)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "timestamps must be a buffer of int64");
+            goto error;
+        }
+        values = (const int64_t*)view.buf;
+        n = view.len / 8;
+    }
+    else {
+        seq = PySequence_Fast(timestamps, "timestamps must be a buffer of "
+                              "int64 or a sequence of integers");
+        if (seq == NULL)
+            return NULL;
+        n = PySequence_Fast_GET_SIZE(seq);
+        copy = PyMem_Malloc((n > 0 ? n : 1) * sizeof(int64_t));
+        if (copy == NULL) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        for (i = 0; i < n; i++) {
+            copy[i] = PyLong_AsLongLong(PySequence_Fast_GET_ITEM(seq, i));
+            if (copy[i] == -1 && PyErr_Occurred())
+                goto error;
+        }
+        values = copy;
+    }
+    for (i = 1; i < n; i++) {
+        if (values[i] < values[i - 1]) {
+            PyErr_SetString(PyExc_ValueError,
+                            "timestamps must not decrease");
+            goto error;
+        }
+    }
+
+    start = timer_clock_ns();
+    for (i = 0; i < n; i = j) {
+        due = replay_due(start, values[i] - values[0], speed);
+        /* The batch is every event due before the microsecond is up. */
+        batch = due + 1000;
+        for (j = i + 1; j < n; j++) {
+            if (replay_due(start, values[j] - values[0], speed) >= batch)
+                break;
+        }
+        now = timer_clock_ns();
+        if (now < due) {
+            rslt = precise_sleep(due);
+            if (rslt == NULL)
+                goto error;
+            Py_DECREF(rslt);
+            now = timer_clock_ns();
+        }
+        else if (PyErr_CheckSignals() < 0)
+            goto error;
+        if (now - due > worst)
+            worst = now - due;
+        for (; i < j; i++) {
+            index = PyLong_FromSsize_t(i);
+            if (index == NULL)
+                goto error;
+            rslt = PyObject_CallFunctionObjArgs(callback, index, NULL);
+            Py_DECREF(index);
+            if (rslt == NULL)
+                goto error;
+            Py_DECREF(rslt);
+        }
+    }
+
+    if (have_view)
+        PyBuffer_Release(&view);
+    PyMem_Free(copy);
+    Py_XDECREF(seq);
+    return PyLong_FromLongLong(worst);
+
+error:
+    if (have_view)
+        PyBuffer_Release(&view);
+    PyMem_Free(copy);
+    Py_XDECREF(seq);
+    return NULL;
+}
+
+PyDoc_STRVAR(module_use_virtual_clock_doc,
+"use_virtual_clock(enable=True)\n"
+"\n"
+"Freeze the engine clock and let advance() move it, for tests. Timers,\n"
+"Stopwatches and now_ns() all read the virtual clock, and callbacks run\n"
+"inside advance() instead of on the scheduler thread. It starts at the\n"
+"current time, rounded up to a microsecond, so pending timers keep their\n"
+"deadlines. Switching back to the real clock is only allowed while no\n"
+"timers are pending.");
+
+static PyObject *
+module_use_virtual_clock(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"enable", NULL};
+    PyObject *enable = Py_True;
+    int on, i;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:use_virtual_clock",
+                                     kwlist, &enable))
+        return NULL;
+    on = PyObject_IsTrue(enable);
+    if (on < 0)
+        return NULL;
+
+    if (!on)
+        shards_compact();
+    shards_lock();
+    if (on && !virtual_clock) {
+        /* On a whole microsecond, the wheel's tick, so that timers whose
+           durations are whole microseconds fire exactly on time. */
+        virtual_now = (timer_clock_ns() + 999) / 1000 * 1000;
+        virtual_clock = TRUE;
+    } else if (!on && virtual_clock) {
+        if (shards_pending()) {
+            shards_unlock();
+            PyErr_SetString(PyExc_RuntimeError,
+                            "cannot leave the virtual clock while timers "
+                            "are pending");
+            return NULL;
+        }
+        /* The wheel has moved on to virtual time, which may be ahead.
+           The new queues start from the real clock. */
+        virtual_clock = FALSE;
+        if (!shards_replace_queues(scheduler.queue_type)) {
+            virtual_clock = TRUE;
+            shards_unlock();
+            return NULL;
+        }
+    }
+    for (i = 0; i < scheduler.shards; i++)
+        shard_wake(&shards[i]);
+    shards_unlock();
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(module_advance_doc,
+"advance(ns) -> int\n"
+"\n"
+"Move the virtual clock forward by ns nanoseconds, running the callbacks\n"
+"of the timers that come due on the way in deadline order, each with the\n"
+"clock at its deadline. Timers started by those callbacks fire too if\n"
+"they come due in time. Returns the number of callbacks run.");
+
+static PyObject *
+module_advance(PyObject *module, PyObject *args)
+{
+    long long ns;
+    int64_t target, next, shard_next, fired = stats.fired;
+    timer_queue *queue;
+    timer_node *due, *last, *node, *next_node;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "L:advance", &ns))
+        return NULL;
+    if (!virtual_clock) {
+        PyErr_SetString(PyExc_RuntimeError, "the virtual clock is not in use");
+        return NULL;
+    }
+    if (ns < 0) {
+        PyErr_SetString(PyExc_ValueError, "the clock can't go backwards");
+        return NULL;
+    }
+
+    target = virtual_now + ns;
+    while (1) {
+        shards_lock();
+        next = -1;
+        for (i = 0; i < scheduler.shards; i++) {
+            queue = &shards[i].queue;
+            if (queue->ops == NULL)
+                continue;
+            shard_collect(&shards[i]);
+            shard_next = queue->ops->next(queue);
+            if (shard_next >= 0 && (next < 0 || shard_next < next))
+                next = shard_next;
+        }
+        if (next < 0 || next > target) {
+            shards_unlock();
+            break;
+        }
+        if (next > virtual_now)
+            virtual_now = next;
+        /* The same hand over as scheduler_run, but the GIL is held. */
+        due = last = NULL;
+        for (i = 0; i < scheduler.shards; i++) {
+            queue = &shards[i].queue;
+            if (queue->ops == NULL)
+                continue;
+            node = queue->ops->pop_due(queue, virtual_now);
+            for (; node != NULL; node = next_node) {
+                next_node = node->next;
+                node_unqueued(&shards[i], node, NODE_DUE);
+                node->due_time = virtual_now;
+                node_append(&due, &last, node);
+            }
+        }
+        shards_unlock();
+
+        while (due != NULL) {
+            node = due;
+            due = node->next;
+            if (node->timer == NULL)
+                native_run(node);
+            else
+                Timer_expire(node, virtual_now);
+        }
+    }
+    virtual_now = target;
+
+    return PyLong_FromLongLong(stats.fired - fired);
+}
+
+PyDoc_STRVAR(module_stats_doc,
+"stats()\n"
+"\n"
+"Return a dict of engine counters since import: pending timers, timers\n"
+"started, fired and cancelled, callbacks that raised, nanoseconds spent\n"
+"in callbacks and waiting for the GIL, scheduler wake-ups, clock reads\n"
+"while spinning, hits and misses of the Timer and node free lists,\n"
+"scheduler and worker threads created, times the Windows timer\n"
+"resolution was raised, callbacks slower than the watch_callbacks()\n"
+"threshold, and per scheduler thread the CPU it is pinned to, or None,\n"
+"whether it has realtime priority and how late its backend wakes it, an\n"
+"upper quantile in nanoseconds, or None before it knows.");
+
+static PyObject *
+module_stats(PyObject *module)
+{
+    Py_ssize_t pending = 0, tombstones = 0, slabs = 0, nodes = 0, i;
+    Py_ssize_t chunks = 0, huge_chunks = 0;
+    int64_t hits = 0, misses = 0;
+    timer_stats total;
+    PyObject *cpus, *realtime, *oversleep, *numa = NULL, *item;
+    int numa_nodes[ARENAS];
+
+    for (i = 0; i < scheduler.shards; i++) {
+        lock_acquire(&shards[i].lock);
+        if (shards[i].queue.ops != NULL)
+            shard_collect(&shards[i]);
+        pending += shard_live(&shards[i]);
+        tombstones += (Py_ssize_t)tombstones_count(&shards[i]);
+        lock_release(&shards[i].lock);
+    }
+    stats_totals(&total);
+
+    for (i = 0; i < ARENAS; i++) {
+        lock_acquire(&arenas[i].lock);
+        slabs += arenas[i].slabs;
+        nodes += arenas[i].used;
+        hits += arenas[i].hits;
+        misses += arenas[i].misses;
+        chunks += arenas[i].chunks;
+        huge_chunks += arenas[i].huge_chunks;
+        numa_nodes[i] = arenas[i].numa_node;
+        lock_release(&arenas[i].lock);
+    }
+
+    /* Where each scheduler thread ended up, see shard_tune, and how late
+       its backend wakes it, see shard_learn. */
+    cpus = PyTuple_New(scheduler.shards);
+    realtime = PyTuple_New(scheduler.shards);
+    oversleep = PyTuple_New(scheduler.shards);
+    numa = PyTuple_New(scheduler.shards);
+    if (cpus == NULL || realtime == NULL || oversleep == NULL || numa == NULL)
+        goto fail;
+    for (i = 0; i < scheduler.shards; i++) {
+        if (shards[i].running && shards[i].cpu >= 0)
+            item = PyLong_FromLong(shards[i].cpu);
+        else {
+            item = Py_None;
+            Py_INCREF(item);
+        }
+        if (item == NULL)
+            goto fail;
+        PyTuple_SET_ITEM(cpus, i, item);
+        item = shards[i].running && shards[i].realtime ? Py_True : Py_False;
+        Py_INCREF(item);
+        PyTuple_SET_ITEM(realtime, i, item);
+        if (shards[i].oversleep >= 0)
+            item = PyLong_FromLongLong(shards[i].oversleep);
+        else {
+            item = Py_None;
+            Py_INCREF(item);
+        }
+        if (item == NULL)
+            goto fail;
+        PyTuple_SET_ITEM(oversleep, i, item);
+        /* Where the chunks of its arena went, see node_alloc. */
+        if (numa_nodes[i] >= 0)
+            item = PyLong_FromLong(numa_nodes[i]);
+        else {
+            item = Py_None;
+            Py_INCREF(item);
+        }
+        if (item == NULL)
+            goto fail;
+        PyTuple_SET_ITEM(numa, i, item);
+    }
+
+    return Py_BuildValue("{s:n,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,"
+                         "s:L,s:L,s:L,s:L,s:n,s:n,s:n,s:n,s:n,s:L,s:i,s:L,"
+                         "s:L,s:L,s:n,s:n,s:L,"
+                         "s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:N,s:N,s:N,s:N}",
+                         "pending", pending,
+                         "started", (long long)stats.started,
+                         "fired", (long long)stats.fired,
+                         "cancelled", (long long)stats.cancelled,
+                         "errors", (long long)stats.errors,
+                         "callback_ns", (long long)stats.callback_ns,
+                         "gil_wait_ns", (long long)stats.gil_wait_ns,
+                         "wakeups", (long long)total.wakeups,
+                         "spins", (long long)total.spins,
+                         "timer_pool_hits", (long long)timer_pool.hits,
+                         "timer_pool_misses", (long long)timer_pool.misses,
+                         "node_pool_hits", (long long)hits,
+                         "node_pool_misses", (long long)misses,
+                         "arena_slabs", slabs,
+                         "arena_nodes", nodes,
+                         "arena_bytes", slabs * (Py_ssize_t)SLAB_SIZE,
+                         "arena_chunks", chunks,
+                         "arena_huge_chunks", huge_chunks,
+                         "threads_started", (long long)threads_started,
+                         "workers_active", scheduler.workers,
+                         "workers_grown", (long long)workers_grown,
+                         "workers_shrunk", (long long)workers_shrunk,
+                         "resolution_raises", (long long)resolution_raises,
+                         "wall_syncs", (Py_ssize_t)wall_syncs,
+                         "gil_stalls", gil_stalls,
+                         "gil_stall_max_ns", (long long)gil_stall_max,
+                         "shed", overload_shed,
+                         "coalesced", overload_coalesced,
+                         "tombstones", tombstones,
+                         "compactions", compactions,
+                         "wall_pending", wall_count,
+                         "clock_changes", clock_changes,
+                         "slow_callbacks", slow_callbacks,
+                         "affinity", cpus,
+                         "realtime", realtime,
+                         "oversleep_ns", oversleep,
+                         "numa_node", numa);
+
+fail:
+    Py_XDECREF(cpus);
+    Py_XDECREF(realtime);
+    Py_XDECREF(oversleep);
+    Py_XDECREF(numa);
+    return NULL;
+}
+
+/* OpenMetrics text exposition for export_openmetrics(). The text is
+   written straight into a bytes object preallocated at the size of the
+   previous scrape, which only grows when that falls short. The histograms
+   count nanoseconds and are exported in seconds, formatted exactly from
+   the integers. */
+typedef struct {
+    PyObject *bytes;
+    char *p;
+    char *end;
+} om_writer;
+
+static Py_ssize_t om_size_hint = 4096;
+
+/* Make room for n more bytes, the writers below don't check. */
+static int
+om_reserve(om_writer *w, Py_ssize_t n)
+{
+    Py_ssize_t used, size;
+
+    if (w->end - w->p >= n)
+        return 1;
+    used = w->p - PyBytes_AS_STRING(w->bytes);
+    size = PyBytes_GET_SIZE(w->bytes) * 2;
+    if (size < used + n)
+        size = used + n;
+    if (_PyBytes_Resize(&w->bytes, size) < 0)
+        return 0;
+    w->p = PyBytes_AS_STRING(w->bytes) + used;
+    w->end = PyBytes_AS_STRING(w->bytes) + size;
+    return 1;
+}
+
+static void
+om_text(om_writer *w, const char *text)
+{
+    size_t n = strlen(text);
+
+    memcpy(w->p, text, n);
+    w->p += n;
+}
+
+static void
+om_int(om_writer *w, int64_t value)
+{
+    char digits[20];
+    uint64_t v = (uint64_t)value;
+    int n = 0;
+
+    if (value < 0) {
+        *w->p++ = '-';
+        v = (uint64_t)0 - v;
+    }
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0)
+        *w->p++ = digits[--n];
+}
+
+/* Nanoseconds as seconds: 1500 is 0.0000015. Never negative here. */
+static void
+om_seconds(om_writer *w, int64_t ns)
+{
+    int64_t fraction = ns % 1000000000;
+    int digits = 9;
+    char *q;
+
+    om_int(w, ns / 1000000000);
+    *w->p++ = '.';
+    if (fraction == 0) {
+        *w->p++ = '0';
+        return;
+    }
+    for (; fraction % 10 == 0; fraction /= 10)
+        digits--;
+    w->p += digits;
+    for (q = w->p; digits > 0; digits--, fraction /= 10)
+        *--q = (char)('0' + fraction % 10);
+}
+
+static int
+om_valid_name(const char *name)
+{
+    const char *c;
+
+    for (c = name; *c != '\0'; c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+              *c == '_' || *c == ':' ||
+              (c != name && *c >= '0' && *c <= '9')))
+            return 0;
+    }
+    return c != name;
+}
+
+static int
+om_ends_with(const char *name, const char *suffix)
+{
+    size_t n = strlen(name), m = strlen(suffix);
+
+    return n >= m && strcmp(name + n - m, suffix) == 0;
+}
+
+/* The TYPE, UNIT and HELP lines of a metric family. */
+static int
+om_family(om_writer *w, const char *name, const char *type,
+          const char *help)
+{
+    if (!om_reserve(w, 3 * (Py_ssize_t)strlen(name) + 64 +
+                       (help != NULL ? (Py_ssize_t)strlen(help) : 0)))
+        return 0;
+    om_text(w, "# TYPE ");
+    om_text(w, name);
+    *w->p++ = ' ';
+    om_text(w, type);
+    *w->p++ = '\n';
+    if (om_ends_with(name, "_seconds")) {
+        om_text(w, "# UNIT ");
+        om_text(w, name);
+        om_text(w, " seconds\n");
+    }
+    if (help != NULL) {
+        om_text(w, "# HELP ");
+        om_text(w, name);
+        *w->p++ = ' ';
+        om_text(w, help);
+        *w->p++ = '\n';
+    }
+    return 1;
+}
+
+/* A counter or gauge, in seconds if its name says so. */
+static int
+om_value(om_writer *w, const char *name, const char *type,
+         const char *help, int64_t value)
+{
+    int counter = strcmp(type, "counter") == 0;
+
+    if (!om_family(w, name, type, help) ||
+        !om_reserve(w, (Py_ssize_t)strlen(name) + 48))
+        return 0;
+    om_text(w, name);
+    if (counter)
+        om_text(w, "_total");
+    *w->p++ = ' ';
+    if (om_ends_with(name, "_seconds"))
+        om_seconds(w, value);
+    else
+        om_int(w, value);
+    *w->p++ = '\n';
+    return 1;
+}
+
+/* Cumulative buckets for the non-empty ones only, le being the highest
+   value a bucket counts, then +Inf, _count and _sum. */
+static int
+om_histogram(om_writer *w, const char *name, const char *help,
+             Histogram *histogram)
+{
+    Py_ssize_t line = (Py_ssize_t)strlen(name) + 64, i;
+    histogram_shard summary;
+    int64_t count, total = 0;
+    char *sum;
+    int ok;
+
+    if (!om_family(w, name, "histogram", help))
+        return 0;
+    for (i = 0; i < histogram->size; i++) {
+        count = histogram_count(histogram, i);
+        if (count == 0)
+            continue;
+        total += count;
+        if (!om_reserve(w, line))
+            return 0;
+        om_text(w, name);
+        om_text(w, "_bucket{le=\"");
+        om_seconds(w, histogram_value(histogram, i));
+        om_text(w, "\"} ");
+        om_int(w, total);
+        *w->p++ = '\n';
+    }
+
+    /* Recorders may have moved on, the count is that of the buckets. */
+    histogram_summary(histogram, &summary);
+    sum = PyOS_double_to_string(summary.sum / 1e9, 'r', 0,
+                                Py_DTSF_ADD_DOT_0, NULL);
+    if (sum == NULL)
+        return 0;
+    ok = om_reserve(w, 3 * line + (Py_ssize_t)strlen(sum));
+    if (ok) {
+        om_text(w, name);
+        om_text(w, "_bucket{le=\"+Inf\"} ");
+        om_int(w, total);
+        *w->p++ = '\n';
+        om_text(w, name);
+        om_text(w, "_count ");
+        om_int(w, total);
+        *w->p++ = '\n';
+        om_text(w, name);
+        om_text(w, "_sum ");
+        om_text(w, sum);
+        *w->p++ = '\n';
+    }
+    PyMem_Free(sum);
+    return ok;
+}
+
+PyDoc_STRVAR(module_run_pending_doc,
+"run_pending() -> int\n"
+"\n"
+"Run the callbacks of the thread_affine timers this thread started that\n"
+"are due so far, in one batch. Returns the number of callbacks run.");
+
+static PyObject *
+module_run_pending(PyObject *module)
+{
+    Channel *inbox = thread_inbox(FALSE);
+
+    if (inbox == NULL)
+        return PyLong_FromLong(0);
+    return Channel_drain(inbox);
+}
+
+PyDoc_STRVAR(module_export_openmetrics_doc,
+"export_openmetrics(histograms=None)\n"
+"\n"
+"Return the engine counters of stats() and the lateness, wake_latency\n"
+"and gil_wait histograms as OpenMetrics text, in bytes. histograms maps\n"
+"more metric names to Histogram objects of nanoseconds to export, in\n"
+"seconds.");
+
+static PyObject *
+module_export_openmetrics(PyObject *module, PyObject *args,
+                          PyObject *kwargs)
+{
+    static char *kwlist[] = {"histograms", NULL};
+    PyObject *histograms = NULL, *items = NULL, *histogram;
+    Py_ssize_t pending = 0, used, i, n = 0;
+    const char *name;
+    timer_stats total;
+    om_writer w = {NULL, NULL, NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:export_openmetrics",
+                                     kwlist, &histograms))
+        return NULL;
+    if (histograms != NULL && histograms != Py_None) {
+        items = PyMapping_Items(histograms);
+        if (items == NULL)
+            return NULL;
+        n = PyList_GET_SIZE(items);
+        for (i = 0; i < n; i++) {
+            if (!PyArg_ParseTuple(PyList_GET_ITEM(items, i),
+                                  "sO!:export_openmetrics", &name,
+                                  &Histogram_type, &histogram))
+                goto fail;
+            if (!om_valid_name(name)) {
+                PyErr_Format(PyExc_ValueError, "invalid metric name '%s'",
+                             name);
+                goto fail;
+            }
+        }
+    }
+
+    for (i = 0; i < scheduler.shards; i++) {
+        lock_acquire(&shards[i].lock);
+        pending += shard_live(&shards[i]);
+        lock_release(&shards[i].lock);
+    }
+    stats_totals(&total);
+
+    w.bytes = PyBytes_FromStringAndSize(NULL, om_size_hint);
+    if (w.bytes == NULL)
+        goto fail;
+    w.p = PyBytes_AS_STRING(w.bytes);
+    w.end = w.p + om_size_hint;
+
+    if (!om_value(&w, "timer_pending", "gauge",
+                  "Timers started that haven't fired or been stopped.",
+                  pending) ||
+        !om_value(&w, "timer_started", "counter", "Timers started.",
+                  total.started) ||
+        !om_value(&w, "timer_fired", "counter", "Timers fired.",
+                  total.fired) ||
+        !om_value(&w, "timer_cancelled", "counter", "Timers stopped.",
+                  total.cancelled) ||
+        !om_value(&w, "timer_errors", "counter", "Callbacks that raised.",
+                  total.errors) ||
+        !om_value(&w, "timer_callback_seconds", "counter",
+                  "Time spent in callbacks.", total.callback_ns) ||
+        !om_value(&w, "timer_wakeups", "counter",
+                  "Scheduler wake-ups.", total.wakeups) ||
+        !om_value(&w, "timer_shed", "counter",
+                  "Timers shed under overload.", overload_shed) ||
+        !om_value(&w, "timer_coalesced", "counter",
+                  "Timers coalesced under overload.", overload_coalesced) ||
+        !om_value(&w, "timer_gil_stalls", "counter",
+                  "Times the scheduler stalled on the GIL.", gil_stalls) ||
+        !om_value(&w, "timer_clock_changes", "counter",
+                  "Wall clock changes seen.", clock_changes) ||
+        !om_value(&w, "timer_slow_callbacks", "counter",
+                  "Callbacks over the watch_callbacks() threshold.",
+                  slow_callbacks) ||
+        !om_value(&w, "timer_workers", "gauge",
+                  "Callback workers in use.", scheduler.workers) ||
+        !om_histogram(&w, "timer_lateness_seconds",
+                      "From the deadline to the callback running.",
+                      (Histogram*)lateness_histogram) ||
+        !om_histogram(&w, "timer_wake_latency_seconds",
+                      "From the deadline to the scheduler noticing it.",
+                      (Histogram*)wake_latency_histogram) ||
+        !om_histogram(&w, "timer_gil_wait_seconds",
+                      "The scheduler waiting for the GIL for a callback.",
+                      (Histogram*)gil_wait_histogram))
+        goto fail;
+    for (i = 0; i < n; i++) {
+        PyArg_ParseTuple(PyList_GET_ITEM(items, i), "sO", &name, &histogram);
+        if (!om_histogram(&w, name, NULL, (Histogram*)histogram))
+            goto fail;
+    }
+    if (!om_reserve(&w, 6))
+        goto fail;
+    om_text(&w, "# EOF\n");
+
+    used = w.p - PyBytes_AS_STRING(w.bytes);
+    om_size_hint = used + used / 8;
+    Py_XDECREF(items);
+    if (_PyBytes_Resize(&w.bytes, used) < 0)
+        return NULL;
+    return w.bytes;
+
+fail:
+    Py_XDECREF(w.bytes);
+    Py_XDECREF(items);
+    return NULL;
+}
+
+PyDoc_STRVAR(module_publish_stats_doc,
+"publish_stats(path, interval=1000000)\n"
+"\n"
+"Publish the stats() counters and the lateness histograms in a memory-\n"
+"mapped file at path, refreshed by the scheduler thread every interval\n"
+"microseconds. timer.shm.read_stats() reads it from any process.\n"
+"publish_stats(None) stops publishing.");
+
+static PyObject *
+module_publish_stats(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "interval", NULL};
+    const char *path;
+    Py_ssize_t interval = 1000000;
+    mapped_file new_file, old_file;
+    stats_page *new_page = NULL;
+    size_t header_size, size;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "z|n:publish_stats",
+                                     kwlist, &path, &interval))
+        return NULL;
+    if (interval <= 0) {
+        PyErr_SetString(PyExc_ValueError, "interval must be positive");
+        return NULL;
+    }
+
+    if (path != NULL) {
+        if (!scheduler_ensure_started())
+            return NULL;
+        header_size = (sizeof(stats_page) + 7) & ~(size_t)7;
+        size = header_size + STATS_PAGE_HISTOGRAMS * (4 +
+            ((Histogram*)lateness_histogram)->size) * sizeof(int64_t);
+
+        /* Let go of the old file first, path may be the same one and
+           truncating it under the scheduler would fault. */
+        lock_acquire(&shards[0].lock);
+        unmap_file(&page_file);
+        page = NULL;
+        lock_release(&shards[0].lock);
+
+        if (!map_file(&new_file, path, size))
+            return NULL;
+        new_page = (stats_page*)new_file.memory;
+        memcpy(new_page->magic, STATS_PAGE_MAGIC, sizeof(new_page->magic));
+        new_page->version = STATS_PAGE_VERSION;
+        new_page->header_size = (uint32_t)header_size;
+#ifdef MS_WINDOWS
+        new_page->pid = (int64_t)GetCurrentProcessId();
+#elif defined(UNIX)
+        new_page->pid = (int64_t)getpid();
+#endif
+        new_page->interval_ns = (int64_t)interval * 1000;
+        new_page->histograms = STATS_PAGE_HISTOGRAMS;
+        new_page->buckets = (uint32_t)((Histogram*)lateness_histogram)->size;
+        new_page->bits = ((Histogram*)lateness_histogram)->bits;
+    }
+
+    else
+        new_file.memory = NULL;
+
+    lock_acquire(&shards[0].lock);
+    old_file = page_file;
+    page_file = new_file;
+    page = new_page;
+    /* Publish right away, the shard may be asleep for long. */
+    page_due = 0;
+    unmap_file(&old_file);
+    shard_wake(&shards[0]);
+    lock_release(&shards[0].lock);
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(module_trace_doc,
+"trace(path, capacity=65536, rings=8)\n"
+"\n"
+"Record timer lifecycle events into memory-mapped rings in a file at\n"
+"path, one ring of capacity records per recording thread, up to rings\n"
+"of them. timer.shm.read_trace() reads it. trace(None) stops tracing.");
+
+static PyObject *
+module_trace(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "capacity", "rings", NULL};
+    const char *path;
+    Py_ssize_t capacity = 65536, rings = 8;
+    trace_header *header;
+    uint32_t size;
+    size_t header_size;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "z|nn:trace", kwlist,
+                                     &path, &capacity, &rings))
+        return NULL;
+    if (capacity < 1 || capacity > (1 << 24)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "capacity must be between 1 and 2 ** 24");
+        return NULL;
+    }
+    if (rings < 1 || rings > TRACE_MAX_RINGS) {
+        PyErr_Format(PyExc_ValueError, "rings must be between 1 and %d",
+                     TRACE_MAX_RINGS);
+        return NULL;
+    }
+
+    /* Let go of the old file first, path may be the same one. */
+    trace_stop();
+    unmap_file(&trace_file);
+    if (path == NULL)
+        Py_RETURN_NONE;
+
+    for (size = 1; size < (uint32_t)capacity; size <<= 1)
+        ;
+    header_size = (sizeof(trace_header) + CACHE_LINE - 1) &
+                  ~(size_t)(CACHE_LINE - 1);
+    trace_stride = offsetof(trace_ring, records) + size * sizeof(trace_record);
+    trace_stride = (trace_stride + CACHE_LINE - 1) &
+                   ~(size_t)(CACHE_LINE - 1);
+    if (!map_file(&trace_file, path, header_size + rings * trace_stride))
+        return NULL;
+
+    header = (trace_header*)trace_file.memory;
+    memcpy(header->magic, TRACE_MAGIC, sizeof(header->magic));
+    header->version = TRACE_VERSION;
+    header->header_size = (uint32_t)header_size;
+    header->rings = (uint32_t)rings;
+    header->capacity = size;
+    header->record_size = sizeof(trace_record);
+#ifdef MS_WINDOWS
+    header->pid = (int64_t)GetCurrentProcessId();
+#elif defined(UNIX)
+    header->pid = (int64_t)getpid();
+#endif
+    /* Writers may start right away, so only once it is filled in. */
+    RELEASE_STORE(trace, header);
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+    {"trace", (PyCFunction)module_trace, METH_VARARGS | METH_KEYWORDS,
+     module_trace_doc},
+    {"publish_stats", (PyCFunction)module_publish_stats,
+     METH_VARARGS | METH_KEYWORDS, module_publish_stats_doc},
+    {"serve", (PyCFunction)module_serve, METH_VARARGS | METH_KEYWORDS,
+     module_serve_doc},
+    {"use_virtual_clock", (PyCFunction)module_use_virtual_clock,
+     METH_VARARGS | METH_KEYWORDS, module_use_virtual_clock_doc},
+    {"advance", (PyCFunction)module_advance, METH_VARARGS,
+     module_advance_doc},
+    {"stats", (PyCFunction)module_stats, METH_NOARGS, module_stats_doc},
+    {"run_pending", (PyCFunction)module_run_pending, METH_NOARGS,
+     module_run_pending_doc},
+    {"export_openmetrics", (PyCFunction)module_export_openmetrics,
+     METH_VARARGS | METH_KEYWORDS, module_export_openmetrics_doc},
+    {"start_many", (PyCFunction)module_start_many, METH_O,
+     module_start_many_doc},
+    {"snapshot", (PyCFunction)module_snapshot, METH_VARARGS,
+     module_snapshot_doc},
+    {"restore", (PyCFunction)module_restore, METH_VARARGS,
+     module_restore_doc},
+    {"stop_many", (PyCFunction)module_stop_many, METH_O,
+     module_stop_many_doc},
+    {"now_ns", (PyCFunction)module_now_ns, METH_NOARGS, module_now_ns_doc},
+    {"deadline_ns", (PyCFunction)module_deadline_ns, METH_NOARGS,
+     module_deadline_ns_doc},
+    {"remaining_us", (PyCFunction)module_remaining_us, METH_NOARGS,
+     module_remaining_us_doc},
+    {"now_us", (PyCFunction)module_now_us, METH_NOARGS, module_now_us_doc},
+    {"wall_ns", (PyCFunction)module_wall_ns, METH_NOARGS, module_wall_ns_doc},
+    {"sleep_us", (PyCFunction)module_sleep_us, METH_VARARGS,
+     module_sleep_us_doc},
+    {"watch_callbacks", (PyCFunction)module_watch_callbacks,
+     METH_VARARGS | METH_KEYWORDS, module_watch_callbacks_doc},
+    {"callback_stats", (PyCFunction)module_callback_stats,
+     METH_VARARGS | METH_KEYWORDS, module_callback_stats_doc},
+    {"watch_gil", (PyCFunction)module_watch_gil, METH_VARARGS | METH_KEYWORDS,
+     module_watch_gil_doc},
+    {"sample_stacks", (PyCFunction)module_sample_stacks,
+     METH_VARARGS | METH_KEYWORDS, module_sample_stacks_doc},
+    {"folded_stacks", (PyCFunction)module_folded_stacks,
+     METH_VARARGS | METH_KEYWORDS, module_folded_stacks_doc},
+    {"sleep_until", (PyCFunction)module_sleep_until, METH_VARARGS,
+     module_sleep_until_doc},
+    {"replay", (PyCFunction)module_replay, METH_VARARGS | METH_KEYWORDS,
+     module_replay_doc},
+    {"configure", (PyCFunction)module_configure_locked,
+     METH_VARARGS | METH_KEYWORDS, module_configure_doc},
+    {"_shutdown", (PyCFunction)module_shutdown, METH_NOARGS,
+     module_shutdown_doc},
+#ifdef UNIX
+    {"_after_fork", (PyCFunction)module_after_fork, METH_NOARGS,
+     module_after_fork_doc},
+#endif
+    {NULL, NULL}
+};
+
+/* Have atexit call _shutdown before the interpreter goes away. */
+static int
+register_shutdown(PyObject *module)
+{
+    PyObject *atexit, *func, *rslt;
+
+    atexit = PyImport_ImportModule("atexit");
+    if (atexit == NULL)
+        return -1;
+    func = PyObject_GetAttrString(module, "_shutdown");
+    if (func == NULL) {
+        Py_DECREF(atexit);
+        return -1;
+    }
+    rslt = PyObject_CallMethod(atexit, "register", "O", func);
+    Py_DECREF(func);
+    Py_DECREF(atexit);
+    if (rslt == NULL)
+        return -1;
+    Py_DECREF(rslt);
+    return 0;
+}
+
+#ifdef UNIX
+/* Have the child of os.fork() call _after_fork, where Python can; before
+   3.7 the child's scheduler restarts with its first start() instead. */
+static int
+register_after_fork(PyObject *module)
+{
+    PyObject *os, *hook, *func, *args, *kwargs, *rslt;
+
+    os = PyImport_ImportModule("os");
+    if (os == NULL)
+        return -1;
+    hook = PyObject_GetAttrString(os, "register_at_fork");
+    Py_DECREF(os);
+    if (hook == NULL) {
+        if (!PyErr_ExceptionMatches(PyExc_AttributeError))
+            return -1;
+        PyErr_Clear();
+        return 0;
+    }
+    func = PyObject_GetAttrString(module, "_after_fork");
+    if (func == NULL) {
+        Py_DECREF(hook);
+        return -1;
+    }
+    args = PyTuple_New(0);
+    kwargs = Py_BuildValue("{s:N}", "after_in_child", func);
+    rslt = args != NULL && kwargs != NULL ?
+           PyObject_Call(hook, args, kwargs) : NULL;
+    Py_XDECREF(kwargs);
+    Py_XDECREF(args);
+    Py_DECREF(hook);
+    if (rslt == NULL)
+        return -1;
+    Py_DECREF(rslt);
+    return 0;
+}
+#endif /* UNIX */
+
+PyDoc_STRVAR(module_doc, "A simple timer module implemented in C.");
+
+/* Multi-phase init runs module_exec for each interpreter that imports the
+   module, which single-phase init doesn't do for a subinterpreter, so
+   each registers its own _shutdown. The engine's state is set up once
+   and shared, Timers are tagged with their interpreter. */
+#if PY_VERSION_HEX >= 0x03050000
+#define MULTI_PHASE_INIT
+#endif
+
+static int
+module_exec(PyObject *module)
+{
+    PyObject *capi, *lanes;
+    int i;
+
+    if (!scheduler_initialized) {
+#ifdef MS_WINDOWS
+        QueryPerformanceFrequency(&clock_frequency);
+        QueryPerformanceCounter(&clock_reference.perf_counter);
+        precise_time = (precise_time_fn)GetProcAddress(
+            GetModuleHandleW(L"kernel32.dll"),
+            "GetSystemTimePreciseAsFileTime");
+#endif
+        for (i = 0; i < MAX_SHARDS; i++) {
+            lock_init(&shards[i].lock);
+            shards[i].index = i;
+            shards[i].cpu = -1;
+            shards[i].oversleep = -1;
+            shards[i].numa_node = -1;
+            shards[i].numa_stale = TRUE;
+        }
+        for (i = 0; i < MAX_WORKERS; i++) {
+            lock_init(&workers[i].lock);
+            cond_init(&workers[i].cond);
+            workers[i].index = i;
+        }
+        lock_init(&workers_lock);
+        lock_init(&main_lock);
+        lock_init(&wall_lock);
+#if defined(UNIX) && !defined(HAVE_TIMERFD)
+        cond_init(&wall_cond);
+#endif
+#ifdef MS_WINDOWS
+        lock_init(&resolution_lock);
+#endif
+        for (i = 0; i < ARENAS; i++) {
+            lock_init(&arenas[i].lock);
+            arenas[i].numa_node = -1;
+        }
+        scheduler.backend_type = backend_types[0];
+        scheduler.queue_type = queue_types[0];
+        scheduler.spin_margin = (int64_t)DEFAULT_SPIN_MARGIN * 1000;
+        scheduler.batch_limit = DEFAULT_BATCH_LIMIT;
+        scheduler.shards = default_shards();
+        if (getenv("TIMER_SHARDS") != NULL &&
+            !set_shards(getenv("TIMER_SHARDS")))
+            goto fail;
+#ifdef UNIX
+        pthread_atfork(fork_prepare, fork_parent, fork_child);
+#endif
+        scheduler_initialized = TRUE;
+    }
+    /* The clock can only be picked before any deadline is computed. */
+    if (!scheduler.started && getenv("TIMER_CLOCK") != NULL &&
+        !set_clock(getenv("TIMER_CLOCK")))
+        goto fail;
+    if (!scheduler.started)
+        coarse_setup();
+    if (getenv("TIMER_QUEUE") != NULL && !set_queue_type(getenv("TIMER_QUEUE")))
+        goto fail;
+    if (getenv("TIMER_BACKEND") != NULL &&
+        !set_backend_type(getenv("TIMER_BACKEND")))
+        goto fail;
+    if (register_shutdown(module) < 0)
+        goto fail;
+#ifdef UNIX
+    if (register_after_fork(module) < 0)
+        goto fail;
+#endif
+
+#ifdef HAVE_TYPE_VECTORCALL
+    Timer_type.tp_vectorcall = Timer_vectorcall;
+#endif
+    if (PyType_Ready(&Timer_type) < 0)
+        goto fail;
+    Py_INCREF(&Timer_type);
+    PyModule_AddObject(module, "Timer", (PyObject*)&Timer_type);
+
+    if (PyType_Ready(&Future_type) < 0)
+        goto fail;
+    Py_INCREF(&Future_type);
+    PyModule_AddObject(module, "Future", (PyObject*)&Future_type);
+
+    Ticker_type.tp_base = &Timer_type;
+    if (PyType_Ready(&Ticker_type) < 0)
+        goto fail;
+    Py_INCREF(&Ticker_type);
+    PyModule_AddObject(module, "Ticker", (PyObject*)&Ticker_type);
+
+    Debouncer_type.tp_base = &Timer_type;
+    if (PyType_Ready(&Debouncer_type) < 0)
+        goto fail;
+    Py_INCREF(&Debouncer_type);
+    PyModule_AddObject(module, "Debouncer", (PyObject*)&Debouncer_type);
+
+    Throttler_type.tp_base = &Timer_type;
+    if (PyType_Ready(&Throttler_type) < 0)
+        goto fail;
+    Py_INCREF(&Throttler_type);
+    PyModule_AddObject(module, "Throttler", (PyObject*)&Throttler_type);
+
+    Backoff_type.tp_base = &Timer_type;
+    if (PyType_Ready(&Backoff_type) < 0)
+        goto fail;
+    Py_INCREF(&Backoff_type);
+    PyModule_AddObject(module, "Backoff", (PyObject*)&Backoff_type);
+
+    if (PyType_Ready(&Stopwatch_type) < 0)
+        goto fail;
+    Py_INCREF(&Stopwatch_type);
+    PyModule_AddObject(module, "Stopwatch", (PyObject*)&Stopwatch_type);
+
+    if (PyType_Ready(&Histogram_type) < 0)
+        goto fail;
+    Py_INCREF(&Histogram_type);
+    PyModule_AddObject(module, "Histogram", (PyObject*)&Histogram_type);
+
+    if (PyType_Ready(&Channel_type) < 0)
+        goto fail;
+    Py_INCREF(&Channel_type);
+    PyModule_AddObject(module, "Channel", (PyObject*)&Channel_type);
+
+    if (PyType_Ready(&Remote_type) < 0)
+        goto fail;
+    Py_INCREF(&Remote_type);
+    PyModule_AddObject(module, "Remote", (PyObject*)&Remote_type);
+
+    if (PyType_Ready(&TimerGroup_type) < 0)
+        goto fail;
+    Py_INCREF(&TimerGroup_type);
+    PyModule_AddObject(module, "TimerGroup", (PyObject*)&TimerGroup_type);
+
+    if (PyType_Ready(&Deadline_type) < 0)
+        goto fail;
+    Py_INCREF(&Deadline_type);
+    PyModule_AddObject(module, "deadline", (PyObject*)&Deadline_type);
+
+    if (PyType_Ready(&Within_type) < 0)
+        goto fail;
+    Py_INCREF(&Within_type);
+    PyModule_AddObject(module, "within", (PyObject*)&Within_type);
+#ifdef HAVE_CONTEXTVARS
+    if (deadline_var == NULL &&
+        (deadline_var = PyContextVar_New("timer.deadline", NULL)) == NULL)
+        goto fail;
+#endif
+
+    if (PyType_Ready(&Profile_type) < 0)
+        goto fail;
+    Py_INCREF(&Profile_type);
+    PyModule_AddObject(module, "profile", (PyObject*)&Profile_type);
+
+    if (PyType_Ready(&RateLimiter_type) < 0)
+        goto fail;
+    Py_INCREF(&RateLimiter_type);
+    PyModule_AddObject(module, "RateLimiter", (PyObject*)&RateLimiter_type);
+    /* Shared like the histograms, Deadline_fire raises it. */
+    if (DeadlineExceeded == NULL)
+#ifdef PYTHON3
+        DeadlineExceeded = PyErr_NewException("_timer.DeadlineExceeded",
+                                              PyExc_TimeoutError, NULL);
+#else
+        DeadlineExceeded = PyErr_NewException("_timer.DeadlineExceeded",
+                                              PyExc_OSError, NULL);
+#endif
+    if (DeadlineExceeded == NULL)
+        goto fail;
+    Py_INCREF(DeadlineExceeded);
+    PyModule_AddObject(module, "DeadlineExceeded", DeadlineExceeded);
+
+    capi = PyCapsule_New(&timer_capi, TIMER_API_NAME, NULL);
+    if (capi == NULL)
+        goto fail;
+    PyModule_AddObject(module, "_C_API", capi);
+
+    if (lateness_histogram == NULL) {
+        lateness_histogram = PyObject_CallObject((PyObject*)&Histogram_type,
+                                                 NULL);
+        wake_latency_histogram = PyObject_CallObject(
+            (PyObject*)&Histogram_type, NULL);
+        gil_wait_histogram = PyObject_CallObject((PyObject*)&Histogram_type,
+                                                 NULL);
+        if (lateness_histogram == NULL || wake_latency_histogram == NULL ||
+            gil_wait_histogram == NULL)
+            goto fail;
+    }
+    Py_INCREF(lateness_histogram);
+    PyModule_AddObject(module, "lateness", lateness_histogram);
+    Py_INCREF(wake_latency_histogram);
+    PyModule_AddObject(module, "wake_latency", wake_latency_histogram);
+    Py_INCREF(gil_wait_histogram);
+    PyModule_AddObject(module, "gil_wait", gil_wait_histogram);
+
+    lanes = PyDict_New();
+    if (lanes == NULL)
+        goto fail;
+    for (i = 0; i < LANES; i++) {
+        if (lane_lateness_histograms[i] == NULL)
+            lane_lateness_histograms[i] = PyObject_CallObject(
+                (PyObject*)&Histogram_type, NULL);
+        if (lane_lateness_histograms[i] == NULL ||
+            PyDict_SetItemString(lanes, lane_names[i],
+                                 lane_lateness_histograms[i]) < 0) {
+            Py_DECREF(lanes);
+            goto fail;
+        }
+    }
+    PyModule_AddObject(module, "priority_lateness", lanes);
+
+    PyModule_AddStringConstant(module, "clock", clock_name);
+    PyModule_AddStringConstant(module, "__version__", TIMER_VERSION);
+    PyModule_AddStringConstant(module, "__author__", AUTHOR);
+    return 0;
+
+fail:
+    return -1;
+}
+
+#ifdef MULTI_PHASE_INIT
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, (void*)module_exec},
+#ifdef Py_mod_multiple_interpreters
+    /* Not a GIL of their own, the engine and the types are shared. */
+    {Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_SUPPORTED},
+#endif
+#ifdef Py_GIL_DISABLED
+    /* See FREE_THREADED. */
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+#endif
+
+#ifdef PYTHON3
+static struct PyModuleDef _timer_module = {
+    PyModuleDef_HEAD_INIT,
+    "_timer",
+    module_doc,
+#ifdef MULTI_PHASE_INIT
+    0,
+    module_methods,
+    module_slots,
+#else
+    -1,
+    module_methods,
+    NULL,
+#endif
+    NULL, NULL, NULL
+};
+#endif
+
+#ifdef PYTHON3
+PyMODINIT_FUNC PyInit__timer(void)
+#else
+PyMODINIT_FUNC init_timer()
+#endif
+{
+#ifdef MULTI_PHASE_INIT
+    return PyModuleDef_Init(&_timer_module);
+#else
+    PyObject *module;
+
+#ifdef PYTHON3
+    module = PyModule_Create(&_timer_module);
+    if (module != NULL && module_exec(module) < 0)
+        Py_CLEAR(module);
+    return module;
+#else
+    /* An exception set says it failed. */
+    module = Py_InitModule3("_timer", module_methods, module_doc);
+    if (module != NULL)
+        module_exec(module);
+#endif
 #endif
 }
@@ -0,0 +1,55 @@
+/*
+   C API of the timer engine, for other extension modules.
+
+   Import it once with the GIL held, typically in the module's init
+   function, then start the scheduler:
+
+       #include "timer_api.h"
+
+       if (Timer_IMPORT() == NULL || Timer_API->start() < 0)
+           return NULL;
+
+   After that schedule() and cancel() may be called from any thread,
+   without the GIL. Callbacks run on the scheduler thread without the GIL
+   and must not touch Python objects unless they take it themselves. They
+   should be short, every other timer waits for them.
+
+   A handle stays valid until its callback has returned or cancel() has
+   returned 1 for it. Calling cancel() while the callback runs is fine and
+   returns 0.
+*/
+
+#ifndef TIMER_API_H
+#define TIMER_API_H
+
+#include <stdint.h>
+
+#define TIMER_API_NAME "timer._timer._C_API"
+#define TIMER_API_VERSION 1
+
+typedef struct timer_api_handle timer_api_handle;
+
+typedef struct {
+    int version; /* TIMER_API_VERSION */
+    /* Start the scheduler thread if it isn't running. The GIL must be
+       held. Returns -1 with a Python exception set on failure. */
+    int (*start)(void);
+    /* The engine clock in nanoseconds, the timebase of deadlines. */
+    int64_t (*now_ns)(void);
+    /* Call fn(arg) on the scheduler thread once now_ns() reaches
+       deadline_ns. Returns NULL if out of memory or the scheduler isn't
+       running. */
+    timer_api_handle *(*schedule)(int64_t deadline_ns, void (*fn)(void *),
+                                  void *arg);
+    /* Returns 1 if fn won't be called, 0 if it is running or has run. */
+    int (*cancel)(timer_api_handle *handle);
+} Timer_CAPI;
+
+#ifndef TIMER_MODULE
+static Timer_CAPI *Timer_API;
+
+#define Timer_IMPORT() \
+    (Timer_API = (Timer_CAPI*)PyCapsule_Import(TIMER_API_NAME, 0))
+#endif
+
+#endif /* TIMER_API_H */
@@ -0,0 +1,110 @@
+"""asyncio integration.
+
+Timers started through this module deliver their expirations over a
+timer.Channel that the event loop watches, so callbacks run in the loop's
+thread in one batch per wake-up instead of on the scheduler thread with a
+call_soon_threadsafe() hop back. Where channels aren't available, such as
+Windows, the hop is used instead.
+"""
+
+import asyncio
+import weakref
+
+from timer._timer import Channel, Timer
+
+_dispatchers = weakref.WeakKeyDictionary()
+
+
+def _current_loop():
+    try:
+        return asyncio.get_running_loop()
+    except (AttributeError, RuntimeError):
+        # Before 3.7, or not called from a coroutine.
+        return asyncio.get_event_loop()
+
+
+class Dispatcher(object):
+    """Watches a Channel from an event loop and drains it there."""
+
+    def __init__(self, loop):
+        # Weak, the loop's entry in _dispatchers has to be able to go.
+        self.loop = weakref.ref(loop)
+        self.channel = Channel()
+        loop.add_reader(self.channel.fileno(), self.channel.drain)
+
+    def close(self):
+        loop = self.loop()
+        if loop is not None and not loop.is_closed():
+            loop.remove_reader(self.channel.fileno())
+        self.channel.close()
+
+
+def dispatcher(loop=None):
+    """Return the Dispatcher for loop, the current one by default, or None
+    if the loop can't watch a Channel."""
+    if loop is None:
+        loop = _current_loop()
+    try:
+        return _dispatchers[loop]
+    except KeyError:
+        pass
+    try:
+        result = Dispatcher(loop)
+    except NotImplementedError:
+        # No channels on this platform, or a loop without add_reader().
+        result = None
+    _dispatchers[loop] = result
+    return result
+
+
+def _start(loop, delay, callback, args):
+    d = dispatcher(loop)
+    if d is not None:
+        t = Timer(delay, callback, *args)
+        t.channel = d.channel
+    else:
+        t = Timer(delay, loop.call_soon_threadsafe, callback, *args)
+    t.start()
+    return t
+
+
+def call_later_us(delay, callback, *args):
+    """Start a Timer that runs callback(*args) in the running event loop's
+    thread after delay microseconds, and return it."""
+    return _start(_current_loop(), delay, callback, args)
+
+
+def _wake(future, result):
+    if not future.done():
+        future.set_result(result)
+
+
+def sleep_us(delay, result=None):
+    """Return a future, to be awaited, that completes with result after
+    delay microseconds. Cancelling it stops the timer."""
+    loop = _current_loop()
+    future = loop.create_future()
+    t = _start(loop, delay, _wake, (future, result))
+    future.add_done_callback(lambda f: f.cancelled() and t.stop())
+    return future
+
+
+def _copy_outcome(source, future):
+    if future.cancelled():
+        return
+    exception = source.exception()
+    if exception is not None:
+        future.set_exception(exception)
+    else:
+        future.set_result(source.result())
+
+
+def wrap_future(source, loop=None):
+    """Return a future of loop, the running one by default, that completes
+    like source, a timer.Future, does. This is what awaiting one uses."""
+    if loop is None:
+        loop = _current_loop()
+    future = loop.create_future()
+    source.add_done_callback(
+        lambda f: loop.call_soon_threadsafe(_copy_outcome, f, future))
+    return future
@@ -0,0 +1,100 @@
+"""Benchmarks for the timer engine.
+
+Run them all with ``python -m timer.bench``; the results are printed as
+one JSON document. ``--quick`` uses smaller sizes, ``--only`` picks
+benchmarks by name and ``--output`` writes the JSON to a file.
+``--baseline`` compares the regress benchmark against an earlier run's,
+see timer.bench.regress.
+"""
+
+import gc
+import os
+import sys
+import time
+
+BENCHMARKS = []
+
+
+def benchmark(func):
+    """Register func(quick) as a benchmark returning a dict of results."""
+    BENCHMARKS.append(func)
+    return func
+
+
+def clock():
+    """Wall clock in seconds for timing benchmark loops."""
+    return getattr(time, "perf_counter", time.time)()
+
+
+def cpu_time():
+    """CPU seconds used by the whole process, all threads included."""
+    times = os.times()
+    return times[0] + times[1]
+
+
+def rss_bytes():
+    """Resident set size of the process, or None where unavailable."""
+    try:
+        with open("/proc/self/statm") as f:
+            return int(f.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+    except (IOError, OSError, ValueError):
+        pass
+    if sys.platform == "win32":
+        try:
+            import ctypes
+            import ctypes.wintypes
+
+            class Counters(ctypes.Structure):
+                _fields_ = [("cb", ctypes.wintypes.DWORD),
+                            ("PageFaultCount", ctypes.wintypes.DWORD),
+                            ("PeakWorkingSetSize", ctypes.c_size_t),
+                            ("WorkingSetSize", ctypes.c_size_t)]
+            counters = Counters()
+            counters.cb = ctypes.sizeof(Counters)
+            ctypes.windll.psapi.GetProcessMemoryInfo(
+                ctypes.windll.kernel32.GetCurrentProcess(),
+                ctypes.byref(counters), counters.cb)
+            return counters.WorkingSetSize
+        except Exception:
+            return None
+    return None
+
+
+def percentiles(values, points=(50, 90, 99, 99.9, 100)):
+    """Nearest-rank percentiles of values, keyed like "p99.9"."""
+    values = sorted(values)
+    result = {}
+    for p in points:
+        if not values:
+            result["p%g" % p] = None
+            continue
+        rank = max(1, int(round(p / 100.0 * len(values))))
+        result["p%g" % p] = values[rank - 1]
+    return result
+
+
+def per_second(count, seconds):
+    return count / seconds if seconds > 0 else None
+
+
+def run(names=None, quick=False):
+    """Run the registered benchmarks, or those named, and return a dict
+    of their results along with the environment they ran in."""
+    from timer.bench import engine, compare, regress  # Registers them.
+    import timer
+
+    results = {
+        "python": sys.version.split()[0],
+        "platform": sys.platform,
+        "timer": timer._timer.__version__,
+        "clock": timer.clock,
+        "settings": timer.configure(),
+        "quick": quick,
+        "benchmarks": {},
+    }
+    for func in BENCHMARKS:
+        if names and func.__name__ not in names:
+            continue
+        gc.collect()
+        results["benchmarks"][func.__name__] = func(quick)
+    return results
@@ -0,0 +1,53 @@
+import argparse
+import json
+import sys
+
+from timer.bench import run
+from timer.bench.regress import check
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        prog="python -m timer.bench",
+        description="Benchmark the timer engine and print JSON results.")
+    parser.add_argument("--quick", action="store_true",
+                        help="use smaller sizes and shorter runs")
+    parser.add_argument("--only", action="append", metavar="NAME",
+                        help="run only this benchmark, may be repeated")
+    parser.add_argument("--output", metavar="FILE",
+                        help="write the JSON here instead of stdout")
+    parser.add_argument("--baseline", metavar="FILE",
+                        help="run the regress benchmark, unless --only "
+                             "names others too, compare it with the one in "
+                             "this earlier output, and exit with 1 if "
+                             "anything regressed")
+    args = parser.parse_args(argv)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)["benchmarks"]["regress"]
+        if not args.only:
+            args.only = ["regress"]
+        elif "regress" not in args.only:
+            args.only.append("regress")
+
+    results = run(args.only, args.quick)
+    text = json.dumps(results, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        sys.stdout.write(text + "\n")
+
+    if args.baseline:
+        report = check(baseline, results["benchmarks"]["regress"])
+        for r in report:
+            sys.stderr.write("%-32s %12.0f %12.0f  x%.2f  p=%.4f%s\n" % (
+                r["name"], r["baseline"], r["current"], r["ratio"] or 0,
+                r["p"], "  REGRESSION" if r["regression"] else ""))
+        if any(r["regression"] for r in report):
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,290 @@
+"""The same scenarios run on timer.Timer and on the standard library's
+threading.Timer, sched.scheduler and asyncio's call_later.
+
+Every implementation reports, per scenario, how fast timers were
+scheduled or cancelled, how late callbacks ran against the intended time
+on one common clock, and the CPU the process used while doing it.
+"""
+
+import random
+import sched
+import threading
+import time
+
+import timer
+from timer.bench import (benchmark, clock, cpu_time, per_second,
+                         percentiles)
+
+try:
+    import asyncio
+except ImportError:  # Python 2
+    asyncio = None
+
+# threading.Timer needs an OS thread per pending timer, so keep its share
+# of the concurrent scenarios small enough not to exhaust the process.
+MAX_THREADS = 1000
+
+# sched.scheduler.cancel() is linear in the pending events, so cancelling
+# them all is quadratic; past this it measures nothing but the wait.
+MAX_SCHED_CANCELS = 2000
+
+# Far enough away that nothing fires while a benchmark runs.
+NEVER = 3600
+
+
+def noop():
+    pass
+
+
+def lateness_us(fired):
+    """Percentiles of (actual - intended) in microseconds."""
+    return percentiles([(actual - intended) * 1e6
+                        for intended, actual in fired])
+
+
+def measured(func, *args):
+    """Run func, adding the CPU it used and its wall time to its result."""
+    cpu, wall = cpu_time(), clock()
+    result = func(*args)
+    wall = clock() - wall
+    result["wall_s"] = wall
+    result["cpu_percent"] = (cpu_time() - cpu) / wall * 100 if wall else None
+    return result
+
+
+def with_done(count):
+    """A callback recording when it ran, and an event set after count."""
+    fired = []
+    done = threading.Event()
+
+    def callback(intended):
+        fired.append((intended, clock()))
+        if len(fired) == count:
+            done.set()
+    return fired, done, callback
+
+
+# N concurrent timeouts, each due at its own random delay.
+
+def timeouts_timer(delays):
+    fired, done, callback = with_done(len(delays))
+    begin = clock()
+    for delay in delays:
+        timer.Timer(int(delay * 1e6), callback, begin + delay).start()
+    scheduled = clock() - begin
+    done.wait(60)
+    return {"schedule_per_s": per_second(len(delays), scheduled),
+            "fired": len(fired), "lateness_us": lateness_us(fired)}
+
+
+def timeouts_threading(delays):
+    fired, done, callback = with_done(len(delays))
+    begin = clock()
+    for delay in delays:
+        threading.Timer(delay, callback, (begin + delay,)).start()
+    scheduled = clock() - begin
+    done.wait(60)
+    return {"schedule_per_s": per_second(len(delays), scheduled),
+            "fired": len(fired), "lateness_us": lateness_us(fired)}
+
+
+def sched_scheduler():
+    return sched.scheduler(getattr(time, "monotonic", time.time), time.sleep)
+
+
+def timeouts_sched(delays):
+    fired, done, callback = with_done(len(delays))
+    s = sched_scheduler()
+    begin = clock()
+    for delay in delays:
+        s.enter(delay, 0, callback, (begin + delay,))
+    scheduled = clock() - begin
+    s.run()
+    return {"schedule_per_s": per_second(len(delays), scheduled),
+            "fired": len(fired), "lateness_us": lateness_us(fired)}
+
+
+def timeouts_asyncio(delays):
+    fired, done, callback = with_done(len(delays))
+    loop = asyncio.new_event_loop()
+    try:
+        finished = loop.create_future()
+
+        def on_fire(intended):
+            callback(intended)
+            if done.is_set() and not finished.done():
+                finished.set_result(None)
+        begin = clock()
+        for delay in delays:
+            loop.call_later(delay, on_fire, begin + delay)
+        scheduled = clock() - begin
+        loop.run_until_complete(asyncio.wait_for(finished, 60))
+    finally:
+        loop.close()
+    return {"schedule_per_s": per_second(len(delays), scheduled),
+            "fired": len(fired), "lateness_us": lateness_us(fired)}
+
+
+# Periodic ticks at 1 kHz, each one scheduled against the ideal time.
+
+def periodic_timer(ticks, period):
+    fired, done, callback = with_done(ticks)
+    state = {}
+
+    def tick():
+        callback(state["origin"] + len(fired) * period)
+        if done.is_set():
+            t.stop()
+    t = timer.Timer(int(period * 1e6), tick)
+    t.interval = int(period * 1e6)
+    state["origin"] = clock() + period
+    t.start()
+    done.wait(60)
+    t.stop()
+    return {"fired": len(fired), "lateness_us": lateness_us(fired)}
+
+
+def periodic_threading(ticks, period):
+    fired, done, callback = with_done(ticks)
+    origin = clock() + period
+
+    def tick(intended):
+        callback(intended)
+        if not done.is_set():
+            following = origin + len(fired) * period
+            threading.Timer(max(0, following - clock()), tick,
+                            (following,)).start()
+    threading.Timer(period, tick, (origin,)).start()
+    done.wait(60)
+    return {"fired": len(fired), "lateness_us": lateness_us(fired)}
+
+
+def periodic_sched(ticks, period):
+    fired, done, callback = with_done(ticks)
+    s = sched_scheduler()
+    offset = clock() - s.timefunc()
+    origin = clock() + period
+
+    def tick(intended):
+        callback(intended)
+        if not done.is_set():
+            following = origin + len(fired) * period
+            s.enterabs(following - offset, 0, tick, (following,))
+    s.enterabs(origin - offset, 0, tick, (origin,))
+    s.run()
+    return {"fired": len(fired), "lateness_us": lateness_us(fired)}
+
+
+def periodic_asyncio(ticks, period):
+    fired, done, callback = with_done(ticks)
+    loop = asyncio.new_event_loop()
+    try:
+        finished = loop.create_future()
+        offset = clock() - loop.time()
+        origin = clock() + period
+
+        def tick(intended):
+            callback(intended)
+            if done.is_set():
+                finished.set_result(None)
+                return
+            following = origin + len(fired) * period
+            loop.call_at(following - offset, tick, following)
+        loop.call_at(origin - offset, tick, origin)
+        loop.run_until_complete(asyncio.wait_for(finished, 60))
+    finally:
+        loop.close()
+    return {"fired": len(fired), "lateness_us": lateness_us(fired)}
+
+
+# Cancel-heavy: schedule timeouts that never fire and cancel them all.
+
+def cancel_timer(count):
+    begin = clock()
+    timers = [timer.Timer(NEVER * 1000000, noop) for _ in range(count)]
+    for t in timers:
+        t.start()
+    for t in timers:
+        t.stop()
+    return {"ops_per_s": per_second(count, clock() - begin)}
+
+
+def cancel_threading(count):
+    begin = clock()
+    timers = [threading.Timer(NEVER, noop) for _ in range(count)]
+    for t in timers:
+        t.start()
+    for t in timers:
+        t.cancel()
+    for t in timers:
+        t.join()
+    return {"ops_per_s": per_second(count, clock() - begin)}
+
+
+def cancel_sched(count):
+    s = sched_scheduler()
+    begin = clock()
+    events = [s.enter(NEVER, 0, noop, ()) for _ in range(count)]
+    for event in events:
+        s.cancel(event)
+    return {"ops_per_s": per_second(count, clock() - begin)}
+
+
+def cancel_asyncio(count):
+    loop = asyncio.new_event_loop()
+    try:
+        begin = clock()
+        handles = [loop.call_later(NEVER, noop)
+                   for _ in range(count)]
+        for handle in handles:
+            handle.cancel()
+        # Let the loop drop the cancelled handles, as it would in service.
+        loop.run_until_complete(asyncio.sleep(0))
+        elapsed = clock() - begin
+    finally:
+        loop.close()
+    return {"ops_per_s": per_second(count, elapsed)}
+
+
+def implementations(prefix):
+    names = ["timer", "threading", "sched"]
+    if asyncio is not None:
+        names.append("asyncio")
+    return [(name, globals()["%s_%s" % (prefix, name)]) for name in names]
+
+
+@benchmark
+def compare_timeouts(quick):
+    """N timeouts due at random times in a 200 ms window."""
+    count = 1000 if quick else 10000
+    rng = random.Random(0)
+    delays = [rng.uniform(0.01, 0.21) for _ in range(count)]
+    result = {"count": count}
+    for name, func in implementations("timeouts"):
+        subset = delays if name != "threading" else delays[:MAX_THREADS]
+        result[name] = measured(func, subset)
+        result[name]["count"] = len(subset)
+    return result
+
+
+@benchmark
+def compare_periodic(quick):
+    """A single 1 kHz periodic tick."""
+    ticks = 200 if quick else 2000
+    result = {"ticks": ticks, "period_us": 1000}
+    for name, func in implementations("periodic"):
+        result[name] = measured(func, ticks, 0.001)
+    return result
+
+
+@benchmark
+def compare_cancel(quick):
+    """Schedule and cancel timeouts that never fire."""
+    count = 10000 if quick else 100000
+    result = {"count": count}
+    limits = {"threading": MAX_THREADS, "sched": MAX_SCHED_CANCELS}
+    for name, func in implementations("cancel"):
+        n = min(count, limits.get(name, count))
+        result[name] = measured(func, n)
+        result[name]["count"] = n
+    return result
@@ -0,0 +1,173 @@
+"""Benchmarks of the timer engine on its own."""
+
+import threading
+import time
+
+import timer
+from timer.bench import (benchmark, clock, cpu_time, per_second,
+                         percentiles, rss_bytes)
+
+# Far enough away that nothing fires while a benchmark runs.
+NEVER = 3600 * 1000000
+
+
+def noop():
+    pass
+
+
+@benchmark
+def lifecycle(quick):
+    """Timer construction and start/stop pairs per second."""
+    count = 20000 if quick else 200000
+
+    begin = clock()
+    for _ in range(count):
+        timer.Timer(NEVER, noop)
+    construct = clock() - begin
+
+    t = timer.Timer(NEVER, noop)
+    begin = clock()
+    for _ in range(count):
+        t.start()
+        t.stop()
+    start_stop = clock() - begin
+
+    t.start()
+    begin = clock()
+    for _ in range(count):
+        t.touch()
+    touch = clock() - begin
+    t.stop()
+
+    return {"count": count,
+            "construct_per_s": per_second(count, construct),
+            "start_stop_per_s": per_second(count, start_stop),
+            "touch_per_s": per_second(count, touch)}
+
+
+@benchmark
+def stopwatch(quick):
+    """Overhead of a Stopwatch start/stop pair, and of recording into a
+    Histogram, net of the loop itself."""
+    count = 50000 if quick else 500000
+    sw = timer.Stopwatch()
+
+    begin = clock()
+    for _ in range(count):
+        pass
+    loop = clock() - begin
+
+    begin = clock()
+    for _ in range(count):
+        sw.start()
+        sw.stop()
+    plain = clock() - begin
+
+    sw.histogram = timer.Histogram()
+    begin = clock()
+    for _ in range(count):
+        sw.start()
+        sw.stop()
+    recorded = clock() - begin
+
+    return {"count": count,
+            "start_stop_ns": (plain - loop) / count * 1e9,
+            "start_stop_histogram_ns": (recorded - loop) / count * 1e9}
+
+
+@benchmark
+def dispatch(quick):
+    """Callbacks per second when many timers are due at once."""
+    count = 10000 if quick else 100000
+    done = threading.Event()
+    fired = [0]
+
+    def callback():
+        fired[0] += 1
+        if fired[0] == count:
+            done.set()
+
+    deadline = timer.now_ns() + 100 * 1000000
+    timers = [timer.Timer(0, callback) for _ in range(count)]
+    for t in timers:
+        t.start_at(deadline)
+    done.wait(60)
+    finished = timer.now_ns()
+
+    return {"count": count,
+            "fired": fired[0],
+            "callbacks_per_s": per_second(fired[0],
+                                          (finished - deadline) / 1e9)}
+
+
+@benchmark
+def lateness(quick):
+    """How late callbacks run, for timers due one at a time."""
+    count = 200 if quick else 2000
+    spacing = 1000  # Microseconds
+    timers = [timer.Timer(spacing * (i + 1), noop) for i in range(count)]
+    for t in timers:
+        t.start()
+    time.sleep(spacing * (count + 50) / 1e6)
+
+    late = [t.lateness_ns for t in timers if t.expired]
+    result = {"count": count, "fired": len(late)}
+    result["lateness_ns"] = percentiles(late)
+    result["wake_latency_ns"] = percentiles(
+        [t.wake_latency_ns for t in timers if t.expired])
+    result["gil_wait_ns"] = percentiles(
+        [t.gil_wait_ns for t in timers if t.expired])
+    return result
+
+
+@benchmark
+def idle_cpu(quick):
+    """CPU used while timers are pending but none is due."""
+    seconds = 0.5 if quick else 2.0
+    result = {}
+    for count in (1, 1000, 100000):
+        timers = [timer.Timer(NEVER, noop) for _ in range(count)]
+        for t in timers:
+            t.start()
+        time.sleep(0.05)
+        cpu = cpu_time()
+        time.sleep(seconds)
+        used = cpu_time() - cpu
+        for t in timers:
+            t.stop()
+        result[str(count)] = {"cpu_percent": used / seconds * 100,
+                              "cpu_ns_per_timer_per_s":
+                                  used / seconds / count * 1e9}
+    return result
+
+
+def _start_pending(count, args):
+    # count started Timer(NEVER, noop, *args) and the resident memory per
+    # timer they added.
+    before = rss_bytes()
+    timers = [timer.Timer(NEVER, noop, *args) for _ in range(count)]
+    for t in timers:
+        t.start()
+    return timers, float(rss_bytes() - before) / count
+
+
+@benchmark
+def memory(quick):
+    """Resident memory per pending timer, Python object included, without
+    arguments and with one, which needs no tuple."""
+    sizes = (1000, 10000, 100000) if quick else (1000, 100000, 1000000)
+    result = {}
+    if rss_bytes() is None:
+        return {"error": "resident memory unavailable on this platform"}
+    for count in sizes:
+        # Both kinds stay pending until measured, so that the second
+        # doesn't reuse the memory of the first.
+        bare, bare_bytes = _start_pending(count, ())
+        one_arg, one_arg_bytes = _start_pending(count, (count,))
+        for t in bare + one_arg:
+            t.stop()
+        del bare, one_arg
+        result[str(count)] = {"bytes_per_timer": bare_bytes,
+                              "bytes_per_timer_one_arg": one_arg_bytes}
+    result["object_bytes"] = timer.Timer.__basicsize__
+    return result
@@ -0,0 +1,181 @@
+"""Performance regression checks.
+
+The regress benchmark measures, on every scheduler backend the host has,
+how late callbacks fire, what start() costs and how long stop() takes.
+Each is measured over several batches, so a run holds a distribution per
+figure rather than one number. check() compares two runs and only calls
+a figure a regression when it is both worse by more than a tolerance and
+significantly so, by a one-sided Mann-Whitney U test of the batches,
+with the significance split between the figures compared. A few batches
+hit by a loaded host don't make a regression. Nor does a host that runs
+slower as a whole in one run than in the other: each batch also times a
+loop of Python calls, and the start() and stop() figures are compared
+relative to it.
+
+Record a baseline with ``python -m timer.bench --only regress --output
+FILE`` and compare a later build against it with ``--baseline FILE``.
+"""
+
+import math
+import time
+
+import timer
+from timer.bench import benchmark, clock
+
+# Every backend that may exist somewhere; those a host lacks are skipped.
+BACKENDS = ("condvar", "timerfd", "io_uring", "posix_timer", "kqueue",
+            "waitable", "threadpool")
+
+# Far enough away that nothing fires while a batch runs.
+NEVER = 3600 * 1000000
+
+# A regression has to be this much worse, at this significance.
+TOLERANCE = 0.25
+ALPHA = 0.01
+
+# Figures that scale with how fast the host runs Python, see check().
+RELATIVE = ("start_ns", "stop_ns")
+
+
+def noop():
+    pass
+
+
+def median(values):
+    values = sorted(values)
+    n = len(values)
+    if n == 0:
+        return None
+    if n % 2:
+        return values[n // 2]
+    return (values[n // 2 - 1] + values[n // 2]) / 2.0
+
+
+def _lateness_batch(count, spacing):
+    timers = [timer.Timer(spacing * (i + 1), noop) for i in range(count)]
+    for t in timers:
+        t.start()
+    time.sleep(spacing * (count + 20) / 1e6)
+    for t in timers:
+        t.stop()
+    return median([t.lateness_ns for t in timers if t.expired])
+
+
+def _reference_batch(count):
+    begin = clock()
+    for _ in range(count):
+        noop()
+    return (clock() - begin) / count * 1e9
+
+
+def _lifecycle_batch(count):
+    timers = [timer.Timer(NEVER, noop) for _ in range(count)]
+    begin = clock()
+    for t in timers:
+        t.start()
+    started = clock()
+    for t in timers:
+        t.stop()
+    stopped = clock()
+    return ((started - begin) / count * 1e9,
+            (stopped - started) / count * 1e9)
+
+
+def measure(batches, count=20, spacing=2000, lifecycle=1000):
+    """Batches of fire lateness, start cost and stop latency, in
+    nanoseconds, for the current backend, and of the reference loop."""
+    result = {"fire_lateness_ns": [], "start_ns": [], "stop_ns": [],
+              "reference_ns": []}
+    # Not counted: the first batch on a backend warms its thread up, and
+    # the allocators.
+    _lifecycle_batch(lifecycle)
+    for _ in range(batches):
+        result["fire_lateness_ns"].append(_lateness_batch(count, spacing))
+        start, stop = _lifecycle_batch(lifecycle)
+        result["start_ns"].append(start)
+        result["stop_ns"].append(stop)
+        result["reference_ns"].append(_reference_batch(lifecycle))
+    return result
+
+
+@benchmark
+def regress(quick):
+    """Fire lateness, start() cost and stop() latency per backend, in
+    batches that check() can compare between runs."""
+    batches = 8 if quick else 20
+    original = timer.configure()["backend"]
+    result = {"batches": batches, "backends": {}}
+    try:
+        for name in BACKENDS:
+            try:
+                timer.configure(backend=name)
+            except (ValueError, OSError, NotImplementedError):
+                continue
+            result["backends"][name] = measure(batches)
+    finally:
+        timer.configure(backend=original)
+    return result
+
+
+def mann_whitney(baseline, current):
+    """One-sided p-value of current tending to be larger than baseline,
+    by the normal approximation of the U statistic with ties."""
+    n1, n2 = len(baseline), len(current)
+    if n1 == 0 or n2 == 0:
+        return 1.0
+    pooled = sorted([(v, 0) for v in baseline] + [(v, 1) for v in current])
+    n = n1 + n2
+    rank_sum, ties, i = 0.0, 0.0, 0
+    while i < n:
+        j = i
+        while j < n and pooled[j][0] == pooled[i][0]:
+            j += 1
+        # Tied values share the mean of their ranks, i + 1 to j.
+        rank = (i + 1 + j) / 2.0
+        rank_sum += rank * sum(1 for k in range(i, j) if pooled[k][1])
+        ties += (j - i) ** 3 - (j - i)
+        i = j
+    u = rank_sum - n2 * (n2 + 1) / 2.0
+    variance = n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1.0)))
+    if variance <= 0:
+        return 1.0
+    z = (u - n1 * n2 / 2.0 - 0.5) / math.sqrt(variance)
+    return 0.5 * math.erfc(z / math.sqrt(2))
+
+
+def check(baseline, current, tolerance=TOLERANCE, alpha=ALPHA):
+    """Compare two regress results, as the benchmark returns them. Returns
+    one dict per figure both have, worst first, with regression set for
+    those significantly worse by more than tolerance. The current values
+    of RELATIVE figures are scaled by how much faster the reference loop
+    ran in the baseline, at its fastest, first."""
+    report = []
+    for backend, figures in sorted(current.get("backends", {}).items()):
+        before = baseline.get("backends", {}).get(backend)
+        if before is None:
+            continue
+        # The fastest batch, the others were interrupted or on a slower
+        # core.
+        old_ref = min(before.get("reference_ns") or [None])
+        new_ref = min(figures.get("reference_ns") or [None])
+        for figure, values in sorted(figures.items()):
+            if figure == "reference_ns":
+                continue
+            old = [v for v in before.get(figure, ()) if v is not None]
+            new = [v for v in values if v is not None]
+            if not old or not new:
+                continue
+            if figure in RELATIVE and old_ref and new_ref:
+                new = [v * old_ref / new_ref for v in new]
+            old_median, new_median = median(old), median(new)
+            report.append({
+                "name": "%s.%s" % (backend, figure),
+                "baseline": old_median, "current": new_median,
+                "ratio": new_median / old_median if old_median > 0 else None,
+                "p": mann_whitney(old, new)})
+    for r in report:
+        r["regression"] = (r["ratio"] is not None and
+                           r["ratio"] > 1 + tolerance and
+                           r["p"] < alpha / len(report))
+    report.sort(key=lambda r: -(r["ratio"] or 0))
+    return report
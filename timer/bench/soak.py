@@ -0,0 +1,193 @@
+"""Soak test: sustained timer churn at a production shape.
+
+Threads arm timers at a steady total rate, most of which they cancel
+again a moment later, as a server does with its request timeouts, and
+the rest fire. Meanwhile the process is sampled at an interval: the rates
+reached, resident memory, CPU, the lateness of the callbacks that ran in
+the interval and how many timers the scheduler holds. Each sample is a
+line of JSON, then a summary follows. Run it with::
+
+    python -m timer.bench.soak --rate 500000 --cancel 0.95 --duration 600
+
+A microbenchmark is over before locks contend, queues grow or memory
+fragments; this keeps going for as long as it is asked to.
+"""
+
+import argparse
+import collections
+import json
+import random
+import sys
+import threading
+import time
+
+import timer
+from timer.bench import clock, cpu_time, rss_bytes
+
+# Arms per pass of a thread before it cancels what is due again.
+BATCH = 256
+
+
+def noop():
+    pass
+
+
+def _churn(rate, cancel, min_delay, max_delay, cancel_after, lazy, stop,
+           seed):
+    rng = random.Random(seed)
+    cancels = collections.deque()
+    begin = clock()
+    armed = 0
+    while not stop.is_set():
+        now = clock()
+        due = min(int((now - begin) * rate) - armed, BATCH)
+        for _ in range(due):
+            t = timer.Timer(rng.randint(min_delay, max_delay), noop)
+            t.lazy = lazy
+            t.start()
+            if rng.random() < cancel:
+                cancels.append((now + cancel_after, t))
+        armed += max(due, 0)
+        while cancels and cancels[0][0] <= now:
+            cancels.popleft()[1].stop()
+        if due <= 0:
+            time.sleep(0.0005)
+    for _, t in cancels:
+        t.stop()
+
+
+def _percentiles(histogram):
+    return dict(("p%g" % p, histogram.percentile(p))
+                for p in (50, 99, 99.9, 100))
+
+
+def _reset():
+    for histogram in (timer.lateness, timer.wake_latency, timer.gil_wait):
+        histogram.reset()
+
+
+def soak(rate=100000, cancel=0.95, threads=4, min_delay=10000,
+         max_delay=100000, cancel_after=5000, duration=60, interval=1.0,
+         report=None, lazy=False):
+    """Churn timers for duration seconds and return the samples, also
+    passing each to report as it is taken. rate is arms a second across
+    all threads, cancel the fraction stopped cancel_after microseconds
+    after they were started, and delays are picked between min_delay and
+    max_delay microseconds. lazy is what Timer.lazy is set to. Lateness
+    is read from timer.lateness, which is reset every interval along
+    with the histograms that go with it."""
+    if not 0 < cancel_after < min_delay:
+        raise ValueError("cancel_after must be under min_delay, or the "
+                         "timers to cancel fire first")
+    stop = threading.Event()
+    workers = [threading.Thread(target=_churn,
+                                args=(float(rate) / threads, cancel,
+                                      min_delay, max_delay,
+                                      cancel_after / 1e6, lazy, stop, i))
+               for i in range(threads)]
+    samples = []
+    _reset()
+    before, cpu, wall = timer.stats(), cpu_time(), clock()
+    begin = wall
+    for w in workers:
+        w.daemon = True
+        w.start()
+    try:
+        while wall - begin < duration:
+            time.sleep(max(0, min(interval, begin + duration - wall)))
+            stats, now_cpu, now = timer.stats(), cpu_time(), clock()
+            elapsed = now - wall
+            sample = {
+                "t_s": round(now - begin, 3),
+                "started_per_s": (stats["started"] - before["started"]) /
+                                 elapsed,
+                "cancelled_per_s": (stats["cancelled"] -
+                                    before["cancelled"]) / elapsed,
+                "fired_per_s": (stats["fired"] - before["fired"]) / elapsed,
+                "pending": stats["pending"],
+                "tombstones": stats["tombstones"],
+                "rss_bytes": rss_bytes(),
+                "cpu_percent": (now_cpu - cpu) / elapsed * 100,
+                "lateness_ns": _percentiles(timer.lateness),
+            }
+            _reset()
+            samples.append(sample)
+            if report is not None:
+                report(sample)
+            before, cpu, wall = stats, now_cpu, now
+    finally:
+        stop.set()
+        for w in workers:
+            w.join()
+        # Let the last timers that weren't cancelled fire, so the engine is
+        # left idle.
+        time.sleep(max_delay / 1e6)
+    return samples
+
+
+def summary(samples):
+    """The worst of the samples, and the memory growth over the run."""
+    if not samples:
+        return {}
+    rss = [s["rss_bytes"] for s in samples if s["rss_bytes"] is not None]
+    return {
+        "samples": len(samples),
+        "min_started_per_s": min(s["started_per_s"] for s in samples),
+        "max_pending": max(s["pending"] for s in samples),
+        "max_cpu_percent": max(s["cpu_percent"] for s in samples),
+        "max_lateness_p99_ns": max(s["lateness_ns"]["p99"]
+                                   for s in samples),
+        "max_lateness_ns": max(s["lateness_ns"]["p100"] for s in samples),
+        "rss_growth_bytes": rss[-1] - rss[0] if rss else None,
+    }
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        prog="python -m timer.bench.soak",
+        description="Churn timers at a steady rate and print samples of "
+                    "the process as JSON lines.")
+    parser.add_argument("--rate", type=int, default=100000,
+                        help="timers armed per second, all threads "
+                             "together (default 100000)")
+    parser.add_argument("--cancel", type=float, default=0.95,
+                        help="fraction of them cancelled (default 0.95)")
+    parser.add_argument("--threads", type=int, default=4,
+                        help="arming threads (default 4)")
+    parser.add_argument("--min-delay", type=int, default=10000,
+                        metavar="US", help="shortest delay (default 10000)")
+    parser.add_argument("--max-delay", type=int, default=100000,
+                        metavar="US", help="longest delay (default 100000)")
+    parser.add_argument("--cancel-after", type=int, default=5000,
+                        metavar="US",
+                        help="how long after starting it a timer is "
+                             "cancelled (default 5000)")
+    parser.add_argument("--duration", type=float, default=60,
+                        metavar="S", help="seconds to run (default 60)")
+    parser.add_argument("--interval", type=float, default=1.0,
+                        metavar="S", help="seconds between samples "
+                                          "(default 1)")
+    parser.add_argument("--lazy", action="store_true",
+                        help="start the timers with Timer.lazy set")
+    parser.add_argument("--output", metavar="FILE",
+                        help="write the JSON lines here instead of stdout")
+    args = parser.parse_args(argv)
+
+    out = open(args.output, "w") if args.output else sys.stdout
+
+    def report(sample):
+        out.write(json.dumps(sample, sort_keys=True) + "\n")
+        out.flush()
+    try:
+        samples = soak(args.rate, args.cancel, args.threads, args.min_delay,
+                       args.max_delay, args.cancel_after, args.duration,
+                       args.interval, report, args.lazy)
+        out.write(json.dumps({"summary": summary(samples)},
+                             sort_keys=True) + "\n")
+    finally:
+        if out is not sys.stdout:
+            out.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,77 @@
+"""gevent integration.
+
+Timers started through this module deliver their expirations over a
+timer.Channel that the hub's loop watches, so the callbacks run in the
+hub greenlet. A timed wait then costs the hub waking up once for all
+timers due together and a greenlet switch back to each waiter, rather
+than a callback on the scheduler thread contending for the GIL. Where
+channels aren't available, such as Windows, the callbacks go through the
+loop's run_callback_threadsafe() instead.
+"""
+
+import weakref
+
+from gevent.hub import Waiter, get_hub
+
+from timer._timer import Channel, Timer
+
+_dispatchers = weakref.WeakKeyDictionary()
+
+
+class Dispatcher(object):
+    """Watches a Channel from a hub's loop and drains it there."""
+
+    def __init__(self, hub):
+        self.channel = Channel()
+        self.watcher = hub.loop.io(self.channel.fileno(), 1)
+        self.watcher.start(self.channel.drain)
+
+    def close(self):
+        self.watcher.stop()
+        self.channel.close()
+
+
+def dispatcher(hub=None):
+    """Return the Dispatcher for hub, the current thread's by default, or
+    None if the hub can't watch a Channel."""
+    if hub is None:
+        hub = get_hub()
+    try:
+        return _dispatchers[hub]
+    except KeyError:
+        pass
+    try:
+        result = Dispatcher(hub)
+    except NotImplementedError:
+        result = None
+    _dispatchers[hub] = result
+    return result
+
+
+def _start(hub, delay, callback, args):
+    d = dispatcher(hub)
+    if d is not None:
+        t = Timer(delay, callback, *args)
+        t.channel = d.channel
+    else:
+        t = Timer(delay, hub.loop.run_callback_threadsafe, callback, *args)
+    t.start()
+    return t
+
+
+def call_later_us(delay, callback, *args):
+    """Start a Timer that runs callback(*args) in the current thread's hub
+    after delay microseconds, and return it."""
+    return _start(get_hub(), delay, callback, args)
+
+
+def sleep_us(delay):
+    """Block the current greenlet for delay microseconds, letting others
+    run. The timer is stopped if the greenlet is killed while waiting."""
+    hub = get_hub()
+    waiter = Waiter(hub)
+    t = _start(hub, delay, waiter.switch, (None,))
+    try:
+        waiter.get()
+    finally:
+        t.stop()
@@ -0,0 +1,198 @@
+"""Readers for the stats page written by timer.publish_stats() and the
+event trace written by timer.trace().
+
+The page is a file with a fixed, native endian layout:
+
+    offset  type        field
+    0       char[8]     magic, "PYTIMER\\0"
+    8       uint32      version, 1
+    12      uint32      header_size, offset of the first histogram
+    16      uint64      seq, odd while the scheduler is updating the page
+    24      int64       pid of the publishing process
+    32      int64       updated_ns, engine clock at the last update
+    40      int64       interval_ns between updates
+    48      int64       pending
+    56      int64 * 8   started, fired, cancelled, errors, callback_ns,
+                        gil_wait_ns, wakeups, spins
+    120     uint32      histograms, 3: lateness, wake_latency, gil_wait
+    124     uint32      buckets per histogram
+    128     int32       bits of the histograms
+    132     int32       reserved
+
+followed at header_size by each histogram as int64 count, min, max, sum
+and its bucket counts. Only the standard library is needed, so the
+reader can live in a monitoring agent without the extension.
+"""
+
+import mmap
+import struct
+
+MAGIC = b"PYTIMER\0"
+VERSION = 1
+
+_HEADER = struct.Struct("=8sIIQqqqq8qIIii")
+_COUNTERS = ("started", "fired", "cancelled", "errors", "callback_ns",
+             "gil_wait_ns", "wakeups", "spins")
+HISTOGRAMS = ("lateness", "wake_latency", "gil_wait")
+
+
+def _bucket_value(bits, index):
+    # The top of a bucket, as Histogram.snapshot() reports it.
+    shift = (index >> bits) - 1
+    if shift <= 0:
+        return index
+    top = (index & ((1 << bits) - 1)) + (1 << bits)
+    return (top << shift) + (1 << shift) - 1
+
+
+def _parse(data):
+    fields = _HEADER.unpack_from(data, 0)
+    magic, version, header_size = fields[:3]
+    if magic != MAGIC:
+        raise ValueError("not a timer stats page")
+    if version != VERSION:
+        raise ValueError("unsupported stats page version %d" % version)
+    stats = {"pid": fields[4], "updated_ns": fields[5],
+             "interval_ns": fields[6], "pending": fields[7]}
+    stats.update(zip(_COUNTERS, fields[8:16]))
+    histograms, buckets, bits = fields[16:19]
+
+    offset = header_size
+    for name in HISTOGRAMS[:histograms]:
+        values = struct.unpack_from("=%dq" % (4 + buckets), data, offset)
+        offset += 8 * (4 + buckets)
+        count, low, high, total = values[:4]
+        stats[name] = {
+            "count": count, "min": low, "max": high,
+            "mean": float(total) / count if count else 0.0,
+            "buckets": [(_bucket_value(bits, i), n)
+                        for i, n in enumerate(values[4:]) if n]}
+    return stats
+
+
+def read_stats(path, retries=100):
+    """Return the counters and histograms in the page at path as a dict
+    shaped like timer.stats(), plus pid, updated_ns, interval_ns and one
+    Histogram.snapshot()-like dict per histogram."""
+    with open(path, "rb") as f:
+        page = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    try:
+        for _ in range(retries):
+            seq = struct.unpack_from("=Q", page, 16)[0]
+            if seq & 1:
+                continue
+            data = page[:]
+            if struct.unpack_from("=Q", page, 16)[0] == seq:
+                return _parse(data)
+        raise RuntimeError("stats page kept changing while being read")
+    finally:
+        page.close()
+
+
+# Event trace written by timer.trace(). The header is
+#
+#     offset  type        field
+#     0       char[8]     magic, "PYTRACE\0"
+#     8       uint32      version, 1
+#     12      uint32      header_size, offset of the first ring
+#     16      uint32      rings
+#     20      uint32      capacity, records per ring, a power of two
+#     24      uint32      record_size, 40
+#     28      uint32      reserved
+#     32      int64       pid
+#
+# followed by the rings, each starting on a 64 byte boundary with a
+# uint64 count of records ever claimed by writers, padded to 64 bytes,
+# then capacity records of uint64 seq, int64 time, uint64 timer, int64
+# arg, uint32 event and uint32 thread. Record n is complete once its seq
+# is n + 1, the writer's last store. Ring i starts at header_size + i * stride, stride
+# being 64 + capacity * record_size rounded up to 64.
+
+TRACE_MAGIC = b"PYTRACE\0"
+TRACE_VERSION = 1
+TRACE_EVENTS = {1: "start", 2: "arm", 3: "fire", 4: "callback_begin",
+                5: "callback_end", 6: "cancel"}
+
+# The fields of a record, as numpy.dtype(TRACE_RECORD) takes them.
+TRACE_RECORD = [("seq", "=u8"), ("time", "=i8"), ("timer", "=u8"), ("arg", "=i8"),
+                ("event", "=u4"), ("thread", "=u4")]
+
+_TRACE_HEADER = struct.Struct("=8sIIIIIIq")
+_RECORD = struct.Struct("=QqQqII")
+
+
+def _trace_layout(data):
+    # header_size, rings, capacity, record_size and stride of a trace.
+    (magic, version, header_size, rings, capacity, record_size,
+     _, _) = _TRACE_HEADER.unpack_from(data, 0)
+    if magic != TRACE_MAGIC:
+        raise ValueError("not a timer trace")
+    if version != TRACE_VERSION:
+        raise ValueError("unsupported trace version %d" % version)
+    stride = (64 + capacity * record_size + 63) & ~63
+    return header_size, rings, capacity, record_size, stride
+
+
+def trace_rings(path):
+    """Return the rings of the trace file at path as (head, records)
+    pairs, without copying them: head is how many records were ever
+    claimed in the ring when it was read, records a read-only buffer of
+    its capacity records mapped from the file, record n at n % capacity
+    and written once its seq is n + 1. The records go on changing while the trace is recording. With numpy,
+    numpy.frombuffer(records, dtype=TRACE_RECORD) maps them as an
+    array."""
+    with open(path, "rb") as f:
+        data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    header_size, rings, capacity, record_size, stride = _trace_layout(data)
+    try:
+        view = memoryview(data)
+    except TypeError:
+        # Python 2's mmap only has the old buffer interface.
+        view = None
+    result = []
+    for ring in range(rings):
+        base = header_size + ring * stride
+        head = struct.unpack_from("=Q", data, base)[0]
+        start, size = base + 64, capacity * record_size
+        if view is not None:
+            records = view[start:start + size]
+        else:
+            records = buffer(data, start, size)
+        result.append((head, records))
+    return result
+
+
+def read_trace(path):
+    """Return the events in the trace file at path, oldest first, as
+    (time_ns, trace_id, event, arg, thread) tuples. arg is the deadline
+    for start, arm and fire, and 1 for a callback_end whose callback
+    raised."""
+    with open(path, "rb") as f:
+        data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    try:
+        header_size, rings, capacity, record_size, stride = _trace_layout(
+            data)
+
+        events = []
+        for ring in range(rings):
+            base = header_size + ring * stride
+            head = struct.unpack_from("=Q", data, base)[0]
+            first = max(0, head - capacity)
+            records = data[base + 64:base + 64 + capacity * record_size]
+            # Anything the writers lapped while we copied is unreliable.
+            first = max(first, struct.unpack_from("=Q", data, base)[0] -
+                        capacity)
+            for n in range(first, head):
+                (seq, time_ns, timer_id, arg, event,
+                 thread) = _RECORD.unpack_from(
+                    records, (n & (capacity - 1)) * record_size)
+                if seq != n + 1:
+                    # Claimed, but not written yet.
+                    continue
+                events.append((time_ns, timer_id,
+                               TRACE_EVENTS.get(event, event), arg, thread))
+        # Stable, so events with the same time stay in the order written.
+        events.sort(key=lambda event: event[0])
+        return events
+    finally:
+        data.close()
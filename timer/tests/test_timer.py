@@ -1,4 +1,13 @@
+import gc
+import os
+import select
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
 import time
+import weakref
 
 try:
     import unittest2 as unittest
@@ -7,6 +16,24 @@ except ImportError:
 
 import timer
 
+try:
+    import asyncio
+except ImportError:
+    asyncio = None
+
+try:
+    import gevent
+except ImportError:
+    gevent = None
+
+try:
+    import _interpreters as subinterpreters
+except ImportError:
+    try:
+        import _xxsubinterpreters as subinterpreters
+    except ImportError:
+        subinterpreters = None
+
 CALLBACK_ARGS = []
 CALLBACK_KWARGS = {}
 
@@ -17,6 +44,13 @@ def callback_function(*args, **kwargs):
     CALLBACK_KWARGS = kwargs
 
 
+def wait_fired(t, timeout=5.0):
+    """Wait for the callback of t, started after its future was set, to
+    have returned. A loaded host only makes this take longer, where a
+    fixed sleep would fail."""
+    t.future.result(timeout)
+
+
 class TestFunctionCallbacks(unittest.TestCase):
     def setUp(self):
         self.duration = 5000 # 5 milliseconds
@@ -25,9 +59,10 @@ class TestFunctionCallbacks(unittest.TestCase):
         callback = lambda: None
 
         t = timer.Timer(self.duration, callback)
+        t.future = timer.Future()
         t.start()
         self.assertTrue(t.running)
-        time.sleep(0.01)
+        wait_fired(t)
         self.assertTrue(t.expired)
         self.assertEqual(self.duration, t.elapsed)
         self.assertFalse(t.running)
@@ -63,19 +98,53 @@ class TestFunctionCallbacks(unittest.TestCase):
     def test_callback_function_args(self):
         args = (1, 2, 3)
         t = timer.Timer(self.duration, callback_function, *args)
+        t.future = timer.Future()
         t.start()
-        time.sleep(0.1)
+        wait_fired(t)
         self.assertEqual(args, CALLBACK_ARGS)
 
     def test_callback_function_args_and_kwargs(self):
         args = (1, 2, 3)
         kwargs = {"lol" : True, "hurf" : "durf"}
         t = timer.Timer(self.duration, callback_function, *args, **kwargs)
+        t.future = timer.Future()
         t.start()
-        time.sleep(0.1)
+        wait_fired(t)
         self.assertEqual(args, CALLBACK_ARGS)
         self.assertEqual(kwargs, CALLBACK_KWARGS)
 
+    def test_refire_args_and_kwargs(self):
+        calls = []
+        t = timer.Timer(1000, lambda *a, **k: calls.append((a, k)),
+                        1, "two", three=3)
+        for _ in range(3):
+            t.reset()
+            t.start()
+            time.sleep(0.01)
+        self.assertEqual(calls, [((1, "two"), {"three": 3})] * 3)
+        # Each call gets its own dict.
+        calls[0][1]["four"] = 4
+        self.assertEqual(calls[1][1], {"three": 3})
+        # Keyword arguments alone, and one positional with them.
+        del calls[:]
+        for t in (timer.Timer(1000, lambda **k: calls.append(k), three=3),
+                  timer.Timer(1000, lambda a, **k: calls.append((a, k)), 1,
+                              two=2)):
+            t.start()
+        time.sleep(0.01)
+        self.assertEqual(sorted(map(repr, calls)),
+                         sorted(map(repr, [{"three": 3}, (1, {"two": 2})])))
+
+    def test_subclass_init(self):
+        # Subclasses are created through tp_new and run their __init__,
+        # where Timer itself takes the vectorcall path.
+        class Sub(timer.Timer):
+            def __init__(self, duration, callback, *args, **kwargs):
+                self.seen = (duration, args, kwargs)
+        s = Sub(1000, callback_function, 1, two=2)
+        self.assertEqual(s.seen, (1000, (1,), {"two": 2}))
+        self.assertEqual(s.duration, 1000)
+
 
 # Test cases where methods of a class would be used instead of functions.
 # This is probably the most common case.
@@ -99,8 +168,9 @@ class TestMethodCallbacks(unittest.TestCase):
             t = timer.Timer(self.duration, cb, *args)
         else:
             t = timer.Timer(self.duration, cb)
+        t.future = timer.Future()
         t.start()
-        time.sleep(0.01)
+        wait_fired(t)
         self.assertEqual(t.elapsed, self.duration)
         self.assertFalse(t.running)
         self.assertTrue(t.expired)
@@ -122,6 +192,2159 @@ class TestMethodCallbacks(unittest.TestCase):
         # Confirm that the callback actually happened.
         self.assertEqual([True], self.args)
 
+    def test_cycle(self):
+        class Owner(object):
+            def fire(self):
+                pass
+        owner = Owner()
+        owner.timer = timer.Timer(self.duration, owner.fire)
+        ref = weakref.ref(owner)
+        del owner
+        gc.collect()
+        self.assertIsNone(ref())
+
+        # Nothing to find through atomic arguments, or while pending.
+        self.assertFalse(gc.is_tracked(timer.Timer(1000, int, 1, "a")))
+        self.assertTrue(gc.is_tracked(timer.Timer(1000, int, [])))
+        t = timer.Timer(self.duration, self.callback)
+        t.start()
+        self.assertFalse(gc.is_tracked(t))
+        t.stop()
+        self.assertTrue(gc.is_tracked(t))
+
+
+class TestScheduler(unittest.TestCase):
+    def test_many_timers(self):
+        # All timers share one scheduler thread.
+        fired = []
+        timers = [timer.Timer(1000 + i, fired.append, i) for i in range(200)]
+        for t in timers:
+            t.start()
+        time.sleep(0.1)
+        self.assertEqual(sorted(fired), list(range(200)))
+        for t in timers:
+            self.assertTrue(t.expired)
+
+    def test_stop_leaves_others(self):
+        fired = []
+        first = timer.Timer(5000, fired.append, 1)
+        second = timer.Timer(5000, fired.append, 2)
+        first.start()
+        second.start()
+        first.stop()
+        time.sleep(0.02)
+        self.assertEqual(fired, [2])
+        self.assertFalse(first.expired)
+        self.assertTrue(second.expired)
+
+    def test_stop_many(self):
+        # Stopping only touches the timer's own queue entry.
+        fired = []
+        timers = [timer.Timer(100000 + i, fired.append, i)
+                  for i in range(5000)]
+        for t in timers:
+            t.start()
+        begin = time.time()
+        for t in timers:
+            t.stop()
+        self.assertLess(time.time() - begin, 0.5)
+        self.assertFalse(any(t.running for t in timers))
+        time.sleep(0.15)
+        self.assertEqual(fired, [])
+
+    def test_start_stop_threads(self):
+        # Several threads racing on the same timers, which matters without
+        # a GIL, must leave each either running once or stopped.
+        timers = [timer.Timer(100000, int) for i in range(50)]
+
+        def churn():
+            for i in range(200):
+                for t in timers:
+                    t.start()
+                    t.rearm(200000)
+                    t.stop()
+        threads = [threading.Thread(target=churn) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertFalse(any(t.running for t in timers))
+        timer.start_many(timers)
+        self.assertTrue(all(t.running for t in timers))
+        timer.stop_many(timers)
+        self.assertFalse(any(t.running for t in timers))
+
+    def test_batch(self):
+        fired = []
+        timers = timer.Timer.many([(1000 + i, fired.append, (i,))
+                                   for i in range(200)])
+        self.assertEqual(len(timers), 200)
+        self.assertRaises(TypeError, timer.Timer.many, [(1000, int)])
+        self.assertRaises(TypeError, timer.start_many, [timers[0], None])
+        self.assertFalse(timers[0].running)
+        timer.start_many(timers)
+        self.assertTrue(all(t.running for t in timers))
+        time.sleep(0.05)
+        self.assertEqual(sorted(fired), list(range(200)))
+
+        del fired[:]
+        timers = timer.Timer.many([(100000, fired.append, (i,))
+                                   for i in range(200)])
+        timer.start_many(timers)
+        # Duplicates and timers that aren't running are fine.
+        timer.stop_many(timers + timers[:10] + [timer.Timer(1, int)])
+        self.assertFalse(any(t.running for t in timers))
+        self.assertTrue(all(t.elapsed < 100000 for t in timers))
+        time.sleep(0.15)
+        self.assertEqual(fired, [])
+
+    def test_group(self):
+        group = timer.TimerGroup()
+        fired = []
+        timers = [timer.Timer(20000 + i, fired.append, i) for i in range(100)]
+        for t in timers:
+            t.group = group
+            t.start()
+        loner = timer.Timer(20000, fired.append, "loner")
+        loner.start()
+        group.cancel()
+        self.assertEqual(group.generation, 1)
+        self.assertFalse(timers[0].running)
+        self.assertTrue(loner.running)
+        # Restarted after the cancel, so it runs.
+        timers[1].start()
+        self.assertTrue(timers[1].running)
+        time.sleep(0.05)
+        self.assertEqual(sorted(fired, key=str), [1, "loner"])
+        self.assertFalse(any(t.running for t in timers))
+        self.assertEqual(timer.stats()["pending"], 0)
+        with self.assertRaises(TypeError):
+            loner.group = object()
+        loner.group = None
+
+    def test_submit_from_threads(self):
+        # Starting a timer only wakes the scheduler for a new earliest
+        # deadline, which must not get lost behind a far away one.
+        far = timer.Timer(10000000, int)
+        far.start()
+        fired = []
+
+        def worker(base):
+            for i in range(200):
+                timer.Timer(500, fired.append, base + i).start()
+                time.sleep(0.0002)
+        threads = [threading.Thread(target=worker, args=(n * 200,))
+                   for n in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        time.sleep(0.05)
+        far.stop()
+        self.assertEqual(sorted(fired), list(range(800)))
+
+    def test_stop_during_callback(self):
+        # stop() from another thread must not wait for a running callback.
+        entered = threading.Event()
+        release = threading.Event()
+
+        def callback():
+            entered.set()
+            release.wait(1)
+        t = timer.Timer(1000, callback)
+        t.interval = 1000
+        t.start()
+        self.assertTrue(entered.wait(1))
+        begin = time.time()
+        t.stop()
+        t.reset()
+        self.assertLess(time.time() - begin, 0.1)
+        release.set()
+        self.assertFalse(t.running)
+
+    def test_touch(self):
+        fired = []
+        t = timer.Timer(20000, fired.append, 1)
+        t.start()
+        for i in range(6):
+            time.sleep(0.01)
+            t.touch()
+        self.assertEqual(fired, [])
+        self.assertTrue(t.running)
+        time.sleep(0.04)
+        self.assertEqual(fired, [1])
+        self.assertTrue(t.expired)
+
+    def test_rearm(self):
+        fired = []
+        t = timer.Timer(1000000, fired.append, 1)
+        t.start()
+        # Bringing the deadline forward moves it in the queue.
+        t.rearm(2000)
+        time.sleep(0.02)
+        self.assertEqual(fired, [1])
+        # A stopped timer is started again.
+        t.rearm()
+        time.sleep(0.02)
+        self.assertEqual(fired, [1, 1])
+
+    def test_start_at(self):
+        fired = []
+        deadline = timer.now_ns() + 5000000
+        timers = [timer.Timer(0, fired.append, i) for i in range(3)]
+        for t in timers:
+            t.start_at(deadline)
+        self.assertTrue(all(t.running for t in timers))
+        time.sleep(0.03)
+        self.assertEqual(sorted(fired), [0, 1, 2])
+        # A deadline in the past expires right away.
+        t = timer.Timer(1000000, fired.append, 3)
+        t.start_at(timer.now_ns() - 1000)
+        time.sleep(0.01)
+        self.assertEqual(fired[-1], 3)
+        self.assertTrue(t.expired)
+
+    def test_now(self):
+        ns, us = timer.now_ns(), timer.now_us()
+        self.assertTrue(isinstance(ns, (int, type(sys.maxsize + 1))))
+        self.assertTrue(0 <= us - ns // 1000 < 10000)
+        time.sleep(0.01)
+        self.assertGreaterEqual(timer.now_us() - us, 9000)
+
+    def test_live_elapsed(self):
+        t = timer.Timer(1000000, lambda: None)
+        self.assertEqual(t.elapsed, 0)
+        t.start()
+        time.sleep(0.01)
+        first = t.elapsed
+        self.assertGreaterEqual(first, 9000)
+        time.sleep(0.01)
+        self.assertGreater(t.elapsed, first)
+        self.assertTrue(t.running)
+        stopped = t.stop()
+        self.assertEqual(t.elapsed, stopped)
+
+    def test_nanoseconds(self):
+        t = timer.Timer.from_ns(1500, lambda: None)
+        self.assertEqual(t.duration_ns, 1500)
+        self.assertEqual(t.duration, 1)
+        t.start()
+        time.sleep(0.01)
+        self.assertTrue(t.expired)
+        self.assertEqual(t.elapsed_ns, 1500)
+        # Longer than a 32-bit number of microseconds.
+        t = timer.Timer(1, lambda: None)
+        t.duration = 2 ** 33
+        self.assertEqual(t.duration_ns, 2 ** 33 * 1000)
+        t.elapsed = 2 ** 33
+        self.assertEqual(t.elapsed, 2 ** 33)
+
+    def test_lateness(self):
+        before = timer.lateness.count
+        t = timer.Timer(1000, lambda: None)
+        t.start()
+        time.sleep(0.01)
+        self.assertTrue(t.expired)
+        self.assertGreaterEqual(t.lateness_ns, 0)
+        self.assertGreaterEqual(t.wake_latency_ns, 0)
+        self.assertGreaterEqual(t.gil_wait_ns, 0)
+        self.assertGreaterEqual(t.lateness_ns,
+                                t.wake_latency_ns + t.gil_wait_ns)
+        self.assertEqual(timer.lateness.count, before + 1)
+        self.assertEqual(timer.wake_latency.count, before + 1)
+        self.assertEqual(timer.gil_wait.count, before + 1)
+
+    def test_stats(self):
+        before = timer.stats()
+        t = timer.Timer(1000, lambda: 1 // 0)
+        t.start()
+        time.sleep(0.01)
+        pending = timer.Timer(1000000, lambda: None)
+        pending.start()
+        u = timer.Timer(1000000, lambda: None)
+        u.start()
+        u.stop()
+        after = timer.stats()
+        pending.reset()
+        self.assertEqual(after["started"] - before["started"], 3)
+        self.assertEqual(after["fired"] - before["fired"], 1)
+        self.assertEqual(after["errors"] - before["errors"], 1)
+        self.assertEqual(after["cancelled"] - before["cancelled"], 1)
+        self.assertEqual(after["pending"] - before["pending"], 1)
+        self.assertGreater(after["wakeups"], 0)
+
+    def test_errors(self):
+        def boom():
+            raise KeyError("boom")
+        seen, written = [], []
+
+        class Stderr(object):
+            def write(self, text):
+                written.append(text)
+        stderr = sys.stderr
+        try:
+            timer.configure(errors=lambda *args: seen.append(args))
+            timer.Timer(1000, boom).start()
+            time.sleep(0.05)
+            callback, exc_type, value, tb = seen[0]
+            self.assertIs(callback, boom)
+            self.assertIs(exc_type, KeyError)
+            self.assertEqual(value.args, ("boom",))
+            self.assertIsNotNone(tb)
+
+            self.assertEqual(timer.configure(errors="count")["errors"],
+                             "count")
+            before = timer.stats()["errors"]
+            timer.Timer(1000, boom).start()
+            time.sleep(0.05)
+            self.assertEqual(timer.stats()["errors"], before + 1)
+
+            timer.configure(errors="defer")
+            sys.stderr = Stderr()
+            for i in range(150):
+                timer.Timer(1000, boom).start()
+            time.sleep(0.02)
+            self.assertEqual(written, [])
+            time.sleep(0.3)
+        finally:
+            sys.stderr = stderr
+            timer.configure(errors="print")
+        text = "".join(written)
+        self.assertEqual(text.count("KeyError: 'boom'"), 100)
+        self.assertIn("50 more callback errors not shown", text)
+        self.assertRaises(ValueError, timer.configure, errors="loud")
+        self.assertRaises(TypeError, timer.configure, errors=1)
+
+    def test_threads_persist(self):
+        timer.Timer(1, int).start()
+        threads = timer.stats()["threads_started"]
+        self.assertGreater(threads, 0)
+        t = timer.Timer(100, int)
+        for i in range(100):
+            t.start()
+            if i % 2:
+                t.stop()
+            else:
+                t.reset()
+        t.start()
+        time.sleep(0.01)
+        self.assertTrue(t.expired)
+        self.assertEqual(timer.stats()["threads_started"], threads)
+
+    def test_resolution(self):
+        # Only a backend bound to the Windows tick raises the resolution.
+        before = timer.stats()["resolution_raises"]
+        t = timer.Timer(50000, int)
+        t.start()
+        time.sleep(0.1)
+        self.assertTrue(t.expired)
+        raised = timer.stats()["resolution_raises"] - before
+        if sys.platform == "win32" and timer.configure()["backend"] == "condvar":
+            self.assertGreaterEqual(raised, 1)
+        else:
+            self.assertEqual(raised, 0)
+
+    def test_pools(self):
+        def noop():
+            pass
+        before = timer.stats()
+        for _ in range(100):
+            t = timer.Timer(1000000, noop)
+            t.start()
+            t.stop()
+            del t
+        after = timer.stats()
+        # After the first round, every Timer and node is a reused one.
+        self.assertTrue(after["timer_pool_hits"] - before["timer_pool_hits"]
+                        >= 99)
+        self.assertTrue(after["node_pool_hits"] - before["node_pool_hits"]
+                        >= 99)
+
+        class Sub(timer.Timer):
+            pass
+        s = Sub(1000, noop)
+        del s
+        self.assertEqual(timer.stats()["timer_pool_hits"],
+                         after["timer_pool_hits"])
+
+    def test_arena(self):
+        def noop():
+            pass
+        before = timer.stats()
+        timers = [timer.Timer(10000000, noop) for _ in range(3000)]
+        for t in timers:
+            t.start()
+        during = timer.stats()
+        self.assertEqual(during["arena_nodes"] - before["arena_nodes"], 3000)
+        self.assertTrue(during["arena_slabs"] >= 3)
+        self.assertEqual(during["arena_bytes"], during["arena_slabs"] * 65536)
+        for t in timers:
+            t.stop()
+        # Stopped nodes stay in the queue, as tombstones, until the
+        # scheduler clears them out in bulk.
+        time.sleep(0.05)
+        after = timer.stats()
+        self.assertLess(after["tombstones"], 1500)
+        self.assertGreater(after["compactions"], before["compactions"])
+        self.assertLess(after["arena_nodes"] - before["arena_nodes"], 1500)
+        self.assertTrue(after["arena_slabs"] < during["arena_slabs"])
+
+    def test_arena_placement(self):
+        with self.assertRaises(ValueError):
+            timer.configure(huge_pages="gigantic")
+        self.assertEqual(timer.configure()["huge_pages"], "off")
+        modes = [("off", False)]
+        if sys.platform.startswith("linux"):
+            modes += [("transparent", True), ("explicit", False)]
+        if sys.platform.startswith("linux") or sys.platform == "win32":
+            modes.append(("off", True))
+        try:
+            for huge_pages, numa in modes:
+                settings = timer.configure(huge_pages=huge_pages, numa=numa)
+                self.assertEqual((settings["huge_pages"], settings["numa"]),
+                                 (huge_pages, numa))
+                before = timer.stats()
+                fired = []
+                timers = [timer.Timer(10000000, int) for _ in range(3000)]
+                timers.append(timer.Timer(1000, fired.append, 1))
+                for t in timers:
+                    t.start()
+                during = timer.stats()
+                # The last mode's tombstones may be cleared out meanwhile,
+                # so only what is pending is exact.
+                self.assertEqual(during["pending"] - before["pending"], 3001)
+                self.assertGreaterEqual(during["arena_nodes"], 3001)
+                self.assertEqual(len(during["numa_node"]),
+                                 settings["shards"])
+                time.sleep(0.02)
+                self.assertEqual(fired, [1])
+                for t in timers:
+                    t.stop()
+                if huge_pages != "off" or numa:
+                    # Chunks are kept, their free slabs reused.
+                    self.assertGreater(during["arena_chunks"], 0)
+                    self.assertLessEqual(during["arena_huge_chunks"],
+                                         during["arena_chunks"])
+        finally:
+            timer.configure(huge_pages="off", numa=False)
+
+    def test_export_openmetrics(self):
+        h = timer.Histogram()
+        h.record(1500)
+        h.record(2000000000, 3)
+        lines = timer.export_openmetrics({"app_seconds": h}).decode()
+        lines = lines.splitlines()
+        self.assertEqual(lines[-1], "# EOF")
+        self.assertIn("# TYPE timer_fired counter", lines)
+        self.assertTrue([line for line in lines
+                         if line.startswith("timer_fired_total ")])
+        self.assertIn("# TYPE timer_lateness_seconds histogram", lines)
+        app = [line for line in lines if line.startswith("app_seconds")]
+        self.assertEqual(app, ['app_seconds_bucket{le="0.000001503"} 1',
+                               'app_seconds_bucket{le="2.004877311"} 4',
+                               'app_seconds_bucket{le="+Inf"} 4',
+                               "app_seconds_count 4",
+                               "app_seconds_sum 6.0000015"])
+        self.assertRaises(ValueError, timer.export_openmetrics, {"1x": h})
+        self.assertRaises(TypeError, timer.export_openmetrics, {"x": 1})
+
+    def test_publish_stats(self):
+        from timer import shm
+        path = os.path.join(tempfile.mkdtemp(), "timer.stats")
+        try:
+            timer.publish_stats(path, interval=1000)
+            t = timer.Timer(1000, lambda: None)
+            t.start()
+            time.sleep(0.02)
+            page = shm.read_stats(path)
+            self.assertEqual(page["pid"], os.getpid())
+            self.assertEqual(page["interval_ns"], 1000000)
+            stats = timer.stats()
+            self.assertEqual(page["fired"], stats["fired"])
+            self.assertEqual(page["lateness"]["count"],
+                             timer.lateness.count)
+            self.assertEqual(page["lateness"]["buckets"],
+                             timer.lateness.snapshot()["buckets"])
+        finally:
+            timer.publish_stats(None)
+            shutil.rmtree(os.path.dirname(path))
+
+    def test_trace(self):
+        from timer import shm
+        path = os.path.join(tempfile.mkdtemp(), "timer.trace")
+        try:
+            timer.trace(path, capacity=1024)
+            t = timer.Timer(1000, lambda: None)
+            t.start()
+            time.sleep(0.01)
+            u = timer.Timer(1000000, lambda: None)
+            u.start()
+            u.stop()
+            timer.trace(None)
+            events = shm.read_trace(path)
+            rings = shm.trace_rings(path)
+            recorded = sum(min(head, 1024) for head, _ in rings)
+            self.assertEqual(len(rings[0][1]), 1024 * shm._RECORD.size)
+            # Every record claimed was written, and stamped with its index.
+            for head, records in rings:
+                self.assertEqual(
+                    [shm._RECORD.unpack_from(records, n * shm._RECORD.size)[0]
+                     for n in range(min(head, 1024))],
+                    list(range(1, min(head, 1024) + 1)))
+            del rings
+        finally:
+            timer.trace(None)
+            shutil.rmtree(os.path.dirname(path))
+        self.assertEqual([e[2] for e in events if e[1] == t.trace_id],
+                         ["start", "arm", "fire", "callback_begin",
+                          "callback_end"])
+        self.assertEqual([e[2] for e in events if e[1] == u.trace_id],
+                         ["start", "arm", "cancel"])
+        self.assertEqual(recorded, len(events))
+
+    def test_trace_shared(self):
+        # Threads and scheduler shards all writing one ring, with the trace
+        # replaced and stopped under them.
+        from timer import shm
+        path = os.path.join(tempfile.mkdtemp(), "timer.trace")
+        stop = threading.Event()
+
+        def worker():
+            for _ in range(5000):
+                if stop.is_set():
+                    break
+                timer.Timer(100, int).start()
+        threads = [threading.Thread(target=worker) for _ in range(4)]
+        try:
+            for t in threads:
+                t.start()
+            for _ in range(20):
+                timer.trace(path, rings=1)
+                time.sleep(0.002)
+                timer.trace(None)
+            timer.trace(path, capacity=1 << 20, rings=1)
+            timers = [timer.Timer(1000, int) for _ in range(1000)]
+            for t in timers:
+                t.start()
+            time.sleep(0.01)
+            stop.set()
+            for t in threads:
+                t.join()
+            deadline = time.time() + 2
+            while (not all(t.expired for t in timers) and
+                   time.time() < deadline):
+                time.sleep(0.01)
+            timer.trace(None)
+            events = shm.read_trace(path)
+            (head, _), = shm.trace_rings(path)
+        finally:
+            stop.set()
+            timer.trace(None)
+            shutil.rmtree(os.path.dirname(path))
+        self.assertEqual(head, len(events))
+        ids = set(t.trace_id for t in timers)
+        self.assertEqual(len([e for e in events if e[1] in ids]), 5000)
+
+    def test_queue_types(self):
+        self.assertEqual(timer.configure()["queue"], "wheel")
+        with self.assertRaises(ValueError):
+            timer.configure(queue="nope")
+        try:
+            for queue in ("list", "heap", "wheel"):
+                self.assertEqual(timer.configure(queue=queue)["queue"], queue)
+                fired = []
+                timers = [timer.Timer(d, fired.append, d)
+                          for d in (30000, 10, 700, 2000, 300)]
+                for t in timers:
+                    t.start()
+                time.sleep(0.06)
+                self.assertEqual(fired, [10, 300, 700, 2000, 30000])
+        finally:
+            timer.configure(queue="wheel")
+
+    def test_shards(self):
+        # The shard count is fixed at import, so try others in a child.
+        code = "\n".join([
+            "import threading, time, timer",
+            "assert timer.configure()['shards'] == 4",
+            "fired = []",
+            "def worker(base):",
+            "    for i in range(100):",
+            "        timer.Timer(1000 + i, fired.append, base + i).start()",
+            "threads = [threading.Thread(target=worker, args=(n * 100,))",
+            "           for n in range(8)]",
+            "for t in threads: t.start()",
+            "for t in threads: t.join()",
+            "time.sleep(0.1)",
+            "assert sorted(fired) == list(range(800)), len(fired)",
+            "assert timer.stats()['pending'] == 0"])
+        env = dict(os.environ, TIMER_SHARDS="4")
+        self.assertEqual(subprocess.call([sys.executable, "-c", code],
+                                         env=env), 0)
+        env["TIMER_SHARDS"] = "0"
+        child = subprocess.Popen([sys.executable, "-c", "import timer"],
+                                 env=env, stderr=subprocess.PIPE)
+        self.assertIn(b"TIMER_SHARDS", child.communicate()[1])
+        self.assertNotEqual(child.returncode, 0)
+        self.assertTrue(1 <= timer.configure()["shards"] <= 64)
+
+    def test_stack_size(self):
+        self.assertEqual(timer.configure()["stack_size"], 0)
+        with self.assertRaises(ValueError):
+            timer.configure(stack_size=1000)
+        # Threads started afterwards get it, callbacks have room.
+        code = "\n".join([
+            "import time, timer",
+            "size = timer.configure(stack_size=256 * 1024)['stack_size']",
+            "assert size == 256 * 1024",
+            "fired = []",
+            "t = timer.Timer(1000, fired.append, sorted(range(1000)))",
+            "t.start()",
+            "time.sleep(0.05)",
+            "assert fired and timer.stats()['threads_started'] > 0"])
+        self.assertEqual(subprocess.call([sys.executable, "-c", code]), 0)
+        self.assertEqual(timer.configure()["stack_size"], 0)
+
+    def test_lazy_start(self):
+        # Importing starts nothing, and an idle scheduler stays asleep.
+        code = "\n".join([
+            "import time, timer",
+            "assert timer.stats()['threads_started'] == 0",
+            "timer.configure(workers=1)",
+            "assert timer.stats()['threads_started'] == 0",
+            "t = timer.Timer(1000, int)",
+            "t.start()",
+            "time.sleep(0.05)",
+            "assert t.expired and timer.stats()['threads_started'] > 0",
+            "before = timer.stats()",
+            "time.sleep(0.3)",
+            "after = timer.stats()",
+            "assert after['wakeups'] == before['wakeups']",
+            "assert after['spins'] == before['spins']"])
+        self.assertEqual(subprocess.call([sys.executable, "-c", code]), 0)
+
+    def test_wall_ns(self):
+        self.assertEqual(timer.configure()["wall_resync"], 1000000)
+        self.assertLess(abs(timer.wall_ns() - time.time() * 1e9), 5e6)
+        timer.configure(wall_resync=1000)
+        try:
+            before = timer.stats()["wall_syncs"]
+            time.sleep(0.01)
+            first = timer.wall_ns()
+            self.assertGreater(timer.stats()["wall_syncs"], before)
+            self.assertLess(abs(first - time.time() * 1e9), 5e6)
+        finally:
+            timer.configure(wall_resync=1000000)
+
+    def test_tsc_clock(self):
+        # Where the counter can't be trusted the import refuses it, else it
+        # keeps time with the OS clock.
+        code = "\n".join([
+            "import time, timer",
+            "assert timer.clock in ('TSC', 'CNTVCT_EL0'), timer.clock",
+            "a, b = timer.now_ns(), time.time()",
+            "t = timer.Timer(1000, int)",
+            "t.start()",
+            "time.sleep(0.2)",
+            "assert t.expired",
+            "ratio = (timer.now_ns() - a) / ((time.time() - b) * 1e9)",
+            "assert 0.99 < ratio < 1.01, ratio"])
+        env = dict(os.environ, TIMER_CLOCK="tsc")
+        child = subprocess.Popen([sys.executable, "-c", code],
+                                 env=env, stderr=subprocess.PIPE)
+        err = child.communicate()[1]
+        if child.returncode != 0:
+            self.assertIn(b"'tsc'", err)
+
+    @unittest.skipUnless(hasattr(os, "fork"), "needs os.fork()")
+    def test_fork(self):
+        # A child gets a working scheduler, with or without what the parent
+        # had pending, while the parent's carries on.
+        code = "\n".join([
+            "import os, sys, time, timer",
+            "timer.configure(fork=sys.argv[1], workers=1)",
+            "inherited = timer.Timer(100000, int)",
+            "inherited.start()",
+            "pid = os.fork()",
+            "if pid == 0:",
+            "    fresh = timer.Timer(1000, int)",
+            "    fresh.start()",
+            "    time.sleep(0.3)",
+            "    ok = fresh.expired and inherited.expired == (sys.argv[1] == 'keep')",
+            "    os._exit(0 if ok and not inherited.running else 1)",
+            "time.sleep(0.3)",
+            "assert inherited.expired",
+            "assert os.waitpid(pid, 0)[1] == 0"])
+        for policy in ("keep", "discard"):
+            self.assertEqual(subprocess.call([sys.executable, "-c", code,
+                                              policy]), 0, policy)
+        with self.assertRaises(ValueError):
+            timer.configure(fork="nope")
+        self.assertEqual(timer.configure()["fork"], "keep")
+
+    @unittest.skipIf(subinterpreters is None, "needs subinterpreters")
+    def test_subinterpreter(self):
+        # Callbacks run in the interpreter the Timer was made in, and one
+        # ending takes its pending timers along but leaves the others.
+        code = "\n".join([
+            "import sys, time, timer",
+            "try:",
+            "    import _interpreters as subinterpreters",
+            "except ImportError:",
+            "    import _xxsubinterpreters as subinterpreters",
+            # One sharing the GIL, spelt differently from 3.12 to 3.13.
+            "try:",
+            "    interp = subinterpreters.create(isolated=False)",
+            "except TypeError:",
+            "    interp = subinterpreters.create('legacy')",
+            "fired = []",
+            "kept = timer.Timer(200000, fired.append, 1)",
+            "kept.start()",
+            "subinterpreters.run_string(interp, '\\n'.join([",
+            # It doesn't get the directory -c ran in on its path.
+            "    'import sys',",
+            "    'sys.path[:] = %r' % sys.path,",
+            "    'import time, timer',",
+            "    'fired = []',",
+            "    't = timer.Timer(1000, lambda: fired.append(',",
+            "    '    __import__(\"sys\").modules))',",
+            "    't.start()',",
+            "    'timer.Timer(10000000, int).start()',",
+            "    'time.sleep(0.05)',",
+            "    'assert len(fired) == 1 and fired[0] is sys.modules']))",
+            "pending = timer.stats()['pending']",
+            "subinterpreters.destroy(interp)",
+            "assert timer.stats()['pending'] == pending - 1",
+            "time.sleep(0.3)",
+            "assert fired == [1] and kept.expired"])
+        self.assertEqual(subprocess.call([sys.executable, "-c", code]), 0)
+
+    def test_placement(self):
+        t = timer.Timer(1000, lambda: None)
+        t.start()
+        shards = timer.configure()["shards"]
+        pinnable = sys.platform.startswith("linux") or sys.platform == "win32"
+        try:
+            # Realtime priority needs privileges, so only ask for it.
+            settings = timer.configure(realtime=True)
+            self.assertIs(settings["realtime"], True)
+            self.assertEqual(len(timer.stats()["realtime"]), shards)
+            if pinnable:
+                self.assertEqual(timer.configure(affinity=[0])["affinity"],
+                                 (0,))
+                self.assertEqual(timer.stats()["affinity"], (0,) * shards)
+                with self.assertRaises(ValueError):
+                    timer.configure(affinity=[-1])
+            else:
+                with self.assertRaises(NotImplementedError):
+                    timer.configure(affinity=[0])
+            t = timer.Timer(1000, lambda: None)
+            t.start()
+            time.sleep(0.02)
+            self.assertTrue(t.expired)
+        finally:
+            timer.configure(affinity=(), realtime=False)
+        self.assertEqual(timer.stats()["affinity"], (None,) * shards)
+        self.assertEqual(timer.stats()["realtime"], (False,) * shards)
+
+    def test_precision(self):
+        t = timer.Timer(20000, int)
+        self.assertEqual(t.precision, "hybrid")
+        with self.assertRaises(ValueError):
+            t.precision = "exact"
+        # Waiting for a coarse timer costs no spinning, a spin one does.
+        t.precision = "coarse"
+        before = timer.stats()["spins"]
+        t.start()
+        time.sleep(0.05)
+        self.assertTrue(t.expired)
+        self.assertEqual(timer.stats()["spins"], before)
+        t.precision = "spin"
+        t.start()
+        time.sleep(0.05)
+        self.assertTrue(t.expired)
+        self.assertGreater(timer.stats()["spins"], before)
+
+    def test_sleep(self):
+        start = timer.now_ns()
+        timer.sleep_us(2000)
+        self.assertGreaterEqual(timer.now_ns() - start, 2000000)
+        deadline = timer.now_ns() + 3000000
+        timer.sleep_until(deadline)
+        self.assertGreaterEqual(timer.now_ns(), deadline)
+        timer.sleep_until(0)
+        self.assertRaises(ValueError, timer.sleep_us, -1)
+        # The GIL is free meanwhile, so callbacks run.
+        fired = []
+        timer.Timer(1000, fired.append, 1).start()
+        timer.sleep_us(20000)
+        self.assertEqual(fired, [1])
+
+    def test_replay(self):
+        offsets = [1000000, 3000000, 3000400, 6000000]
+        fired = []
+        start = timer.now_ns()
+        worst = timer.replay(offsets,
+                             lambda i: fired.append((i, timer.now_ns())))
+        self.assertEqual([i for i, _ in fired], [0, 1, 2, 3])
+        for (i, when), offset in zip(fired, offsets):
+            self.assertGreaterEqual(when - start, offset - offsets[0])
+        self.assertGreaterEqual(worst, 0)
+        # Twice as fast, and from an int64 buffer where there is one.
+        if sys.version_info[0] >= 3:
+            import array
+            offsets = array.array("q", offsets)
+        start = timer.now_ns()
+        timer.replay(offsets, lambda i: None, speed=2)
+        elapsed = timer.now_ns() - start
+        self.assertGreaterEqual(elapsed, 2500000)
+        self.assertLess(elapsed, 5000000)
+        self.assertEqual(timer.replay([], int), 0)
+        self.assertRaises(ValueError, timer.replay, [2, 1], int)
+        self.assertRaises(ValueError, timer.replay, [1], int, 0)
+        self.assertRaises(TypeError, timer.replay, [1], None)
+        if sys.version_info[0] >= 3:
+            self.assertRaises(TypeError, timer.replay, b"12345678", int)
+
+        def fail(i):
+            fired.append(i)
+            raise KeyError(i)
+        del fired[:]
+        self.assertRaises(KeyError, timer.replay, [0, 0, 1000], fail)
+        self.assertEqual(fired, [0])
+
+    def test_ticker(self):
+        self.assertRaises(ValueError, timer.Ticker, 0, int)
+        ticks = []
+        t = timer.Ticker(500, lambda tick, late: ticks.append((tick, late)))
+        self.assertIsInstance(t, timer.Timer)
+        self.assertEqual(t.hz, 500)
+        # Numbered on the fixed schedule, which the virtual clock keeps to
+        # exactly, so none are late or missed.
+        timer.use_virtual_clock()
+        try:
+            t.start()
+            self.assertEqual(timer.advance(100000000), 50)
+            t.stop()
+        finally:
+            timer.use_virtual_clock(False)
+        self.assertEqual(ticks, [(tick, 0) for tick in range(50)])
+        self.assertEqual(t.missed, 0)
+
+    def test_deadline(self):
+        pending = timer.stats()["pending"]
+        with timer.deadline(1000000) as d:
+            self.assertEqual(timer.stats()["pending"], pending + 1)
+        self.assertFalse(d.expired)
+        self.assertEqual(timer.stats()["pending"], pending)
+        self.assertRaises(ValueError, timer.deadline, -1)
+
+        d = timer.deadline(20000)
+        start = time.time()
+        with self.assertRaises(timer.DeadlineExceeded):
+            with d:
+                while time.time() - start < 2:
+                    pass
+        self.assertTrue(d.expired)
+        self.assertLess(time.time() - start, 1)
+        # It can be used again.
+        with d:
+            pass
+        self.assertFalse(d.expired)
+
+        # Left while its callback waits for the GIL, which a long switch
+        # interval keeps here, the callback doesn't reach the next entry.
+        interval = sys.getswitchinterval()
+        sys.setswitchinterval(1)
+        try:
+            with d:
+                start = time.time()
+                while time.time() - start < 0.05:
+                    pass
+            with d:
+                time.sleep(0.005)
+        finally:
+            sys.setswitchinterval(interval)
+        self.assertFalse(d.expired)
+        self.assertEqual(timer.stats()["pending"], pending)
+
+    def test_within(self):
+        self.assertIsNone(timer.remaining_us())
+        self.assertIsNone(timer.deadline_ns())
+        self.assertRaises(LookupError, timer.Timer(1000, int).start_at)
+        with timer.within(1000000) as outer:
+            self.assertTrue(0 < timer.remaining_us() <= 1000000)
+            self.assertEqual(timer.deadline_ns(), outer.deadline_ns)
+            # A nested block only ever tightens it.
+            with timer.within(5000000) as loose:
+                self.assertEqual(loose.deadline_ns, outer.deadline_ns)
+            with timer.within(20000) as tight:
+                self.assertEqual(timer.deadline_ns(), tight.deadline_ns)
+                self.assertLess(tight.deadline_ns, outer.deadline_ns)
+                t = timer.Timer(0, int)
+                t.future = timer.Future()
+                t.start_at()
+                self.assertTrue(0 < t.duration <= 20000)
+                wait_fired(t)
+                self.assertGreaterEqual(timer.now_ns(), tight.deadline_ns)
+                self.assertEqual(timer.remaining_us(), 0)
+                self.assertEqual(tight.remaining_us, 0)
+            self.assertEqual(timer.deadline_ns(), outer.deadline_ns)
+            with timer.deadline(10000):
+                self.assertLessEqual(timer.remaining_us(), 10000)
+            self.assertEqual(timer.deadline_ns(), outer.deadline_ns)
+        self.assertIsNone(timer.deadline_ns())
+        self.assertRaises(ValueError, timer.within, -1)
+
+    @unittest.skipUnless(sys.version_info >= (3, 7), "needs contextvars")
+    def test_within_context(self):
+        import contextvars
+        # What asyncio tasks created in the block run in.
+        with timer.within(1000000) as w:
+            context = contextvars.copy_context()
+        self.assertIsNone(timer.deadline_ns())
+        self.assertEqual(context.run(timer.deadline_ns), w.deadline_ns)
+
+    def test_watch_gil(self):
+        stalls = []
+        timer.watch_gil(20000, stalls.append)
+        try:
+            time.sleep(0.05)
+            self.assertEqual(stalls, [])
+            # sum() over a range runs in C without letting the GIL go.
+            start = time.time()
+            while time.time() - start < 0.1:
+                sum(range(100000))
+            n = 10 ** 6
+            start = time.time()
+            while time.time() - start < 0.05:
+                sum(range(n))
+                n *= 2
+            time.sleep(0.05)
+        finally:
+            timer.watch_gil(0)
+        self.assertTrue(stalls)
+        self.assertGreaterEqual(min(stalls), 20000000)
+        self.assertGreaterEqual(timer.stats()["gil_stalls"], len(stalls))
+        self.assertGreaterEqual(timer.stats()["gil_stall_max_ns"], max(stalls))
+        count = len(stalls)
+        sum(range(n))
+        time.sleep(0.05)
+        self.assertEqual(len(stalls), count)
+        self.assertRaises(ValueError, timer.watch_gil, -1)
+        self.assertRaises(TypeError, timer.watch_gil, 1000, 1)
+
+    def test_watch_callbacks(self):
+        slow = []
+
+        def fast():
+            pass
+
+        def sleepy():
+            time.sleep(0.02)
+        timer.watch_callbacks(threshold=10000,
+                              callback=lambda cb, ns: slow.append((cb, ns)))
+        try:
+            for callback in (fast, fast, sleepy):
+                timer.Timer(1000, callback).start()
+            time.sleep(0.1)
+            counts = timer.callback_stats(reset=True)
+            self.assertEqual(timer.callback_stats(), {})
+        finally:
+            timer.watch_callbacks(False)
+        self.assertEqual(counts[fast][0], 2)
+        calls, total_ns, max_ns = counts[sleepy]
+        self.assertEqual(calls, 1)
+        self.assertGreaterEqual(total_ns, 20000000)
+        self.assertEqual(total_ns, max_ns)
+        self.assertEqual(slow, [(sleepy, max_ns)])
+        self.assertGreaterEqual(timer.stats()["slow_callbacks"], 1)
+        self.assertRaises(ValueError, timer.watch_callbacks, True, -1)
+
+    def test_sample_stacks(self):
+        def busy():
+            start = time.time()
+            while time.time() - start < 0.2:
+                pass
+        timer.sample_stacks(1000)
+        try:
+            busy()
+        finally:
+            timer.sample_stacks(0)
+        folded = timer.folded_stacks()
+        stacks = dict(line.rsplit(" ", 1) for line in folded.splitlines())
+        self.assertTrue(any("busy (" in stack and "test_sample_stacks (" in
+                            stack.split("busy (")[0] for stack in stacks))
+        time.sleep(0.01)
+        self.assertEqual(timer.folded_stacks(), folded)
+        self.assertTrue(timer.folded_stacks(threads=True).startswith("thread "))
+        # Only whole stacks are left once the ring wraps.
+        timer.sample_stacks(1000, capacity=7, depth=3)
+        try:
+            busy()
+        finally:
+            timer.sample_stacks(0)
+        for line in timer.folded_stacks().splitlines():
+            self.assertEqual(line.count(";"), 2)
+        self.assertRaises(ValueError, timer.sample_stacks, -1)
+        self.assertRaises(ValueError, timer.sample_stacks, 10, capacity=0)
+
+    def test_profile(self):
+        h = timer.Histogram()
+
+        @timer.profile(h)
+        def add(x, y=1):
+            "Adds."
+            time.sleep(0.001)
+            return x + y
+
+        class Thing(object):
+            @timer.profile(h)
+            def method(self, x):
+                if x is None:
+                    raise ValueError
+                return self, x
+
+        self.assertEqual(add.__name__, "add")
+        self.assertEqual(add.__doc__, "Adds.")
+        self.assertIs(add.histogram, h)
+        self.assertEqual(add(1, y=2), 3)
+        self.assertEqual(h.count, 1)
+        self.assertGreater(h.min, 1000000)
+        thing = Thing()
+        self.assertEqual(thing.method(4), (thing, 4))
+        self.assertRaises(ValueError, thing.method, None)
+        self.assertEqual(h.count, 3)
+        self.assertEqual(timer.profile(h, len)("abc"), 3)
+        self.assertRaises(TypeError, timer.profile(h))
+        self.assertRaises(TypeError, timer.profile, None)
+
+    def test_future(self):
+        t = timer.Timer(1000, lambda x: x * 2, 21)
+        t.future = timer.Future()
+        done = []
+        t.future.add_done_callback(done.append)
+        self.assertFalse(t.future.done())
+        t.start()
+        self.assertEqual(t.future.result(timeout=1), 42)
+        self.assertIsNone(t.future.exception())
+        self.assertEqual(done, [t.future])
+
+        def fail():
+            raise KeyError("lost")
+        errors = timer.stats()["errors"]
+        t = timer.Timer(1000, fail)
+        t.future = timer.Future()
+        t.start()
+        self.assertRaises(KeyError, t.future.result, 1)
+        self.assertIsInstance(t.future.exception(), KeyError)
+        self.assertEqual(timer.stats()["errors"], errors + 1)
+
+        # Only the first callback after it is assigned completes it.
+        t = timer.Timer(1000, timer.now_ns)
+        t.interval = 1000
+        t.future = f = timer.Future()
+        t.start()
+        first = f.result(1)
+        time.sleep(0.01)
+        t.stop()
+        self.assertEqual(f.result(), first)
+
+        f = timer.Future()
+        start = time.time()
+        self.assertRaises(Exception, f.result, 0.02)
+        self.assertGreaterEqual(time.time() - start, 0.015)
+        self.assertRaises(TypeError, setattr, t, "future", 1)
+
+        if asyncio is not None:
+            loop = asyncio.new_event_loop()
+            try:
+                t = timer.Timer(2000, lambda: "awaited")
+                t.future = timer.Future()
+                t.start()
+                self.assertEqual(loop.run_until_complete(t.future), "awaited")
+            finally:
+                loop.close()
+
+    def test_overload(self):
+        ran = []
+
+        def slow(i=None):
+            ran.append(i)
+            time.sleep(0.002)
+
+        def burst(policy, *timers):
+            del ran[:]
+            before = timer.stats()
+            timer.configure(overload=policy, overload_after=5000)
+            timer.start_many(timers)
+            time.sleep(0.15)
+            after = timer.stats()
+            return (after["shed"] - before["shed"],
+                    after["coalesced"] - before["coalesced"])
+
+        try:
+            timers = [timer.Timer(1000, slow, i) for i in range(20)]
+            shed, coalesced = burst("drop_oldest", *timers)
+            self.assertGreater(shed, 0)
+            self.assertEqual(coalesced, 0)
+            self.assertEqual(len(ran) + shed, 20)
+            self.assertEqual(sum(t.missed for t in timers), shed)
+
+            shed, coalesced = burst("coalesce",
+                                    *[timer.Timer(1000, slow)
+                                      for i in range(20)])
+            self.assertEqual(shed, 0)
+            self.assertGreater(coalesced, 0)
+            self.assertEqual(len(ran) + coalesced, 20)
+
+            timers = [timer.Timer(1000, slow, i) for i in range(20)]
+            for t in timers[::2]:
+                t.slack = 1000
+            shed, coalesced = burst("shed_tolerant", *timers)
+            self.assertGreater(shed, 0)
+            self.assertTrue(set(range(1, 20, 2)) <= set(ran))
+            self.assertRaises(ValueError, timer.configure, overload="lifo")
+        finally:
+            settings = timer.configure(overload="none", overload_after=10000)
+        self.assertEqual(settings["overload"], "none")
+        self.assertEqual(settings["overload_after"], 10000)
+
+    def test_priority(self):
+        order = []
+        t = timer.Timer(1000, int)
+        self.assertEqual(t.priority, "normal")
+        self.assertRaises(ValueError, setattr, t, "priority", "urgent")
+        # Everything comes due while the first callback holds the
+        # scheduler up, then runs by lane.
+        blocker = timer.Timer(1000, time.sleep, 0.03)
+        timers = [blocker]
+        for priority in ("low", "normal", "high"):
+            for i in range(3):
+                t = timer.Timer(2000 + i, order.append, priority)
+                t.priority = priority
+                timers.append(t)
+        high = timer.priority_lateness["high"].count
+        timer.start_many(timers)
+        time.sleep(0.1)
+        self.assertEqual(order, ["high"] * 3 + ["normal"] * 3 + ["low"] * 3)
+        self.assertEqual(timer.priority_lateness["high"].count, high + 3)
+        self.assertGreater(timer.priority_lateness["low"].max, 20000000)
+
+    def test_rate_limiter(self):
+        limiter = timer.RateLimiter(100, burst=5)
+        self.assertEqual((limiter.rate, limiter.burst), (100, 5))
+        self.assertAlmostEqual(limiter.tokens, 5, places=2)
+        self.assertTrue(limiter.try_acquire(3))
+        self.assertTrue(limiter.try_acquire(2))
+        self.assertFalse(limiter.try_acquire())
+        self.assertLess(limiter.tokens, 0.5)
+        # Refilled at 100 a second, so 2 more take 20 ms.
+        start = timer.now_ns()
+        limiter.acquire(2)
+        waited = timer.now_ns() - start
+        self.assertGreaterEqual(waited, 15000000)
+        self.assertLess(waited, 60000000)
+        time.sleep(0.1)
+        self.assertAlmostEqual(limiter.tokens, 5, places=2)
+        self.assertRaises(ValueError, limiter.acquire, 6)
+        self.assertRaises(ValueError, limiter.try_acquire, 0)
+        self.assertRaises(ValueError, timer.RateLimiter, 0)
+        self.assertRaises(ValueError, timer.RateLimiter, 10, 0)
+
+    def test_debouncer(self):
+        fired = []
+        d = timer.Debouncer(20000, fired.append, 1)
+        self.assertTrue(isinstance(d, timer.Timer))
+        for i in range(6):
+            d()
+            time.sleep(0.01)
+        self.assertEqual(fired, [])
+        time.sleep(0.04)
+        self.assertEqual(fired, [1])
+        # Once run a call starts it again.
+        d()
+        time.sleep(0.04)
+        self.assertEqual(fired, [1, 1])
+        d()
+        d.stop()
+        time.sleep(0.04)
+        self.assertEqual(fired, [1, 1])
+        self.assertRaises(TypeError, d, 1)
+
+    def test_throttler(self):
+        fired = []
+        t = timer.Throttler(50000, fired.append, 1)
+        # The first call runs right away, and those within the interval
+        # after it once at its end.
+        t()
+        time.sleep(0.01)
+        self.assertEqual(fired, [1])
+        for i in range(3):
+            t()
+        time.sleep(0.01)
+        self.assertEqual(fired, [1])
+        time.sleep(0.07)
+        self.assertEqual(fired, [1, 1])
+        time.sleep(0.05)
+        t()
+        time.sleep(0.01)
+        self.assertEqual(fired, [1, 1, 1])
+
+    def test_tombstones(self):
+        fired = []
+        t = timer.Timer(20000, fired.append, 1)
+        t.start()
+        t.stop()
+        # Started again, the node it left behind doesn't fire.
+        t.start()
+        time.sleep(0.05)
+        self.assertEqual(fired, [1])
+        before = timer.stats()
+        timers = [timer.Timer(1000000, fired.append, 2) for _ in range(200)]
+        for t in timers:
+            t.start()
+        for t in timers:
+            t.stop()
+        self.assertEqual(timer.stats()["pending"], before["pending"])
+        time.sleep(0.02)
+        after = timer.stats()
+        self.assertGreater(after["compactions"], before["compactions"])
+        self.assertLess(after["tombstones"] - before["tombstones"], 100)
+        self.assertEqual(fired, [1])
+
+        # Buried, a timer lets go of what it refers to right away.
+        class Owner(object):
+            def fire(self):
+                pass
+        for lazy in (False, True):
+            owner = Owner()
+            owner.timer = timer.Timer(3600000000, owner.fire)
+            owner.timer.lazy = lazy
+            owner.timer.start()
+            time.sleep(0.01)
+            owner.timer.stop()
+            ref = weakref.ref(owner)
+            del owner
+            gc.collect()
+            self.assertIsNone(ref())
+
+    def test_lazy(self):
+        fired = []
+        self.assertFalse(timer.Timer(1000, fired.append).lazy)
+        before = timer.stats()
+        timers = [timer.Timer(1000000, fired.append, 2) for _ in range(200)]
+        for t in timers:
+            t.lazy = True
+            t.start()
+        for t in timers:
+            t.stop()
+        time.sleep(0.02)
+        after = timer.stats()
+        # Dropped before the sweep, they never became tombstones.
+        self.assertEqual(after["pending"], before["pending"])
+        self.assertEqual(after["tombstones"], before["tombstones"])
+        self.assertEqual(after["compactions"], before["compactions"])
+        self.assertEqual(after["cancelled"] - before["cancelled"], 200)
+        # Those that survive the sweep fire on time.
+        timers = [timer.Timer(delay, fired.append, delay)
+                  for delay in (20000, 5000, 500)]
+        timers[0].future = timer.Future()
+        for t in timers:
+            t.lazy = True
+            t.start()
+        wait_fired(timers[0])
+        self.assertEqual(fired, [500, 5000, 20000])
+        for t in timers:
+            self.assertLess(t.lateness_ns, 20000000)
+
+    def test_start_at_wall(self):
+        fired = []
+        now = timer.wall_ns()
+        timers = [timer.Timer(0, fired.append, i) for i in range(4)]
+        for t, delay in zip(timers, (30, 10, 20, 40)):
+            t.start_at_wall(now + delay * 1000000)
+        self.assertTrue(0 < timers[0].duration <= 30000)
+        self.assertEqual(timer.stats()["wall_pending"], 4)
+        timers[3].stop()
+        timer.stop_many(timers[2:])
+        self.assertEqual(timer.stats()["wall_pending"], 2)
+        time.sleep(0.06)
+        self.assertEqual(fired, [1, 0])
+        self.assertTrue(timers[0].expired)
+        self.assertEqual(timer.stats()["wall_pending"], 0)
+        timers[2].start_at_wall(now)
+        time.sleep(0.01)
+        self.assertEqual(fired, [1, 0, 2])
+
+    def test_snapshot(self):
+        directory = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, directory)
+        path = os.path.join(directory, "snapshot")
+        fired = []
+        timers = [timer.Timer(d, fired.append, d)
+                  for d in (20000, 60000000, 30000000, 10000)]
+        for t, key in zip(timers, (b"soon", b"late", b"", None)):
+            t.key = key
+            t.start()
+        timers[2].stop()
+        self.assertRaises(TypeError, setattr, timers[0], "key", u"soon")
+        self.assertEqual(timer.snapshot(path), 2)
+        for t in timers:
+            t.stop()
+
+        restored = {}
+        def resolve(key):
+            if key == b"late":
+                return None
+            restored[key] = timer.Timer(1, fired.append, key)
+            return restored[key]
+        self.assertEqual(timer.restore(path, resolve), 1)
+        self.assertEqual(restored[b"soon"].key, b"soon")
+        self.assertTrue(restored[b"soon"].running)
+        time.sleep(0.1)
+        self.assertEqual(fired, [b"soon"])
+        self.assertRaises(TypeError, timer.restore, path, lambda key: key)
+        with open(path, "r+b") as f:
+            f.write(b"X")
+        self.assertRaises(ValueError, timer.restore, path, resolve)
+
+    @unittest.skipIf(sys.platform == "win32", "no timer service on Windows")
+    def test_service(self):
+        directory = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, directory)
+        path = os.path.join(directory, "service")
+        daemon = subprocess.Popen(
+            [sys.executable, "-c", "\n".join([
+                "import sys, timer",
+                "timer.serve(sys.argv[1], clients=2, capacity=4)",
+                "sys.stdout.write('ready\\n')",
+                "sys.stdout.flush()",
+                "sys.stdin.read()"]), path],
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.addCleanup(daemon.wait)
+        self.addCleanup(daemon.stdin.close)
+        self.addCleanup(daemon.stdout.close)
+        self.assertEqual(daemon.stdout.readline(), b"ready\n")
+
+        threads = timer.stats()["threads_started"]
+        remote = timer.Remote(path)
+        keys = []
+
+        def wait(count):
+            end = time.time() + 1
+            while len(keys) < count and time.time() < end:
+                select.select([remote], [], [], 0.1)
+                keys.extend(remote.drain())
+        remote.call_later(10000, "a")
+        b = remote.call_later(10000, "b")
+        remote.call_at(timer.now_ns() + 5000000, "c")
+        self.assertTrue(remote.cancel(b))
+        self.assertFalse(remote.cancel(b))
+        wait(2)
+        time.sleep(0.02)
+        keys.extend(remote.drain())
+        self.assertEqual(sorted(keys), ["a", "c"])
+        self.assertEqual(remote.pending, 0)
+        # Ids go back once drained, and only capacity can be pending.
+        handles = [remote.call_later(1000000, i) for i in range(4)]
+        self.assertRaises(RuntimeError, remote.call_later, 1000, 4)
+        for handle in handles:
+            remote.cancel(handle)
+        # No scheduler thread of its own.
+        self.assertEqual(timer.stats()["threads_started"], threads)
+
+        other = timer.Remote(path)
+        self.assertRaises(RuntimeError, timer.Remote, path)
+        other.close()
+        self.assertRaises(ValueError, other.drain)
+        # Its slot is free again, and its timers are gone with it.
+        other = timer.Remote(path)
+        other.call_later(1000, "d")
+        other.close()
+        remote.close()
+        self.assertRaises(OSError, timer.Remote, path + "x")
+
+    def test_coarse_clock(self):
+        # Coarse timers count from a clock up to a tick old, at most 10 ms.
+        fired = []
+        for delay in (2000, 5000, 20000):
+            t = timer.Timer(delay, lambda: fired.append(timer.now_ns()))
+            t.precision = "coarse"
+            before = timer.now_ns()
+            t.start()
+            time.sleep(delay / 1e6 + 0.03)
+            self.assertTrue(t.expired)
+            self.assertGreater(fired.pop() - before, delay * 1000 - 10000000)
+        t.precision = "coarse"
+        t.start()
+        t.touch()
+        t.rearm(1000)
+        time.sleep(0.03)
+        self.assertTrue(t.expired)
+
+    def test_adaptive(self):
+        try:
+            self.assertIs(timer.configure(adaptive=True)["adaptive"], True)
+            for _ in range(3):
+                t = timer.Timer(5000, int)
+                t.start()
+                time.sleep(0.01)
+                self.assertTrue(t.expired)
+            # Each of those waits was a sample of the backend's lateness.
+            learned = [ns for ns in timer.stats()["oversleep_ns"]
+                       if ns is not None]
+            self.assertTrue(learned)
+            self.assertTrue(all(ns >= 0 for ns in learned))
+        finally:
+            timer.configure(adaptive=False)
+
+    def test_spin_margin(self):
+        default = timer.configure()["spin_margin"]
+        try:
+            self.assertEqual(timer.configure(spin_margin=0)["spin_margin"], 0)
+            t = timer.Timer(5000, lambda: None)
+            t.start()
+            time.sleep(0.02)
+            self.assertTrue(t.expired)
+        finally:
+            timer.configure(spin_margin=default)
+
+    def test_backends(self):
+        default = timer.configure()["backend"]
+        self.assertEqual(default, "condvar")
+        with self.assertRaises(ValueError):
+            timer.configure(backend="nope")
+        backends = ["condvar"]
+        if sys.platform.startswith("linux"):
+            backends.extend(["timerfd", "io_uring", "posix_timer"])
+        elif sys.platform == "darwin" or sys.platform.startswith("freebsd"):
+            backends.append("kqueue")
+        elif sys.platform == "win32":
+            backends.extend(["waitable", "threadpool"])
+        try:
+            for backend in backends:
+                # Switch while a timer is pending to exercise the hand-over.
+                pending = timer.Timer(20000, lambda: None)
+                pending.start()
+                try:
+                    self.assertEqual(
+                        timer.configure(backend=backend)["backend"], backend)
+                except (ValueError, OSError):
+                    # Older headers or kernel, or disabled.
+                    if backend != "io_uring":
+                        raise
+                    pending.stop()
+                    continue
+                fired = []
+                t = timer.Timer(3000, fired.append, backend)
+                t.start()
+                time.sleep(0.03)
+                self.assertEqual(fired, [backend])
+                self.assertTrue(pending.expired)
+        finally:
+            timer.configure(backend=default)
+
+    def test_batch_limit(self):
+        default = timer.configure()["batch_limit"]
+        try:
+            for limit in (0, 1, 7):
+                self.assertEqual(
+                    timer.configure(batch_limit=limit)["batch_limit"], limit)
+                fired = []
+                timers = [timer.Timer(2000, fired.append, i)
+                          for i in range(50)]
+                for t in timers:
+                    t.start()
+                time.sleep(0.02)
+                self.assertEqual(sorted(fired), list(range(50)))
+        finally:
+            timer.configure(batch_limit=default)
+
+    def test_workers(self):
+        self.assertEqual(timer.configure()["workers"], 0)
+        with self.assertRaises(ValueError):
+            timer.configure(workers=65)
+        try:
+            self.assertEqual(timer.configure(workers=2)["workers"], 2)
+            fired = []
+            # The slow callback ties up one worker, the other keeps time.
+            slow = timer.Timer(1000, time.sleep, 0.2)
+            fast = timer.Timer(20000, fired.append, "fast")
+            slow.start()
+            fast.start()
+            time.sleep(0.1)
+            self.assertEqual(len(fired), 1)
+            timers = [timer.Timer(1000, fired.append, i) for i in range(200)]
+            for t in timers:
+                t.start()
+            time.sleep(0.3)
+            self.assertEqual(sorted(fired[1:]), list(range(200)))
+        finally:
+            self.assertEqual(timer.configure(workers=0)["workers"], 0)
+        t = timer.Timer(1000, fired.append, "after")
+        t.start()
+        time.sleep(0.02)
+        self.assertEqual(fired[-1], "after")
+
+    def test_workers_autoscale(self):
+        with self.assertRaises(ValueError):
+            timer.configure(workers_max=65)
+        try:
+            settings = timer.configure(workers_max=4, workers_idle=20000)
+            self.assertEqual((settings["workers"], settings["workers_max"],
+                              settings["workers_idle"]), (0, 4, 20000))
+            before = timer.stats()
+            self.assertEqual(before["workers_active"], 0)
+            # With the scheduler's threads, none for workers yet.
+            timer.Timer(1000, int).start()
+            tasks = "/proc/self/task"
+            if os.path.isdir(tasks):
+                threads = len(os.listdir(tasks))
+
+            # The scheduler falls behind running these itself, so workers
+            # join, and they run side by side as sleep frees the GIL.
+            def overload():
+                fired = []
+                timers = [timer.Timer(1000 + i * 100,
+                                      lambda i: (time.sleep(0.002),
+                                                 fired.append(i)),
+                                      i) for i in range(60)]
+                for t in timers:
+                    t.start()
+                for _ in range(100):
+                    if len(fired) == 60:
+                        break
+                    time.sleep(0.02)
+                self.assertEqual(sorted(fired), list(range(60)))
+            overload()
+            during = timer.stats()
+            self.assertGreater(during["workers_grown"],
+                               before["workers_grown"])
+            self.assertLessEqual(during["workers_active"], 4)
+            # Their threads start as they join.
+            self.assertGreater(during["threads_started"],
+                               before["threads_started"])
+            # Idle, they leave one by one down to workers.
+            for _ in range(100):
+                if timer.stats()["workers_active"] == 0:
+                    break
+                time.sleep(0.02)
+            after = timer.stats()
+            self.assertEqual(after["workers_active"], 0)
+            self.assertEqual(after["workers_shrunk"] - before["workers_shrunk"],
+                             during["workers_grown"] - before["workers_grown"])
+            # And their threads end as they leave.
+            if os.path.isdir(tasks):
+                for _ in range(100):
+                    if len(os.listdir(tasks)) <= threads:
+                        break
+                    time.sleep(0.01)
+                self.assertLessEqual(len(os.listdir(tasks)), threads)
+
+            # The virtual clock standing still neither keeps idle workers
+            # from leaving nor has them spin until they do.
+            timer.configure(workers_idle=200000)
+            overload()
+            timer.use_virtual_clock()
+            try:
+                start, cpu = time.time(), time.process_time()
+                for _ in range(100):
+                    if timer.stats()["workers_active"] == 0:
+                        break
+                    time.sleep(0.02)
+                self.assertEqual(timer.stats()["workers_active"], 0)
+                self.assertLess(time.process_time() - cpu,
+                                (time.time() - start) / 2)
+            finally:
+                timer.use_virtual_clock(False)
+        finally:
+            timer.configure(workers=0, workers_max=0, workers_idle=1000000)
+
+    def test_clock(self):
+        self.assertIn(timer.clock, ("CLOCK_MONOTONIC", "CLOCK_MONOTONIC_RAW",
+                                    "QueryPerformanceCounter"))
+
+    def test_wheel_levels(self):
+        # Timers on every wheel level, with empty levels in between.
+        fired = []
+        timers = [timer.Timer(delay, fired.append, delay)
+                  for delay in (3000, 100, 40000000, 300000, 5000)]
+        for t in timers:
+            t.start()
+        try:
+            time.sleep(0.05)
+            self.assertEqual(fired, [100, 3000, 5000])
+        finally:
+            for t in timers:
+                t.stop()
+
+    def test_queue_change_while_pending(self):
+        t = timer.Timer(1000000, lambda: None)
+        t.start()
+        try:
+            with self.assertRaises(RuntimeError):
+                timer.configure(queue="list")
+        finally:
+            t.stop()
+
+    def test_periodic(self):
+        fired = []
+        t = timer.Timer(2000, fired.append, 1)
+        t.interval = 2000
+        t.start()
+        time.sleep(0.05)
+        self.assertTrue(t.running)
+        t.stop()
+        count = len(fired)
+        self.assertGreater(count, 5)
+        self.assertFalse(t.expired)
+        time.sleep(0.01)
+        self.assertEqual(len(fired), count)
+
+    def test_periodic_overrun(self):
+        t = timer.Timer(1000, lambda: time.sleep(0.01))
+        t.interval = 1000
+        self.assertEqual(t.overrun, "skip")
+        with self.assertRaises(ValueError):
+            t.overrun = "later"
+        t.start()
+        time.sleep(0.05)
+        t.stop()
+        self.assertGreater(t.missed, 0)
+
+    def test_periodic_stop_in_callback(self):
+        fired = []
+
+        def callback():
+            fired.append(1)
+            if len(fired) == 3:
+                t.stop()
+        t = timer.Timer(1000, callback)
+        t.interval = 1000
+        t.start()
+        time.sleep(0.03)
+        self.assertEqual(len(fired), 3)
+        self.assertFalse(t.running)
+
+
+
+class TestStopwatch(unittest.TestCase):
+    def test_measure(self):
+        sw = timer.Stopwatch()
+        self.assertFalse(sw.running)
+        self.assertEqual(sw.elapsed, 0)
+        sw.start()
+        time.sleep(0.01)
+        self.assertTrue(sw.running)
+        self.assertGreaterEqual(sw.elapsed, 9000)
+        val = sw.stop()
+        self.assertFalse(sw.running)
+        self.assertGreaterEqual(val, 9000)
+        self.assertEqual(sw.elapsed, val)
+        self.assertEqual(sw.elapsed_ns // 1000, val)
+        sw.reset()
+        self.assertEqual(sw.elapsed, 0)
+
+    def test_laps(self):
+        sw = timer.Stopwatch(laps=4)
+        self.assertRaises(RuntimeError, sw.lap)
+        sw.start()
+        for i in range(6):
+            time.sleep(0.001 * (i + 1))
+            sw.lap()
+        self.assertEqual(sw.lap_count, 6)
+        laps = list(sw.laps())
+        # Only the newest four are kept, oldest first.
+        self.assertEqual(len(laps), 4)
+        for i, lap in enumerate(laps):
+            self.assertGreaterEqual(lap, 1000000 * (i + 3))
+        self.assertGreater(laps[3], laps[0])
+        sw.start()
+        self.assertEqual(list(sw.laps()), [])
+
+    def test_no_lap_buffer(self):
+        sw = timer.Stopwatch()
+        sw.start()
+        self.assertRaises(ValueError, sw.lap)
+        self.assertEqual(list(sw.laps()), [])
+        self.assertRaises(ValueError, timer.Stopwatch, -1)
+
+    def test_context(self):
+        sw = timer.Stopwatch()
+        sw.histogram = timer.Histogram()
+        for i in range(3):
+            with sw as entered:
+                self.assertTrue(entered is sw)
+                self.assertTrue(sw.running)
+                time.sleep(0.002)
+            self.assertFalse(sw.running)
+            self.assertGreaterEqual(sw.elapsed, 2000)
+        self.assertEqual(sw.histogram.count, 3)
+        # Stopped on the way out of a block that raised, which propagates.
+        def fail():
+            with sw:
+                1 // 0
+        self.assertRaises(ZeroDivisionError, fail)
+        self.assertFalse(sw.running)
+        self.assertEqual(sw.histogram.count, 4)
+        self.assertRaises(TypeError, sw.__exit__)
+
+    def test_decorator(self):
+        sw = timer.Stopwatch()
+
+        @sw
+        def nap(seconds, result=None):
+            "Sleep a while."
+            self.assertTrue(sw.running)
+            time.sleep(seconds)
+            return result
+        self.assertTrue(nap.stopwatch is sw)
+        self.assertEqual(nap.__name__, "nap")
+        self.assertEqual(nap(0.002, result=5), 5)
+        self.assertFalse(sw.running)
+        self.assertGreaterEqual(sw.elapsed, 2000)
+        self.assertRaises(TypeError, sw, 1)
+        self.assertRaises(TypeError, sw)
+
+    def test_buffer(self):
+        sw = timer.Stopwatch(laps=3)
+        sw.start()
+        for i in range(5):
+            sw.lap()
+        view = memoryview(sw)
+        self.assertTrue(view.readonly)
+        self.assertEqual(view.format, "q")
+        self.assertEqual(view.shape, (3,))
+        if sys.version_info >= (3,):
+            self.assertEqual(view.tolist(), list(sw.laps()))
+        # Frozen while exported.
+        self.assertRaises(BufferError, sw.lap)
+        self.assertRaises(BufferError, sw.start)
+        del view
+        sw.lap()
+        self.assertEqual(sw.lap_count, 6)
+
+
+class TestHistogram(unittest.TestCase):
+    def test_percentiles(self):
+        h = timer.Histogram()
+        self.assertEqual(h.percentile(50), 0)
+        for value in range(1, 10001):
+            h.record(value * 1000)
+        self.assertEqual(h.count, 10000)
+        self.assertEqual(h.min, 1000)
+        self.assertEqual(h.max, 10000000)
+        for p, expected in ((50, 5000000), (99, 9900000), (99.9, 9990000),
+                            (100, 10000000)):
+            # Within the bucket precision of 1 / 2 ** bits.
+            self.assertAlmostEqual(h.percentile(p) / float(expected), 1,
+                                   delta=1.0 / 2 ** h.bits)
+        self.assertRaises(ValueError, h.percentile, 101)
+
+    def test_merge_snapshot(self):
+        a, b = timer.Histogram(), timer.Histogram()
+        a.record(5, 3)
+        b.record(2 ** 40)
+        a.merge(b)
+        snap = a.snapshot()
+        self.assertEqual(snap["count"], 4)
+        self.assertEqual(snap["min"], 5)
+        self.assertEqual(snap["max"], 2 ** 40)
+        self.assertEqual(snap["buckets"][0], (5, 3))
+        self.assertEqual(len(snap["buckets"]), 2)
+        self.assertRaises(ValueError, a.merge, timer.Histogram(bits=3))
+        a.reset()
+        self.assertEqual(a.count, 0)
+
+    def test_shards(self):
+        h = timer.Histogram(shards=4)
+        self.assertEqual(h.shards, 4)
+
+        def worker(base):
+            for i in range(1000):
+                h.record(base + i)
+        threads = [threading.Thread(target=worker, args=(n * 1000,))
+                   for n in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(h.count, 8000)
+        self.assertEqual(h.min, 0)
+        self.assertEqual(h.max, 7999)
+        single = timer.Histogram()
+        single.merge(h)
+        self.assertEqual(single.snapshot(), h.snapshot())
+
+    def test_buffer(self):
+        h = timer.Histogram(bits=3)
+        values = list(h.bucket_values())
+        view = memoryview(h)
+        self.assertTrue(view.readonly)
+        self.assertEqual(view.format, "q")
+        self.assertEqual(view.shape, (1, len(values)))
+        h.record(1000, 5)
+        if sys.version_info >= (3,):
+            counts = view.tolist()[0]
+            # A live view, labelled by bucket_values().
+            self.assertEqual(sum(counts), 5)
+            self.assertGreaterEqual(values[counts.index(5)], 1000)
+            sharded = memoryview(timer.Histogram(shards=3))
+            self.assertEqual(sharded.shape[0], 3)
+        self.assertRaises(ValueError, timer.Histogram, shards=0)
+
+    def test_bound(self):
+        h = timer.Histogram()
+        sw = timer.Stopwatch()
+        sw.histogram = h
+        for i in range(3):
+            sw.start()
+            sw.lap()
+            sw.stop()
+        t = timer.Timer(1000000, lambda: None)
+        t.histogram = h
+        t.start()
+        t.stop()
+        self.assertEqual(h.count, 7)
+        self.assertTrue(t.histogram is h)
+        t.histogram = None
+        self.assertRaises(TypeError, setattr, sw, "histogram", 1)
+
+
+class TestVirtualClock(unittest.TestCase):
+    def setUp(self):
+        timer.use_virtual_clock()
+
+    def tearDown(self):
+        timer.use_virtual_clock(False)
+
+    def test_one_shot(self):
+        fired = []
+        t = timer.Timer(1000, lambda: fired.append(timer.now_ns()))
+        start = timer.now_ns()
+        t.start()
+        time.sleep(0.01)
+        self.assertEqual(timer.now_ns(), start)
+        self.assertEqual(timer.advance(999999), 0)
+        self.assertTrue(t.running)
+        self.assertEqual(timer.advance(1), 1)
+        self.assertTrue(t.expired)
+        self.assertEqual(fired, [start + 1000000])
+        self.assertEqual(t.lateness_ns, 0)
+
+    def test_periodic(self):
+        fired = []
+        t = timer.Timer(1000, lambda: fired.append(timer.now_ns()))
+        t.interval = 1000
+        start = timer.now_ns()
+        t.start()
+        self.assertEqual(timer.advance(10000000), 10)
+        self.assertEqual(fired, [start + n * 1000000 for n in range(1, 11)])
+        self.assertEqual(timer.now_ns(), start + 10000000)
+        # Timers stay pending, so the real clock can't come back yet.
+        self.assertRaises(RuntimeError, timer.use_virtual_clock, False)
+        t.stop()
+
+    def test_sequence(self):
+        fired = []
+        offsets = (10000, 50000, 250000, 1000000)
+        t = timer.Timer.sequence(offsets, lambda: fired.append(timer.now_ns()))
+        start = timer.now_ns()
+        t.start()
+        self.assertEqual(timer.advance(2000000000), 4)
+        self.assertEqual(fired, [start + o * 1000 for o in offsets])
+        self.assertTrue(t.expired)
+        self.assertFalse(t.running)
+        # Begins again from the first, stop() cancels the rest.
+        del fired[:]
+        t.start()
+        self.assertEqual(timer.advance(100000000), 2)
+        t.stop()
+        self.assertEqual(timer.advance(2000000000), 0)
+        self.assertEqual(len(fired), 2)
+        self.assertRaises(ValueError, timer.Timer.sequence, (), fired.append)
+        self.assertRaises(ValueError, timer.Timer.sequence, (5, 5),
+                          fired.append)
+        self.assertRaises(TypeError, timer.Timer.sequence, (5,))
+
+    def test_backoff(self):
+        fired = []
+        b = timer.Backoff(1000, lambda n: fired.append((n, timer.now_ns())),
+                          factor=3, max=5000)
+        start = timer.now_ns()
+        self.assertEqual([b.retry(), b.retry()], [1000, None])
+        self.assertEqual(timer.advance(1000000), 1)
+        self.assertEqual(b.retry(), 3000)
+        self.assertEqual(timer.advance(3000000), 1)
+        self.assertEqual(b.retry(), 5000)
+        self.assertEqual(timer.advance(5000000), 1)
+        self.assertEqual(fired, [(1, start + 1000000), (2, start + 4000000),
+                                 (3, start + 9000000)])
+        self.assertEqual(b.attempt, 3)
+        b.retry()
+        b.reset()
+        self.assertEqual((b.attempt, b.running), (0, False))
+        self.assertEqual(b.retry(), 1000)
+        b.reset()
+        jittered = timer.Backoff(1000000, fired.append, jitter=0.5)
+        delays = set()
+        for _ in range(20):
+            delays.add(jittered.retry())
+            jittered.reset()
+        self.assertGreater(len(delays), 1)
+        self.assertTrue(all(500000 <= d <= 1000000 for d in delays))
+        self.assertRaises(ValueError, timer.Backoff, 0, fired.append)
+        self.assertRaises(ValueError, timer.Backoff, 10, fired.append,
+                          jitter=2)
+
+    def test_slack(self):
+        fired = []
+        timers = [timer.Timer(1000 + i, lambda i=i: fired.append(
+            (timer.now_ns(), i))) for i in range(100)]
+        for t in timers:
+            t.slack = 1000
+        start = timer.now_ns()
+        for t in timers:
+            t.start()
+        self.assertEqual(timer.advance(3000000), 100)
+        # 100 microseconds of deadlines share at most two rounded ones.
+        self.assertLessEqual(len(set(when for when, i in fired)), 2)
+        for when, i in fired:
+            self.assertTrue(0 <= when - start - (1000 + i) * 1000 < 1000000)
+
+    def test_errors(self):
+        self.assertRaises(ValueError, timer.advance, -1)
+        timer.use_virtual_clock(False)
+        self.assertRaises(RuntimeError, timer.advance, 1)
+        timer.use_virtual_clock()
+
+
+class TestMainThread(unittest.TestCase):
+    def test_main_thread(self):
+        threads = []
+        t = timer.Timer(1000, lambda: threads.append(threading.current_thread()))
+        t.main_thread = True
+        t.start()
+        # Pending calls run between bytecodes, after time.sleep() returns.
+        deadline = time.time() + 1
+        while not threads and time.time() < deadline:
+            time.sleep(0.001)
+        self.assertEqual(threads, [threading.current_thread()])
+        self.assertTrue(t.expired)
+
+    def test_from_thread(self):
+        threads = []
+        main = threading.current_thread()
+
+        def worker():
+            # Started elsewhere, still runs on the main thread.
+            t = timer.Timer(1000, lambda: threads.append(
+                threading.current_thread()))
+            t.main_thread = True
+            t.start()
+        w = threading.Thread(target=worker)
+        w.start()
+        w.join()
+        deadline = time.time() + 1
+        while not threads and time.time() < deadline:
+            time.sleep(0.001)
+        self.assertEqual(threads, [main])
+
+    def test_thread_affine(self):
+        threads, counts = [], []
+
+        def worker():
+            t = timer.Timer(1000, lambda: threads.append(
+                threading.current_thread()))
+            t.thread_affine = True
+            t.start()
+            time.sleep(0.05)
+            # Due, but waiting in this thread's inbox.
+            self.assertEqual(threads, [])
+            counts.append(timer.run_pending())
+            counts.append(timer.run_pending())
+        w = threading.Thread(target=worker)
+        w.start()
+        w.join()
+        self.assertEqual(threads, [w])
+        self.assertEqual(counts, [1, 0])
+        self.assertEqual(timer.run_pending(), 0)
+
+
+class TestCAPI(unittest.TestCase):
+    def api(self):
+        import ctypes
+        get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+        get_pointer.restype = ctypes.c_void_p
+        get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+        self.callback_type = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+
+        class API(ctypes.Structure):
+            _fields_ = [
+                ("version", ctypes.c_int),
+                # Needs the GIL, unlike the others.
+                ("start", ctypes.PYFUNCTYPE(ctypes.c_int)),
+                ("now_ns", ctypes.CFUNCTYPE(ctypes.c_int64)),
+                ("schedule", ctypes.CFUNCTYPE(
+                    ctypes.c_void_p, ctypes.c_int64, self.callback_type,
+                    ctypes.c_void_p)),
+                ("cancel", ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p))]
+        return API.from_address(get_pointer(timer._timer._C_API,
+                                            b"timer._timer._C_API"))
+
+    def test_schedule_cancel(self):
+        api = self.api()
+        self.assertEqual(api.version, 1)
+        self.assertEqual(api.start(), 0)
+        fired = []
+        done = threading.Event()
+
+        def fn(arg):
+            fired.append(arg)
+            done.set()
+        callback = self.callback_type(fn)
+        now = api.now_ns()
+        self.assertTrue(abs(now - timer.now_ns()) < 10 ** 8)
+        cancelled = api.schedule(now + 10 ** 6, callback, 1)
+        self.assertTrue(api.schedule(now + 2 * 10 ** 6, callback, 2))
+        self.assertEqual(api.cancel(cancelled), 1)
+        self.assertTrue(done.wait(1))
+        time.sleep(0.005)
+        self.assertEqual(fired, [2])
+
+
+@unittest.skipIf(sys.platform == "win32", "channels need select() on a pipe")
+class TestChannel(unittest.TestCase):
+    def test_drain(self):
+        threads = []
+        c = timer.Channel()
+        t = timer.Timer(1000, lambda: threads.append(threading.current_thread()))
+        t.channel = c
+        self.assertTrue(t.channel is c)
+        t.start()
+        readable = select.select([c.fileno()], [], [], 1)[0]
+        self.assertEqual(readable, [c.fileno()])
+        self.assertEqual(threads, [])
+        self.assertEqual(c.drain(), 1)
+        self.assertEqual(threads, [threading.current_thread()])
+        self.assertTrue(t.expired)
+        # Drained, so no longer readable.
+        self.assertEqual(select.select([c.fileno()], [], [], 0)[0], [])
+        self.assertEqual(c.drain(), 0)
+        c.close()
+        self.assertRaises(ValueError, c.fileno)
+        self.assertRaises(TypeError, setattr, t, "channel", 1)
+
+    def test_stop_after_delivery(self):
+        fired = []
+        c = timer.Channel()
+        t = timer.Timer(1000, fired.append, 1)
+        t.channel = c
+        t.start()
+        select.select([c.fileno()], [], [], 1)
+        t.stop()
+        self.assertEqual(c.drain(), 0)
+        self.assertEqual(fired, [])
+
+    def test_drain_count(self):
+        # Only what this drain() runs counts, not what its callbacks do.
+        inner, outer = timer.Channel(), timer.Channel()
+        a = timer.Timer(1000, int)
+        a.channel = inner
+        b = timer.Timer(1000, inner.drain)
+        b.channel = outer
+        a.start()
+        b.start()
+        select.select([inner.fileno()], [], [], 1)
+        select.select([outer.fileno()], [], [], 1)
+        self.assertEqual(outer.drain(), 1)
+        self.assertTrue(a.expired)
+
+    @unittest.skipIf(asyncio is None, "needs asyncio")
+    def test_sleep_us(self):
+        from timer import aio
+
+        loop = asyncio.new_event_loop()
+        asyncio.set_event_loop(loop)
+        try:
+            start = timer.now_us()
+            result = loop.run_until_complete(aio.sleep_us(2000, "done"))
+            self.assertEqual(result, "done")
+            self.assertTrue(timer.now_us() - start >= 2000)
+
+            pending = timer.stats()["pending"]
+            future = aio.sleep_us(1000000)
+            self.assertEqual(timer.stats()["pending"], pending + 1)
+            future.cancel()
+            loop.run_until_complete(asyncio.sleep(0))
+            self.assertEqual(timer.stats()["pending"], pending)
+        finally:
+            asyncio.set_event_loop(None)
+            loop.close()
+
+class TestPerformance(unittest.TestCase):
+    def test_check(self):
+        from timer.bench import regress
+        base = [1000, 1010, 990, 1005, 995, 1002, 998, 1001]
+        def run(values):
+            return {"backends": {"condvar": {"stop_ns": values}}}
+
+        def regressed(values):
+            report = regress.check(run(base), run(values))
+            self.assertEqual(len(report), 1)
+            return report[0]["regression"]
+        self.assertFalse(regressed(base))
+        self.assertFalse(regressed([v * 1.05 for v in base]))
+        self.assertTrue(regressed([v * 1.5 for v in base]))
+        # A few batches hit by a loaded host are not a regression.
+        self.assertFalse(regressed(base[:6] + [5000, 9000]))
+        # Nor are fewer batches than can be significant.
+        self.assertFalse(regressed([2000]))
+        self.assertLess(regress.mann_whitney(base, [v * 2 for v in base]),
+                        0.01)
+        self.assertGreater(regress.mann_whitney(base, base), 0.4)
+
+    @unittest.skipUnless(os.environ.get("TIMER_PERF_BASELINE"),
+                         "set TIMER_PERF_BASELINE to a regress baseline")
+    def test_regress(self):
+        import json
+        from timer.bench import regress
+        with open(os.environ["TIMER_PERF_BASELINE"]) as f:
+            baseline = json.load(f)["benchmarks"]["regress"]
+        report = regress.check(baseline, regress.regress(False))
+        self.assertEqual([r["name"] for r in report if r["regression"]], [])
+
+    def test_soak(self):
+        from timer.bench import soak
+        samples = soak.soak(rate=5000, threads=2, duration=1, interval=0.5)
+        self.assertEqual(len(samples), 2)
+        for sample in samples:
+            self.assertGreater(sample["started_per_s"], 0)
+            self.assertIn("p99", sample["lateness_ns"])
+        self.assertEqual(soak.summary(samples)["samples"], 2)
+        self.assertRaises(ValueError, soak.soak, min_delay=1000,
+                          cancel_after=2000)
+
+
+@unittest.skipIf(gevent is None, "needs gevent")
+class TestGevent(unittest.TestCase):
+    def test_sleep_us(self):
+        from timer import green
+        woken = []
+
+        def sleeper(name, delay):
+            green.sleep_us(delay)
+            woken.append(name)
+        gevent.joinall([gevent.spawn(sleeper, "late", 5000),
+                        gevent.spawn(sleeper, "early", 1000)])
+        self.assertEqual(woken, ["early", "late"])
+
+        g = gevent.spawn(sleeper, "killed", 1000000)
+        gevent.sleep(0)
+        g.kill()
+        self.assertEqual(woken, ["early", "late"])
+
 
 if __name__ == "__main__":
     unittest.main()